@@ -0,0 +1,89 @@
+#include <iostream>
+#include <stdexcept>
+#include <glib.h>
+#include "config_file.hpp"
+#include "scope_guard.hpp"
+
+
+namespace
+{
+
+
+std::string const mount_group_prefix = "mount ";
+
+
+} // unnamed namespace end
+
+
+
+
+std::map < std::string, mount_config > load_config_file(std::string const &p_filename)
+{
+	GError *gerror = nullptr;
+
+	GKeyFile *key_file = g_key_file_new();
+	auto key_file_guard = make_scope_guard([key_file]() { g_key_file_free(key_file); });
+
+	if (!g_key_file_load_from_file(key_file, p_filename.c_str(), G_KEY_FILE_NONE, &gerror))
+	{
+		std::string s = "could not load configuration file \"" + p_filename + "\": " + gerror->message;
+		g_clear_error(&gerror);
+		throw std::runtime_error(s);
+	}
+
+	std::map < std::string, mount_config > configs;
+
+	gchar **groups = g_key_file_get_groups(key_file, nullptr);
+	auto groups_guard = make_scope_guard([groups]() { g_strfreev(groups); });
+
+	for (gchar **group = groups; *group != nullptr; ++group)
+	{
+		if (!g_str_has_prefix(*group, mount_group_prefix.c_str()))
+			throw std::runtime_error(std::string("unknown group \"") + *group + "\" in configuration file");
+
+		std::string name = std::string(*group).substr(mount_group_prefix.size());
+		mount_table::validate_name(name);
+
+		mount_config config;
+
+		gchar **keys = g_key_file_get_keys(key_file, *group, nullptr, nullptr);
+		auto keys_guard = make_scope_guard([keys]() { g_strfreev(keys); });
+
+		for (gchar **key = keys; *key != nullptr; ++key)
+		{
+			// Use the raw value, since launch lines may contain
+			// backslashes that are meant for the launch line parser
+			gchar *value = g_key_file_get_value(key_file, *group, *key, nullptr);
+			auto value_guard = make_scope_guard([value]() { g_free(value); });
+
+			try
+			{
+				config.set(*key, value);
+			}
+			catch (std::exception const &p_exc)
+			{
+				throw std::runtime_error("mount \"" + name + "\": " + p_exc.what());
+			}
+		}
+
+		try
+		{
+			config.validate();
+		}
+		catch (std::exception const &p_exc)
+		{
+			throw std::runtime_error("mount \"" + name + "\": " + p_exc.what());
+		}
+
+		configs[name] = std::move(config);
+	}
+
+	return configs;
+}
+
+
+void reload_config_file(mount_table &p_mount_table, std::string const &p_filename)
+{
+	std::cerr << "Loading configuration file \"" << p_filename << "\"\n";
+	p_mount_table.sync_config_file_mounts(load_config_file(p_filename));
+}
@@ -0,0 +1,27 @@
+#ifndef GST_SOUP_SERVER_EXAMPLE_CONFIG_FILE_HPP
+#define GST_SOUP_SERVER_EXAMPLE_CONFIG_FILE_HPP
+
+#include <string>
+#include <map>
+#include "mount_table.hpp"
+
+
+// Reads the mount configurations from a key file. Each mount is described
+// by a group called "mount NAME", whose keys are the ones accepted by
+// mount_config::set(). Example:
+//
+//   [mount cam1]
+//   content-type=video/mp2t
+//   launch=videotestsrc ! x264enc tune=0x4 ! mpegtsmux name=stream
+//   units-max=5000
+//
+// Throws an exception if the file cannot be read or contains errors.
+std::map < std::string, mount_config > load_config_file(std::string const &p_filename);
+
+// Loads the configuration file and applies it to the mount table.
+// Throws an exception (without touching the mount table) if the
+// configuration file cannot be loaded.
+void reload_config_file(mount_table &p_mount_table, std::string const &p_filename);
+
+
+#endif
@@ -0,0 +1,168 @@
+#include <algorithm>
+#include <cmath>
+#include "connection_limiter.hpp"
+
+
+namespace
+{
+
+
+// How many of the least recently seen addresses make_room() looks at
+std::size_t const max_room_candidates = 16;
+
+
+} // unnamed namespace end
+
+
+
+connection_limiter::connection_limiter(unsigned int const p_max_connections_per_address, double const p_rate, unsigned int const p_burst, std::size_t const p_max_addresses)
+	: m_max_connections_per_address(p_max_connections_per_address)
+	, m_rate(p_rate)
+	, m_burst(std::max(p_burst, 1u))
+	, m_max_addresses(std::max < std::size_t > (p_max_addresses, 1))
+{
+	m_stats.m_num_addresses = 0;
+	m_stats.m_num_accepted = 0;
+	m_stats.m_num_rejected_connections = 0;
+	m_stats.m_num_rejected_rate = 0;
+	m_stats.m_num_rejected_table_full = 0;
+}
+
+
+connection_limiter::~connection_limiter()
+{
+	for (auto &entry : m_addresses)
+	{
+		for (GSocket *socket : entry.second.m_sockets)
+			g_object_unref(G_OBJECT(socket));
+	}
+}
+
+
+connection_limiter::verdict connection_limiter::check(std::string const &p_address)
+{
+	gint64 now = g_get_monotonic_time();
+
+	auto address_iter = m_addresses.find(p_address);
+	if (address_iter == m_addresses.end())
+	{
+		if ((m_addresses.size() >= m_max_addresses) && !make_room())
+		{
+			++m_stats.m_num_rejected_table_full;
+			return table_full;
+		}
+
+		address_iter = add_address(p_address, now);
+	}
+
+	address_entry &entry = address_iter->second;
+	m_address_queue.splice(m_address_queue.end(), m_address_queue, entry.m_queue_iter);
+
+	if (m_max_connections_per_address > 0)
+	{
+		purge_closed_sockets(entry);
+		if (entry.m_sockets.size() >= m_max_connections_per_address)
+		{
+			++m_stats.m_num_rejected_connections;
+			return too_many_connections;
+		}
+	}
+
+	if (m_rate > 0)
+	{
+		refill(entry, now);
+		if (entry.m_tokens < 1.0)
+		{
+			++m_stats.m_num_rejected_rate;
+			return rate_limited;
+		}
+
+		entry.m_tokens -= 1.0;
+	}
+
+	++m_stats.m_num_accepted;
+	return accepted;
+}
+
+
+void connection_limiter::add_connection(std::string const &p_address, GSocket *p_socket)
+{
+	// Without a per-address limit, the connections are not needed. They
+	// would only be purged by check() and make_room() then, so the
+	// sockets of busy addresses would pile up.
+	if (m_max_connections_per_address == 0)
+		return;
+
+	// The entry normally exists, since check() was called right before
+	auto address_iter = m_addresses.find(p_address);
+	if (address_iter == m_addresses.end())
+		address_iter = add_address(p_address, g_get_monotonic_time());
+
+	if (address_iter->second.m_sockets.insert(p_socket).second)
+		g_object_ref(G_OBJECT(p_socket));
+}
+
+
+unsigned int connection_limiter::get_retry_after() const
+{
+	return (m_rate > 0) ? std::max(1u, guint(std::ceil(1.0 / m_rate))) : 1;
+}
+
+
+connection_limiter::address_entries::iterator connection_limiter::add_address(std::string const &p_address, gint64 const p_now)
+{
+	auto queue_iter = m_address_queue.insert(m_address_queue.end(), p_address);
+	auto address_iter = m_addresses.insert(std::make_pair(p_address, address_entry { std::set < GSocket* > (), double(m_burst), p_now, queue_iter })).first;
+	m_stats.m_num_addresses = m_addresses.size();
+	return address_iter;
+}
+
+
+void connection_limiter::purge_closed_sockets(address_entry &p_entry)
+{
+	for (auto socket_iter = p_entry.m_sockets.begin(); socket_iter != p_entry.m_sockets.end(); )
+	{
+		if (g_socket_is_closed(*socket_iter))
+		{
+			g_object_unref(G_OBJECT(*socket_iter));
+			socket_iter = p_entry.m_sockets.erase(socket_iter);
+		}
+		else
+			++socket_iter;
+	}
+}
+
+
+void connection_limiter::refill(address_entry &p_entry, gint64 const p_now) const
+{
+	double elapsed = double(p_now - p_entry.m_last_refill) / G_TIME_SPAN_SECOND;
+	p_entry.m_tokens = std::min(double(m_burst), p_entry.m_tokens + elapsed * m_rate);
+	p_entry.m_last_refill = p_now;
+}
+
+
+bool connection_limiter::make_room()
+{
+	// Forget the least recently seen address without open connections;
+	// it merely gets a full bucket again if it comes back. Addresses
+	// with open connections go to the back of the queue, so the next
+	// call looks at other ones.
+	for (std::size_t i = 0; (i < max_room_candidates) && !m_address_queue.empty(); ++i)
+	{
+		auto address_iter = m_addresses.find(m_address_queue.front());
+		address_entry &entry = address_iter->second;
+		purge_closed_sockets(entry);
+
+		if (entry.m_sockets.empty())
+		{
+			m_address_queue.erase(entry.m_queue_iter);
+			m_addresses.erase(address_iter);
+			m_stats.m_num_addresses = m_addresses.size();
+			return true;
+		}
+
+		m_address_queue.splice(m_address_queue.end(), m_address_queue, entry.m_queue_iter);
+	}
+
+	return false;
+}
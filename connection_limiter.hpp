@@ -0,0 +1,110 @@
+#ifndef GST_SOUP_SERVER_EXAMPLE_CONNECTION_LIMITER_HPP
+#define GST_SOUP_SERVER_EXAMPLE_CONNECTION_LIMITER_HPP
+
+#include <gio/gio.h>
+#include <string>
+#include <list>
+#include <map>
+#include <set>
+
+
+// Protects the server against single clients (or scanners) that open
+// many streaming connections, by limiting per remote address:
+//
+// - how many streaming connections may be open at the same time, and
+// - how quickly streaming requests may be made, with a token bucket
+//   that holds up to "burst" tokens, and is refilled with "rate" tokens
+//   per second. Each request takes one token.
+//
+// Requests are checked before a pipeline is acquired and before any
+// response headers are written, so rejected requests cost nothing but
+// the check itself.
+//
+// Like session_table, the connections are only referred to by their
+// sockets, and closed ones are purged lazily. The table of addresses is
+// bounded: once it is full, addresses without open connections are
+// forgotten (least recently seen first). To keep this cheap, only a few
+// of the least recently seen addresses are looked at per request. If
+// these all have open connections, the request from the new address is
+// rejected, and the next one looks at the addresses that follow them.
+//
+// All functions must be called from the mainloop thread.
+class connection_limiter
+{
+public:
+	enum verdict
+	{
+		accepted,
+		too_many_connections,
+		rate_limited,
+		table_full
+	};
+
+	struct stats
+	{
+		std::size_t m_num_addresses;
+		guint64 m_num_accepted;
+		guint64 m_num_rejected_connections, m_num_rejected_rate, m_num_rejected_table_full;
+	};
+
+	// 0 disables the respective limit. p_max_addresses is the maximum
+	// number of addresses that are tracked at the same time.
+	explicit connection_limiter(unsigned int const p_max_connections_per_address, double const p_rate, unsigned int const p_burst, std::size_t const p_max_addresses);
+	~connection_limiter();
+
+	// Checks a new streaming request from the given address. If the
+	// request is accepted, it takes a token from the address' bucket.
+	verdict check(std::string const &p_address);
+
+	// Counts the socket as an open connection of the address until it
+	// is closed. Sockets that are added more than once (because they
+	// were kept alive for another request) are only counted once. Does
+	// nothing if the number of connections per address is not limited.
+	void add_connection(std::string const &p_address, GSocket *p_socket);
+
+	// Returns how many seconds a rate limited client
+	// should wait before it tries again
+	unsigned int get_retry_after() const;
+
+	stats get_stats() const
+	{
+		return m_stats;
+	}
+
+
+private:
+	connection_limiter(connection_limiter const &) = delete;
+	connection_limiter& operator = (connection_limiter const &) = delete;
+
+	// The addresses, least recently seen first
+	typedef std::list < std::string > address_queue;
+
+	struct address_entry
+	{
+		std::set < GSocket* > m_sockets;
+		double m_tokens;
+		gint64 m_last_refill;
+		address_queue::iterator m_queue_iter;
+	};
+
+	typedef std::map < std::string, address_entry > address_entries;
+
+	address_entries::iterator add_address(std::string const &p_address, gint64 const p_now);
+	static void purge_closed_sockets(address_entry &p_entry);
+	void refill(address_entry &p_entry, gint64 const p_now) const;
+	// Returns false if no room could be made
+	bool make_room();
+
+
+	unsigned int m_max_connections_per_address;
+	double m_rate;
+	unsigned int m_burst;
+	std::size_t m_max_addresses;
+
+	address_entries m_addresses;
+	address_queue m_address_queue;
+	stats m_stats;
+};
+
+
+#endif
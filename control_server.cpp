@@ -0,0 +1,877 @@
+#include <iostream>
+#include <stdexcept>
+#include <map>
+#include "control_server.hpp"
+#include "config_file.hpp"
+#include "scope_guard.hpp"
+
+
+namespace
+{
+
+
+std::string const mounts_path_prefix = "/mounts/";
+std::string const source_path_suffix = "/source";
+
+
+void set_json_response(SoupMessage *p_msg, guint const p_status, JsonNode *p_node)
+{
+	JsonGenerator *generator = json_generator_new();
+	json_generator_set_root(generator, p_node);
+	json_generator_set_pretty(generator, TRUE);
+
+	gsize length = 0;
+	gchar *data = json_generator_to_data(generator, &length);
+
+	g_object_unref(G_OBJECT(generator));
+	json_node_free(p_node);
+
+	soup_message_set_status(p_msg, p_status);
+	soup_message_set_response(p_msg, "application/json", SOUP_MEMORY_TAKE, data, length);
+}
+
+
+void set_error_response(SoupMessage *p_msg, guint const p_status, std::string const &p_error)
+{
+	JsonBuilder *builder = json_builder_new();
+	json_builder_begin_object(builder);
+	json_builder_set_member_name(builder, "error");
+	json_builder_add_string_value(builder, p_error.c_str());
+	json_builder_end_object(builder);
+
+	JsonNode *node = json_builder_get_root(builder);
+	g_object_unref(G_OBJECT(builder));
+
+	set_json_response(p_msg, p_status, node);
+}
+
+
+// Parses the JSON request body, which must be an object. The
+// object is owned by the parser.
+JsonObject* parse_request_object(SoupMessage *p_msg, JsonParser *p_parser)
+{
+	GError *gerror = nullptr;
+
+	if (!json_parser_load_from_data(p_parser, p_msg->request_body->data, p_msg->request_body->length, &gerror))
+	{
+		std::string s = std::string("invalid JSON: ") + gerror->message;
+		g_clear_error(&gerror);
+		throw std::runtime_error(s);
+	}
+
+	JsonNode *root = json_parser_get_root(p_parser);
+	if ((root == nullptr) || !JSON_NODE_HOLDS_OBJECT(root))
+		throw std::runtime_error("request body must be a JSON object");
+
+	return json_node_get_object(root);
+}
+
+
+// Converts the JSON request body into the name/value pairs
+// that mount_config::set() accepts
+std::map < std::string, std::string > parse_mount_config_values(SoupMessage *p_msg)
+{
+	JsonParser *parser = json_parser_new();
+	auto parser_guard = make_scope_guard([parser]() { g_object_unref(G_OBJECT(parser)); });
+
+	JsonObject *object = parse_request_object(p_msg, parser);
+
+	auto get_scalar = [](std::string const &p_name, JsonNode *p_node) -> std::string
+	{
+		if (JSON_NODE_HOLDS_VALUE(p_node))
+		{
+			GType type = json_node_get_value_type(p_node);
+			if (type == G_TYPE_STRING)
+				return json_node_get_string(p_node);
+			else if (type == G_TYPE_INT64)
+				return std::to_string(json_node_get_int(p_node));
+			else if (type == G_TYPE_BOOLEAN)
+				return json_node_get_boolean(p_node) ? "true" : "false";
+		}
+
+		throw std::runtime_error("\"" + p_name + "\" must be a string, an integer, or a boolean");
+	};
+
+	std::map < std::string, std::string > values;
+
+	GList *members = json_object_get_members(object);
+	auto members_guard = make_scope_guard([members]() { g_list_free(members); });
+
+	for (GList *member = members; member != nullptr; member = member->next)
+	{
+		std::string name = reinterpret_cast < char const * > (member->data);
+		JsonNode *node = json_object_get_member(object, name.c_str());
+
+		if (name == "params")
+		{
+			if (!JSON_NODE_HOLDS_ARRAY(node))
+				throw std::runtime_error("\"params\" must be an array");
+
+			std::string declarations;
+			JsonArray *array = json_node_get_array(node);
+			for (guint i = 0; i < json_array_get_length(array); ++i)
+			{
+				if (!declarations.empty())
+					declarations += ";";
+				declarations += get_scalar("params", json_array_get_element(array, i));
+			}
+
+			values["param"] = declarations;
+		}
+		else if (name == "adapt-ladder")
+		{
+			if (!JSON_NODE_HOLDS_ARRAY(node))
+				throw std::runtime_error("\"adapt-ladder\" must be an array");
+
+			std::string ladder;
+			JsonArray *array = json_node_get_array(node);
+			for (guint i = 0; i < json_array_get_length(array); ++i)
+			{
+				if (!ladder.empty())
+					ladder += ";";
+				ladder += get_scalar("adapt-ladder", json_array_get_element(array, i));
+			}
+
+			values["adapt-ladder"] = ladder;
+		}
+		else if ((name == "sink") || (name == "premium-sink"))
+		{
+			// The premium sink settings are named like the
+			// others, with a "premium-" prefix (see mount_config)
+			std::string prefix = (name == "sink") ? "" : "premium-";
+
+			if (!JSON_NODE_HOLDS_OBJECT(node))
+				throw std::runtime_error("\"" + name + "\" must be an object");
+
+			JsonObject *sink_object = json_node_get_object(node);
+			GList *sink_members = json_object_get_members(sink_object);
+			auto sink_members_guard = make_scope_guard([sink_members]() { g_list_free(sink_members); });
+
+			for (GList *sink_member = sink_members; sink_member != nullptr; sink_member = sink_member->next)
+			{
+				std::string sink_name = reinterpret_cast < char const * > (sink_member->data);
+				values[prefix + sink_name] = get_scalar(sink_name, json_object_get_member(sink_object, sink_name.c_str()));
+			}
+		}
+		else if ((name == "content-type") || (name == "launch") || (name == "pool-max-idle") || (name == "pool-max-memory") || (name == "adapt-param") || (name == "ingest") || (name == "relay") || (name == "loop") || (name == "rtp") || (name == "rtp-ttl") || (name == "webrtc") || (name == "unix") || (name == "shm") || (name == "shm-size") || (name == "start-grace") || (name == "stop-linger") || (name == "resume-window") || (name == "slate") || (name == "slate-stall") || (name == "priority"))
+		{
+			values[name] = get_scalar(name, node);
+		}
+		else
+		{
+			throw std::runtime_error("unknown member \"" + name + "\"");
+		}
+	}
+
+	return values;
+}
+
+
+} // unnamed namespace end
+
+
+
+
+control_server::control_server(mount_table &p_mount_table, std::string p_config_filename)
+	: m_mount_table(p_mount_table)
+	, m_config_filename(std::move(p_config_filename))
+{
+	m_server = soup_server_new(SOUP_SERVER_SERVER_HEADER, "gst-soup-server-example-control", nullptr);
+	if (m_server == nullptr)
+		throw std::runtime_error("could not create control server");
+
+	soup_server_add_handler(m_server, "/", request_handler, this, nullptr);
+}
+
+
+control_server::~control_server()
+{
+	soup_server_disconnect(m_server);
+	g_object_unref(G_OBJECT(m_server));
+}
+
+
+void control_server::listen(guint const p_port)
+{
+	GError *gerror = nullptr;
+	if (!soup_server_listen_local(m_server, p_port, SoupServerListenOptions(0), &gerror))
+	{
+		std::string s = std::string("could not start listening for control requests: ") + gerror->message;
+		g_clear_error(&gerror);
+		throw std::runtime_error(s);
+	}
+}
+
+
+void control_server::request_handler(SoupServer *, SoupMessage *p_msg, char const *p_path, GHashTable *, SoupClientContext *, gpointer p_user_data)
+{
+	control_server *self = reinterpret_cast < control_server* > (p_user_data);
+	std::string path = p_path;
+
+	if (path == "/mounts")
+	{
+		if (std::string(p_msg->method) != SOUP_METHOD_GET)
+		{
+			soup_message_set_status(p_msg, SOUP_STATUS_METHOD_NOT_ALLOWED);
+			return;
+		}
+
+		JsonArray *array = json_array_new();
+		for (auto const &entry : self->m_mount_table.get_mounts())
+			json_array_add_element(array, self->describe_mount(*(entry.second)));
+
+		JsonNode *node = json_node_new(JSON_NODE_ARRAY);
+		json_node_take_array(node, array);
+		set_json_response(p_msg, SOUP_STATUS_OK, node);
+	}
+	else if (path == "/sessions")
+	{
+		if (std::string(p_msg->method) != SOUP_METHOD_GET)
+		{
+			soup_message_set_status(p_msg, SOUP_STATUS_METHOD_NOT_ALLOWED);
+			return;
+		}
+
+		JsonArray *array = json_array_new();
+		self->m_mount_table.get_sessions().for_each_session([self, array](session_table::session const &p_session)
+		{
+			json_array_add_element(array, self->describe_session(p_session));
+		});
+
+		JsonNode *node = json_node_new(JSON_NODE_ARRAY);
+		json_node_take_array(node, array);
+		set_json_response(p_msg, SOUP_STATUS_OK, node);
+	}
+	else if (path == "/limits")
+	{
+		if (std::string(p_msg->method) != SOUP_METHOD_GET)
+		{
+			soup_message_set_status(p_msg, SOUP_STATUS_METHOD_NOT_ALLOWED);
+			return;
+		}
+
+		set_json_response(p_msg, SOUP_STATUS_OK, self->describe_limits());
+	}
+	else if (path == "/trace")
+	{
+		if (std::string(p_msg->method) != SOUP_METHOD_GET)
+		{
+			soup_message_set_status(p_msg, SOUP_STATUS_METHOD_NOT_ALLOWED);
+			return;
+		}
+
+		set_json_response(p_msg, SOUP_STATUS_OK, self->describe_trace());
+	}
+	else if (g_str_has_prefix(path.c_str(), mounts_path_prefix.c_str()))
+	{
+		std::string name = path.substr(mounts_path_prefix.size());
+
+		// Mount names cannot contain slashes, so anything
+		// after one addresses a part of the mount
+		std::string::size_type slash_pos = name.find('/');
+		if (slash_pos == std::string::npos)
+			self->handle_mount_request(p_msg, name);
+		else if (name.substr(slash_pos) == source_path_suffix)
+			self->handle_source_request(p_msg, name.substr(0, slash_pos));
+		else
+			soup_message_set_status(p_msg, SOUP_STATUS_NOT_FOUND);
+	}
+	else if (path == "/reload")
+	{
+		self->handle_reload_request(p_msg);
+	}
+	else
+	{
+		soup_message_set_status(p_msg, SOUP_STATUS_NOT_FOUND);
+	}
+}
+
+
+void control_server::handle_mount_request(SoupMessage *p_msg, std::string const &p_name)
+{
+	mount_table::mount const *existing_mount = m_mount_table.find_mount(p_name);
+
+	// libsoup has no SOUP_METHOD_PATCH, so compare strings
+	std::string method = p_msg->method;
+
+	if (method == SOUP_METHOD_GET)
+	{
+		if (existing_mount == nullptr)
+			set_error_response(p_msg, SOUP_STATUS_NOT_FOUND, "no mount \"" + p_name + "\"");
+		else
+			set_json_response(p_msg, SOUP_STATUS_OK, describe_mount(*existing_mount));
+	}
+	else if ((method == SOUP_METHOD_PUT) || (method == "PATCH"))
+	{
+		bool patch = (method == "PATCH");
+		if (patch && (existing_mount == nullptr))
+		{
+			set_error_response(p_msg, SOUP_STATUS_NOT_FOUND, "no mount \"" + p_name + "\"");
+			return;
+		}
+
+		// PUT describes the whole mount, while PATCH
+		// starts out with the current configuration
+		mount_config config = patch ? existing_mount->m_config : mount_config();
+		mount_origin origin = patch ? existing_mount->m_origin : mount_origin::control_api;
+
+		try
+		{
+			// The mount under "/" comes from the command line;
+			// it may be changed, but not named otherwise
+			if (!p_name.empty() || (existing_mount == nullptr))
+				mount_table::validate_name(p_name);
+
+			for (auto const &value : parse_mount_config_values(p_msg))
+				config.set(value.first, value.second);
+			config.validate();
+		}
+		catch (std::exception const &p_exc)
+		{
+			set_error_response(p_msg, SOUP_STATUS_BAD_REQUEST, p_exc.what());
+			return;
+		}
+
+		try
+		{
+			bool created = m_mount_table.set_mount(p_name, std::move(config), origin);
+			set_json_response(p_msg, created ? SOUP_STATUS_CREATED : SOUP_STATUS_OK, describe_mount(*(m_mount_table.find_mount(p_name))));
+		}
+		catch (std::exception const &p_exc)
+		{
+			set_error_response(p_msg, SOUP_STATUS_INTERNAL_SERVER_ERROR, p_exc.what());
+		}
+	}
+	else if (method == SOUP_METHOD_DELETE)
+	{
+		if (m_mount_table.remove_mount(p_name))
+			soup_message_set_status(p_msg, SOUP_STATUS_NO_CONTENT);
+		else
+			set_error_response(p_msg, SOUP_STATUS_NOT_FOUND, "no mount \"" + p_name + "\"");
+	}
+	else
+	{
+		soup_message_set_status(p_msg, SOUP_STATUS_METHOD_NOT_ALLOWED);
+	}
+}
+
+
+void control_server::handle_source_request(SoupMessage *p_msg, std::string const &p_name)
+{
+	if (std::string(p_msg->method) != SOUP_METHOD_POST)
+	{
+		soup_message_set_status(p_msg, SOUP_STATUS_METHOD_NOT_ALLOWED);
+		return;
+	}
+
+	if (m_mount_table.find_mount(p_name) == nullptr)
+	{
+		set_error_response(p_msg, SOUP_STATUS_NOT_FOUND, "no mount \"" + p_name + "\"");
+		return;
+	}
+
+	// The launch line is parsed with mount_config::set(),
+	// so it is split the same way as everywhere else
+	mount_config launch_config;
+	bool preroll = true;
+
+	try
+	{
+		JsonParser *parser = json_parser_new();
+		auto parser_guard = make_scope_guard([parser]() { g_object_unref(G_OBJECT(parser)); });
+
+		JsonObject *object = parse_request_object(p_msg, parser);
+
+		JsonNode *launch_node = json_object_get_member(object, "launch");
+		if ((launch_node == nullptr) || !JSON_NODE_HOLDS_VALUE(launch_node) || (json_node_get_value_type(launch_node) != G_TYPE_STRING))
+			throw std::runtime_error("\"launch\" must be a string");
+		launch_config.set("launch", json_node_get_string(launch_node));
+
+		JsonNode *preroll_node = json_object_get_member(object, "preroll");
+		if (preroll_node != nullptr)
+		{
+			if (!JSON_NODE_HOLDS_VALUE(preroll_node) || (json_node_get_value_type(preroll_node) != G_TYPE_BOOLEAN))
+				throw std::runtime_error("\"preroll\" must be a boolean");
+			preroll = json_node_get_boolean(preroll_node);
+		}
+	}
+	catch (std::exception const &p_exc)
+	{
+		set_error_response(p_msg, SOUP_STATUS_BAD_REQUEST, p_exc.what());
+		return;
+	}
+
+	try
+	{
+		m_mount_table.switch_source(p_name, std::move(launch_config.m_launch), preroll);
+		set_json_response(p_msg, SOUP_STATUS_ACCEPTED, describe_mount(*(m_mount_table.find_mount(p_name))));
+	}
+	catch (std::exception const &p_exc)
+	{
+		set_error_response(p_msg, SOUP_STATUS_BAD_REQUEST, p_exc.what());
+	}
+}
+
+
+void control_server::handle_reload_request(SoupMessage *p_msg)
+{
+	if (std::string(p_msg->method) != SOUP_METHOD_POST)
+	{
+		soup_message_set_status(p_msg, SOUP_STATUS_METHOD_NOT_ALLOWED);
+		return;
+	}
+
+	if (m_config_filename.empty())
+	{
+		set_error_response(p_msg, SOUP_STATUS_CONFLICT, "no configuration file in use");
+		return;
+	}
+
+	try
+	{
+		reload_config_file(m_mount_table, m_config_filename);
+		soup_message_set_status(p_msg, SOUP_STATUS_NO_CONTENT);
+	}
+	catch (std::exception const &p_exc)
+	{
+		set_error_response(p_msg, SOUP_STATUS_INTERNAL_SERVER_ERROR, p_exc.what());
+	}
+}
+
+
+JsonNode* control_server::describe_mount(mount_table::mount const &p_mount) const
+{
+	mount_config const &config = p_mount.m_config;
+
+	JsonBuilder *builder = json_builder_new();
+	json_builder_begin_object(builder);
+
+	json_builder_set_member_name(builder, "name");
+	json_builder_add_string_value(builder, p_mount.m_name.c_str());
+	json_builder_set_member_name(builder, "path");
+	json_builder_add_string_value(builder, mount_table::get_path(p_mount.m_name).c_str());
+	json_builder_set_member_name(builder, "origin");
+	json_builder_add_string_value(builder, get_mount_origin_name(p_mount.m_origin));
+	json_builder_set_member_name(builder, "content-type");
+	json_builder_add_string_value(builder, config.m_content_type.c_str());
+
+	// The launch line is reported the way the pipeline parser
+	// sees it, that is, as a list of arguments
+	json_builder_set_member_name(builder, "launch");
+	json_builder_begin_array(builder);
+	for (std::string const &arg : config.m_launch)
+		json_builder_add_string_value(builder, arg.c_str());
+	json_builder_end_array(builder);
+
+	json_builder_set_member_name(builder, "relay");
+	if (config.m_relay_url.empty())
+		json_builder_add_null_value(builder);
+	else
+		json_builder_add_string_value(builder, config.m_relay_url.c_str());
+
+	json_builder_set_member_name(builder, "loop");
+	if (config.m_loop_path.empty())
+		json_builder_add_null_value(builder);
+	else
+		json_builder_add_string_value(builder, config.m_loop_path.c_str());
+
+	json_builder_set_member_name(builder, "params");
+	json_builder_begin_array(builder);
+	for (pipeline_pool::parameter const &param : config.m_parameters)
+	{
+		std::string declaration = param.m_name + ":" + std::to_string(param.m_min) + ":" + std::to_string(param.m_max) + ":" + std::to_string(param.m_default);
+		json_builder_add_string_value(builder, declaration.c_str());
+	}
+	json_builder_end_array(builder);
+
+	json_builder_set_member_name(builder, "pool-max-idle");
+	json_builder_add_int_value(builder, config.m_max_idle_instances);
+	json_builder_set_member_name(builder, "pool-max-memory");
+	json_builder_add_int_value(builder, config.m_max_memory / (1024 * 1024));
+	json_builder_set_member_name(builder, "start-grace");
+	json_builder_add_int_value(builder, config.m_start_grace_ms);
+	json_builder_set_member_name(builder, "stop-linger");
+	json_builder_add_int_value(builder, config.m_stop_linger_ms);
+	json_builder_set_member_name(builder, "resume-window");
+	json_builder_add_int_value(builder, config.m_resume_window_ms);
+
+	json_builder_set_member_name(builder, "slate");
+	if (config.m_slate_path.empty())
+		json_builder_add_null_value(builder);
+	else
+		json_builder_add_string_value(builder, config.m_slate_path.c_str());
+	json_builder_set_member_name(builder, "slate-stall");
+	json_builder_add_int_value(builder, config.m_slate_stall_ms);
+
+	auto add_sink_settings = [builder](char const *p_name, sink_settings const &p_sink_settings)
+	{
+		json_builder_set_member_name(builder, p_name);
+		json_builder_begin_object(builder);
+		json_builder_set_member_name(builder, "units-max");
+		json_builder_add_int_value(builder, p_sink_settings.m_units_max_ms);
+		json_builder_set_member_name(builder, "units-soft-max");
+		json_builder_add_int_value(builder, p_sink_settings.m_units_soft_max_ms);
+		json_builder_set_member_name(builder, "timeout");
+		json_builder_add_int_value(builder, p_sink_settings.m_timeout_ms);
+		json_builder_set_member_name(builder, "recover-policy");
+		json_builder_add_string_value(builder, p_sink_settings.m_recover_policy.c_str());
+		json_builder_set_member_name(builder, "sync-method");
+		json_builder_add_string_value(builder, p_sink_settings.m_sync_method.c_str());
+		json_builder_end_object(builder);
+	};
+
+	add_sink_settings("sink", config.m_sink_settings);
+	add_sink_settings("premium-sink", config.m_premium_sink_settings);
+	json_builder_set_member_name(builder, "priority");
+	json_builder_add_string_value(builder, get_priority_class_name(config.m_priority));
+
+	json_builder_set_member_name(builder, "instances");
+	json_builder_add_int_value(builder, p_mount.m_pool->get_num_instances());
+	json_builder_set_member_name(builder, "clients");
+	json_builder_add_int_value(builder, p_mount.m_pool->get_num_clients());
+	json_builder_set_member_name(builder, "pipeline-starts");
+	json_builder_add_int_value(builder, p_mount.m_pool->get_num_pipeline_starts());
+	json_builder_set_member_name(builder, "avoided-starts");
+	json_builder_add_int_value(builder, p_mount.m_pool->get_num_avoided_starts());
+	json_builder_set_member_name(builder, "probes");
+	json_builder_add_int_value(builder, p_mount.m_num_probes);
+	json_builder_set_member_name(builder, "resumes");
+	json_builder_add_int_value(builder, p_mount.m_num_resumes);
+
+	json_builder_set_member_name(builder, "classes");
+	json_builder_begin_object(builder);
+	for (priority_class priority : { priority_class::standard, priority_class::premium })
+	{
+		http_stream_pipeline::priority_stats stats = p_mount.m_pool->get_priority_stats(priority);
+
+		json_builder_set_member_name(builder, get_priority_class_name(priority));
+		json_builder_begin_object(builder);
+		json_builder_set_member_name(builder, "clients");
+		json_builder_add_int_value(builder, stats.m_num_clients);
+		json_builder_set_member_name(builder, "evictions");
+		json_builder_add_int_value(builder, stats.m_num_evictions);
+		json_builder_set_member_name(builder, "dropped-buffers");
+		json_builder_add_int_value(builder, stats.m_dropped_buffers);
+		json_builder_end_object(builder);
+	}
+	json_builder_end_object(builder);
+
+	json_builder_set_member_name(builder, "ingest");
+	if (p_mount.m_ingest)
+	{
+		ingest_source::stats stats = p_mount.m_ingest->get_stats();
+
+		json_builder_begin_object(builder);
+		json_builder_set_member_name(builder, "connected");
+		json_builder_add_boolean_value(builder, stats.m_connected);
+		json_builder_set_member_name(builder, "connections");
+		json_builder_add_int_value(builder, stats.m_num_connections);
+		json_builder_set_member_name(builder, "bytes-received");
+		json_builder_add_int_value(builder, stats.m_bytes_received);
+		json_builder_set_member_name(builder, "chunks");
+		json_builder_add_int_value(builder, stats.m_num_chunks);
+		json_builder_set_member_name(builder, "jitter");
+		json_builder_add_double_value(builder, stats.m_jitter / 1000.0);
+		json_builder_set_member_name(builder, "pauses");
+		json_builder_add_int_value(builder, stats.m_num_pauses);
+		json_builder_set_member_name(builder, "paused-time");
+		json_builder_add_double_value(builder, stats.m_paused_time / 1000.0);
+		json_builder_set_member_name(builder, "queued-bytes");
+		json_builder_add_int_value(builder, stats.m_queued_bytes);
+		json_builder_end_object(builder);
+	}
+	else
+		json_builder_add_null_value(builder);
+
+	json_builder_set_member_name(builder, "rtp");
+	if (p_mount.m_rtp)
+	{
+		rtp_output::stats stats = p_mount.m_rtp->get_stats();
+
+		json_builder_begin_object(builder);
+		json_builder_set_member_name(builder, "destination");
+		json_builder_add_string_value(builder, config.m_rtp_destination.c_str());
+		json_builder_set_member_name(builder, "ttl");
+		json_builder_add_int_value(builder, config.m_rtp_ttl);
+		json_builder_set_member_name(builder, "packets");
+		json_builder_add_int_value(builder, stats.m_num_packets);
+		json_builder_set_member_name(builder, "send-calls");
+		json_builder_add_int_value(builder, stats.m_num_batches);
+		json_builder_set_member_name(builder, "packets-per-second");
+		json_builder_add_double_value(builder, stats.m_packets_per_second);
+		json_builder_set_member_name(builder, "cpu-usage");
+		json_builder_add_double_value(builder, stats.m_cpu_usage);
+		json_builder_end_object(builder);
+	}
+	else
+		json_builder_add_null_value(builder);
+
+	json_builder_set_member_name(builder, "webrtc");
+	if (p_mount.m_webrtc)
+	{
+		webrtc_output::stats stats = p_mount.m_webrtc->get_stats();
+
+		json_builder_begin_object(builder);
+		json_builder_set_member_name(builder, "peers");
+		json_builder_add_int_value(builder, stats.m_num_peers);
+		json_builder_set_member_name(builder, "connections");
+		json_builder_add_int_value(builder, stats.m_num_connections);
+		json_builder_set_member_name(builder, "keyframe-requests");
+		json_builder_add_int_value(builder, stats.m_num_keyframe_requests);
+		json_builder_set_member_name(builder, "forwarded-keyframe-requests");
+		json_builder_add_int_value(builder, stats.m_num_forwarded_keyframe_requests);
+		json_builder_end_object(builder);
+	}
+	else
+		json_builder_add_null_value(builder);
+
+	json_builder_set_member_name(builder, "unix");
+	if (p_mount.m_unix_socket)
+	{
+		json_builder_begin_object(builder);
+		json_builder_set_member_name(builder, "path");
+		json_builder_add_string_value(builder, config.m_unix_socket_path.c_str());
+		json_builder_set_member_name(builder, "connections");
+		json_builder_add_int_value(builder, p_mount.m_unix_socket->get_num_connections());
+		json_builder_end_object(builder);
+	}
+	else
+		json_builder_add_null_value(builder);
+
+	json_builder_set_member_name(builder, "shm");
+	if (p_mount.m_shm)
+	{
+		shm_output::stats stats = p_mount.m_shm->get_stats();
+
+		json_builder_begin_object(builder);
+		json_builder_set_member_name(builder, "path");
+		json_builder_add_string_value(builder, config.m_shm_socket_path.c_str());
+		json_builder_set_member_name(builder, "size");
+		json_builder_add_int_value(builder, config.m_shm_size);
+		json_builder_set_member_name(builder, "consumers");
+		json_builder_add_int_value(builder, stats.m_num_consumers);
+		json_builder_set_member_name(builder, "connections");
+		json_builder_add_int_value(builder, stats.m_num_connections);
+		json_builder_end_object(builder);
+	}
+	else
+		json_builder_add_null_value(builder);
+
+	json_builder_set_member_name(builder, "adapt-param");
+	json_builder_add_string_value(builder, config.m_adapt_parameter.c_str());
+	json_builder_set_member_name(builder, "adapt-ladder");
+	json_builder_begin_array(builder);
+	for (gint64 value : config.m_adapt_ladder)
+		json_builder_add_int_value(builder, value);
+	json_builder_end_array(builder);
+	json_builder_set_member_name(builder, "adapt-downswitches");
+	json_builder_add_int_value(builder, p_mount.m_num_downswitches);
+	json_builder_set_member_name(builder, "adapt-upswitches");
+	json_builder_add_int_value(builder, p_mount.m_num_upswitches);
+
+	// Source switches are reported for the default instance,
+	// which takes part in every switch
+	http_stream_pipeline &default_pipeline = p_mount.m_pool->get_default_pipeline();
+	json_builder_set_member_name(builder, "source-switches");
+	json_builder_add_int_value(builder, default_pipeline.get_num_source_switches());
+	json_builder_set_member_name(builder, "last-source-switch-latency");
+	gint64 latency = default_pipeline.get_last_source_switch_latency();
+	if (latency < 0)
+		json_builder_add_null_value(builder);
+	else
+		json_builder_add_double_value(builder, latency / 1000.0);
+	json_builder_set_member_name(builder, "source-restarts");
+	json_builder_add_int_value(builder, default_pipeline.get_num_source_restarts());
+	json_builder_set_member_name(builder, "slate-activations");
+	json_builder_add_int_value(builder, default_pipeline.get_num_slate_activations());
+	json_builder_set_member_name(builder, "showing-slate");
+	json_builder_add_boolean_value(builder, default_pipeline.is_showing_slate());
+
+	json_builder_end_object(builder);
+
+	JsonNode *node = json_builder_get_root(builder);
+	g_object_unref(G_OBJECT(builder));
+
+	return node;
+}
+
+
+JsonNode* control_server::describe_limits() const
+{
+	connection_limiter *limiter = m_mount_table.get_connection_limiter();
+	if (limiter == nullptr)
+		return json_node_new(JSON_NODE_NULL);
+
+	connection_limiter::stats stats = limiter->get_stats();
+
+	JsonBuilder *builder = json_builder_new();
+	json_builder_begin_object(builder);
+	json_builder_set_member_name(builder, "addresses");
+	json_builder_add_int_value(builder, stats.m_num_addresses);
+	json_builder_set_member_name(builder, "accepted");
+	json_builder_add_int_value(builder, stats.m_num_accepted);
+	json_builder_set_member_name(builder, "rejected-connections");
+	json_builder_add_int_value(builder, stats.m_num_rejected_connections);
+	json_builder_set_member_name(builder, "rejected-rate");
+	json_builder_add_int_value(builder, stats.m_num_rejected_rate);
+	json_builder_set_member_name(builder, "rejected-table-full");
+	json_builder_add_int_value(builder, stats.m_num_rejected_table_full);
+	json_builder_end_object(builder);
+
+	JsonNode *node = json_builder_get_root(builder);
+	g_object_unref(G_OBJECT(builder));
+
+	return node;
+}
+
+
+JsonNode* control_server::describe_trace() const
+{
+	event_trace *trace = m_mount_table.get_event_trace();
+	if (trace == nullptr)
+		return json_node_new(JSON_NODE_NULL);
+
+	std::vector < event_trace::event > events = trace->get_events();
+
+	// Chrome's trace viewer and Perfetto show each pid as a process and
+	// each tid as a thread in it; here, the tracks are the processes,
+	// and the connections and pipelines are the threads
+	JsonBuilder *builder = json_builder_new();
+	json_builder_begin_object(builder);
+	json_builder_set_member_name(builder, "displayTimeUnit");
+	json_builder_add_string_value(builder, "ms");
+	json_builder_set_member_name(builder, "otherData");
+	json_builder_begin_object(builder);
+	json_builder_set_member_name(builder, "recorded-events");
+	json_builder_add_int_value(builder, trace->get_num_recorded());
+	json_builder_set_member_name(builder, "capacity");
+	json_builder_add_int_value(builder, trace->get_capacity());
+	json_builder_end_object(builder);
+
+	json_builder_set_member_name(builder, "traceEvents");
+	json_builder_begin_array(builder);
+
+	std::pair < event_trace::track, char const * > const track_names[] = {
+		{ event_trace::connections, "connections" },
+		{ event_trace::pipelines, "pipelines" }
+	};
+	for (auto const &track_name : track_names)
+	{
+		json_builder_begin_object(builder);
+		json_builder_set_member_name(builder, "name");
+		json_builder_add_string_value(builder, "process_name");
+		json_builder_set_member_name(builder, "ph");
+		json_builder_add_string_value(builder, "M");
+		json_builder_set_member_name(builder, "pid");
+		json_builder_add_int_value(builder, track_name.first);
+		json_builder_set_member_name(builder, "args");
+		json_builder_begin_object(builder);
+		json_builder_set_member_name(builder, "name");
+		json_builder_add_string_value(builder, track_name.second);
+		json_builder_end_object(builder);
+		json_builder_end_object(builder);
+	}
+
+	for (event_trace::event const &recorded_event : events)
+	{
+		json_builder_begin_object(builder);
+		json_builder_set_member_name(builder, "name");
+		json_builder_add_string_value(builder, recorded_event.m_name);
+		json_builder_set_member_name(builder, "cat");
+		json_builder_add_string_value(builder, recorded_event.m_category);
+		json_builder_set_member_name(builder, "ph");
+		json_builder_add_string_value(builder, "i");
+		json_builder_set_member_name(builder, "s");
+		json_builder_add_string_value(builder, "t");
+		json_builder_set_member_name(builder, "ts");
+		json_builder_add_int_value(builder, recorded_event.m_time);
+		json_builder_set_member_name(builder, "pid");
+		json_builder_add_int_value(builder, recorded_event.m_track);
+		json_builder_set_member_name(builder, "tid");
+		json_builder_add_int_value(builder, recorded_event.m_id);
+		if (recorded_event.m_arg_name != nullptr)
+		{
+			json_builder_set_member_name(builder, "args");
+			json_builder_begin_object(builder);
+			json_builder_set_member_name(builder, recorded_event.m_arg_name);
+			json_builder_add_int_value(builder, recorded_event.m_arg_value);
+			json_builder_end_object(builder);
+		}
+		json_builder_end_object(builder);
+	}
+
+	json_builder_end_array(builder);
+	json_builder_end_object(builder);
+
+	JsonNode *node = json_builder_get_root(builder);
+	g_object_unref(G_OBJECT(builder));
+
+	return node;
+}
+
+
+JsonNode* control_server::describe_session(session_table::session const &p_session) const
+{
+	JsonBuilder *builder = json_builder_new();
+	json_builder_begin_object(builder);
+
+	json_builder_set_member_name(builder, "token");
+	json_builder_add_string_value(builder, p_session.m_token.c_str());
+	json_builder_set_member_name(builder, "mount");
+	json_builder_add_string_value(builder, p_session.m_mount_name.c_str());
+
+	// Clients that are being moved are not in any pipeline right now
+	mount_table::mount const *current_mount = m_mount_table.find_mount(p_session.m_mount_name);
+	http_stream_pipeline *pipeline = (current_mount != nullptr) ? current_mount->m_pool->find_client_pipeline(p_session.m_socket) : nullptr;
+
+	json_builder_set_member_name(builder, "params");
+	if (pipeline != nullptr)
+	{
+		json_builder_begin_object(builder);
+		for (auto const &value : current_mount->m_pool->get_parameter_values(*pipeline))
+		{
+			json_builder_set_member_name(builder, value.first.c_str());
+			json_builder_add_int_value(builder, value.second);
+		}
+		json_builder_end_object(builder);
+	}
+	else
+		json_builder_add_null_value(builder);
+
+	http_stream_pipeline::client_stats stats;
+	bool has_stats = (pipeline != nullptr) && pipeline->get_client_stats(p_session.m_socket, stats);
+	json_builder_set_member_name(builder, "bytes-sent");
+	if (has_stats)
+		json_builder_add_int_value(builder, stats.m_bytes_sent);
+	else
+		json_builder_add_null_value(builder);
+	json_builder_set_member_name(builder, "dropped-buffers");
+	if (has_stats)
+		json_builder_add_int_value(builder, stats.m_dropped_buffers);
+	else
+		json_builder_add_null_value(builder);
+
+	json_builder_set_member_name(builder, "rendition-history");
+	json_builder_begin_array(builder);
+	for (session_table::rendition_change const &change : p_session.m_rendition_history)
+	{
+		json_builder_begin_object(builder);
+		json_builder_set_member_name(builder, "time");
+		json_builder_add_double_value(builder, change.m_time / double(G_USEC_PER_SEC));
+		json_builder_set_member_name(builder, "from");
+		json_builder_add_string_value(builder, change.m_from.c_str());
+		json_builder_set_member_name(builder, "to");
+		json_builder_add_string_value(builder, change.m_to.c_str());
+		json_builder_set_member_name(builder, "reason");
+		json_builder_add_string_value(builder, change.m_reason.c_str());
+		json_builder_end_object(builder);
+	}
+	json_builder_end_array(builder);
+
+	json_builder_end_object(builder);
+
+	JsonNode *node = json_builder_get_root(builder);
+	g_object_unref(G_OBJECT(builder));
+
+	return node;
+}
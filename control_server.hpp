@@ -0,0 +1,75 @@
+#ifndef GST_SOUP_SERVER_EXAMPLE_CONTROL_SERVER_HPP
+#define GST_SOUP_SERVER_EXAMPLE_CONTROL_SERVER_HPP
+
+#include <glib.h>
+#include <libsoup/soup.h>
+#include <json-glib/json-glib.h>
+#include <string>
+#include "mount_table.hpp"
+
+
+// Local HTTP server with a REST/JSON API for changing the mounts at runtime:
+//
+//   GET    /mounts        lists all mounts
+//   GET    /mounts/NAME   describes one mount
+//   PUT    /mounts/NAME   creates or replaces a mount
+//   PATCH  /mounts/NAME   changes some of the values of a mount
+//   DELETE /mounts/NAME   removes a mount
+//   POST   /mounts/NAME/source
+//                         switches the source of a mount
+//   POST   /reload        reloads the configuration file
+//   GET    /sessions      lists the streaming connections, with their
+//                         statistics and quality adaptation history
+//   GET    /limits        reports how many requests the connection
+//                         limiter accepted and rejected (null if there
+//                         is no limiter)
+//   GET    /trace         returns the recorded connection and pipeline
+//                         events in the Chrome trace event format (null
+//                         if tracing is off)
+//
+// The mount that is served under "/" has the empty name, so it is
+// addressed as "/mounts/". PUT and PATCH expect a JSON object whose
+// members are named like the mount_config values, except that the
+// parameter declarations are given as a "params" array of strings,
+// and that the sink settings are given in a "sink" object (and the
+// premium sink settings in a "premium-sink" object). Only
+// changes of "content-type", "launch", or "params" restart the
+// pipelines of a mount. Switching the source does not; it expects
+// a JSON object with a "launch" string, and an optional "preroll"
+// boolean (true by default) that makes the switch happen at the
+// first keyframe of the new source. Relay mounts are set up with a
+// "relay" URL instead of a "launch" line; their source cannot be switched.
+//
+// The server only listens on the loopback interface.
+class control_server
+{
+public:
+	// p_config_filename may be empty if there is no configuration file.
+	explicit control_server(mount_table &p_mount_table, std::string p_config_filename);
+	~control_server();
+
+	void listen(guint const p_port);
+
+
+private:
+	control_server(control_server const &) = delete;
+	control_server& operator = (control_server const &) = delete;
+
+	static void request_handler(SoupServer *, SoupMessage *p_msg, char const *p_path, GHashTable *, SoupClientContext *, gpointer p_user_data);
+	void handle_mount_request(SoupMessage *p_msg, std::string const &p_name);
+	void handle_source_request(SoupMessage *p_msg, std::string const &p_name);
+	void handle_reload_request(SoupMessage *p_msg);
+
+	JsonNode* describe_mount(mount_table::mount const &p_mount) const;
+	JsonNode* describe_limits() const;
+	JsonNode* describe_trace() const;
+	JsonNode* describe_session(session_table::session const &p_session) const;
+
+
+	mount_table &m_mount_table;
+	std::string m_config_filename;
+	SoupServer *m_server;
+};
+
+
+#endif
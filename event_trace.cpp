@@ -0,0 +1,91 @@
+#include <algorithm>
+#include <utility>
+#include "event_trace.hpp"
+
+
+event_trace::event_trace(std::size_t const p_capacity)
+	: m_capacity(std::max < std::size_t > (p_capacity, 1))
+	, m_slots(new slot[m_capacity])
+	, m_num_recorded(0)
+{
+	for (std::size_t i = 0; i < m_capacity; ++i)
+		m_slots[i].m_sequence.store(0, std::memory_order_relaxed);
+}
+
+
+void event_trace::record(track const p_track, gint64 const p_id, char const *p_category, char const *p_name, char const *p_arg_name, gint64 const p_arg_value)
+{
+	gint64 now = g_get_monotonic_time();
+
+	// Sequence numbers start at 1, since 0 marks slots
+	// that are empty or being written to
+	guint64 sequence = m_num_recorded.fetch_add(1, std::memory_order_relaxed) + 1;
+	slot &event_slot = m_slots[(sequence - 1) % m_capacity];
+
+	event_slot.m_sequence.store(0, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	event_slot.m_time.store(now, std::memory_order_relaxed);
+	event_slot.m_track.store(p_track, std::memory_order_relaxed);
+	event_slot.m_id.store(p_id, std::memory_order_relaxed);
+	event_slot.m_category.store(p_category, std::memory_order_relaxed);
+	event_slot.m_name.store(p_name, std::memory_order_relaxed);
+	event_slot.m_arg_name.store(p_arg_name, std::memory_order_relaxed);
+	event_slot.m_arg_value.store(p_arg_value, std::memory_order_relaxed);
+
+	event_slot.m_sequence.store(sequence, std::memory_order_release);
+}
+
+
+std::vector < event_trace::event > event_trace::get_events() const
+{
+	std::vector < std::pair < guint64, event > > sequenced_events;
+	sequenced_events.reserve(m_capacity);
+
+	for (std::size_t i = 0; i < m_capacity; ++i)
+	{
+		slot const &event_slot = m_slots[i];
+
+		guint64 sequence = event_slot.m_sequence.load(std::memory_order_acquire);
+		if (sequence == 0)
+			continue;
+
+		event recorded_event;
+		recorded_event.m_time = event_slot.m_time.load(std::memory_order_relaxed);
+		recorded_event.m_track = track(event_slot.m_track.load(std::memory_order_relaxed));
+		recorded_event.m_id = event_slot.m_id.load(std::memory_order_relaxed);
+		recorded_event.m_category = event_slot.m_category.load(std::memory_order_relaxed);
+		recorded_event.m_name = event_slot.m_name.load(std::memory_order_relaxed);
+		recorded_event.m_arg_name = event_slot.m_arg_name.load(std::memory_order_relaxed);
+		recorded_event.m_arg_value = event_slot.m_arg_value.load(std::memory_order_relaxed);
+
+		// If the slot was overwritten in the meantime,
+		// what was read may be a mix of two events
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (event_slot.m_sequence.load(std::memory_order_relaxed) != sequence)
+			continue;
+
+		sequenced_events.push_back(std::make_pair(sequence, recorded_event));
+	}
+
+	std::sort(sequenced_events.begin(), sequenced_events.end(), [](std::pair < guint64, event > const &p_first, std::pair < guint64, event > const &p_second)
+	{
+		return p_first.first < p_second.first;
+	});
+
+	std::vector < event > events;
+	events.reserve(sequenced_events.size());
+	for (auto const &sequenced_event : sequenced_events)
+		events.push_back(sequenced_event.second);
+
+	return events;
+}
+
+
+gint64 event_trace::get_connection_id(GSocket *p_socket)
+{
+	// File descriptors are reused, but never by two open
+	// connections at the same time, so a connection's
+	// events can still be told apart on the timeline
+	return g_socket_get_fd(p_socket);
+}
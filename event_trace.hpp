@@ -0,0 +1,92 @@
+#ifndef GST_SOUP_SERVER_EXAMPLE_EVENT_TRACE_HPP
+#define GST_SOUP_SERVER_EXAMPLE_EVENT_TRACE_HPP
+
+#include <gio/gio.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+
+// Records timestamped lifecycle events of the streaming connections and
+// the pipelines, for finding out where the time goes until a client gets
+// its first byte. The events are kept in a fixed-size ring; once it is
+// full, the oldest events are overwritten.
+//
+// Events are recorded from the mainloop thread as well as from streaming
+// threads, so recording does not take any lock: each event gets a slot
+// by atomically incrementing a counter, and the slot's sequence number is
+// only set once the event is complete. get_events() skips slots that are
+// being written to at the same time.
+//
+// Events belong to a track (connections or pipelines) and an ID within
+// it: the socket's file descriptor for connections, and a serial number
+// for pipelines. The names, categories, and argument names must be
+// static strings, since only the pointers are stored.
+class event_trace
+{
+public:
+	enum track
+	{
+		connections = 1,
+		pipelines = 2
+	};
+
+	struct event
+	{
+		// Monotonic time, in microseconds
+		gint64 m_time;
+		track m_track;
+		gint64 m_id;
+		char const *m_category, *m_name;
+		// m_arg_name is null if the event has no argument
+		char const *m_arg_name;
+		gint64 m_arg_value;
+	};
+
+	explicit event_trace(std::size_t const p_capacity);
+
+	void record(track const p_track, gint64 const p_id, char const *p_category, char const *p_name, char const *p_arg_name = nullptr, gint64 const p_arg_value = 0);
+
+	// Returns the events that are currently in the ring, oldest first
+	std::vector < event > get_events() const;
+
+	// Returns how many events were recorded so far, including
+	// the ones that were overwritten already
+	guint64 get_num_recorded() const
+	{
+		return m_num_recorded.load(std::memory_order_relaxed);
+	}
+
+	std::size_t get_capacity() const
+	{
+		return m_capacity;
+	}
+
+	// The ID of a connection on the connections track
+	static gint64 get_connection_id(GSocket *p_socket);
+
+
+private:
+	event_trace(event_trace const &) = delete;
+	event_trace& operator = (event_trace const &) = delete;
+
+	// The fields are atomic only so that reading a slot while it is
+	// written to is well defined; the sequence number tells whether
+	// what was read belongs together. 0 means "being written to".
+	struct slot
+	{
+		std::atomic < guint64 > m_sequence;
+		std::atomic < gint64 > m_time;
+		std::atomic < int > m_track;
+		std::atomic < gint64 > m_id;
+		std::atomic < char const * > m_category, m_name, m_arg_name;
+		std::atomic < gint64 > m_arg_value;
+	};
+
+	std::size_t m_capacity;
+	std::unique_ptr < slot[] > m_slots;
+	std::atomic < guint64 > m_num_recorded;
+};
+
+
+#endif
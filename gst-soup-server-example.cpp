@@ -1,12 +1,23 @@
 #include <iostream>
 #include <glib.h>
 #include <glib-unix.h>
+#include <gio/gunixsocketaddress.h>
 #include <gst/gst.h>
 #include <libsoup/soup.h>
 #include <stdexcept>
-#include <map>
+#include <string>
+#include <memory>
 #include <vector>
-#include <mutex>
+#include <set>
+#include <algorithm>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "mount_table.hpp"
+#include "config_file.hpp"
+#include "control_server.hpp"
+#include "quality_adapter.hpp"
+#include "sibling_balancer.hpp"
+#include "rtsp_server.hpp"
 #include "scope_guard.hpp"
 
 
@@ -25,419 +36,179 @@ gboolean exit_sighandler(gpointer p_data)
 
 
 
-class http_stream_pipeline
+// Context for the SIGHUP handler
+struct reload_context
 {
-public:
-	explicit http_stream_pipeline(std::string p_content_type, char **pipeline_cmdline_argv)
-		: m_pipeline(nullptr)
-		, m_multisocketsink(nullptr)
-		, m_content_type(std::move(p_content_type))
-	{
-		GError *gerror = nullptr;
-		GstElement *cmdline_bin = nullptr, *stream_element = nullptr;
-
-		// Scope guard to ensure elements are unref'd in case of an exception/error
-		auto elements_guard = make_scope_guard([&stream_element, &cmdline_bin, this]()
-		{
-			// Using a vector here instead of an initializer list as a workaround
-			// for a C++11 bug that was corrected in C++14. The bug was reported
-			// as DR 1288 (https://gcc.gnu.org/bugzilla/show_bug.cgi?id=50025).
-			std::vector < GstElement ** > elements = { &stream_element, &cmdline_bin, &m_multisocketsink, &m_pipeline };
-
-			// Unref all elements and make sure their pointers are set to null
-			for (GstElement** elem : elements)
-			{
-				if (*elem != nullptr)
-				{
-					gst_object_unref(GST_OBJECT(*elem));
-					*elem = nullptr;
-				}
-			}
-		});
-
-
-		// Parse the command line
-		cmdline_bin = gst_parse_launchv((gchar const **)pipeline_cmdline_argv, &gerror);
-		if (cmdline_bin == nullptr)
-		{
-			std::string s = std::string("could not parse pipeline: ") + gerror->message;
-			g_clear_error(&gerror);
-			throw std::runtime_error(s);
-		}
-
-
-		// Add a ghost srcpad to the bin and connect it to the srcpad
-		// of the element called "stream"
-		{
-			stream_element = gst_bin_get_by_name(GST_BIN(cmdline_bin), "stream");
-			if (stream_element == nullptr)
-				throw std::runtime_error("no element with name \"stream\" found");
-
-			GstPad *srcpad = gst_element_get_static_pad(stream_element, "src");
-			if (srcpad == nullptr)
-				throw std::runtime_error("no \"src\" pad in element \"stream\" found\n");
-			gst_element_add_pad(GST_ELEMENT(cmdline_bin), gst_ghost_pad_new("src", srcpad));
-			gst_object_unref(GST_OBJECT(srcpad));
-
-			gst_object_unref(GST_OBJECT(stream_element));
-		}
-
-
-		// Setup the multisocketsink
-
-		m_multisocketsink = gst_element_factory_make("multisocketsink", nullptr);
-		if (m_multisocketsink == nullptr)
-			throw std::runtime_error("could not create multisocketsink");
-
-		g_object_set(
-			m_multisocketsink,
-			"unit-format", GST_FORMAT_TIME,
-			"units-max", (gint64) 7 * GST_SECOND,
-			"units-soft-max", (gint64) 3 * GST_SECOND,
-			"recover-policy", 3 /* keyframe */ ,
-			"timeout", (guint64) 10 * GST_SECOND,
-			"sync-method", 1 /* next-keyframe */ ,
-			nullptr
-		);
-
-		g_signal_connect(m_multisocketsink, "client-socket-removed", G_CALLBACK(on_client_socket_removed), this);
-
-
-		// Setup the pipeline element & its bus watch
-
-		m_pipeline = gst_pipeline_new(nullptr);
-		g_assert(m_pipeline != nullptr);
-
-		GstBus *bus = gst_pipeline_get_bus(GST_PIPELINE(m_pipeline));
-		gst_bus_add_watch(
-			bus,
-			[](GstBus *p_bus, GstMessage *p_msg, gpointer p_user_data) -> gboolean
-			{
-				http_stream_pipeline *self = reinterpret_cast < http_stream_pipeline* > (p_user_data);
-				return self->bus_watch(p_bus, p_msg);
-			},
-			gpointer(this)
-		);
-		gst_object_unref(GST_OBJECT(bus));
-
-		// Add the other elements to the pipeline (which transfers ownership
-		// over the elements to m_pipeline) and link it all together
-		gst_bin_add_many(GST_BIN(m_pipeline), cmdline_bin, m_multisocketsink, nullptr);
-		gst_element_link(cmdline_bin, m_multisocketsink);
-
-
-		// The pipeline element now contains all the others and took
-		// ownership over them, making the guard unnecessary. If something
-		// goes wrong, only the pipeline element itself has to be unref'd now.
-		elements_guard.dismiss();
-
-
-		// Try to switch the pipeline's state to READY as the last step
-		if (gst_element_set_state(m_pipeline, GST_STATE_READY) == GST_STATE_CHANGE_FAILURE)
-		{
-			gst_object_unref(GST_OBJECT(m_pipeline));
-			m_pipeline = nullptr;
-			throw std::runtime_error("failed to set pipeline state to READY");
-		}
-	}
+	mount_table *m_mount_table;
+	std::string m_config_filename;
+};
 
-	~http_stream_pipeline()
-	{
-		if (m_pipeline != nullptr)
-		{
-			gst_element_set_state(m_pipeline, GST_STATE_NULL);
-			gst_object_unref(GST_OBJECT(m_pipeline));
-		}
-	}
 
-	void play(bool const p_do_play)
-	{
-		if (gst_element_set_state(m_pipeline, p_do_play ? GST_STATE_PLAYING : GST_STATE_READY) == GST_STATE_CHANGE_FAILURE)
-			throw std::runtime_error("failed to set pipeline state");
-	}
+gboolean reload_sighandler(gpointer p_data)
+{
+	reload_context *context = reinterpret_cast < reload_context* > (p_data);
 
-	std::string const & get_content_type() const
-	{
-		return m_content_type;
-	}
+	std::cerr << "caught SIGHUP, reloading configuration\n";
 
-	void add_client(GIOStream *p_stream, GSocket *p_socket)
+	try
 	{
-		// Guard against race conditions, since the m_clients
-		// collection might be accessed in the streaming thread
-		std::lock_guard < std::mutex > lock(m_client_mutex);
-
-		m_clients[p_socket] = p_stream;
-		g_signal_emit_by_name(m_multisocketsink, "add", p_socket);
-
-		std::cerr << "Adding socket " << std::hex << guintptr(p_socket) << std::dec << "\n";
-
-		// If no clients were connected until now, start/resume the pipeline
-		if (m_clients.size() == 1)
-		{
-			std::cerr << "A client just connected, and pipeline isn't running yet - setting pipeline state to PLAYING\n";
-			play(true);
-		}
+		reload_config_file(*(context->m_mount_table), context->m_config_filename);
 	}
-
-
-private:
-	static void on_client_socket_removed(GstElement *p_element, GSocket *p_socket, gpointer p_user_data)
+	catch (std::exception const &p_exc)
 	{
-		http_stream_pipeline *self = reinterpret_cast < http_stream_pipeline* > (p_user_data);
-
-		// Guard against race conditions, since this callback
-		// is executed in the streaming thread
-		std::lock_guard < std::mutex > lock(self->m_client_mutex);
-
-		std::cerr << "Client with socket " << std::hex << guintptr(p_socket) << std::dec << " got removed\n";
-
-		// Find the socket in the clients list
-		auto iter = self->m_clients.find(p_socket);
-		if (iter == self->m_clients.end())
-		{
-			std::cerr << "Socket is not in list - ignoring\n";
-			return;
-		}
-
-		// Close the GIOStream, disconnecting the client
-		g_io_stream_close(iter->second, nullptr, nullptr);
-
-		// Remove the client from the collection
-		self->m_clients.erase(iter);
-
-		// Was this the last client? If so, halt the pipeline.
-		// Don't call play(false) here directly, since setting the
-		// state from within the streaming thread is not possible.
-		// Instead, post a message that is then handled in bus_watch().
-		if (self->m_clients.empty())
-		{
-			std::cerr << "No clients connected - setting pipeline state to READY\n";
-			gst_element_post_message(
-				p_element,
-				gst_message_new_element(GST_OBJECT(p_element), gst_structure_new_empty("StopPipeline"))
-			);
-		}
+		std::cerr << "Could not reload configuration: " << p_exc.what() << "\n";
 	}
 
-	bool bus_watch(GstBus *, GstMessage *p_message)
-	{
-		switch (GST_MESSAGE_TYPE(p_message))
-		{
-			case GST_MESSAGE_STATE_CHANGED:
-			{
-				// Only consider state change messages coming from
-				// the toplevel element.
-				if (GST_MESSAGE_SRC(p_message) != GST_OBJECT(m_pipeline))
-					break;
-
-				GstState old_gst_state, new_gst_state, pending_gst_state;
-				gst_message_parse_state_changed(p_message, &old_gst_state, &new_gst_state, &pending_gst_state);
-
-				auto get_dot_dump_name = [old_gst_state, new_gst_state, pending_gst_state]() -> std::string
-				{
-					return std::string("statechange-") +
-					       "old-" + gst_element_state_get_name(old_gst_state) + "-" +
-					       "cur-" + gst_element_state_get_name(new_gst_state) + "-" +
-					       "pending-" + gst_element_state_get_name(pending_gst_state);
-				};
-
-				std::cerr << "State change: "
-					<< " old " << gst_element_state_get_name(old_gst_state)
-					<< " new " << gst_element_state_get_name(new_gst_state)
-					<< " pending " << gst_element_state_get_name(pending_gst_state)
-					<< "\n";
-
-				// If the GST_DEBUG_DUMP_DOT_DIR environment variable
-				// is set to a valid path, this creates a .dot dump
-				// of the current pipeline structure. This is useful
-				// for debugging.
-				GST_DEBUG_BIN_TO_DOT_FILE_WITH_TS(GST_BIN(m_pipeline), GST_DEBUG_GRAPH_SHOW_ALL, get_dot_dump_name().c_str());
-
-				break;
-			}
-
-			case GST_MESSAGE_ELEMENT:
-				// This is sent by on_client_socket_removed() in case there
-				// are no more clients connected.
-				if (gst_message_has_name(p_message, "StopPipeline"))
-					play(false);
-				break;
-
-			case GST_MESSAGE_EOS:
-			{
-				// Stop and tear down pipeline when EOS is reached
-				std::cerr << "EOS received - halting pipeline\n";
-				play(false);
-
-				// Clear all sockets. This will invoke on_client_socket_removed()
-				// for each one of them, which in turn means that all of the
-				// associated GIOStreams will be closed & the m_clients collection
-				// will be emptied. This way, it is ensured that all clients are
-				// disconnected, which is the proper way to let them know that
-				// transmission is over (since the Soup encoding in use is
-				// SOUP_ENCODING_EOF).
-				g_signal_emit_by_name(m_multisocketsink, "clear");
-
-				break;
-			}
-
-			case GST_MESSAGE_INFO:
-			case GST_MESSAGE_WARNING:
-			case GST_MESSAGE_ERROR:
-			{
-				// Log the info/warning/error
-
-				GError *gerror = nullptr;
-				gchar *debug_info = nullptr;
-
-				switch (GST_MESSAGE_TYPE(p_message))
-				{
-					case GST_MESSAGE_INFO:
-						gst_message_parse_info(p_message, &gerror, &debug_info);
-						std::cerr << "INFO: ";
-						break;
-
-					case GST_MESSAGE_WARNING:
-						gst_message_parse_warning(p_message, &gerror, &debug_info);
-						std::cerr << "WARNING: ";
-						break;
-
-					case GST_MESSAGE_ERROR:
-						gst_message_parse_error(p_message, &gerror, &debug_info);
-						std::cerr << "ERROR: ";
-						break;
-
-					default:
-						g_assert_not_reached();
-				}
-
-				std::cerr << gerror->message << "; debug info: " << debug_info << "\n";
-
-				g_clear_error(&gerror);
-				g_free(debug_info);
-
-				// In case of an error, create a dot dump and stop the pipeline
-				if (GST_MESSAGE_TYPE(p_message) == GST_MESSAGE_ERROR)
-				{
-					GST_DEBUG_BIN_TO_DOT_FILE_WITH_TS(GST_BIN(m_pipeline), GST_DEBUG_GRAPH_SHOW_ALL, "error");
-
-					std::cerr << "Stopping pipeline due to error\n";
-
-					// Stop the pipeline just like how
-					// it is done with EOS messages
-					play(false);
-					g_signal_emit_by_name(m_multisocketsink, "clear");
-				}
-
-				break;
-			}
-
-			case GST_MESSAGE_REQUEST_STATE:
-			{
-				// Some element might have requested a state change.
-				// Follow this request. Since the requested change
-				// is done by a regular gst_element_set_state() call,
-				// the pipeline will eventually produce a statechange
-				// message, which is handled above. So, we do not
-				// have to handle anything about the request here
-				// further once gst_element_set_state() was called.
+	return TRUE;
+}
 
-				GstState requested_state;
-				gst_message_parse_request_state(p_message, &requested_state);
 
-				std::cerr << "State change to " << gst_element_state_get_name(requested_state) << " was requested by " << GST_MESSAGE_SRC_NAME(p_message) << "\n";
+// Makes the server accept connections on a Unix domain socket,
+// in addition to its TCP sockets
+bool listen_unix_socket(SoupServer *p_server, char const *p_path, GError **p_error)
+{
+	// A socket file left behind by a previous run would make bind() fail
+	struct stat file_stat;
+	if ((lstat(p_path, &file_stat) == 0) && S_ISSOCK(file_stat.st_mode))
+		unlink(p_path);
 
-				gst_element_set_state(GST_ELEMENT(m_pipeline), requested_state);
+	GSocket *socket = g_socket_new(G_SOCKET_FAMILY_UNIX, G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_DEFAULT, p_error);
+	if (socket == nullptr)
+		return false;
 
-				break;
-			}
+	auto socket_guard = make_scope_guard([socket]() { g_object_unref(G_OBJECT(socket)); });
 
-			case GST_MESSAGE_LATENCY:
-			{
-				std::cerr << "Redistributing latency\n";
-				gst_bin_recalculate_latency(GST_BIN(m_pipeline));
-				break;
-			}
-
-			default:
-				break;
-		}
-
-		return true;
-	}
+	GSocketAddress *address = g_unix_socket_address_new(p_path);
+	bool ok = g_socket_bind(socket, address, TRUE, p_error);
+	g_object_unref(G_OBJECT(address));
 
+	return ok && g_socket_listen(socket, p_error) && soup_server_listen_socket(p_server, socket, SoupServerListenOptions(0), p_error);
+}
 
-	typedef std::map < GSocket* , GIOStream* > clients;
 
-	GstElement *m_pipeline, *m_multisocketsink;
-	std::string m_content_type;
-	clients m_clients;
-	std::mutex m_client_mutex;
-};
+// Upper bound for the memory used by the connection limiter
+std::size_t const max_limited_addresses = 16384;
 
 
+} // unnamed namespace end
 
 
-struct request_context
-{
-	SoupClientContext *m_client;
-	http_stream_pipeline *m_pipeline;
-};
 
 
-void http_request_handler(SoupServer *, SoupMessage *p_msg, char const *, GHashTable *, SoupClientContext *p_client, gpointer p_user_data)
+int main(int argc, char *argv[])
 {
-	http_stream_pipeline *pipeline = reinterpret_cast < http_stream_pipeline* > (p_user_data);
-
-	// Set up the HTTP response headers. Use HTTP 1.0 (1.1 is not needed here).
-	// We intend to transmit an open-ended stream until we close the socket
-	// (because of an error or because EOS was reached), or the client disconnects.
-	// This means we need EOF encoding (= data ends when the socket is closed).
-	soup_message_set_http_version(p_msg, SOUP_HTTP_1_0);
-	soup_message_headers_set_encoding(p_msg->response_headers, SOUP_ENCODING_EOF);
-	soup_message_headers_set_content_type(p_msg->response_headers, pipeline->get_content_type().c_str(), nullptr);
-	soup_message_set_status(p_msg, SOUP_STATUS_OK);
-
-	// Context for the wrote-headers callback below
-	request_context *context = new request_context { p_client, pipeline };
-
-	// Once the HTTP response headers have all been written, steal the connection
-	// and add the client. The idea is that once the headers are written, GStreamer
-	// (more specifically, the multisocketsink) should take over the connection,
-	// since we won't pass any data over the libsoup message body write functions
-	// anyway. So, let's just take over the connection and hand it over to the
-	// multisocketsink. (Keep a pointer to the GIOStream around to be able to
-	// close the stream if EOS is reached or an error occurs).
-	void (*wrote_headers_cb)(GObject *, GParamSpec *, gpointer) = [](GObject *, GParamSpec *, gpointer p_user_data)
+	// Parse our own options as well as GStreamer's. The GStreamer
+	// option group also takes care of initializing GStreamer.
+	gint snapshot_ttl_ms = 1000;
+	gchar **param_declarations = nullptr;
+	gint pool_max_idle = 4;
+	gint pool_max_memory_mb = 0;
+	gchar *config_filename = nullptr;
+	gint control_port = 0;
+	gchar *adapt_parameter = nullptr;
+	gchar *adapt_ladder = nullptr;
+	gboolean ingest = FALSE;
+	gchar *relay_url = nullptr;
+	gchar *loop_path = nullptr;
+	gchar **sibling_urls = nullptr;
+	gint max_clients = 0;
+	gchar *rtp_destination = nullptr;
+	gint rtp_ttl = 1;
+	gint rtsp_port = 0;
+	gboolean webrtc = FALSE;
+	gchar *unix_socket_path = nullptr;
+	gchar *shm_socket_path = nullptr;
+	gint shm_size_mb = 64;
+	gchar *http_unix_socket_path = nullptr;
+	gint max_connections_per_ip = 0;
+	gdouble accept_rate = 0;
+	gint accept_burst = 10;
+	gchar **premium_tokens = nullptr;
+	gint start_grace_ms = 0;
+	gint stop_linger_ms = 0;
+	gint resume_window_ms = 0;
+	gchar *slate_path = nullptr;
+	gint slate_stall_ms = 3000;
+	gint trace_events = 0;
+	GOptionEntry option_entries[] =
 	{
-		request_context *context_ = reinterpret_cast < request_context* > (p_user_data);
-
-		GSocket *socket = soup_client_context_get_gsocket(context_->m_client);
-		GIOStream *stream = soup_client_context_steal_connection(context_->m_client);
-
-		context_->m_pipeline->add_client(stream, socket);
-
-		delete context_;
+		{ "snapshot-ttl", 0, 0, G_OPTION_ARG_INT, &snapshot_ttl_ms, "How long a /snapshot JPEG is cached, in milliseconds (default: 1000)", "MS" },
+		{ "param", 0, 0, G_OPTION_ARG_STRING_ARRAY, &param_declarations, "Declare an integer launch line parameter, which replaces @NAME@ in the launch line and is set with ?NAME=VALUE in the URL (can be used multiple times)", "NAME:MIN:MAX:DEFAULT" },
+		{ "pool-max-idle", 0, 0, G_OPTION_ARG_INT, &pool_max_idle, "Maximum number of idle parameterized pipeline instances to keep around (default: 4)", "N" },
+		{ "pool-max-memory", 0, 0, G_OPTION_ARG_INT, &pool_max_memory_mb, "Destroy idle parameterized pipeline instances while the process uses more than this many MiB (default: 0 = no limit)", "MIB" },
+		{ "adapt-param", 0, 0, G_OPTION_ARG_STRING, &adapt_parameter, "Move congested clients between the pipeline instances for the --adapt-ladder values of this parameter", "NAME" },
+		{ "adapt-ladder", 0, 0, G_OPTION_ARG_STRING, &adapt_ladder, "Values of the --adapt-param parameter, from the highest quality to the lowest, separated by ';'", "V1;V2;..." },
+		{ "ingest", 0, 0, G_OPTION_ARG_NONE, &ingest, "Accept a stream pushed with PUT or POST, and feed it into the appsrc called \"ingest\" in the launch line", nullptr },
+		{ "relay", 0, 0, G_OPTION_ARG_STRING, &relay_url, "Relay the MPEG-TS stream at this URL (served by another instance of this server) instead of running a launch line", "URL" },
+		{ "loop", 0, 0, G_OPTION_ARG_FILENAME, &loop_path, "Loop this pre-encoded clip in real time instead of running a launch line, without encoding anything (for load tests); CONTENT-TYPE picks the container", "PATH" },
+		{ "start-grace", 0, 0, G_OPTION_ARG_INT, &start_grace_ms, "Start the pipeline only if the first client is still connected after this many milliseconds (default: 0 = disabled)", "MS" },
+		{ "stop-linger", 0, 0, G_OPTION_ARG_INT, &stop_linger_ms, "Keep the pipeline running for this many milliseconds after the last client left (default: 0 = disabled)", "MS" },
+		{ "resume-window", 0, 0, G_OPTION_ARG_INT, &resume_window_ms, "Let clients that lost their connection resume the stream if they reconnect within this many milliseconds (default: 0 = disabled)", "MS" },
+		{ "slate", 0, 0, G_OPTION_ARG_FILENAME, &slate_path, "Loop this pre-encoded clip to the clients while the source is down; it must have the same format as the stream", "PATH" },
+		{ "slate-stall", 0, 0, G_OPTION_ARG_INT, &slate_stall_ms, "Show the --slate clip and restart the source if it delivered no data for this many milliseconds (default: 3000; 0 = only on errors)", "MS" },
+		{ "rtp", 0, 0, G_OPTION_ARG_STRING, &rtp_destination, "Also send the stream as RTP to this address (typically a multicast group); needs an MPEG-TS stream", "HOST:PORT" },
+		{ "rtp-ttl", 0, 0, G_OPTION_ARG_INT, &rtp_ttl, "TTL of the multicast RTP packets (default: 1)", "TTL" },
+		{ "rtsp-port", 0, 0, G_OPTION_ARG_INT, &rtsp_port, "Also serve the mounts over RTSP on this port (default: 0 = disabled)", "PORT" },
+		{ "webrtc", 0, 0, G_OPTION_ARG_NONE, &webrtc, "Also send the \"video\" stream to WebRTC peers, which connect to the signaling WebSocket under /webrtc; needs an H.264 elementary stream", nullptr },
+		{ "unix", 0, 0, G_OPTION_ARG_FILENAME, &unix_socket_path, "Also let local consumers read the raw stream (without HTTP) from a Unix domain socket at this path", "PATH" },
+		{ "shm", 0, 0, G_OPTION_ARG_FILENAME, &shm_socket_path, "Also let local consumers read the stream from shared memory, through a shmsink control socket at this path", "PATH" },
+		{ "shm-size", 0, 0, G_OPTION_ARG_INT, &shm_size_mb, "Size of the shared memory area, in MiB (default: 64)", "MIB" },
+		{ "http-unix-socket", 0, 0, G_OPTION_ARG_FILENAME, &http_unix_socket_path, "Also accept HTTP requests (for all mounts) on a Unix domain socket at this path", "PATH" },
+		{ "sibling", 0, 0, G_OPTION_ARG_STRING_ARRAY, &sibling_urls, "Base URL of another server with the same mounts, whose load is polled and to which new clients are redirected once --max-clients is reached (can be used multiple times)", "URL" },
+		{ "max-clients", 0, 0, G_OPTION_ARG_INT, &max_clients, "Redirect new clients to the least loaded sibling once this many clients are connected (default: 0 = never redirect)", "N" },
+		{ "max-connections-per-ip", 0, 0, G_OPTION_ARG_INT, &max_connections_per_ip, "Reject streaming requests from addresses that already have this many streaming connections open (default: 0 = no limit)", "N" },
+		{ "accept-rate", 0, 0, G_OPTION_ARG_DOUBLE, &accept_rate, "Reject streaming requests from addresses that make more than this many per second on average (default: 0 = no limit)", "RATE" },
+		{ "accept-burst", 0, 0, G_OPTION_ARG_INT, &accept_burst, "Number of requests an address may make at once before --accept-rate applies (default: 10)", "N" },
+		{ "premium-token", 0, 0, G_OPTION_ARG_STRING_ARRAY, &premium_tokens, "Serve requests with an \"Authorization: Bearer TOKEN\" header as premium clients (can be used multiple times)", "TOKEN" },
+		{ "config", 0, 0, G_OPTION_ARG_FILENAME, &config_filename, "Load additional mounts from this file; send SIGHUP to reload it", "FILE" },
+		{ "control-port", 0, 0, G_OPTION_ARG_INT, &control_port, "Serve the control API on this port on the loopback interface (default: 0 = disabled)", "PORT" },
+		{ "trace-events", 0, 0, G_OPTION_ARG_INT, &trace_events, "Record the lifecycle of connections and pipelines, keeping the last N events for GET /trace of the control API (default: 0 = disabled)", "N" },
+		{ nullptr, 0, 0, G_OPTION_ARG_NONE, nullptr, nullptr, nullptr }
 	};
-	g_signal_connect(G_OBJECT(p_msg), "wrote-headers", G_CALLBACK(wrote_headers_cb), context);
-}
-
-
-} // unnamed namespace end
-
 
+	{
+		GError *gerror = nullptr;
+		GOptionContext *option_context = g_option_context_new("PORT [CONTENT-TYPE <launch line>]");
+		g_option_context_add_main_entries(option_context, option_entries, nullptr);
+		g_option_context_add_group(option_context, gst_init_get_option_group());
 
+		bool ok = g_option_context_parse(option_context, &argc, &argv, &gerror);
+		g_option_context_free(option_context);
 
-int main(int argc, char *argv[])
-{
-	// First, let GStreamer parse & filter the arguments
-	gst_init(&argc, &argv);
+		if (!ok)
+		{
+			std::cerr << "Could not parse options: " << gerror->message << "\n";
+			g_clear_error(&gerror);
+			return -1;
+		}
+	}
 
-	// Check if there are enough arguments left
-	if (argc < 5)
+	auto option_values_guard = make_scope_guard([=]()
+	{
+		g_strfreev(param_declarations);
+		g_free(config_filename);
+		g_free(adapt_parameter);
+		g_free(adapt_ladder);
+		g_free(relay_url);
+		g_free(loop_path);
+		g_strfreev(sibling_urls);
+		g_strfreev(premium_tokens);
+		g_free(rtp_destination);
+		g_free(unix_socket_path);
+		g_free(shm_socket_path);
+		g_free(slate_path);
+		g_free(http_unix_socket_path);
+	});
+
+	// Check if there are enough arguments left. The launch line
+	// can be omitted if the mounts come from a configuration file,
+	// or if a relayed stream or a loop clip replaces it.
+	bool has_launch_line = ((relay_url != nullptr) || (loop_path != nullptr)) ? (argc == 3) : (argc >= 5);
+	if (!has_launch_line && ((argc != 2) || (config_filename == nullptr)))
 	{
-		std::cerr << "Usage: " << argv[0] << " PORT CONTENT-TYPE <launch line>\n";
+		std::cerr << "Usage: " << argv[0] << " [OPTION...] PORT [CONTENT-TYPE <launch line>]\n";
+		std::cerr << "       " << argv[0] << " [OPTION...] --relay URL PORT CONTENT-TYPE\n";
+		std::cerr << "       " << argv[0] << " [OPTION...] --loop PATH PORT CONTENT-TYPE\n";
 		std::cerr << "Example: " << argv[0] << " 8080 ( videotestsrc ! theoraenc ! oggmux name=stream )\n";
 		return -1;
 	}
@@ -490,9 +261,105 @@ int main(int argc, char *argv[])
 	// start listening, and start the mainloop
 	try
 	{
-		http_stream_pipeline pipeline(argv[2], &argv[3]);
+		// The RTSP server must outlive the mounts, which use it
+		std::unique_ptr < rtsp_server > rtsp;
+		if (rtsp_port > 0)
+		{
+			rtsp.reset(new rtsp_server(rtsp_port));
+			std::cerr << "Listening for RTSP requests on port " << rtsp_port << "\n";
+		}
 
-		soup_server_add_handler(soup_server, "/", http_request_handler, &pipeline, nullptr);
+		// The pipelines may record events until they are destroyed,
+		// so the trace has to outlive the mounts
+		std::unique_ptr < event_trace > trace;
+		if (trace_events > 0)
+			trace.reset(new event_trace(trace_events));
+
+		mount_table mounts(soup_server, GstClockTime(snapshot_ttl_ms) * GST_MSECOND);
+		mounts.set_rtsp_server(rtsp.get());
+		mounts.set_event_trace(trace.get());
+
+		std::set < std::string > premium_token_set;
+		for (gchar **token = premium_tokens; (token != nullptr) && (*token != nullptr); ++token)
+			premium_token_set.insert(*token);
+		mounts.set_premium_tokens(std::move(premium_token_set));
+
+		std::unique_ptr < connection_limiter > limiter;
+		if ((max_connections_per_ip > 0) || (accept_rate > 0))
+		{
+			limiter.reset(new connection_limiter(max_connections_per_ip, std::max(accept_rate, 0.0), std::max(accept_burst, 1), max_limited_addresses));
+			mounts.set_connection_limiter(limiter.get());
+		}
+
+		// The launch line from the command line is served under "/"
+		if (has_launch_line)
+		{
+			mount_config config;
+			config.m_content_type = argv[2];
+			if (relay_url != nullptr)
+				config.m_relay_url = relay_url;
+			else if (loop_path != nullptr)
+				config.m_loop_path = loop_path;
+			else
+				config.m_launch.assign(&argv[3], &argv[argc]);
+			for (gchar **declaration = param_declarations; (declaration != nullptr) && (*declaration != nullptr); ++declaration)
+				config.m_parameters.push_back(pipeline_pool::parse_parameter(*declaration));
+			config.m_max_idle_instances = std::max(pool_max_idle, 0);
+			config.m_max_memory = guint64(std::max(pool_max_memory_mb, 0)) * 1024 * 1024;
+			if (adapt_parameter != nullptr)
+				config.set("adapt-param", adapt_parameter);
+			if (adapt_ladder != nullptr)
+				config.set("adapt-ladder", adapt_ladder);
+			config.m_ingest = ingest;
+			config.m_webrtc = webrtc;
+			if (unix_socket_path != nullptr)
+				config.set("unix", unix_socket_path);
+			if (shm_socket_path != nullptr)
+				config.set("shm", shm_socket_path);
+			config.set("shm-size", std::to_string(shm_size_mb));
+			if (rtp_destination != nullptr)
+				config.set("rtp", rtp_destination);
+			config.set("rtp-ttl", std::to_string(rtp_ttl));
+			config.set("start-grace", std::to_string(std::max(start_grace_ms, 0)));
+			config.set("stop-linger", std::to_string(std::max(stop_linger_ms, 0)));
+			config.set("resume-window", std::to_string(std::max(resume_window_ms, 0)));
+			if (slate_path != nullptr)
+				config.set("slate", slate_path);
+			config.set("slate-stall", std::to_string(std::max(slate_stall_ms, 0)));
+
+			mounts.set_mount("", std::move(config), mount_origin::command_line);
+		}
+
+		std::string config_filename_str = (config_filename != nullptr) ? config_filename : "";
+		reload_context reload { &mounts, config_filename_str };
+		guint reload_source = 0;
+		auto reload_source_guard = make_scope_guard([&reload_source]()
+		{
+			if (reload_source != 0)
+				g_source_remove(reload_source);
+		});
+
+		if (!config_filename_str.empty())
+		{
+			// At startup, a configuration file that cannot be loaded is fatal
+			mounts.sync_config_file_mounts(load_config_file(config_filename_str));
+			reload_source = g_unix_signal_add(SIGHUP, reload_sighandler, &reload);
+		}
+
+		quality_adapter adapter(mounts);
+
+		std::vector < std::string > siblings;
+		for (gchar **url = sibling_urls; (url != nullptr) && (*url != nullptr); ++url)
+			siblings.push_back(*url);
+		sibling_balancer balancer(soup_server, mounts, siblings, std::max(max_clients, 0));
+
+		std::unique_ptr < control_server > control;
+		if (control_port > 0)
+		{
+			control.reset(new control_server(mounts, config_filename_str));
+			control->listen(control_port);
+			std::cerr << "Listening for control requests on port " << control_port << " (loopback only)\n";
+		}
 
 		GError *gerror = nullptr;
 		if (!soup_server_listen_all(soup_server, port, SoupServerListenOptions(0), &gerror))
@@ -504,6 +371,27 @@ int main(int argc, char *argv[])
 
 		std::cerr << "Listening for incoming HTTP requests on port " << port << "\n";
 
+		// Local clients can skip the TCP/IP stack
+		bool http_unix_socket_created = false;
+		auto http_unix_socket_guard = make_scope_guard([&]()
+		{
+			if (http_unix_socket_created)
+				unlink(http_unix_socket_path);
+		});
+
+		if (http_unix_socket_path != nullptr)
+		{
+			if (!listen_unix_socket(soup_server, http_unix_socket_path, &gerror))
+			{
+				std::cerr << "could not listen on Unix socket " << http_unix_socket_path << ": " << gerror->message << "\n";
+				g_clear_error(&gerror);
+				return -1;
+			}
+
+			http_unix_socket_created = true;
+			std::cerr << "Listening for incoming HTTP requests on Unix socket " << http_unix_socket_path << "\n";
+		}
+
 		g_main_loop_run(mainloop);
 	}
 	catch (std::exception const &p_exc)
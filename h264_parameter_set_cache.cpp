@@ -0,0 +1,173 @@
+#include "h264_parameter_set_cache.hpp"
+
+
+namespace
+{
+
+
+guint8 const nal_type_slice = 1;
+guint8 const nal_type_idr_slice = 5;
+guint8 const nal_type_sps = 7;
+guint8 const nal_type_pps = 8;
+
+guint8 const start_code[] = { 0x00, 0x00, 0x00, 0x01 };
+
+
+// Returns the offset right after the next 00 00 01 start code
+// (the four byte variant ends in one of these too), or p_size
+gsize find_nal_start(guint8 const *p_data, gsize const p_size, gsize const p_offset)
+{
+	for (gsize i = p_offset; (i + 3) <= p_size; ++i)
+	{
+		if ((p_data[i] == 0x00) && (p_data[i + 1] == 0x00) && (p_data[i + 2] == 0x01))
+			return i + 3;
+	}
+
+	return p_size;
+}
+
+
+} // unnamed namespace end
+
+
+
+
+h264_parameter_set_cache::h264_parameter_set_cache()
+	: m_byte_stream(false)
+{
+}
+
+
+std::shared_ptr < h264_parameter_set_cache > h264_parameter_set_cache::attach(GstPad *p_pad)
+{
+	std::shared_ptr < h264_parameter_set_cache > cache(new h264_parameter_set_cache());
+
+	gst_pad_add_probe(
+		p_pad,
+		GstPadProbeType(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM),
+		probe,
+		new std::shared_ptr < h264_parameter_set_cache > (cache),
+		[](gpointer p_data) { delete reinterpret_cast < std::shared_ptr < h264_parameter_set_cache > * > (p_data); }
+	);
+
+	return cache;
+}
+
+
+GstSample* h264_parameter_set_cache::create_sample(GstSample *p_keyframe_sample) const
+{
+	GstBuffer *keyframe = gst_sample_get_buffer(p_keyframe_sample);
+	if ((keyframe == nullptr) || !m_byte_stream)
+		return nullptr;
+
+	GstBuffer *buffer;
+
+	{
+		std::lock_guard < std::mutex > lock(m_mutex);
+
+		if (m_sps.empty() || m_pps.empty())
+			return nullptr;
+
+		buffer = gst_buffer_new_allocate(nullptr, m_sps.size() + m_pps.size(), nullptr);
+		gst_buffer_fill(buffer, 0, m_sps.data(), m_sps.size());
+		gst_buffer_fill(buffer, m_sps.size(), m_pps.data(), m_pps.size());
+	}
+
+	GST_BUFFER_PTS(buffer) = GST_BUFFER_PTS(keyframe);
+	GST_BUFFER_DTS(buffer) = GST_BUFFER_DTS(keyframe);
+	GST_BUFFER_FLAG_SET(buffer, GST_BUFFER_FLAG_HEADER);
+
+	GstSample *sample = gst_sample_new(buffer, gst_sample_get_caps(p_keyframe_sample), gst_sample_get_segment(p_keyframe_sample), nullptr);
+	gst_buffer_unref(buffer);
+
+	return sample;
+}
+
+
+GstPadProbeReturn h264_parameter_set_cache::probe(GstPad *, GstPadProbeInfo *p_info, gpointer p_user_data)
+{
+	h264_parameter_set_cache &self = **reinterpret_cast < std::shared_ptr < h264_parameter_set_cache > * > (p_user_data);
+
+	if (GST_PAD_PROBE_INFO_TYPE(p_info) & GST_PAD_PROBE_TYPE_BUFFER)
+	{
+		if (self.m_byte_stream)
+			self.parse_buffer(GST_PAD_PROBE_INFO_BUFFER(p_info));
+	}
+	else if (GST_PAD_PROBE_INFO_TYPE(p_info) & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+	{
+		if (self.m_byte_stream)
+		{
+			GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST(p_info);
+			for (guint i = 0; i < gst_buffer_list_length(list); ++i)
+				self.parse_buffer(gst_buffer_list_get(list, i));
+		}
+	}
+	else
+	{
+		GstEvent *event = GST_PAD_PROBE_INFO_EVENT(p_info);
+		if (GST_EVENT_TYPE(event) != GST_EVENT_CAPS)
+			return GST_PAD_PROBE_OK;
+
+		GstCaps *caps = nullptr;
+		gst_event_parse_caps(event, &caps);
+
+		// Without a stream-format, h264parse assumes byte-stream as well
+		bool byte_stream = false;
+		if (gst_caps_get_size(caps) > 0)
+		{
+			GstStructure const *structure = gst_caps_get_structure(caps, 0);
+			char const *stream_format = gst_structure_get_string(structure, "stream-format");
+			byte_stream = gst_structure_has_name(structure, "video/x-h264") && ((stream_format == nullptr) || (g_strcmp0(stream_format, "byte-stream") == 0));
+		}
+
+		self.m_byte_stream = byte_stream;
+	}
+
+	return GST_PAD_PROBE_OK;
+}
+
+
+void h264_parameter_set_cache::parse_buffer(GstBuffer *p_buffer)
+{
+	if (GST_BUFFER_FLAG_IS_SET(p_buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+		return;
+
+	GstMapInfo map_info;
+	if (!gst_buffer_map(p_buffer, &map_info, GST_MAP_READ))
+		return;
+
+	guint8 const *data = map_info.data;
+	gsize size = map_info.size;
+
+	gsize nal_start = find_nal_start(data, size, 0);
+	while (nal_start < size)
+	{
+		gsize next_nal_start = find_nal_start(data, size, nal_start);
+
+		// Zero bytes in front of the next start code are not part
+		// of the NAL unit; the SPS and PPS never end in one
+		gsize nal_end = (next_nal_start < size) ? (next_nal_start - 3) : size;
+		while ((nal_end > nal_start) && (data[nal_end - 1] == 0x00))
+			--nal_end;
+
+		if (nal_end > nal_start)
+		{
+			guint8 nal_type = data[nal_start] & 0x1F;
+			if ((nal_type == nal_type_slice) || (nal_type == nal_type_idr_slice))
+				break;
+
+			if ((nal_type == nal_type_sps) || (nal_type == nal_type_pps))
+			{
+				std::lock_guard < std::mutex > lock(m_mutex);
+
+				std::vector < guint8 > &parameter_set = (nal_type == nal_type_sps) ? m_sps : m_pps;
+				parameter_set.assign(start_code, start_code + sizeof(start_code));
+				parameter_set.insert(parameter_set.end(), data + nal_start, data + nal_end);
+			}
+		}
+
+		nal_start = next_nal_start;
+	}
+
+	gst_buffer_unmap(p_buffer, &map_info);
+}
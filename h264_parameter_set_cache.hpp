@@ -0,0 +1,54 @@
+#ifndef GST_SOUP_SERVER_EXAMPLE_H264_PARAMETER_SET_CACHE_HPP
+#define GST_SOUP_SERVER_EXAMPLE_H264_PARAMETER_SET_CACHE_HPP
+
+#include <gst/gst.h>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <vector>
+
+
+// Keeps the most recent SPS and PPS of an H.264 byte-stream, so that
+// consumers which join the stream later (the RTSP and WebRTC outputs) can
+// send them ahead of their first keyframe. Many encoders only emit them
+// at the start of the stream, and h264parse cannot repeat them in front
+// of keyframes (config-interval=-1) without having seen them once.
+// Streams in the avc format carry them in the caps (codec_data) already,
+// so the cache does nothing for these.
+//
+// Only keyframes are parsed, and only up to their first slice, since the
+// parameter sets come in front of it. Only the latest SPS and PPS are
+// kept, which is enough for encoders that use one of each.
+class h264_parameter_set_cache
+{
+public:
+	// Creates a cache that parses everything that passes the pad
+	// from then on. The pad's probe shares the cache.
+	static std::shared_ptr < h264_parameter_set_cache > attach(GstPad *p_pad);
+
+	// Returns a new sample that holds the parameter sets, with the caps,
+	// segment, and timestamps of the given keyframe sample. Returns null
+	// if no parameter sets were seen (yet). Can be called from any thread.
+	GstSample* create_sample(GstSample *p_keyframe_sample) const;
+
+
+private:
+	h264_parameter_set_cache();
+
+	h264_parameter_set_cache(h264_parameter_set_cache const &) = delete;
+	h264_parameter_set_cache& operator = (h264_parameter_set_cache const &) = delete;
+
+	static GstPadProbeReturn probe(GstPad *, GstPadProbeInfo *p_info, gpointer p_user_data);
+	void parse_buffer(GstBuffer *p_buffer);
+
+
+	// Set from the caps
+	std::atomic < bool > m_byte_stream;
+
+	mutable std::mutex m_mutex;
+	// The NAL units, with four byte start codes
+	std::vector < guint8 > m_sps, m_pps;
+};
+
+
+#endif
@@ -0,0 +1,2813 @@
+#include <iostream>
+#include <stdexcept>
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include <gst/app/gstappsrc.h>
+#include "http_stream_pipeline.hpp"
+#include "ts_header_cache.hpp"
+#include "scope_guard.hpp"
+
+
+namespace
+{
+
+
+// Container formats that can be produced in elementary stream mode.
+// The name doubles as the URL suffix that selects the format.
+struct container_format
+{
+	char const *m_name;
+	char const *m_content_type;
+	char const *m_muxer;
+	char const *m_video_pad_template;
+	char const *m_audio_pad_template;
+	// Only set for formats without muxer
+	char const *m_required_caps;
+};
+
+container_format const container_formats[] =
+{
+	{ "ts",   "video/mp2t",       "mpegtsmux",                                     "sink_%d",  "sink_%d",  nullptr },
+	{ "mkv",  "video/x-matroska", "matroskamux streamable=true",                   "video_%u", "audio_%u", nullptr },
+	{ "webm", "video/webm",       "webmmux streamable=true",                       "video_%u", "audio_%u", nullptr },
+	{ "mp4",  "video/mp4",        "mp4mux streamable=true fragment-duration=1000", "video_%u", "audio_%u", nullptr }
+};
+
+// Formats for the audio-only outputs, in order of preference. The
+// formats without muxer pass on the encoded audio as-is, which only
+// works with self-delimiting formats like ADTS AAC and MP3. These are
+// the most lightweight ones, so they are preferred if the audio fits.
+container_format const audio_formats[] =
+{
+	{ "aac", "audio/aac",        nullptr,                       nullptr, nullptr,    "audio/mpeg, mpegversion=(int){ 2, 4 }, stream-format=(string)adts" },
+	{ "mp3", "audio/mpeg",       nullptr,                       nullptr, nullptr,    "audio/mpeg, mpegversion=(int)1, layer=(int)3" },
+	{ "ogg", "audio/ogg",        "oggmux",                      nullptr, "audio_%u", nullptr },
+	{ "mka", "audio/x-matroska", "matroskamux streamable=true", nullptr, "audio_%u", nullptr },
+	{ "ts",  "video/mp2t",       "mpegtsmux",                   nullptr, "sink_%d",  nullptr }
+};
+
+// Matroska can hold pretty much any audio format
+char const *fallback_audio_format = "mka";
+
+// Prefix of the names of the audio-only outputs
+std::string const audio_output_prefix = "audio.";
+
+// Prefix of the names of additional muxed outputs
+// (like "stream_hd" and "stream_sd") besides "stream"
+std::string const extra_stream_prefix = "stream_";
+
+bool is_muxed_output_name(std::string const &p_name)
+{
+	return (p_name == "stream") || g_str_has_prefix(p_name.c_str(), extra_stream_prefix.c_str());
+}
+
+
+template < std::size_t N >
+container_format const * find_container_format(container_format const (&p_formats)[N], std::string const &p_name)
+{
+	for (container_format const &format : p_formats)
+	{
+		if (p_name == format.m_name)
+			return &format;
+	}
+
+	return nullptr;
+}
+
+
+template < std::size_t N >
+container_format const * find_container_format_by_content_type(container_format const (&p_formats)[N], std::string const &p_content_type)
+{
+	for (container_format const &format : p_formats)
+	{
+		if (g_ascii_strcasecmp(p_content_type.c_str(), format.m_content_type) == 0)
+			return &format;
+		// Both MPEG-TS content types map to the "ts" format
+		if (is_ts_content_type(p_content_type) && is_ts_content_type(format.m_content_type))
+			return &format;
+	}
+
+	return nullptr;
+}
+
+
+container_format const * find_output_format(std::string const &p_output)
+{
+	if (g_str_has_prefix(p_output.c_str(), audio_output_prefix.c_str()))
+		return find_container_format(audio_formats, p_output.substr(audio_output_prefix.size()));
+	else
+		return find_container_format(container_formats, p_output);
+}
+
+
+std::string strip(std::string const &p_str)
+{
+	std::string::size_type begin = p_str.find_first_not_of(" \t");
+	if (begin == std::string::npos)
+		return "";
+	std::string::size_type end = p_str.find_last_not_of(" \t");
+	return p_str.substr(begin, end - begin + 1);
+}
+
+
+// Parses an Accept header value into its media types,
+// ordered by their quality values (highest first)
+std::vector < std::string > parse_accept_header(std::string const &p_accept_header)
+{
+	std::vector < std::pair < double, std::string > > media_ranges;
+
+	std::string::size_type pos = 0;
+	while (pos <= p_accept_header.size())
+	{
+		std::string::size_type end = p_accept_header.find(',', pos);
+		if (end == std::string::npos)
+			end = p_accept_header.size();
+
+		std::string media_range = p_accept_header.substr(pos, end - pos);
+		pos = end + 1;
+
+		double quality = 1.0;
+		std::string::size_type params_pos = media_range.find(';');
+		if (params_pos != std::string::npos)
+		{
+			std::string::size_type q_pos = media_range.find("q=", params_pos);
+			if (q_pos != std::string::npos)
+				quality = g_ascii_strtod(media_range.c_str() + q_pos + 2, nullptr);
+			media_range.erase(params_pos);
+		}
+
+		media_range = strip(media_range);
+		if (!media_range.empty() && (quality > 0.0))
+			media_ranges.emplace_back(quality, media_range);
+	}
+
+	std::stable_sort(
+		media_ranges.begin(), media_ranges.end(),
+		[](std::pair < double, std::string > const &p_first, std::pair < double, std::string > const &p_second)
+		{
+			return p_first.first > p_second.first;
+		}
+	);
+
+	std::vector < std::string > media_types;
+	for (auto const &media_range : media_ranges)
+		media_types.push_back(media_range.second);
+
+	return media_types;
+}
+
+
+// Picks the first of the formats that is listed in an Accept header.
+// Returns p_default if a wildcard is found before that, and null if
+// none of the listed types is available.
+template < std::size_t N >
+container_format const * find_container_format_by_accept_header(container_format const (&p_formats)[N], std::vector < std::string > const &p_media_types, char const *p_media_type_wildcard, container_format const *p_default)
+{
+	for (std::string const &media_type : p_media_types)
+	{
+		if ((media_type == "*/*") || (media_type == p_media_type_wildcard))
+			return p_default;
+
+		container_format const *format = find_container_format_by_content_type(p_formats, media_type);
+		if (format != nullptr)
+			return format;
+	}
+
+	return nullptr;
+}
+
+
+// Delay before a failed or ended source is restarted
+// (see http_stream_pipeline::set_restart_source())
+guint const source_restart_delay_ms = 1000;
+
+
+// GstSyncMethod is not part of the public API of the multisocketsink
+// plugin, so its values for "latest-keyframe" and "burst-keyframe" are
+// replicated here
+gint const sync_method_latest_keyframe = 2;
+gint const sync_method_burst_keyframe = 4;
+
+
+// Gives each pipeline its own row on the pipelines track of the event trace
+std::atomic < gint64 > next_trace_id(1);
+
+
+// If no keyframe shows up in a pre-rolling new source within this
+// time, the switch is cancelled and the current source stays.
+guint const source_switch_timeout_ms = 10000;
+
+// How often a running pipeline checks whether its source stalled
+// (see http_stream_pipeline::set_slate())
+guint const stall_check_interval_ms = 250;
+
+
+// Data that made it into the switched source's bins after the switch
+// (this can happen with the very last buffers) is dropped, so that the
+// source does not run into not-linked errors while it is being removed.
+char const *retired_source_key = "http-stream-pipeline-retired-source";
+
+
+GstPadProbeReturn drop_probe(GstPad *, GstPadProbeInfo *, gpointer)
+{
+	return GST_PAD_PROBE_DROP;
+}
+
+
+// Computes the running time of the start (or end) of a buffer, based
+// on the segment of the pad. Returns GST_CLOCK_TIME_NONE if this is not
+// possible (for example, because the segment is not in TIME format).
+GstClockTime get_buffer_running_time(GstPad *p_pad, GstBuffer *p_buffer, bool const p_end)
+{
+	GstClockTime timestamp = GST_BUFFER_PTS_IS_VALID(p_buffer) ? GST_BUFFER_PTS(p_buffer) : GST_BUFFER_DTS(p_buffer);
+	if (!GST_CLOCK_TIME_IS_VALID(timestamp))
+		return GST_CLOCK_TIME_NONE;
+
+	if (p_end && GST_BUFFER_DURATION_IS_VALID(p_buffer))
+		timestamp += GST_BUFFER_DURATION(p_buffer);
+
+	GstEvent *segment_event = gst_pad_get_sticky_event(p_pad, GST_EVENT_SEGMENT, 0);
+	if (segment_event == nullptr)
+		return GST_CLOCK_TIME_NONE;
+
+	GstSegment const *segment;
+	gst_event_parse_segment(segment_event, &segment);
+
+	GstClockTime running_time = GST_CLOCK_TIME_NONE;
+	if (segment->format == GST_FORMAT_TIME)
+		running_time = gst_segment_to_running_time(segment, GST_FORMAT_TIME, timestamp);
+
+	gst_event_unref(segment_event);
+
+	return running_time;
+}
+
+
+bool is_inside_retired_source(GstObject *p_object)
+{
+	for (GstObject *object = GST_OBJECT(gst_object_ref(p_object)); object != nullptr; )
+	{
+		bool retired = (g_object_get_data(G_OBJECT(object), retired_source_key) != nullptr);
+		GstObject *parent = gst_object_get_parent(object);
+		gst_object_unref(object);
+
+		if (retired)
+		{
+			if (parent != nullptr)
+				gst_object_unref(parent);
+			return true;
+		}
+
+		object = parent;
+	}
+
+	return false;
+}
+
+
+// Drops buffers until the first keyframe. Branches that are attached
+// to a running pipeline would otherwise start muxing with delta units
+// that cannot be decoded without their keyframe.
+GstPadProbeReturn wait_for_keyframe_probe(GstPad *, GstPadProbeInfo *p_info, gpointer)
+{
+	GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(p_info);
+
+	if (GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+		return GST_PAD_PROBE_DROP;
+
+	// Found the keyframe - pass it on and remove the probe
+	return GST_PAD_PROBE_REMOVE;
+}
+
+
+// Prefix of the names of the WebSocket variants of the outputs
+std::string const websocket_output_prefix = "ws:";
+
+// Suffix of the names of the premium variants of the outputs
+std::string const premium_output_suffix = "@premium";
+
+// GST_CLIENT_STATUS_SLOW; the GstClientStatus enum
+// is not part of the public GStreamer headers
+gint const client_status_slow = 3;
+
+
+// Returns a buffer that contains the given buffer as one unmasked binary
+// WebSocket message (RFC 6455). The payload memory is shared, not copied.
+// The metadata (timestamps, flags) is taken over, so the sinks can still
+// tell where keyframes are.
+GstBuffer* frame_websocket_message(GstBuffer *p_buffer)
+{
+	gsize payload_size = gst_buffer_get_size(p_buffer);
+
+	guint8 header[10];
+	gsize header_size;
+	header[0] = 0x82; // FIN, binary frame
+	if (payload_size < 126)
+	{
+		header[1] = guint8(payload_size);
+		header_size = 2;
+	}
+	else if (payload_size <= 0xFFFF)
+	{
+		header[1] = 126;
+		header[2] = guint8(payload_size >> 8);
+		header[3] = guint8(payload_size);
+		header_size = 4;
+	}
+	else
+	{
+		header[1] = 127;
+		for (int i = 0; i < 8; ++i)
+			header[2 + i] = guint8(guint64(payload_size) >> (56 - i * 8));
+		header_size = 10;
+	}
+
+	GstBuffer *framed = gst_buffer_new_allocate(nullptr, header_size, nullptr);
+	gst_buffer_fill(framed, 0, header, header_size);
+	gst_buffer_copy_into(framed, p_buffer, GstBufferCopyFlags(GST_BUFFER_COPY_METADATA | GST_BUFFER_COPY_MEMORY), 0, gsize(-1));
+
+	return framed;
+}
+
+
+// Frames everything that goes into the multisocketsink of a WebSocket
+// output, including the stream headers in the caps, which the sink
+// sends to each new client before anything else. This happens once per
+// buffer, no matter how many clients there are. Each buffer becomes one
+// message, so a fragment that the muxer pushes in several buffers is
+// sent in several messages (see the README).
+GstPadProbeReturn websocket_framing_probe(GstPad *, GstPadProbeInfo *p_info, gpointer)
+{
+	if (GST_PAD_PROBE_INFO_TYPE(p_info) & GST_PAD_PROBE_TYPE_BUFFER)
+	{
+		GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(p_info);
+		GST_PAD_PROBE_INFO_DATA(p_info) = frame_websocket_message(buffer);
+		gst_buffer_unref(buffer);
+	}
+	else if (GST_PAD_PROBE_INFO_TYPE(p_info) & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+	{
+		GstBufferList *list = gst_buffer_list_make_writable(GST_PAD_PROBE_INFO_BUFFER_LIST(p_info));
+		for (guint i = 0; i < gst_buffer_list_length(list); ++i)
+		{
+			GstBuffer *framed = frame_websocket_message(gst_buffer_list_get(list, i));
+			gst_buffer_list_remove(list, i, 1);
+			gst_buffer_list_insert(list, i, framed);
+		}
+		GST_PAD_PROBE_INFO_DATA(p_info) = list;
+	}
+	else
+	{
+		GstEvent *event = GST_PAD_PROBE_INFO_EVENT(p_info);
+		if (GST_EVENT_TYPE(event) != GST_EVENT_CAPS)
+			return GST_PAD_PROBE_OK;
+
+		GstCaps *caps = nullptr;
+		gst_event_parse_caps(event, &caps);
+
+		GValue const *streamheader = gst_structure_get_value(gst_caps_get_structure(caps, 0), "streamheader");
+		if ((streamheader == nullptr) || !GST_VALUE_HOLDS_ARRAY(streamheader))
+			return GST_PAD_PROBE_OK;
+
+		GValue framed_streamheader = G_VALUE_INIT;
+		g_value_init(&framed_streamheader, GST_TYPE_ARRAY);
+		for (guint i = 0; i < gst_value_array_get_size(streamheader); ++i)
+		{
+			GValue const *header_value = gst_value_array_get_value(streamheader, i);
+			if (!GST_VALUE_HOLDS_BUFFER(header_value))
+				continue;
+
+			GValue framed_header_value = G_VALUE_INIT;
+			g_value_init(&framed_header_value, GST_TYPE_BUFFER);
+			g_value_take_boxed(&framed_header_value, frame_websocket_message(gst_value_get_buffer(header_value)));
+			gst_value_array_append_and_take_value(&framed_streamheader, &framed_header_value);
+		}
+
+		GstCaps *framed_caps = gst_caps_copy(caps);
+		gst_structure_take_value(gst_caps_get_structure(framed_caps, 0), "streamheader", &framed_streamheader);
+
+		GST_PAD_PROBE_INFO_DATA(p_info) = gst_event_new_caps(framed_caps);
+		gst_caps_unref(framed_caps);
+		gst_event_unref(event);
+	}
+
+	return GST_PAD_PROBE_OK;
+}
+
+
+// State shared by the appsrcs of a clip bin (for the slate and for loop
+// sources). The clip is looped with timestamps that start at the running
+// time the bin was started at, so that it continues the stream (and
+// identity's clock sync paces it). If the pipeline is restarted, it has
+// a new base time; the feeds then start over.
+struct clip_feed
+{
+	std::shared_ptr < slate_clip const > m_clip;
+	std::mutex m_mutex;
+	GstClockTime m_base_time, m_start;
+	unsigned int m_generation;
+};
+
+struct clip_stream_feed
+{
+	std::shared_ptr < clip_feed > m_feed;
+	slate_clip::stream const *m_stream;
+	unsigned int m_generation;
+	std::size_t m_position;
+	guint64 m_num_loops;
+};
+
+
+void clip_need_data(GstAppSrc *p_appsrc, guint, gpointer p_user_data)
+{
+	clip_stream_feed *stream_feed = reinterpret_cast < clip_stream_feed* > (p_user_data);
+	clip_feed &feed = *(stream_feed->m_feed);
+
+	GstClockTime start;
+	{
+		std::lock_guard < std::mutex > lock(feed.m_mutex);
+
+		GstClockTime base_time = gst_element_get_base_time(GST_ELEMENT(p_appsrc));
+		if (base_time != feed.m_base_time)
+		{
+			feed.m_base_time = base_time;
+			feed.m_start = 0;
+			++feed.m_generation;
+
+			GstClock *clock = gst_element_get_clock(GST_ELEMENT(p_appsrc));
+			if (clock != nullptr)
+			{
+				GstClockTime now = gst_clock_get_time(clock);
+				if (now > base_time)
+					feed.m_start = now - base_time;
+				gst_object_unref(GST_OBJECT(clock));
+			}
+		}
+
+		if (stream_feed->m_generation != feed.m_generation)
+		{
+			stream_feed->m_generation = feed.m_generation;
+			stream_feed->m_position = 0;
+			stream_feed->m_num_loops = 0;
+		}
+
+		start = feed.m_start;
+	}
+
+	std::vector < GstBuffer* > const &buffers = stream_feed->m_stream->m_buffers;
+	if (stream_feed->m_position == buffers.size())
+	{
+		stream_feed->m_position = 0;
+		++(stream_feed->m_num_loops);
+	}
+
+	// The copy shares the clip's memory; only the metadata is copied
+	GstBuffer *buffer = gst_buffer_copy(buffers[stream_feed->m_position++]);
+	GstClockTime shift = start + stream_feed->m_num_loops * feed.m_clip->get_duration();
+	if (GST_BUFFER_PTS_IS_VALID(buffer))
+		GST_BUFFER_PTS(buffer) += shift;
+	if (GST_BUFFER_DTS_IS_VALID(buffer))
+		GST_BUFFER_DTS(buffer) += shift;
+
+	gst_app_src_push_buffer(p_appsrc, buffer);
+}
+
+
+} // unnamed namespace end
+
+
+
+
+http_stream_pipeline::output_branch::output_branch(http_stream_pipeline *p_pipeline, std::string p_name)
+	: m_pipeline(p_pipeline)
+	, m_name(std::move(p_name))
+	, m_bin(nullptr)
+	, m_multisocketsink(nullptr)
+	, m_num_first_byte_pending(0)
+{
+}
+
+http_stream_pipeline::output_branch::~output_branch()
+{
+	for (GstPad *tee_pad : m_tee_pads)
+		gst_object_unref(GST_OBJECT(tee_pad));
+}
+
+
+
+
+char const * get_priority_class_name(priority_class const p_class)
+{
+	switch (p_class)
+	{
+		case priority_class::standard: return "standard";
+		case priority_class::premium: return "premium";
+		default: return "<unknown>";
+	}
+}
+
+
+bool is_ts_content_type(std::string const &p_content_type)
+{
+	return (g_ascii_strcasecmp(p_content_type.c_str(), "video/mp2t") == 0) || (g_ascii_strcasecmp(p_content_type.c_str(), "video/mpegts") == 0);
+}
+
+
+
+
+sink_settings::sink_settings()
+	: m_units_max_ms(7000)
+	, m_units_soft_max_ms(3000)
+	, m_timeout_ms(10000)
+	, m_recover_policy("keyframe")
+	, m_sync_method("next-keyframe")
+{
+}
+
+void sink_settings::set(std::string const &p_name, std::string const &p_value)
+{
+	if ((p_name == "recover-policy") || (p_name == "sync-method"))
+	{
+		// Check the nick against the enum type of the property
+		GstElement *multisocketsink = gst_element_factory_make("multisocketsink", nullptr);
+		if (multisocketsink == nullptr)
+			throw std::runtime_error("could not create multisocketsink");
+		auto multisocketsink_guard = make_scope_guard([multisocketsink]() { gst_object_unref(GST_OBJECT(multisocketsink)); });
+
+		GParamSpec *pspec = g_object_class_find_property(G_OBJECT_GET_CLASS(multisocketsink), p_name.c_str());
+		if ((pspec == nullptr) || !G_IS_PARAM_SPEC_ENUM(pspec) || (g_enum_get_value_by_nick(G_PARAM_SPEC_ENUM(pspec)->enum_class, p_value.c_str()) == nullptr))
+			throw std::runtime_error("invalid " + p_name + " \"" + p_value + "\"");
+
+		((p_name == "recover-policy") ? m_recover_policy : m_sync_method) = p_value;
+		return;
+	}
+
+	if ((p_name != "units-max") && (p_name != "units-soft-max") && (p_name != "timeout"))
+		throw std::runtime_error("unknown sink setting \"" + p_name + "\"");
+
+	char *end = nullptr;
+	gint64 value = g_ascii_strtoll(p_value.c_str(), &end, 10);
+	if (p_value.empty() || (*end != '\0') || (value < 0))
+		throw std::runtime_error("invalid " + p_name + " \"" + p_value + "\"");
+
+	if (p_name == "units-max")
+		m_units_max_ms = value;
+	else if (p_name == "units-soft-max")
+		m_units_soft_max_ms = value;
+	else
+		m_timeout_ms = guint64(value);
+}
+
+void sink_settings::apply(GstElement *p_multisocketsink) const
+{
+	g_object_set(
+		p_multisocketsink,
+		"unit-format", GST_FORMAT_TIME,
+		"units-max", gint64(m_units_max_ms * GST_MSECOND),
+		"units-soft-max", gint64(m_units_soft_max_ms * GST_MSECOND),
+		"timeout", guint64(m_timeout_ms * GST_MSECOND),
+		nullptr
+	);
+
+	gst_util_set_object_arg(G_OBJECT(p_multisocketsink), "recover-policy", m_recover_policy.c_str());
+	gst_util_set_object_arg(G_OBJECT(p_multisocketsink), "sync-method", m_sync_method.c_str());
+}
+
+bool sink_settings::operator == (sink_settings const &p_other) const
+{
+	return (m_units_max_ms == p_other.m_units_max_ms)
+	    && (m_units_soft_max_ms == p_other.m_units_soft_max_ms)
+	    && (m_timeout_ms == p_other.m_timeout_ms)
+	    && (m_recover_policy == p_other.m_recover_policy)
+	    && (m_sync_method == p_other.m_sync_method);
+}
+
+
+
+
+http_stream_pipeline::http_stream_pipeline(std::string p_content_type, char **pipeline_cmdline_argv, sink_settings p_sink_settings)
+	: http_stream_pipeline(std::move(p_content_type), pipeline_cmdline_argv, nullptr, std::move(p_sink_settings))
+{
+}
+
+http_stream_pipeline::http_stream_pipeline(std::string p_content_type, std::shared_ptr < slate_clip const > p_loop_clip, sink_settings p_sink_settings)
+	: http_stream_pipeline(std::move(p_content_type), nullptr, std::move(p_loop_clip), std::move(p_sink_settings))
+{
+}
+
+http_stream_pipeline::http_stream_pipeline(std::string p_content_type, char **p_argv, std::shared_ptr < slate_clip const > p_loop_clip, sink_settings p_sink_settings)
+	: m_pipeline(nullptr)
+	, m_bus_watch_id(0)
+	, m_source_bin(nullptr)
+	, m_stream_pad(nullptr)
+	, m_content_type(std::move(p_content_type))
+	, m_muxed(false)
+	, m_sink_settings(std::move(p_sink_settings))
+	, m_num_clients(0)
+	, m_num_holds(0)
+	, m_resume_window_ms(0)
+	, m_event_trace(nullptr)
+	, m_trace_id(next_trace_id.fetch_add(1))
+	, m_last_running_time_end(GST_CLOCK_TIME_NONE)
+	, m_num_source_switches(0)
+	, m_last_switch_latency(-1)
+	, m_restart_source(false)
+	, m_restart_source_timeout(0)
+	, m_num_source_restarts(0)
+	, m_stall_timeout_ms(0)
+	, m_stall_check_source(0)
+	, m_last_buffer_time(0)
+	, m_slate_active(false)
+	, m_num_slate_activations(0)
+	, m_start_grace_ms(0)
+	, m_stop_linger_ms(0)
+	, m_start_grace_source(0)
+	, m_stop_linger_source(0)
+	, m_running(false)
+	, m_num_starts(0)
+	, m_num_avoided_starts(0)
+{
+	for (std::atomic < guint64 > &num_evictions : m_num_evictions)
+		num_evictions = 0;
+
+	GstElement *cmdline_bin = nullptr, *multisocketsink = nullptr;
+
+	// Scope guard to ensure elements are unref'd in case of an exception/error
+	auto elements_guard = make_scope_guard([&cmdline_bin, &multisocketsink, this]()
+	{
+		// Using a vector here instead of an initializer list as a workaround
+		// for a C++11 bug that was corrected in C++14. The bug was reported
+		// as DR 1288 (https://gcc.gnu.org/bugzilla/show_bug.cgi?id=50025).
+		std::vector < GstElement ** > elements = { &cmdline_bin, &multisocketsink, &m_pipeline };
+		for (auto &tee : m_tees)
+			elements.push_back(&(tee.second));
+
+		// Unref all elements and make sure their pointers are set to null
+		for (GstElement** elem : elements)
+		{
+			if (*elem != nullptr)
+			{
+				gst_object_unref(GST_OBJECT(*elem));
+				*elem = nullptr;
+			}
+		}
+
+		m_tees.clear();
+	});
+
+
+	// Parse the command line, and create one tee per output. If there
+	// is an element called "stream" (or "stream_<NAME>"), we are in muxed
+	// mode. Otherwise, the bin outputs elementary streams. A loop clip is
+	// always muxed.
+	{
+		std::vector < std::string > output_names;
+		if (p_loop_clip)
+		{
+			output_names.push_back("stream");
+			cmdline_bin = create_clip_bin(p_loop_clip, output_names);
+		}
+		else
+			cmdline_bin = create_source_bin(p_argv, output_names);
+
+		m_muxed = is_muxed_output_name(output_names[0]);
+		m_primary_output = output_names[0];
+
+		for (std::string const &name : output_names)
+		{
+			GstElement *tee = gst_element_factory_make("tee", nullptr);
+			if (tee == nullptr)
+				throw std::runtime_error("could not create tee");
+
+			// Without this, the tee would stop the entire pipeline
+			// during the short moments when it has no branches
+			g_object_set(G_OBJECT(tee), "allow-not-linked", TRUE, nullptr);
+
+			m_tees[name] = tee;
+		}
+
+		// Snapshots are made from the primary muxed stream or the video
+		// stream. The tee's sinkpad is used, since it stays the same even
+		// if the source is switched.
+		auto snapshot_tee_iter = m_tees.find(m_muxed ? m_primary_output : "video");
+		if (snapshot_tee_iter != m_tees.end())
+		{
+			m_stream_pad = gst_element_get_static_pad(snapshot_tee_iter->second, "sink");
+			gst_object_unref(GST_OBJECT(m_stream_pad));
+		}
+
+		if (!m_muxed)
+		{
+			// The content type given on the command line
+			// picks the default container, if it is one
+			// of the supported ones
+			container_format const *default_format = find_container_format_by_content_type(container_formats, m_content_type);
+			m_default_container = (default_format != nullptr) ? default_format->m_name : container_formats[0].m_name;
+		}
+	}
+
+
+	// In muxed mode, the primary output is set up right away and never
+	// removed. Additional muxed outputs are set up on demand.
+
+	std::unique_ptr < output_branch > stream_branch;
+	if (m_muxed)
+	{
+		stream_branch.reset(new output_branch(this, m_primary_output));
+		multisocketsink = create_multisocketsink(stream_branch.get());
+	}
+
+
+	// Setup the pipeline element & its bus watch
+
+	m_pipeline = gst_pipeline_new(nullptr);
+	g_assert(m_pipeline != nullptr);
+
+	GstBus *bus = gst_pipeline_get_bus(GST_PIPELINE(m_pipeline));
+	m_bus_watch_id = gst_bus_add_watch(
+		bus,
+		[](GstBus *p_bus, GstMessage *p_msg, gpointer p_user_data) -> gboolean
+		{
+			http_stream_pipeline *self = reinterpret_cast < http_stream_pipeline* > (p_user_data);
+			return self->bus_watch(p_bus, p_msg);
+		},
+		gpointer(this)
+	);
+	gst_object_unref(GST_OBJECT(bus));
+
+	// Add the other elements to the pipeline (which transfers ownership
+	// over the elements to m_pipeline) and link it all together
+	gst_bin_add(GST_BIN(m_pipeline), cmdline_bin);
+	for (auto const &tee : m_tees)
+	{
+		gst_bin_add(GST_BIN(m_pipeline), tee.second);
+		gst_element_link_pads(cmdline_bin, tee.first.c_str(), tee.second, "sink");
+	}
+
+	m_source_bin = cmdline_bin;
+	for (char **arg = p_argv; (arg != nullptr) && (*arg != nullptr); ++arg)
+		m_source_argv.push_back(*arg);
+
+	// Keep track of where the primary output is, so that a new
+	// source can continue seamlessly when sources are switched
+	{
+		GstPad *primary_tee_sinkpad = gst_element_get_static_pad(m_tees[m_primary_output], "sink");
+		gst_pad_add_probe(primary_tee_sinkpad, GstPadProbeType(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST), track_running_time_probe, this, nullptr);
+		gst_object_unref(GST_OBJECT(primary_tee_sinkpad));
+	}
+
+	// Sources that are restarted must not end the stream for the clients
+	for (auto const &tee : m_tees)
+	{
+		GstPad *tee_sinkpad = gst_element_get_static_pad(tee.second, "sink");
+		gst_pad_add_probe(tee_sinkpad, GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM, source_eos_probe, this, nullptr);
+		gst_object_unref(GST_OBJECT(tee_sinkpad));
+	}
+
+	// New clients of muxed MPEG-TS outputs get the latest PAT and PMT
+	// first. The tee's sinkpad keeps them across source switches.
+	if (m_muxed && is_ts_content_type(m_content_type))
+	{
+		for (auto const &tee : m_tees)
+		{
+			if (!is_muxed_output_name(tee.first))
+				continue;
+
+			GstPad *tee_sinkpad = gst_element_get_static_pad(tee.second, "sink");
+			ts_header_cache::attach(tee_sinkpad);
+			gst_object_unref(GST_OBJECT(tee_sinkpad));
+		}
+	}
+
+	// Stream consumers that join the video stream later get its
+	// latest parameter sets from here
+	if (!m_muxed && (m_stream_pad != nullptr))
+		m_parameter_set_cache = h264_parameter_set_cache::attach(m_stream_pad);
+
+	if (m_muxed)
+	{
+		gst_bin_add(GST_BIN(m_pipeline), multisocketsink);
+		gst_element_link(m_tees[m_primary_output], multisocketsink);
+		stream_branch->m_multisocketsink = multisocketsink;
+		m_branches[m_primary_output] = std::move(stream_branch);
+	}
+
+
+	// The pipeline element now contains all the others and took
+	// ownership over them, making the guard unnecessary. If something
+	// goes wrong, only the pipeline element itself has to be unref'd now.
+	elements_guard.dismiss();
+
+
+	// Try to switch the pipeline's state to READY as the last step
+	if (gst_element_set_state(m_pipeline, GST_STATE_READY) == GST_STATE_CHANGE_FAILURE)
+	{
+		g_source_remove(m_bus_watch_id);
+		gst_object_unref(GST_OBJECT(m_pipeline));
+		m_pipeline = nullptr;
+		throw std::runtime_error("failed to set pipeline state to READY");
+	}
+}
+
+http_stream_pipeline::~http_stream_pipeline()
+{
+	// Instances may be destroyed while the mainloop keeps running,
+	// so the bus watch must not outlive them, and clients that are
+	// still connected must be disconnected properly
+	if (m_bus_watch_id != 0)
+		g_source_remove(m_bus_watch_id);
+
+	if (m_source_switch && (m_source_switch->m_timeout_source != 0))
+		g_source_remove(m_source_switch->m_timeout_source);
+
+	if (m_restart_source_timeout != 0)
+		g_source_remove(m_restart_source_timeout);
+	if (m_stall_check_source != 0)
+		g_source_remove(m_stall_check_source);
+	if (m_start_grace_source != 0)
+		g_source_remove(m_start_grace_source);
+	if (m_stop_linger_source != 0)
+		g_source_remove(m_stop_linger_source);
+
+	clear_all_branches();
+
+	if (m_pipeline != nullptr)
+	{
+		gst_element_set_state(m_pipeline, GST_STATE_NULL);
+		gst_object_unref(GST_OBJECT(m_pipeline));
+	}
+}
+
+void http_stream_pipeline::play(bool const p_do_play)
+{
+	// Set this first, so that a failed start is not mistaken
+	// for a running pipeline that merely has to be kept going
+	m_running = false;
+	event_trace *trace = m_event_trace;
+	if (trace != nullptr)
+		trace->record(event_trace::pipelines, m_trace_id, "pipeline", p_do_play ? "play" : "stop");
+	if (gst_element_set_state(m_pipeline, p_do_play ? GST_STATE_PLAYING : GST_STATE_READY) == GST_STATE_CHANGE_FAILURE)
+	{
+		update_stall_check();
+		throw std::runtime_error("failed to set pipeline state");
+	}
+	m_running = p_do_play;
+
+	// A source that was stopped has not stalled
+	m_last_buffer_time = g_get_monotonic_time();
+	update_stall_check();
+}
+
+std::string http_stream_pipeline::select_output(std::string const &p_path, char const *p_accept_header) const
+{
+	// Requests for ".../audio" and ".../audio.<format>" get the audio-only outputs
+	std::string::size_type slash_pos = p_path.rfind('/');
+	std::string last_path_component = (slash_pos == std::string::npos) ? p_path : p_path.substr(slash_pos + 1);
+
+	// Requests for ".../NAME" get the "stream_NAME" output, if there is one
+	if (m_muxed && !last_path_component.empty() && (m_tees.find(extra_stream_prefix + last_path_component) != m_tees.end()))
+		return extra_stream_prefix + last_path_component;
+
+	if ((last_path_component == "audio") || g_str_has_prefix(last_path_component.c_str(), audio_output_prefix.c_str()))
+		return select_audio_output(last_path_component, p_accept_header);
+
+	if (m_muxed)
+		return m_primary_output;
+
+	// An explicit suffix in the URL wins
+	for (container_format const &format : container_formats)
+	{
+		if (g_str_has_suffix(p_path.c_str(), (std::string(".") + format.m_name).c_str()))
+			return format.m_name;
+	}
+
+	if (p_accept_header == nullptr)
+		return m_default_container;
+
+	// Otherwise, pick the most preferred of the accepted types.
+	// Wildcards get the default container.
+	std::vector < std::string > media_types = parse_accept_header(p_accept_header);
+	if (media_types.empty())
+		return m_default_container;
+
+	container_format const *format = find_container_format_by_accept_header(container_formats, media_types, "video/*", find_container_format(container_formats, m_default_container));
+	return (format != nullptr) ? format->m_name : "";
+}
+
+std::string http_stream_pipeline::get_websocket_output(std::string const &p_output)
+{
+	return websocket_output_prefix + p_output;
+}
+
+bool http_stream_pipeline::is_websocket_output(std::string const &p_output)
+{
+	return g_str_has_prefix(p_output.c_str(), websocket_output_prefix.c_str());
+}
+
+std::string http_stream_pipeline::get_priority_output(std::string const &p_output, priority_class const p_class)
+{
+	return (p_class == priority_class::premium) ? (p_output + premium_output_suffix) : p_output;
+}
+
+priority_class http_stream_pipeline::get_output_priority_class(std::string const &p_output)
+{
+	return g_str_has_suffix(p_output.c_str(), premium_output_suffix.c_str()) ? priority_class::premium : priority_class::standard;
+}
+
+std::string http_stream_pipeline::get_content_type(std::string const &p_output) const
+{
+	// Premium and WebSocket outputs carry the same
+	// data as their plain counterparts
+	if (get_output_priority_class(p_output) == priority_class::premium)
+		return get_content_type(p_output.substr(0, p_output.size() - premium_output_suffix.size()));
+	if (is_websocket_output(p_output))
+		return get_content_type(p_output.substr(websocket_output_prefix.size()));
+
+	if (is_muxed_output_name(p_output))
+		return m_content_type;
+
+	container_format const *format = find_output_format(p_output);
+	return (format != nullptr) ? format->m_content_type : "application/octet-stream";
+}
+
+void http_stream_pipeline::add_client(GIOStream *p_stream, GSocket *p_socket, std::string const &p_output, bool const p_from_latest_keyframe, GstClockTime const p_rewind)
+{
+	state_change change = state_change::none;
+
+	{
+		// Guard against race conditions, since the client
+		// collections might be accessed in the streaming thread
+		std::lock_guard < std::mutex > lock(m_client_mutex);
+
+		output_branch *branch;
+		auto branch_iter = m_branches.find(p_output);
+		if (branch_iter != m_branches.end())
+			branch = branch_iter->second.get();
+		else
+			branch = create_branch(p_output);
+
+		branch->m_clients[p_socket] = p_stream;
+		++m_num_clients;
+		event_trace *trace = m_event_trace;
+		if (trace != nullptr)
+		{
+			trace->record(event_trace::connections, event_trace::get_connection_id(p_socket), "connection", "add-client", "pipeline", m_trace_id);
+			branch->m_first_byte_pending.insert(p_socket);
+			branch->m_num_first_byte_pending = branch->m_first_byte_pending.size();
+		}
+		if (GST_CLOCK_TIME_IS_VALID(p_rewind))
+			g_signal_emit_by_name(branch->m_multisocketsink, "add-full", p_socket, sync_method_burst_keyframe, GST_FORMAT_TIME, guint64(p_rewind), GST_FORMAT_TIME, guint64(std::max < GstClockTime > (p_rewind, m_resume_window_ms * GST_MSECOND)));
+		else if (p_from_latest_keyframe)
+			g_signal_emit_by_name(branch->m_multisocketsink, "add-full", p_socket, sync_method_latest_keyframe, GST_FORMAT_BUFFERS, guint64(0), GST_FORMAT_BUFFERS, guint64(-1));
+		else
+			g_signal_emit_by_name(branch->m_multisocketsink, "add", p_socket);
+
+		std::cerr << "Adding socket " << std::hex << guintptr(p_socket) << std::dec << " to output \"" << p_output << "\"\n";
+
+		// If no clients were connected until now, start/resume the pipeline
+		if ((m_num_clients == 1) && (m_num_holds == 0))
+			change = request_start(false);
+	}
+
+	change_state(change);
+}
+
+std::string http_stream_pipeline::get_client_output(GSocket *p_socket) const
+{
+	std::lock_guard < std::mutex > lock(m_client_mutex);
+
+	for (auto const &branch : m_branches)
+	{
+		if (branch.second->m_clients.find(p_socket) != branch.second->m_clients.end())
+			return branch.first;
+	}
+
+	return "";
+}
+
+bool http_stream_pipeline::get_client_stats(GSocket *p_socket, client_stats &p_stats) const
+{
+	GstElement *multisocketsink = nullptr;
+
+	{
+		std::lock_guard < std::mutex > lock(m_client_mutex);
+
+		for (auto const &branch : m_branches)
+		{
+			if (branch.second->m_clients.find(p_socket) != branch.second->m_clients.end())
+			{
+				multisocketsink = GST_ELEMENT(gst_object_ref(GST_OBJECT(branch.second->m_multisocketsink)));
+				break;
+			}
+		}
+	}
+
+	if (multisocketsink == nullptr)
+		return false;
+
+	GstStructure *stats = nullptr;
+	g_signal_emit_by_name(multisocketsink, "get-stats", p_socket, &stats);
+	gst_object_unref(GST_OBJECT(multisocketsink));
+
+	// The sink returns an empty structure if it does not know the socket
+	// (anymore); the fields are left at zero then
+	p_stats.m_bytes_sent = 0;
+	p_stats.m_dropped_buffers = 0;
+	if (stats != nullptr)
+	{
+		gst_structure_get_uint64(stats, "bytes-sent", &(p_stats.m_bytes_sent));
+		gst_structure_get_uint64(stats, "dropped-buffers", &(p_stats.m_dropped_buffers));
+		gst_structure_free(stats);
+	}
+
+	return true;
+}
+
+bool http_stream_pipeline::detach_client(GSocket *p_socket, detach_callback p_callback)
+{
+	GstElement *multisocketsink = nullptr;
+
+	{
+		std::lock_guard < std::mutex > lock(m_client_mutex);
+
+		for (auto const &branch : m_branches)
+		{
+			if (branch.second->m_clients.find(p_socket) != branch.second->m_clients.end())
+			{
+				multisocketsink = GST_ELEMENT(gst_object_ref(GST_OBJECT(branch.second->m_multisocketsink)));
+				break;
+			}
+		}
+
+		if (multisocketsink == nullptr)
+			return false;
+
+		m_detached_clients[p_socket] = std::move(p_callback);
+	}
+
+	std::cerr << "Detaching socket " << std::hex << guintptr(p_socket) << std::dec << "\n";
+
+	// Like "clear", this may invoke on_client_socket_removed()
+	// synchronously, so the client mutex must not be locked here.
+	// (Not using "remove-flush", since flushing the queued data
+	// would delay the client's next stream.)
+	g_signal_emit_by_name(multisocketsink, "remove", p_socket);
+	gst_object_unref(GST_OBJECT(multisocketsink));
+
+	return true;
+}
+
+void http_stream_pipeline::acquire_hold()
+{
+	state_change change = state_change::none;
+
+	{
+		std::lock_guard < std::mutex > lock(m_client_mutex);
+
+		++m_num_holds;
+
+		// Like in add_client(), start the pipeline if nothing else
+		// is keeping it running at this point
+		if ((m_num_holds == 1) && (m_num_clients == 0))
+			change = request_start(true);
+	}
+
+	change_state(change);
+}
+
+void http_stream_pipeline::release_hold()
+{
+	state_change change = state_change::none;
+
+	{
+		std::lock_guard < std::mutex > lock(m_client_mutex);
+
+		g_assert(m_num_holds > 0);
+		--m_num_holds;
+
+		if ((m_num_holds == 0) && (m_num_clients == 0))
+			change = request_stop();
+	}
+
+	// This is always called in the mainloop thread,
+	// so the state can be changed directly here
+	change_state(change);
+}
+
+bool http_stream_pipeline::is_idle() const
+{
+	std::lock_guard < std::mutex > lock(m_client_mutex);
+	return (m_num_clients == 0) && (m_num_holds == 0) && (m_stop_linger_source == 0);
+}
+
+void http_stream_pipeline::set_start_stop_delays(guint const p_start_grace_ms, guint const p_stop_linger_ms)
+{
+	// Pending delays keep their old duration
+	std::lock_guard < std::mutex > lock(m_client_mutex);
+	m_start_grace_ms = p_start_grace_ms;
+	m_stop_linger_ms = p_stop_linger_ms;
+}
+
+http_stream_pipeline::state_change http_stream_pipeline::request_start(bool const p_immediately)
+{
+	if (m_stop_linger_source != 0)
+	{
+		std::cerr << "Pipeline is still lingering - keeping it running\n";
+		g_source_remove(m_stop_linger_source);
+		m_stop_linger_source = 0;
+		++m_num_avoided_starts;
+	}
+
+	if (m_running)
+		return state_change::none;
+
+	if (p_immediately || (m_start_grace_ms == 0))
+	{
+		if (m_start_grace_source != 0)
+		{
+			g_source_remove(m_start_grace_source);
+			m_start_grace_source = 0;
+		}
+
+		std::cerr << "Pipeline isn't running yet - setting pipeline state to PLAYING\n";
+		++m_num_starts;
+		return state_change::start;
+	}
+
+	if (m_start_grace_source == 0)
+		m_start_grace_source = g_timeout_add(m_start_grace_ms, start_grace_timeout, this);
+
+	return state_change::none;
+}
+
+http_stream_pipeline::state_change http_stream_pipeline::request_stop()
+{
+	if (m_start_grace_source != 0)
+	{
+		// The pipeline was never started for the client(s) that just left
+		std::cerr << "No clients connected anymore before the start grace period ended - not starting pipeline\n";
+		g_source_remove(m_start_grace_source);
+		m_start_grace_source = 0;
+		++m_num_avoided_starts;
+		return state_change::idle;
+	}
+
+	if ((m_stop_linger_ms == 0) || !m_running)
+	{
+		std::cerr << "No clients connected and no holds acquired - setting pipeline state to READY\n";
+		return state_change::stop;
+	}
+
+	if (m_stop_linger_source == 0)
+		m_stop_linger_source = g_timeout_add(m_stop_linger_ms, stop_linger_timeout, this);
+
+	return state_change::none;
+}
+
+void http_stream_pipeline::change_state(state_change const p_change)
+{
+	switch (p_change)
+	{
+		case state_change::none:
+			break;
+
+		case state_change::start:
+			play(true);
+			break;
+
+		case state_change::stop:
+			play(false);
+			if (m_idle_callback)
+				m_idle_callback();
+			break;
+
+		case state_change::idle:
+			if (m_idle_callback)
+				m_idle_callback();
+			break;
+	}
+}
+
+gboolean http_stream_pipeline::start_grace_timeout(gpointer p_user_data)
+{
+	http_stream_pipeline *self = reinterpret_cast < http_stream_pipeline* > (p_user_data);
+
+	{
+		std::lock_guard < std::mutex > lock(self->m_client_mutex);
+		self->m_start_grace_source = 0;
+		++self->m_num_starts;
+	}
+
+	try
+	{
+		std::cerr << "Start grace period ended with clients connected - setting pipeline state to PLAYING\n";
+		self->play(true);
+	}
+	catch (std::exception const &p_exc)
+	{
+		std::cerr << "Could not start pipeline: " << p_exc.what() << "\n";
+	}
+
+	return G_SOURCE_REMOVE;
+}
+
+gboolean http_stream_pipeline::stop_linger_timeout(gpointer p_user_data)
+{
+	http_stream_pipeline *self = reinterpret_cast < http_stream_pipeline* > (p_user_data);
+
+	{
+		std::lock_guard < std::mutex > lock(self->m_client_mutex);
+		self->m_stop_linger_source = 0;
+	}
+
+	try
+	{
+		std::cerr << "Stop linger period ended without clients or holds - setting pipeline state to READY\n";
+		self->play(false);
+	}
+	catch (std::exception const &p_exc)
+	{
+		std::cerr << "Could not stop pipeline: " << p_exc.what() << "\n";
+	}
+
+	if (self->m_idle_callback)
+		self->m_idle_callback();
+
+	return G_SOURCE_REMOVE;
+}
+
+unsigned int http_stream_pipeline::get_num_clients() const
+{
+	std::lock_guard < std::mutex > lock(m_client_mutex);
+	return m_num_clients;
+}
+
+void http_stream_pipeline::set_sink_settings(sink_settings const &p_sink_settings)
+{
+	std::lock_guard < std::mutex > lock(m_client_mutex);
+
+	m_sink_settings = p_sink_settings;
+	for (auto const &branch : m_branches)
+	{
+		if (get_output_priority_class(branch.first) == priority_class::standard)
+			m_sink_settings.apply(branch.second->m_multisocketsink);
+	}
+}
+
+void http_stream_pipeline::set_premium_sink_settings(sink_settings const &p_sink_settings)
+{
+	std::lock_guard < std::mutex > lock(m_client_mutex);
+
+	m_premium_sink_settings = p_sink_settings;
+	for (auto const &branch : m_branches)
+	{
+		if (get_output_priority_class(branch.first) == priority_class::premium)
+			m_premium_sink_settings.apply(branch.second->m_multisocketsink);
+	}
+}
+
+http_stream_pipeline::priority_stats http_stream_pipeline::get_priority_stats(priority_class const p_class) const
+{
+	priority_stats stats;
+	stats.m_num_clients = 0;
+	stats.m_num_evictions = m_num_evictions[int(p_class)];
+	stats.m_dropped_buffers = 0;
+
+	// Like in get_client_stats(), the sinks must not be
+	// asked while the client mutex is locked
+	std::vector < std::pair < GstElement*, GSocket* > > clients;
+	{
+		std::lock_guard < std::mutex > lock(m_client_mutex);
+
+		for (auto const &branch : m_branches)
+		{
+			if (get_output_priority_class(branch.first) != p_class)
+				continue;
+
+			for (auto const &client : branch.second->m_clients)
+			{
+				gst_object_ref(GST_OBJECT(branch.second->m_multisocketsink));
+				g_object_ref(G_OBJECT(client.first));
+				clients.emplace_back(branch.second->m_multisocketsink, client.first);
+			}
+		}
+	}
+
+	stats.m_num_clients = clients.size();
+
+	for (auto const &client : clients)
+	{
+		GstStructure *client_stats = nullptr;
+		g_signal_emit_by_name(client.first, "get-stats", client.second, &client_stats);
+		if (client_stats != nullptr)
+		{
+			guint64 dropped_buffers = 0;
+			gst_structure_get_uint64(client_stats, "dropped-buffers", &dropped_buffers);
+			stats.m_dropped_buffers += dropped_buffers;
+			gst_structure_free(client_stats);
+		}
+
+		g_object_unref(G_OBJECT(client.second));
+		gst_object_unref(GST_OBJECT(client.first));
+	}
+
+	return stats;
+}
+
+void http_stream_pipeline::set_idle_callback(idle_callback p_idle_callback)
+{
+	m_idle_callback = std::move(p_idle_callback);
+}
+
+void http_stream_pipeline::set_client_removed_callback(client_removed_callback p_client_removed_callback)
+{
+	m_client_removed_callback = std::move(p_client_removed_callback);
+}
+
+void http_stream_pipeline::set_event_trace(event_trace *p_event_trace)
+{
+	m_event_trace = p_event_trace;
+	if (p_event_trace != nullptr)
+		p_event_trace->record(event_trace::pipelines, m_trace_id, "pipeline", "traced");
+}
+
+void http_stream_pipeline::set_resume_window(guint const p_resume_window_ms)
+{
+	std::lock_guard < std::mutex > lock(m_client_mutex);
+
+	m_resume_window_ms = p_resume_window_ms;
+	for (auto const &branch : m_branches)
+		g_object_set(G_OBJECT(branch.second->m_multisocketsink), "time-min", gint64((m_resume_window_ms == 0) ? -1 : (m_resume_window_ms * GST_MSECOND)), nullptr);
+}
+
+GstElement* http_stream_pipeline::create_multisocketsink(output_branch *p_branch)
+{
+	GstElement *multisocketsink = gst_element_factory_make("multisocketsink", nullptr);
+	if (multisocketsink == nullptr)
+		throw std::runtime_error("could not create multisocketsink");
+
+	if (get_output_priority_class(p_branch->m_name) == priority_class::premium)
+		m_premium_sink_settings.apply(multisocketsink);
+	else
+		m_sink_settings.apply(multisocketsink);
+
+	// The resume window is kept for all outputs
+	if (m_resume_window_ms != 0)
+		g_object_set(G_OBJECT(multisocketsink), "time-min", gint64(m_resume_window_ms * GST_MSECOND), nullptr);
+
+	g_signal_connect(multisocketsink, "client-socket-removed", G_CALLBACK(on_client_socket_removed), p_branch);
+	g_signal_connect(multisocketsink, "client-removed", G_CALLBACK(on_client_removed), p_branch);
+
+	GstPad *sinkpad = gst_element_get_static_pad(multisocketsink, "sink");
+	gst_pad_add_probe(sinkpad, GstPadProbeType(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST), first_byte_probe, p_branch, nullptr);
+	gst_object_unref(GST_OBJECT(sinkpad));
+
+	return multisocketsink;
+}
+
+std::string http_stream_pipeline::select_audio_output(std::string const &p_last_path_component, char const *p_accept_header) const
+{
+	if (m_tees.find("audio") == m_tees.end())
+		return "";
+
+	// An explicit format in the URL wins
+	if (p_last_path_component.size() > audio_output_prefix.size())
+	{
+		container_format const *format = find_container_format(audio_formats, p_last_path_component.substr(audio_output_prefix.size()));
+		return (format != nullptr) ? (audio_output_prefix + format->m_name) : "";
+	}
+
+	// Pick the default format: the first one that can
+	// hold the audio. If the audio caps are not known
+	// yet, pick one that can hold almost anything.
+	container_format const *default_format = nullptr;
+	GstCaps *audio_caps = get_stream_caps("audio");
+	if (audio_caps != nullptr)
+	{
+		for (container_format const &format : audio_formats)
+		{
+			if (format.m_required_caps == nullptr)
+				break;
+
+			GstCaps *required_caps = gst_caps_from_string(format.m_required_caps);
+			bool compatible = gst_caps_can_intersect(audio_caps, required_caps);
+			gst_caps_unref(required_caps);
+
+			if (compatible)
+			{
+				default_format = &format;
+				break;
+			}
+		}
+
+		gst_caps_unref(audio_caps);
+	}
+
+	if (default_format == nullptr)
+		default_format = find_container_format(audio_formats, fallback_audio_format);
+
+	if (p_accept_header != nullptr)
+	{
+		std::vector < std::string > media_types = parse_accept_header(p_accept_header);
+		if (!media_types.empty())
+		{
+			container_format const *format = find_container_format_by_accept_header(audio_formats, media_types, "audio/*", default_format);
+			return (format != nullptr) ? (audio_output_prefix + format->m_name) : "";
+		}
+	}
+
+	return audio_output_prefix + default_format->m_name;
+}
+
+GstCaps* http_stream_pipeline::get_stream_caps(std::string const &p_stream_name) const
+{
+	auto tee_iter = m_tees.find(p_stream_name);
+	if (tee_iter == m_tees.end())
+		return nullptr;
+
+	GstPad *tee_sinkpad = gst_element_get_static_pad(tee_iter->second, "sink");
+	GstCaps *caps = gst_pad_get_current_caps(tee_sinkpad);
+	gst_object_unref(GST_OBJECT(tee_sinkpad));
+
+	return caps;
+}
+
+bool http_stream_pipeline::tap_audio_stream(GstElement *p_cmdline_bin)
+{
+	// In muxed mode, the "audio" element is linked to the muxer inside
+	// the launch line. Insert a tee between the two, and expose another
+	// srcpad of that tee as the bin's "audio" ghost pad.
+
+	GstElement *audio_element = gst_bin_get_by_name(GST_BIN(p_cmdline_bin), "audio");
+	if (audio_element == nullptr)
+		return false;
+
+	GstPad *audio_srcpad = gst_element_get_static_pad(audio_element, "src");
+	gst_object_unref(GST_OBJECT(audio_element));
+	if (audio_srcpad == nullptr)
+		throw std::runtime_error("no \"src\" pad in element \"audio\" found");
+	auto audio_srcpad_guard = make_scope_guard([audio_srcpad]() { gst_object_unref(GST_OBJECT(audio_srcpad)); });
+
+	GstPad *muxer_sinkpad = gst_pad_get_peer(audio_srcpad);
+	if (muxer_sinkpad == nullptr)
+		throw std::runtime_error("srcpad of element \"audio\" is not linked");
+	auto muxer_sinkpad_guard = make_scope_guard([muxer_sinkpad]() { gst_object_unref(GST_OBJECT(muxer_sinkpad)); });
+
+	GstElement *audio_tee = gst_element_factory_make("tee", nullptr);
+	if (audio_tee == nullptr)
+		throw std::runtime_error("could not create tee");
+	gst_bin_add(GST_BIN(p_cmdline_bin), audio_tee);
+
+	gst_pad_unlink(audio_srcpad, muxer_sinkpad);
+
+	GstPad *tee_sinkpad = gst_element_get_static_pad(audio_tee, "sink");
+	gst_pad_link(audio_srcpad, tee_sinkpad);
+	gst_object_unref(GST_OBJECT(tee_sinkpad));
+
+	GstPad *tee_srcpad = gst_element_get_request_pad(audio_tee, "src_%u");
+	gst_pad_link(tee_srcpad, muxer_sinkpad);
+	gst_object_unref(GST_OBJECT(tee_srcpad));
+
+	tee_srcpad = gst_element_get_request_pad(audio_tee, "src_%u");
+	gst_element_add_pad(p_cmdline_bin, gst_ghost_pad_new("audio", tee_srcpad));
+	gst_object_unref(GST_OBJECT(tee_srcpad));
+
+	return true;
+}
+
+void http_stream_pipeline::switch_source(char **p_argv, bool const p_preroll)
+{
+	std::vector < std::string > output_names;
+	GstElement *new_bin = create_source_bin(p_argv, output_names);
+
+	switch_to_bin(new_bin, std::move(output_names), p_preroll, false);
+
+	m_source_argv.clear();
+	for (char **arg = p_argv; *arg != nullptr; ++arg)
+		m_source_argv.push_back(*arg);
+}
+
+void http_stream_pipeline::switch_to_bin(GstElement *p_new_bin, std::vector < std::string > p_output_names, bool const p_preroll, bool const p_slate)
+{
+	GstElement *new_bin = p_new_bin;
+	auto new_bin_guard = make_scope_guard([new_bin]() { gst_object_unref(GST_OBJECT(new_bin)); });
+
+	std::vector < std::string > &output_names = p_output_names;
+	std::sort(output_names.begin(), output_names.end());
+	std::vector < std::string > current_output_names;
+	for (auto const &tee : m_tees)
+		current_output_names.push_back(tee.first);
+	if (output_names != current_output_names)
+		throw std::runtime_error("the new source must have the same outputs as the current one");
+
+	// Only one switch can be in progress at a time
+	if (m_source_switch)
+		abort_source_switch("a newer switch was requested");
+
+	// Pre-rolling only makes sense while data is flowing
+	GstState state = GST_STATE_NULL;
+	gst_element_get_state(m_pipeline, &state, nullptr, 0);
+	bool keep_old_source = p_preroll && (state == GST_STATE_PLAYING);
+
+	std::shared_ptr < source_switch > new_switch = std::make_shared < source_switch > ();
+	new_switch->m_pipeline = this;
+	new_switch->m_new_bin = new_bin;
+	new_switch->m_old_bin = keep_old_source ? m_source_bin : nullptr;
+	new_switch->m_wait_for_keyframe = p_preroll;
+	new_switch->m_slate = p_slate;
+	new_switch->m_request_time = g_get_monotonic_time();
+	new_switch->m_switch_time = 0;
+	new_switch->m_timeout_source = 0;
+	new_switch->m_state = source_switch::pending;
+
+	std::cerr << "Switching source (" << (keep_old_source ? "switching at the first keyframe" : "switching right away") << ")\n";
+
+	if (!keep_old_source && (m_source_bin != nullptr))
+	{
+		detach_source_bin(m_source_bin);
+		remove_source_bin(m_source_bin);
+		m_source_bin = nullptr;
+	}
+
+	// The new source's outputs stay unlinked until the switch.
+	// Until then, the probes drop everything they output.
+	for (std::string const &name : output_names)
+	{
+		GstPad *srcpad = gst_element_get_static_pad(new_bin, name.c_str());
+		gst_pad_add_probe(
+			srcpad,
+			GstPadProbeType(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+			new_source_probe,
+			new std::shared_ptr < source_switch > (new_switch),
+			[](gpointer p_data) { delete reinterpret_cast < std::shared_ptr < source_switch > * > (p_data); }
+		);
+		gst_object_unref(GST_OBJECT(srcpad));
+	}
+
+	if (keep_old_source)
+	{
+		new_switch->m_timeout_source = g_timeout_add(source_switch_timeout_ms, [](gpointer p_data) -> gboolean
+		{
+			http_stream_pipeline *self = reinterpret_cast < http_stream_pipeline* > (p_data);
+			self->m_source_switch->m_timeout_source = 0;
+			self->abort_source_switch("no keyframe arrived in time");
+
+			// While the slate is shown, the source is retried until it works
+			if (self->m_restart_source && self->m_slate_active)
+				self->schedule_source_restart("the restarted source delivered no keyframe");
+
+			return G_SOURCE_REMOVE;
+		}, this);
+	}
+
+	new_bin_guard.dismiss();
+	m_source_switch = new_switch;
+
+	gst_bin_add(GST_BIN(m_pipeline), new_bin);
+	gst_element_sync_state_with_parent(new_bin);
+}
+
+void http_stream_pipeline::attach_stream_consumer(GstElement *p_bin)
+{
+	GstElement *tee = m_tees[m_primary_output];
+
+	gst_bin_add(GST_BIN(m_pipeline), p_bin);
+
+	GstPad *tee_srcpad = gst_element_get_request_pad(tee, "src_%u");
+	GstPad *bin_sinkpad = gst_element_get_static_pad(p_bin, "sink");
+	GstPadLinkReturn link_ret = gst_pad_link(tee_srcpad, bin_sinkpad);
+	gst_object_unref(GST_OBJECT(bin_sinkpad));
+
+	if (GST_PAD_LINK_FAILED(link_ret))
+	{
+		gst_element_release_request_pad(tee, tee_srcpad);
+		gst_object_unref(GST_OBJECT(tee_srcpad));
+		gst_bin_remove(GST_BIN(m_pipeline), p_bin);
+		throw std::runtime_error("could not link stream consumer");
+	}
+
+	gst_object_unref(GST_OBJECT(tee_srcpad));
+	gst_element_sync_state_with_parent(p_bin);
+}
+
+GstSample* http_stream_pipeline::create_parameter_set_sample(GstSample *p_keyframe_sample) const
+{
+	return m_parameter_set_cache ? m_parameter_set_cache->create_sample(p_keyframe_sample) : nullptr;
+}
+
+void http_stream_pipeline::detach_stream_consumer(GstElement *p_bin)
+{
+	GstPad *bin_sinkpad = gst_element_get_static_pad(p_bin, "sink");
+	GstPad *tee_srcpad = gst_pad_get_peer(bin_sinkpad);
+
+	// Releasing tee request pads is safe even while data is flowing
+	if (tee_srcpad != nullptr)
+	{
+		gst_pad_unlink(tee_srcpad, bin_sinkpad);
+		gst_element_release_request_pad(m_tees[m_primary_output], tee_srcpad);
+		gst_object_unref(GST_OBJECT(tee_srcpad));
+	}
+
+	gst_object_unref(GST_OBJECT(bin_sinkpad));
+
+	gst_element_set_state(p_bin, GST_STATE_NULL);
+	gst_bin_remove(GST_BIN(m_pipeline), p_bin);
+}
+
+void http_stream_pipeline::set_restart_source(bool const p_restart_source)
+{
+	m_restart_source = p_restart_source;
+
+	if (!p_restart_source && (m_restart_source_timeout != 0))
+	{
+		g_source_remove(m_restart_source_timeout);
+		m_restart_source_timeout = 0;
+	}
+}
+
+GstElement* http_stream_pipeline::find_source_element(std::string const &p_name) const
+{
+	if (m_source_bin == nullptr)
+		return nullptr;
+
+	return gst_bin_get_by_name(GST_BIN(m_source_bin), p_name.c_str());
+}
+
+GstElement* http_stream_pipeline::create_source_bin(char **p_argv, std::vector < std::string > &p_output_names)
+{
+	GError *gerror = nullptr;
+	GstElement *bin = gst_parse_launchv((gchar const **)p_argv, &gerror);
+	if (bin == nullptr)
+	{
+		std::string s = std::string("could not parse pipeline: ") + gerror->message;
+		g_clear_error(&gerror);
+		throw std::runtime_error(s);
+	}
+
+	auto bin_guard = make_scope_guard([bin]() { gst_object_unref(GST_OBJECT(bin)); });
+
+	// Add ghost srcpads to the bin and connect them to the srcpads
+	// of the output elements. The ghost pads are named after these.
+	auto add_output_pad = [bin](char const *p_element_name) -> bool
+	{
+		GstElement *element = gst_bin_get_by_name(GST_BIN(bin), p_element_name);
+		if (element == nullptr)
+			return false;
+
+		GstPad *srcpad = gst_element_get_static_pad(element, "src");
+		gst_object_unref(GST_OBJECT(element));
+		if (srcpad == nullptr)
+			throw std::runtime_error(std::string("no \"src\" pad in element \"") + p_element_name + "\" found");
+
+		gst_element_add_pad(GST_ELEMENT(bin), gst_ghost_pad_new(p_element_name, srcpad));
+		gst_object_unref(GST_OBJECT(srcpad));
+
+		return true;
+	};
+
+	p_output_names.clear();
+
+	// Additional muxed outputs can only be found by looking at all elements
+	std::vector < std::string > extra_stream_names;
+	GstIterator *element_iter = gst_bin_iterate_recurse(GST_BIN(bin));
+	gst_iterator_foreach(
+		element_iter,
+		[](GValue const *p_value, gpointer p_user_data)
+		{
+			gchar *name = gst_object_get_name(GST_OBJECT(g_value_get_object(p_value)));
+			if (g_str_has_prefix(name, extra_stream_prefix.c_str()))
+				reinterpret_cast < std::vector < std::string > * > (p_user_data)->push_back(name);
+			g_free(name);
+		},
+		&extra_stream_names
+	);
+	gst_iterator_free(element_iter);
+	std::sort(extra_stream_names.begin(), extra_stream_names.end());
+
+	// Without a "stream" element, the first additional one is the primary output
+	if (add_output_pad("stream"))
+		p_output_names.push_back("stream");
+	for (std::string const &name : extra_stream_names)
+	{
+		add_output_pad(name.c_str());
+		p_output_names.push_back(name);
+	}
+
+	if (!p_output_names.empty())
+	{
+		// If there is an element called "audio", its encoded output
+		// is made available for the audio-only outputs as well
+		if (tap_audio_stream(bin))
+			p_output_names.push_back("audio");
+	}
+	else
+	{
+		for (char const *name : { "video", "audio" })
+		{
+			if (add_output_pad(name))
+				p_output_names.push_back(name);
+		}
+
+		if (p_output_names.empty())
+			throw std::runtime_error("no element with name \"stream\", \"video\", or \"audio\" found");
+	}
+
+	bin_guard.dismiss();
+	return bin;
+}
+
+void http_stream_pipeline::detach_source_bin(GstElement *p_source_bin)
+{
+	// Mark the bin, so errors it posts from now on are ignored. Then
+	// drop whatever it still outputs, and unlink it from the tees.
+	g_object_set_data(G_OBJECT(p_source_bin), retired_source_key, GINT_TO_POINTER(1));
+
+	for (auto const &tee : m_tees)
+	{
+		GstPad *srcpad = gst_element_get_static_pad(p_source_bin, tee.first.c_str());
+		GstPad *tee_sinkpad = gst_element_get_static_pad(tee.second, "sink");
+
+		gst_pad_add_probe(srcpad, GST_PAD_PROBE_TYPE_DATA_DOWNSTREAM, drop_probe, nullptr, nullptr);
+		gst_pad_unlink(srcpad, tee_sinkpad);
+
+		gst_object_unref(GST_OBJECT(tee_sinkpad));
+		gst_object_unref(GST_OBJECT(srcpad));
+	}
+}
+
+void http_stream_pipeline::remove_source_bin(GstElement *p_source_bin)
+{
+	gst_element_set_state(p_source_bin, GST_STATE_NULL);
+	gst_bin_remove(GST_BIN(m_pipeline), p_source_bin);
+}
+
+GstPadProbeReturn http_stream_pipeline::new_source_probe(GstPad *p_pad, GstPadProbeInfo *p_info, gpointer p_user_data)
+{
+	source_switch &sw = **reinterpret_cast < std::shared_ptr < source_switch > * > (p_user_data);
+	std::lock_guard < std::mutex > lock(sw.m_mutex);
+
+	switch (sw.m_state)
+	{
+		case source_switch::aborted:
+			return GST_PAD_PROBE_DROP;
+
+		case source_switch::switched:
+			// The pad was linked during the switch, so let the data pass
+			return GST_PAD_PROBE_REMOVE;
+
+		default:
+			break;
+	}
+
+	// The switch is triggered by the primary output. The others
+	// drop their data until then.
+	gchar *pad_name = gst_pad_get_name(p_pad);
+	bool is_primary = (sw.m_pipeline->m_primary_output == pad_name);
+	g_free(pad_name);
+	if (!is_primary)
+		return GST_PAD_PROBE_DROP;
+
+	GstBuffer *buffer = nullptr;
+	if ((GST_PAD_PROBE_INFO_TYPE(p_info) & GST_PAD_PROBE_TYPE_BUFFER_LIST) != 0)
+	{
+		GstBufferList *buffer_list = GST_PAD_PROBE_INFO_BUFFER_LIST(p_info);
+		if (gst_buffer_list_length(buffer_list) > 0)
+			buffer = gst_buffer_list_get(buffer_list, 0);
+	}
+	else
+		buffer = GST_PAD_PROBE_INFO_BUFFER(p_info);
+
+	if ((buffer == nullptr) || (sw.m_wait_for_keyframe && GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT)))
+		return GST_PAD_PROBE_DROP;
+
+	sw.m_pipeline->perform_source_switch(sw, buffer);
+
+	// Let the first buffer pass; it goes to the tee now
+	return GST_PAD_PROBE_REMOVE;
+}
+
+GstPadProbeReturn http_stream_pipeline::track_running_time_probe(GstPad *p_pad, GstPadProbeInfo *p_info, gpointer p_user_data)
+{
+	http_stream_pipeline *self = reinterpret_cast < http_stream_pipeline* > (p_user_data);
+
+	GstBuffer *buffer = nullptr;
+	if ((GST_PAD_PROBE_INFO_TYPE(p_info) & GST_PAD_PROBE_TYPE_BUFFER_LIST) != 0)
+	{
+		GstBufferList *buffer_list = GST_PAD_PROBE_INFO_BUFFER_LIST(p_info);
+		guint length = gst_buffer_list_length(buffer_list);
+		if (length > 0)
+			buffer = gst_buffer_list_get(buffer_list, length - 1);
+	}
+	else
+		buffer = GST_PAD_PROBE_INFO_BUFFER(p_info);
+
+	if (buffer != nullptr)
+	{
+		GstClockTime running_time_end = get_buffer_running_time(p_pad, buffer, true);
+		if (GST_CLOCK_TIME_IS_VALID(running_time_end))
+			self->m_last_running_time_end = running_time_end;
+		self->m_last_buffer_time = g_get_monotonic_time();
+	}
+
+	return GST_PAD_PROBE_OK;
+}
+
+void http_stream_pipeline::perform_source_switch(source_switch &p_switch, GstBuffer *p_first_buffer)
+{
+	// This runs in the streaming thread of the new source, with the
+	// switch's mutex locked.
+
+	// If the new source's timestamps would go back in time (which is the
+	// case with non-live sources, which start at zero), shift them so
+	// they continue where the previous source stopped. Live sources are
+	// left alone, since their timestamps already follow the clock.
+	gint64 offset = 0;
+	{
+		GstPad *primary_srcpad = gst_element_get_static_pad(p_switch.m_new_bin, m_primary_output.c_str());
+		GstClockTime first_running_time = get_buffer_running_time(primary_srcpad, p_first_buffer, false);
+		gst_object_unref(GST_OBJECT(primary_srcpad));
+
+		GstClockTime last_running_time_end = m_last_running_time_end;
+		if (GST_CLOCK_TIME_IS_VALID(first_running_time) && GST_CLOCK_TIME_IS_VALID(last_running_time_end) && (first_running_time < last_running_time_end))
+			offset = gint64(last_running_time_end - first_running_time);
+	}
+
+	if (p_switch.m_old_bin != nullptr)
+		detach_source_bin(p_switch.m_old_bin);
+
+	for (auto const &tee : m_tees)
+	{
+		GstPad *srcpad = gst_element_get_static_pad(p_switch.m_new_bin, tee.first.c_str());
+		GstPad *tee_sinkpad = gst_element_get_static_pad(tee.second, "sink");
+
+		gst_pad_set_offset(srcpad, offset);
+		gst_pad_link(srcpad, tee_sinkpad);
+
+		gst_object_unref(GST_OBJECT(tee_sinkpad));
+		gst_object_unref(GST_OBJECT(srcpad));
+	}
+
+	p_switch.m_switch_time = g_get_monotonic_time();
+	p_switch.m_state = source_switch::switched;
+
+	// The rest (removing the old source) is done in the mainloop thread
+	gst_element_post_message(
+		m_pipeline,
+		gst_message_new_element(GST_OBJECT(m_pipeline), gst_structure_new_empty("SourceSwitched"))
+	);
+}
+
+void http_stream_pipeline::finish_source_switch()
+{
+	if (!m_source_switch)
+		return;
+
+	source_switch &sw = *m_source_switch;
+
+	{
+		std::lock_guard < std::mutex > lock(sw.m_mutex);
+		if (sw.m_state != source_switch::switched)
+			return;
+	}
+
+	if (sw.m_timeout_source != 0)
+		g_source_remove(sw.m_timeout_source);
+
+	if (sw.m_old_bin != nullptr)
+		remove_source_bin(sw.m_old_bin);
+
+	m_source_bin = sw.m_new_bin;
+	m_slate_active = sw.m_slate;
+	m_last_buffer_time = g_get_monotonic_time();
+
+	m_last_switch_latency = sw.m_switch_time - sw.m_request_time;
+	++m_num_source_switches;
+
+	std::cerr << "Source switched; switch latency: " << (m_last_switch_latency / 1000) << " ms\n";
+
+	m_source_switch.reset();
+}
+
+void http_stream_pipeline::abort_source_switch(char const *p_reason)
+{
+	if (!m_source_switch)
+		return;
+
+	source_switch &sw = *m_source_switch;
+
+	bool switched;
+
+	{
+		std::lock_guard < std::mutex > lock(sw.m_mutex);
+
+		switched = (sw.m_state == source_switch::switched);
+		if (!switched)
+			sw.m_state = source_switch::aborted;
+	}
+
+	// The switch may have happened in the meantime, in which case
+	// the SourceSwitched message is pending. finish_source_switch()
+	// locks the mutex itself, and destroys it with the switch.
+	if (switched)
+	{
+		finish_source_switch();
+		return;
+	}
+
+	std::cerr << "Source switch cancelled: " << p_reason << "\n";
+
+	if (sw.m_slate)
+		m_slate_active = false;
+
+	if (sw.m_timeout_source != 0)
+		g_source_remove(sw.m_timeout_source);
+
+	remove_source_bin(sw.m_new_bin);
+
+	if (m_source_bin == nullptr)
+		std::cerr << "No source left; the pipeline will not produce data anymore\n";
+
+	m_source_switch.reset();
+}
+
+GstPadProbeReturn http_stream_pipeline::first_byte_probe(GstPad *, GstPadProbeInfo *, gpointer p_user_data)
+{
+	output_branch *branch = reinterpret_cast < output_branch* > (p_user_data);
+	http_stream_pipeline *self = branch->m_pipeline;
+	event_trace *trace = self->m_event_trace;
+	if ((trace == nullptr) || (branch->m_num_first_byte_pending == 0))
+		return GST_PAD_PROBE_OK;
+
+	// The sink calls on_client_socket_removed() with its own lock
+	// held, so its stats must not be queried with m_client_mutex held
+	std::vector < GSocket* > pending_sockets;
+	{
+		std::lock_guard < std::mutex > lock(self->m_client_mutex);
+		for (GSocket *socket : branch->m_first_byte_pending)
+			pending_sockets.push_back(G_SOCKET(g_object_ref(G_OBJECT(socket))));
+	}
+
+	for (GSocket *socket : pending_sockets)
+	{
+		GstStructure *stats = nullptr;
+		guint64 bytes_sent = 0;
+		g_signal_emit_by_name(branch->m_multisocketsink, "get-stats", socket, &stats);
+		if (stats != nullptr)
+		{
+			gst_structure_get_uint64(stats, "bytes-sent", &bytes_sent);
+			gst_structure_free(stats);
+		}
+
+		if (bytes_sent > 0)
+		{
+			std::lock_guard < std::mutex > lock(self->m_client_mutex);
+			if (branch->m_first_byte_pending.erase(socket) > 0)
+			{
+				branch->m_num_first_byte_pending = branch->m_first_byte_pending.size();
+				trace->record(event_trace::connections, event_trace::get_connection_id(socket), "connection", "first-byte", "bytes", gint64(bytes_sent));
+			}
+		}
+
+		g_object_unref(G_OBJECT(socket));
+	}
+
+	return GST_PAD_PROBE_OK;
+}
+
+GstPadProbeReturn http_stream_pipeline::source_eos_probe(GstPad *, GstPadProbeInfo *p_info, gpointer p_user_data)
+{
+	http_stream_pipeline *self = reinterpret_cast < http_stream_pipeline* > (p_user_data);
+
+	if (!self->m_restart_source || (GST_EVENT_TYPE(GST_PAD_PROBE_INFO_EVENT(p_info)) != GST_EVENT_EOS))
+		return GST_PAD_PROBE_OK;
+
+	// The restart happens in the mainloop thread
+	gst_element_post_message(
+		self->m_pipeline,
+		gst_message_new_element(GST_OBJECT(self->m_pipeline), gst_structure_new_empty("SourceEnded"))
+	);
+
+	return GST_PAD_PROBE_DROP;
+}
+
+void http_stream_pipeline::schedule_source_restart(char const *p_reason)
+{
+	// Outputs end (or fail) one after the other; restart only once
+	if (m_restart_source_timeout != 0)
+		return;
+
+	std::cerr << "Restarting source in " << source_restart_delay_ms << " ms: " << p_reason << "\n";
+
+	// The clients get the slate in the meantime
+	show_slate();
+
+	m_restart_source_timeout = g_timeout_add(source_restart_delay_ms, [](gpointer p_data) -> gboolean
+	{
+		http_stream_pipeline *self = reinterpret_cast < http_stream_pipeline* > (p_data);
+		self->m_restart_source_timeout = 0;
+		self->restart_source();
+		return G_SOURCE_REMOVE;
+	}, this);
+}
+
+void http_stream_pipeline::restart_source()
+{
+	// This also happens if the pipeline was stopped in the meantime.
+	// The new source then just waits in the READY state like the old one
+	// would have, and does not connect to anything before it is started.
+	std::vector < char* > argv;
+	for (std::string const &arg : m_source_argv)
+		argv.push_back(const_cast < char* > (arg.c_str()));
+	argv.push_back(nullptr);
+
+	// If the slate is shown, it stays until the
+	// restarted source delivers its first keyframe
+	try
+	{
+		switch_source(argv.data(), m_slate_active);
+		++m_num_source_restarts;
+	}
+	catch (std::exception const &p_exc)
+	{
+		std::cerr << "Could not restart source: " << p_exc.what() << "\n";
+		schedule_source_restart("the previous attempt failed");
+	}
+}
+
+void http_stream_pipeline::set_slate(std::shared_ptr < slate_clip const > p_slate, guint const p_stall_timeout_ms)
+{
+	if (p_slate)
+	{
+		for (auto const &tee : m_tees)
+		{
+			if (is_muxed_output_name(tee.first))
+			{
+				container_format const *format = find_container_format_by_content_type(container_formats, m_content_type);
+				if ((format == nullptr) || (format->m_muxer == nullptr))
+					throw std::runtime_error("a slate needs a content type with a known container format in muxed mode, not " + m_content_type);
+			}
+			else if (p_slate->find_stream(tee.first) == nullptr)
+				throw std::runtime_error("slate clip " + p_slate->get_path() + " has no " + tee.first + " stream");
+		}
+	}
+
+	m_slate = std::move(p_slate);
+	m_stall_timeout_ms = p_stall_timeout_ms;
+	update_stall_check();
+}
+
+GstElement* http_stream_pipeline::create_clip_bin(std::shared_ptr < slate_clip const > const &p_clip, std::vector < std::string > const &p_output_names) const
+{
+	GstElement *bin = gst_bin_new(nullptr);
+	auto bin_guard = make_scope_guard([bin]() { gst_object_unref(GST_OBJECT(bin)); });
+
+	std::shared_ptr < clip_feed > feed = std::make_shared < clip_feed > ();
+	feed->m_clip = p_clip;
+	feed->m_base_time = GST_CLOCK_TIME_NONE;
+	feed->m_start = 0;
+	feed->m_generation = 0;
+
+	auto create_element = [bin](char const *p_factory_name) -> GstElement*
+	{
+		GstElement *element = gst_element_factory_make(p_factory_name, nullptr);
+		if (element == nullptr)
+			throw std::runtime_error(std::string("could not create clip element ") + p_factory_name);
+		gst_bin_add(GST_BIN(bin), element);
+		return element;
+	};
+
+	auto add_stream_source = [&](slate_clip::stream const &p_stream) -> GstElement*
+	{
+		GstElement *appsrc = create_element("appsrc");
+		g_object_set(
+			G_OBJECT(appsrc),
+			"caps", p_stream.m_caps,
+			"is-live", TRUE,
+			"format", GST_FORMAT_TIME,
+			nullptr
+		);
+
+		GstAppSrcCallbacks callbacks = GstAppSrcCallbacks();
+		callbacks.need_data = clip_need_data;
+		gst_app_src_set_callbacks(
+			GST_APP_SRC(appsrc),
+			&callbacks,
+			new clip_stream_feed { feed, &p_stream, 0, 0, 0 },
+			[](gpointer p_data) { delete reinterpret_cast < clip_stream_feed* > (p_data); }
+		);
+
+		return appsrc;
+	};
+
+	// The clip is paced to the clock here, since
+	// nothing else in the pipeline would do that
+	auto add_output = [&](GstElement *p_last_element, std::string const &p_name)
+	{
+		GstElement *identity = create_element("identity");
+		g_object_set(G_OBJECT(identity), "sync", TRUE, nullptr);
+		gst_element_link(p_last_element, identity);
+
+		GstPad *srcpad = gst_element_get_static_pad(identity, "src");
+		gst_element_add_pad(bin, gst_ghost_pad_new(p_name.c_str(), srcpad));
+		gst_object_unref(GST_OBJECT(srcpad));
+	};
+
+	for (std::string const &output_name : p_output_names)
+	{
+		if (is_muxed_output_name(output_name))
+		{
+			// Muxing the encoded clip costs next to nothing
+			container_format const *format = find_container_format_by_content_type(container_formats, m_content_type);
+			if ((format == nullptr) || (format->m_muxer == nullptr))
+				throw std::runtime_error("no muxer for content type " + m_content_type + " known");
+
+			GError *gerror = nullptr;
+			GstElement *muxer = gst_parse_launch(format->m_muxer, &gerror);
+			if (muxer == nullptr)
+			{
+				std::string s = std::string("could not create clip muxer: ") + gerror->message;
+				g_clear_error(&gerror);
+				throw std::runtime_error(s);
+			}
+			g_clear_error(&gerror);
+			gst_bin_add(GST_BIN(bin), muxer);
+
+			for (slate_clip::stream const &clip_stream : p_clip->get_streams())
+			{
+				char const *pad_template = (clip_stream.m_name == "video") ? format->m_video_pad_template : format->m_audio_pad_template;
+				GstPad *muxer_sinkpad = gst_element_get_request_pad(muxer, pad_template);
+				if (muxer_sinkpad == nullptr)
+					throw std::runtime_error("could not get " + clip_stream.m_name + " sinkpad from clip muxer");
+
+				GstPad *appsrc_srcpad = gst_element_get_static_pad(add_stream_source(clip_stream), "src");
+				gst_pad_link(appsrc_srcpad, muxer_sinkpad);
+				gst_object_unref(GST_OBJECT(appsrc_srcpad));
+				gst_object_unref(GST_OBJECT(muxer_sinkpad));
+			}
+
+			add_output(muxer, output_name);
+		}
+		else
+			add_output(add_stream_source(*(p_clip->find_stream(output_name))), output_name);
+	}
+
+	bin_guard.dismiss();
+	return bin;
+}
+
+void http_stream_pipeline::show_slate()
+{
+	if (!m_slate || m_slate_active)
+		return;
+
+	std::vector < std::string > output_names;
+	for (auto const &tee : m_tees)
+		output_names.push_back(tee.first);
+
+	try
+	{
+		GstElement *slate_bin = create_clip_bin(m_slate, output_names);
+		m_slate_active = true;
+		switch_to_bin(slate_bin, std::move(output_names), false, true);
+	}
+	catch (std::exception const &p_exc)
+	{
+		m_slate_active = false;
+		std::cerr << "Could not show slate: " << p_exc.what() << "\n";
+		return;
+	}
+
+	++m_num_slate_activations;
+	std::cerr << "Showing slate " << m_slate->get_path() << "\n";
+
+	event_trace *trace = m_event_trace;
+	if (trace != nullptr)
+		trace->record(event_trace::pipelines, m_trace_id, "pipeline", "slate");
+}
+
+void http_stream_pipeline::update_stall_check()
+{
+	bool needed = m_running && m_slate && (m_stall_timeout_ms > 0);
+
+	if (needed && (m_stall_check_source == 0))
+		m_stall_check_source = g_timeout_add(stall_check_interval_ms, stall_check_timeout, this);
+	else if (!needed && (m_stall_check_source != 0))
+	{
+		g_source_remove(m_stall_check_source);
+		m_stall_check_source = 0;
+	}
+}
+
+gboolean http_stream_pipeline::stall_check_timeout(gpointer p_user_data)
+{
+	http_stream_pipeline *self = reinterpret_cast < http_stream_pipeline* > (p_user_data);
+
+	// Sources that are being replaced anyway are left alone
+	if (self->m_slate_active || self->m_source_switch || (self->m_source_bin == nullptr) || (self->m_restart_source_timeout != 0) || !self->m_restart_source)
+		return G_SOURCE_CONTINUE;
+
+	gint64 silence = g_get_monotonic_time() - self->m_last_buffer_time;
+	if (silence > gint64(self->m_stall_timeout_ms) * 1000)
+	{
+		// Whatever the stalled source still
+		// does is of no interest anymore
+		g_object_set_data(G_OBJECT(self->m_source_bin), retired_source_key, GINT_TO_POINTER(1));
+		self->schedule_source_restart("the source stalled");
+	}
+
+	return G_SOURCE_CONTINUE;
+}
+
+http_stream_pipeline::output_branch* http_stream_pipeline::create_branch(std::string const &p_output)
+{
+	// Premium and WebSocket outputs are set up like the output they are
+	// based on. In muxed mode, this includes the muxed outputs themselves,
+	// which get their data straight from their tee.
+	bool premium = (get_output_priority_class(p_output) == priority_class::premium);
+	std::string base_output = premium ? p_output.substr(0, p_output.size() - premium_output_suffix.size()) : p_output;
+	bool websocket = is_websocket_output(base_output);
+	if (websocket)
+		base_output = base_output.substr(websocket_output_prefix.size());
+	bool muxed_stream = m_muxed && is_muxed_output_name(base_output) && (m_tees.find(base_output) != m_tees.end());
+
+	container_format const *format = find_output_format(base_output);
+	if ((format == nullptr) && !muxed_stream)
+		throw std::runtime_error("unknown output \"" + p_output + "\"");
+
+	// Audio-only outputs only get the audio stream,
+	// the others get all elementary streams
+	bool audio_only = g_str_has_prefix(base_output.c_str(), audio_output_prefix.c_str());
+	std::vector < std::string > stream_names;
+	for (auto const &tee : m_tees)
+	{
+		if (muxed_stream ? (tee.first == base_output) : (!audio_only || (tee.first == "audio")))
+			stream_names.push_back(tee.first);
+	}
+
+	std::cerr << "Attaching " << p_output << " output branch\n";
+
+	std::unique_ptr < output_branch > branch(new output_branch(this, p_output));
+
+	GstElement *bin = gst_bin_new(nullptr);
+	auto bin_guard = make_scope_guard([bin]() { gst_object_unref(GST_OBJECT(bin)); });
+
+
+	// Setup the muxer (if any) and the multisocketsink
+
+	branch->m_multisocketsink = create_multisocketsink(branch.get());
+	gst_bin_add(GST_BIN(bin), branch->m_multisocketsink);
+
+	// The same goes for the MPEG-TS outputs in elementary stream
+	// mode. The cache must see the data before it is framed.
+	if ((format != nullptr) && is_ts_content_type(format->m_content_type))
+	{
+		GstPad *multisocketsink_sinkpad = gst_element_get_static_pad(branch->m_multisocketsink, "sink");
+		ts_header_cache::attach(multisocketsink_sinkpad);
+		gst_object_unref(GST_OBJECT(multisocketsink_sinkpad));
+	}
+
+	if (websocket)
+	{
+		GstPad *multisocketsink_sinkpad = gst_element_get_static_pad(branch->m_multisocketsink, "sink");
+		gst_pad_add_probe(
+			multisocketsink_sinkpad,
+			GstPadProbeType(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM),
+			websocket_framing_probe,
+			nullptr,
+			nullptr
+		);
+		gst_object_unref(GST_OBJECT(multisocketsink_sinkpad));
+	}
+
+	GstElement *muxer = nullptr;
+	if ((format != nullptr) && (format->m_muxer != nullptr))
+	{
+		GError *gerror = nullptr;
+		muxer = gst_parse_launch(format->m_muxer, &gerror);
+		if (muxer == nullptr)
+		{
+			std::string s = std::string("could not create muxer: ") + gerror->message;
+			g_clear_error(&gerror);
+			throw std::runtime_error(s);
+		}
+		g_clear_error(&gerror);
+
+		gst_bin_add(GST_BIN(bin), muxer);
+		gst_element_link(muxer, branch->m_multisocketsink);
+	}
+
+
+	// Setup one queue per elementary stream and link it to the
+	// muxer. The queues decouple the muxer from the tees, since
+	// the muxer may block while it waits for data from the other
+	// elementary stream.
+
+	for (std::string const &stream_name : stream_names)
+	{
+		GstElement *queue = gst_element_factory_make("queue", nullptr);
+		gst_bin_add(GST_BIN(bin), queue);
+
+		GstCaps *stream_caps = get_stream_caps(stream_name);
+		auto stream_caps_guard = make_scope_guard([stream_caps]()
+		{
+			if (stream_caps != nullptr)
+				gst_caps_unref(stream_caps);
+		});
+
+		// If the elementary stream's caps are known already (that is,
+		// the pipeline ran before), make sure the format can hold
+		// the stream. Otherwise, linking would fail later with a
+		// not-negotiated error, which would stop the whole pipeline.
+		auto check_caps = [&](GstCaps *p_format_caps)
+		{
+			if ((stream_caps != nullptr) && !gst_caps_can_intersect(stream_caps, p_format_caps))
+				throw std::runtime_error("the " + p_output + " format cannot hold the " + stream_name + " stream");
+		};
+
+		GstPad *queue_srcpad = gst_element_get_static_pad(queue, "src");
+		auto queue_srcpad_guard = make_scope_guard([queue_srcpad]() { gst_object_unref(GST_OBJECT(queue_srcpad)); });
+
+		if (muxer != nullptr)
+		{
+			char const *pad_template = (stream_name == "video") ? format->m_video_pad_template : format->m_audio_pad_template;
+
+			GstPad *muxer_sinkpad = gst_element_get_request_pad(muxer, pad_template);
+			if (muxer_sinkpad == nullptr)
+				throw std::runtime_error("could not get " + stream_name + " sinkpad from " + p_output + " muxer");
+			auto muxer_sinkpad_guard = make_scope_guard([muxer_sinkpad]() { gst_object_unref(GST_OBJECT(muxer_sinkpad)); });
+
+			GstCaps *muxer_caps = gst_pad_query_caps(muxer_sinkpad, nullptr);
+			auto muxer_caps_guard = make_scope_guard([muxer_caps]() { gst_caps_unref(muxer_caps); });
+			check_caps(muxer_caps);
+
+			if (GST_PAD_LINK_FAILED(gst_pad_link(queue_srcpad, muxer_sinkpad)))
+				throw std::runtime_error("could not link " + stream_name + " queue to " + p_output + " muxer");
+		}
+		else if (muxed_stream)
+		{
+			gst_element_link(queue, branch->m_multisocketsink);
+		}
+		else
+		{
+			// Without muxer, the elementary stream goes straight to the
+			// multisocketsink. The capsfilter makes sure that only what
+			// the format can carry is passed on.
+			GstCaps *required_caps = gst_caps_from_string(format->m_required_caps);
+			auto required_caps_guard = make_scope_guard([required_caps]() { gst_caps_unref(required_caps); });
+			check_caps(required_caps);
+
+			GstElement *capsfilter = gst_element_factory_make("capsfilter", nullptr);
+			g_object_set(G_OBJECT(capsfilter), "caps", required_caps, nullptr);
+			gst_bin_add(GST_BIN(bin), capsfilter);
+			gst_element_link_many(queue, capsfilter, branch->m_multisocketsink, nullptr);
+		}
+
+		GstPad *queue_sinkpad = gst_element_get_static_pad(queue, "sink");
+		if (stream_name == "video")
+			gst_pad_add_probe(queue_sinkpad, GST_PAD_PROBE_TYPE_BUFFER, wait_for_keyframe_probe, nullptr, nullptr);
+		gst_element_add_pad(bin, gst_ghost_pad_new(stream_name.c_str(), queue_sinkpad));
+		gst_object_unref(GST_OBJECT(queue_sinkpad));
+	}
+
+
+	// Add the bin to the pipeline and connect it to the tees
+
+	bin_guard.dismiss();
+	gst_bin_add(GST_BIN(m_pipeline), bin);
+	branch->m_bin = bin;
+
+	for (std::string const &stream_name : stream_names)
+	{
+		GstPad *tee_srcpad = gst_element_get_request_pad(m_tees[stream_name], "src_%u");
+		GstPad *bin_sinkpad = gst_element_get_static_pad(bin, stream_name.c_str());
+		gst_pad_link(tee_srcpad, bin_sinkpad);
+		gst_object_unref(GST_OBJECT(bin_sinkpad));
+		branch->m_tee_pads.push_back(tee_srcpad);
+	}
+
+	gst_element_sync_state_with_parent(bin);
+
+	output_branch *branch_ptr = branch.get();
+	m_branches[p_output] = std::move(branch);
+	return branch_ptr;
+}
+
+void http_stream_pipeline::remove_branch(std::unique_ptr < output_branch > p_branch)
+{
+	output_branch &branch = *p_branch;
+
+	std::cerr << "Removing " << branch.m_name << " output branch\n";
+
+	g_signal_handlers_disconnect_by_data(G_OBJECT(branch.m_multisocketsink), &branch);
+
+	// Detach the bin from the tees. Releasing tee request pads
+	// is safe even while data is flowing.
+	for (GstPad *tee_srcpad : branch.m_tee_pads)
+	{
+		GstPad *peer = gst_pad_get_peer(tee_srcpad);
+		if (peer != nullptr)
+		{
+			gst_pad_unlink(tee_srcpad, peer);
+			gst_object_unref(GST_OBJECT(peer));
+		}
+
+		GstElement *tee = gst_pad_get_parent_element(tee_srcpad);
+		gst_element_release_request_pad(tee, tee_srcpad);
+		gst_object_unref(GST_OBJECT(tee));
+	}
+
+	gst_element_set_state(branch.m_bin, GST_STATE_NULL);
+	gst_bin_remove(GST_BIN(m_pipeline), branch.m_bin);
+}
+
+void http_stream_pipeline::clear_all_branches()
+{
+	// Clear all sockets. This will invoke on_client_socket_removed()
+	// for each one of them, which in turn means that all of the
+	// associated GIOStreams will be closed & the client collections
+	// will be emptied. This way, it is ensured that all clients are
+	// disconnected, which is the proper way to let them know that
+	// transmission is over (since the Soup encoding in use is
+	// SOUP_ENCODING_EOF).
+	//
+	// The sinks are collected first, since the "clear" signal
+	// invokes on_client_socket_removed() synchronously, which
+	// locks the client mutex.
+
+	std::vector < GstElement* > multisocketsinks;
+
+	{
+		std::lock_guard < std::mutex > lock(m_client_mutex);
+		for (auto const &branch : m_branches)
+			multisocketsinks.push_back(GST_ELEMENT(gst_object_ref(GST_OBJECT(branch.second->m_multisocketsink))));
+	}
+
+	for (GstElement *multisocketsink : multisocketsinks)
+	{
+		g_signal_emit_by_name(multisocketsink, "clear");
+		gst_object_unref(GST_OBJECT(multisocketsink));
+	}
+}
+
+void http_stream_pipeline::on_client_removed(GstElement *, GObject *, gint p_status, gpointer p_user_data)
+{
+	// This is called with the sink's client lock held,
+	// so nothing but the counting is done here
+	output_branch *branch = reinterpret_cast < output_branch* > (p_user_data);
+	if (p_status == client_status_slow)
+		++(branch->m_pipeline->m_num_evictions[int(get_output_priority_class(branch->m_name))]);
+}
+
+void http_stream_pipeline::on_client_socket_removed(GstElement *p_element, GSocket *p_socket, gpointer p_user_data)
+{
+	output_branch *branch = reinterpret_cast < output_branch* > (p_user_data);
+	http_stream_pipeline *self = branch->m_pipeline;
+
+	// Guard against race conditions, since this callback
+	// is executed in the streaming thread
+	std::lock_guard < std::mutex > lock(self->m_client_mutex);
+
+	std::cerr << "Client with socket " << std::hex << guintptr(p_socket) << std::dec << " got removed from output \"" << branch->m_name << "\"\n";
+
+	// Find the socket in the clients list
+	auto iter = branch->m_clients.find(p_socket);
+	if (iter == branch->m_clients.end())
+	{
+		std::cerr << "Socket is not in list - ignoring\n";
+		return;
+	}
+
+	// Detached clients are handed over to their new owner. All others
+	// are disconnected by closing their GIOStream.
+	auto detached_iter = self->m_detached_clients.find(p_socket);
+	event_trace *trace = self->m_event_trace;
+	if (trace != nullptr)
+	{
+		bool detached = (detached_iter != self->m_detached_clients.end());
+		trace->record(event_trace::connections, event_trace::get_connection_id(p_socket), "connection", detached ? "detached" : "removed", "pipeline", self->m_trace_id);
+	}
+	// Also done if the trace was unset in the meantime
+	branch->m_first_byte_pending.erase(p_socket);
+	branch->m_num_first_byte_pending = branch->m_first_byte_pending.size();
+	if (detached_iter != self->m_detached_clients.end())
+	{
+		struct handover
+		{
+			GIOStream *m_stream;
+			detach_callback m_callback;
+		};
+
+		g_idle_add([](gpointer p_data) -> gboolean
+		{
+			handover *handover_ = reinterpret_cast < handover* > (p_data);
+			handover_->m_callback(handover_->m_stream);
+			delete handover_;
+			return G_SOURCE_REMOVE;
+		}, new handover { iter->second, std::move(detached_iter->second) });
+
+		self->m_detached_clients.erase(detached_iter);
+	}
+	else
+	{
+		g_io_stream_close(iter->second, nullptr, nullptr);
+
+		// The message keeps the socket alive until it is handled
+		gst_element_post_message(
+			p_element,
+			gst_message_new_element(
+				GST_OBJECT(p_element),
+				gst_structure_new("ClientRemoved", "socket", G_TYPE_SOCKET, p_socket, nullptr)
+			)
+		);
+
+		g_object_unref(G_OBJECT(iter->second));
+	}
+
+	// Remove the client from the collection
+	branch->m_clients.erase(iter);
+	--self->m_num_clients;
+
+	// Branches that were created on demand are removed once their
+	// last client is gone. Like with stopping the pipeline below,
+	// this is done in bus_watch().
+	if (branch->m_clients.empty() && (branch->m_bin != nullptr))
+	{
+		gst_element_post_message(
+			p_element,
+			gst_message_new_element(
+				GST_OBJECT(p_element),
+				gst_structure_new("RemoveBranch", "output", G_TYPE_STRING, branch->m_name.c_str(), nullptr)
+			)
+		);
+	}
+
+	// Was this the last client? If so, halt the pipeline
+	// (unless something is holding it).
+	// Don't call play(false) here directly, since setting the
+	// state from within the streaming thread is not possible.
+	// Instead, post a message that is then handled in bus_watch().
+	if ((self->m_num_clients == 0) && (self->m_num_holds == 0))
+	{
+		gst_element_post_message(
+			p_element,
+			gst_message_new_element(GST_OBJECT(p_element), gst_structure_new_empty("StopPipeline"))
+		);
+	}
+}
+
+bool http_stream_pipeline::bus_watch(GstBus *, GstMessage *p_message)
+{
+	switch (GST_MESSAGE_TYPE(p_message))
+	{
+		case GST_MESSAGE_STATE_CHANGED:
+		{
+			// Only consider state change messages coming from
+			// the toplevel element.
+			if (GST_MESSAGE_SRC(p_message) != GST_OBJECT(m_pipeline))
+				break;
+
+			GstState old_gst_state, new_gst_state, pending_gst_state;
+			gst_message_parse_state_changed(p_message, &old_gst_state, &new_gst_state, &pending_gst_state);
+
+			auto get_dot_dump_name = [old_gst_state, new_gst_state, pending_gst_state]() -> std::string
+			{
+				return std::string("statechange-") +
+				       "old-" + gst_element_state_get_name(old_gst_state) + "-" +
+				       "cur-" + gst_element_state_get_name(new_gst_state) + "-" +
+				       "pending-" + gst_element_state_get_name(pending_gst_state);
+			};
+
+			std::cerr << "State change: "
+				<< " old " << gst_element_state_get_name(old_gst_state)
+				<< " new " << gst_element_state_get_name(new_gst_state)
+				<< " pending " << gst_element_state_get_name(pending_gst_state)
+				<< "\n";
+
+			// If the GST_DEBUG_DUMP_DOT_DIR environment variable
+			// is set to a valid path, this creates a .dot dump
+			// of the current pipeline structure. This is useful
+			// for debugging.
+			GST_DEBUG_BIN_TO_DOT_FILE_WITH_TS(GST_BIN(m_pipeline), GST_DEBUG_GRAPH_SHOW_ALL, get_dot_dump_name().c_str());
+
+			// The state names are static strings
+			event_trace *trace = m_event_trace;
+			if (trace != nullptr)
+				trace->record(event_trace::pipelines, m_trace_id, "state", gst_element_state_get_name(new_gst_state));
+
+			break;
+		}
+
+		case GST_MESSAGE_ELEMENT:
+		{
+			// These are sent by on_client_socket_removed(). A client may
+			// have connected (or a hold may have been acquired) between
+			// the moment the message was posted and now, so check again.
+
+			if (gst_message_has_name(p_message, "SourceSwitched"))
+			{
+				finish_source_switch();
+			}
+			else if (gst_message_has_name(p_message, "StopPipeline"))
+			{
+				state_change change = state_change::none;
+
+				{
+					std::lock_guard < std::mutex > lock(m_client_mutex);
+					if ((m_num_clients == 0) && (m_num_holds == 0))
+						change = request_stop();
+				}
+
+				change_state(change);
+			}
+			else if (gst_message_has_name(p_message, "SourceEnded"))
+			{
+				schedule_source_restart("the source ended");
+			}
+			else if (gst_message_has_name(p_message, "ClientRemoved"))
+			{
+				GSocket *socket = G_SOCKET(g_value_get_object(gst_structure_get_value(gst_message_get_structure(p_message), "socket")));
+				if (m_client_removed_callback)
+					m_client_removed_callback(socket);
+			}
+			else if (gst_message_has_name(p_message, "RemoveBranch"))
+			{
+				std::unique_ptr < output_branch > branch;
+
+				{
+					std::lock_guard < std::mutex > lock(m_client_mutex);
+
+					// Branches without their own bin are permanent
+					std::string output = gst_structure_get_string(gst_message_get_structure(p_message), "output");
+					auto branch_iter = m_branches.find(output);
+					if ((branch_iter != m_branches.end()) && branch_iter->second->m_clients.empty() && (branch_iter->second->m_bin != nullptr))
+					{
+						branch = std::move(branch_iter->second);
+						m_branches.erase(branch_iter);
+					}
+				}
+
+				if (branch)
+					remove_branch(std::move(branch));
+			}
+
+			break;
+		}
+
+		case GST_MESSAGE_EOS:
+		{
+			// Stop and tear down pipeline when EOS is reached
+			std::cerr << "EOS received - halting pipeline\n";
+			play(false);
+			clear_all_branches();
+
+			break;
+		}
+
+		case GST_MESSAGE_INFO:
+		case GST_MESSAGE_WARNING:
+		case GST_MESSAGE_ERROR:
+		{
+			// Log the info/warning/error
+
+			GError *gerror = nullptr;
+			gchar *debug_info = nullptr;
+
+			switch (GST_MESSAGE_TYPE(p_message))
+			{
+				case GST_MESSAGE_INFO:
+					gst_message_parse_info(p_message, &gerror, &debug_info);
+					std::cerr << "INFO: ";
+					break;
+
+				case GST_MESSAGE_WARNING:
+					gst_message_parse_warning(p_message, &gerror, &debug_info);
+					std::cerr << "WARNING: ";
+					break;
+
+				case GST_MESSAGE_ERROR:
+					gst_message_parse_error(p_message, &gerror, &debug_info);
+					std::cerr << "ERROR: ";
+					break;
+
+				default:
+					g_assert_not_reached();
+			}
+
+			std::cerr << gerror->message << "; debug info: " << debug_info << "\n";
+
+			g_clear_error(&gerror);
+			g_free(debug_info);
+
+			if (GST_MESSAGE_TYPE(p_message) == GST_MESSAGE_ERROR)
+			{
+				GST_DEBUG_BIN_TO_DOT_FILE_WITH_TS(GST_BIN(m_pipeline), GST_DEBUG_GRAPH_SHOW_ALL, "error");
+
+				// A new source that fails before it is switched to only
+				// cancels the switch, and a source that was switched away
+				// from is not relevant anymore
+				if (m_source_switch && gst_object_has_as_ancestor(GST_MESSAGE_SRC(p_message), GST_OBJECT(m_source_switch->m_new_bin)))
+				{
+					bool pending;
+					{
+						std::lock_guard < std::mutex > lock(m_source_switch->m_mutex);
+						pending = (m_source_switch->m_state == source_switch::pending);
+					}
+
+					if (pending)
+					{
+						abort_source_switch("the new source failed");
+
+						// A restarted source that fails again
+						// (because the remote end is still gone)
+						// is retried until it works
+						if (m_restart_source && ((m_source_bin == nullptr) || m_slate_active))
+							schedule_source_restart("the restarted source failed");
+
+						break;
+					}
+				}
+
+				if (is_inside_retired_source(GST_MESSAGE_SRC(p_message)))
+				{
+					std::cerr << "Ignoring error from a source that is being removed\n";
+					break;
+				}
+
+				if (m_restart_source && (m_source_bin != nullptr) && gst_object_has_as_ancestor(GST_MESSAGE_SRC(p_message), GST_OBJECT(m_source_bin)))
+				{
+					// Further errors of the failed source are of no interest;
+					// it is replaced by the restart
+					g_object_set_data(G_OBJECT(m_source_bin), retired_source_key, GINT_TO_POINTER(1));
+					schedule_source_restart("the source failed");
+					break;
+				}
+
+				// If the error comes from a branch that was created on
+				// demand (for example because the container cannot hold
+				// the elementary streams), only disconnect the clients
+				// of that branch. Its removal then happens as usual.
+				GstElement *failed_multisocketsink = nullptr;
+				{
+					std::lock_guard < std::mutex > lock(m_client_mutex);
+					for (auto const &branch : m_branches)
+					{
+						if ((branch.second->m_bin != nullptr) && gst_object_has_as_ancestor(GST_MESSAGE_SRC(p_message), GST_OBJECT(branch.second->m_bin)))
+						{
+							failed_multisocketsink = GST_ELEMENT(gst_object_ref(GST_OBJECT(branch.second->m_multisocketsink)));
+							break;
+						}
+					}
+				}
+
+				if (failed_multisocketsink != nullptr)
+				{
+					std::cerr << "Disconnecting the clients of the failed output branch\n";
+					g_signal_emit_by_name(failed_multisocketsink, "clear");
+					gst_object_unref(GST_OBJECT(failed_multisocketsink));
+					break;
+				}
+
+				std::cerr << "Stopping pipeline due to error\n";
+
+				// Stop the pipeline just like how
+				// it is done with EOS messages
+				play(false);
+				clear_all_branches();
+			}
+
+			break;
+		}
+
+		case GST_MESSAGE_REQUEST_STATE:
+		{
+			// Some element might have requested a state change.
+			// Follow this request. Since the requested change
+			// is done by a regular gst_element_set_state() call,
+			// the pipeline will eventually produce a statechange
+			// message, which is handled above. So, we do not
+			// have to handle anything about the request here
+			// further once gst_element_set_state() was called.
+
+			GstState requested_state;
+			gst_message_parse_request_state(p_message, &requested_state);
+
+			std::cerr << "State change to " << gst_element_state_get_name(requested_state) << " was requested by " << GST_MESSAGE_SRC_NAME(p_message) << "\n";
+
+			gst_element_set_state(GST_ELEMENT(m_pipeline), requested_state);
+
+			break;
+		}
+
+		case GST_MESSAGE_LATENCY:
+		{
+			std::cerr << "Redistributing latency\n";
+			gst_bin_recalculate_latency(GST_BIN(m_pipeline));
+			break;
+		}
+
+		default:
+			break;
+	}
+
+	return true;
+}
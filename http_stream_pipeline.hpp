@@ -0,0 +1,536 @@
+#ifndef GST_SOUP_SERVER_EXAMPLE_HTTP_STREAM_PIPELINE_HPP
+#define GST_SOUP_SERVER_EXAMPLE_HTTP_STREAM_PIPELINE_HPP
+
+#include <gio/gio.h>
+#include <gst/gst.h>
+#include <string>
+#include <functional>
+#include <map>
+#include <set>
+#include <memory>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include "event_trace.hpp"
+#include "h264_parameter_set_cache.hpp"
+#include "slate_clip.hpp"
+
+
+// Settings of the multisocketsinks that send the data to the clients.
+// Times are in milliseconds. The policies are nicks of the values of the
+// multisocketsink "recover-policy" and "sync-method" properties.
+struct sink_settings
+{
+	gint64 m_units_max_ms, m_units_soft_max_ms;
+	guint64 m_timeout_ms;
+	std::string m_recover_policy, m_sync_method;
+
+	sink_settings();
+
+	// Sets one of the settings by name ("units-max", "units-soft-max",
+	// "timeout", "recover-policy", "sync-method"). Throws an exception
+	// if the name is unknown or the value is invalid.
+	void set(std::string const &p_name, std::string const &p_value);
+
+	void apply(GstElement *p_multisocketsink) const;
+
+	bool operator == (sink_settings const &p_other) const;
+	bool operator != (sink_settings const &p_other) const
+	{
+		return !(*this == p_other);
+	}
+};
+
+
+// Clients of the premium class are served by sinks of their own, with
+// their own sink settings (see http_stream_pipeline).
+enum class priority_class
+{
+	standard,
+	premium
+};
+
+char const * get_priority_class_name(priority_class const p_class);
+
+
+// Returns true for the MPEG-TS content types. "video/mpegts"
+// is not registered, but common besides "video/mp2t".
+bool is_ts_content_type(std::string const &p_content_type);
+
+
+// Runs a launch line and distributes its output to HTTP clients.
+//
+// There are two modes of operation:
+//
+// In muxed mode, the launch line contains an element called "stream",
+// which produces the final byte stream (typically a muxer). Its output
+// is sent to all clients as-is, with the content type given to the
+// constructor. This output is called "stream". The launch line may
+// produce several muxed streams from one shared capture (for example in
+// different resolutions), in elements called "stream_<NAME>". These are
+// outputs of their own, which are set up on demand, like the containers
+// in elementary stream mode, and removed again once their last client
+// leaves. If there is no "stream" element, the first of them (in
+// alphabetical order) takes its place as the primary output.
+//
+// In elementary stream mode, the launch line contains elements called
+// "video" and/or "audio" instead, which produce encoded elementary
+// streams. For each container format that clients ask for, a muxer and
+// a multisocketsink are attached on demand, and removed again once the
+// last client of that container leaves. This way, the encoding is never
+// duplicated. The outputs are named after the container formats ("ts",
+// "mkv", "webm", "mp4").
+//
+// In both modes, the encoded audio (the output of the "audio" element)
+// is also available in audio-only outputs, which are set up on demand
+// just like the containers in elementary stream mode. These are called
+// "audio.<format>", where format is one of "aac", "mp3" (both sent
+// without muxer), "ogg", "mka", and "ts".
+//
+// Every output also has a premium variant, which carries the same data,
+// but has a multisocketsink of its own with its own settings. Clients of
+// different priority classes therefore have separate queue limits and
+// recovery policies, and standard clients that fall behind are dropped
+// according to the standard settings, without affecting premium clients.
+class http_stream_pipeline
+{
+public:
+	explicit http_stream_pipeline(std::string p_content_type, char **pipeline_cmdline_argv, sink_settings p_sink_settings = sink_settings());
+	// Loops the clip instead of running a launch line. This is always in
+	// muxed mode: the clip is muxed with the muxer of the content type,
+	// which must be one of the container formats. Nothing is decoded or
+	// encoded, so the pipeline costs next to no CPU, which is useful for
+	// measuring what serving the clients costs.
+	explicit http_stream_pipeline(std::string p_content_type, std::shared_ptr < slate_clip const > p_loop_clip, sink_settings p_sink_settings = sink_settings());
+	~http_stream_pipeline();
+
+	// Applies the settings to the multisocketsinks of all outputs (or
+	// of all premium variants). Connected clients stay connected.
+	void set_sink_settings(sink_settings const &p_sink_settings);
+	void set_premium_sink_settings(sink_settings const &p_sink_settings);
+
+	void play(bool const p_do_play);
+
+	// Picks the output that serves a request for the given URL path
+	// and Accept header value (which may be null). In elementary stream
+	// mode, a container suffix in the path (like ".mkv") takes precedence
+	// over the Accept header. Paths whose last component is NAME select
+	// the "stream_<NAME>" output if there is one. Otherwise, paths whose
+	// last component is "audio" or "audio.<format>" select the
+	// audio-only outputs. Returns an empty
+	// string if none of the accepted types can be produced.
+	std::string select_output(std::string const &p_path, char const *p_accept_header) const;
+
+	std::string get_content_type(std::string const &p_output) const;
+
+	// Every output has a WebSocket variant, which carries the same data,
+	// but sends each buffer as one binary WebSocket message. The messages
+	// are framed once in the variant's own branch, and the framed buffers
+	// are shared by all of its clients. Its clients must have completed
+	// the WebSocket handshake already. Like with the other outputs, new
+	// clients start at a keyframe.
+	static std::string get_websocket_output(std::string const &p_output);
+	static bool is_websocket_output(std::string const &p_output);
+
+	// Returns the variant of the output for the given priority class
+	// (see above), and the class an output is meant for. The WebSocket
+	// variant of an output has a premium variant as well.
+	static std::string get_priority_output(std::string const &p_output, priority_class const p_class);
+	static priority_class get_output_priority_class(std::string const &p_output);
+
+	// Replaces the launch line's bin with a new one, which must have
+	// the same outputs (that is, the same set of "stream", "stream_<NAME>",
+	// "video", and "audio" elements). Clients stay connected. If p_preroll is true,
+	// the current source keeps running until the new one produced its
+	// first keyframe, and the switch happens at that keyframe. Otherwise,
+	// the current source is removed right away, and the new one takes
+	// over with its first buffer. Timestamps of the new source are
+	// shifted if necessary, so that they continue where the previous
+	// source stopped. Note that in muxed mode, this only works if the
+	// container format allows for concatenation (like MPEG-TS does).
+	// Throws an exception if the new launch line cannot be used; the
+	// current source is not touched then.
+	void switch_source(char **p_argv, bool const p_preroll);
+
+	// If enabled, a source that fails or ends is not followed by stopping
+	// the pipeline and disconnecting the clients. Instead, the source is
+	// recreated from its launch line after a short delay (as if
+	// switch_source() had been called with it), and the clients continue
+	// with its data. This is meant for sources that connect to something
+	// remote, which may go away temporarily.
+	void set_restart_source(bool const p_restart_source);
+
+	unsigned int get_num_source_restarts() const
+	{
+		return m_num_source_restarts;
+	}
+
+	// If a slate is set, it is shown while the source is restarted (see
+	// set_restart_source(), which must be enabled for this). The slate
+	// replaces the failed source right away, and its clip is looped, with
+	// timestamps that continue the stream, until the restarted source
+	// delivers its first keyframe; the switch back happens at that
+	// keyframe. The slate is fed from memory without any encoding. Its
+	// streams must have the same format as the source's (and in muxed
+	// mode, the content type must be one of the container formats), since
+	// the clients receive them in place of the source's.
+	//
+	// A source that delivers no data on the primary output for
+	// p_stall_timeout_ms milliseconds while the pipeline is running is
+	// treated like a failed one; 0 disables this. Throws an exception if
+	// the clip does not have the streams the outputs need. Null removes
+	// the slate (one that is shown stays until the source is back).
+	void set_slate(std::shared_ptr < slate_clip const > p_slate, guint const p_stall_timeout_ms);
+
+	unsigned int get_num_slate_activations() const
+	{
+		return m_num_slate_activations;
+	}
+
+	bool is_showing_slate() const
+	{
+		return m_slate_active;
+	}
+
+	// Returns the element with the given name in the current source (that
+	// is, the bin created from the launch line), or null if there is none.
+	// The element is ref'd.
+	GstElement* find_source_element(std::string const &p_name) const;
+
+	// Returns the number of completed source switches, and the time it
+	// took from the switch_source() call until the first buffer of the
+	// new source was passed on in the last one (in microseconds, or -1
+	// if there was no switch yet).
+	unsigned int get_num_source_switches() const
+	{
+		return m_num_source_switches;
+	}
+
+	gint64 get_last_source_switch_latency() const
+	{
+		return m_last_switch_latency;
+	}
+
+	// Returns the pad that carries the output of the "stream" element,
+	// or of the "video" element in elementary stream mode. This is the
+	// sinkpad of the tee that distributes that output, so it remains
+	// valid when the source is switched. The pad is owned by the
+	// pipeline; it is not ref'd.
+	GstPad* get_stream_pad() const
+	{
+		return m_stream_pad;
+	}
+
+	// True if the launch line has a "stream" element (see above).
+	bool is_muxed() const
+	{
+		return m_muxed;
+	}
+
+	// Connects a bin to the output of the "stream" element, or of the
+	// "video" element in elementary stream mode (that is, to the pad
+	// returned by get_stream_pad()). The bin must have a sinkpad called
+	// "sink". This is for consumers that need their own branch with its
+	// own streaming thread (so the bin should start with a queue). The
+	// bin is added to the pipeline, and stays until
+	// detach_stream_consumer() is called.
+	void attach_stream_consumer(GstElement *p_bin);
+	void detach_stream_consumer(GstElement *p_bin);
+
+	// Returns a new sample with the latest SPS and PPS of an H.264
+	// "video" stream in elementary stream mode, which stream consumers
+	// send ahead of the given sample, their first keyframe (see
+	// h264_parameter_set_cache). Returns null if there are none.
+	// Can be called from any thread.
+	GstSample* create_parameter_set_sample(GstSample *p_keyframe_sample) const;
+
+	// Adds a client to the given output (as returned by select_output()).
+	// If the output does not exist yet, it is created. Clients normally
+	// start with the next keyframe. If p_from_latest_keyframe is true, the
+	// client starts with the most recent keyframe that is still queued in
+	// the sink instead, so it gets data right away. If p_rewind is valid,
+	// the client starts with a keyframe that is at least that far back in
+	// the queued data, but not further back than the resume window (see
+	// set_resume_window()). If there is no such keyframe, it starts with
+	// the next one. This is for clients that resume an earlier connection.
+	void add_client(GIOStream *p_stream, GSocket *p_socket, std::string const &p_output, bool const p_from_latest_keyframe = false, GstClockTime const p_rewind = GST_CLOCK_TIME_NONE);
+
+	// Makes the sinks keep at least this many milliseconds of data queued,
+	// so that resuming clients can start in the past. 0 turns this off.
+	void set_resume_window(guint const p_resume_window_ms);
+
+	// Returns the output the client with the given socket is connected
+	// to, or an empty string if it is not a client of this pipeline.
+	std::string get_client_output(GSocket *p_socket) const;
+
+	// Statistics about the clients of one priority class. Evictions are
+	// clients that were disconnected by their sink because they fell
+	// behind too far (see the units-max and timeout settings). Dropped
+	// buffers are only counted for the clients that are still connected.
+	struct priority_stats
+	{
+		unsigned int m_num_clients;
+		guint64 m_num_evictions;
+		guint64 m_dropped_buffers;
+	};
+
+	priority_stats get_priority_stats(priority_class const p_class) const;
+
+	// Statistics the multisocketsink keeps about a client.
+	struct client_stats
+	{
+		guint64 m_bytes_sent;
+		// Buffers that were dropped because the client fell behind
+		// (see the units-soft-max and recover-policy settings)
+		guint64 m_dropped_buffers;
+	};
+
+	// Returns false if the socket does not belong
+	// to a client of this pipeline.
+	bool get_client_stats(GSocket *p_socket, client_stats &p_stats) const;
+
+	// Removes a client without closing its connection. Once the sink is
+	// done with the socket, the callback is invoked in the mainloop thread
+	// with the client's stream. The callback then owns the stream; it
+	// must add it to some pipeline, or close and unref it. Returns false
+	// if the socket does not belong to a client of this pipeline.
+	typedef std::function < void(GIOStream *p_stream) > detach_callback;
+	bool detach_client(GSocket *p_socket, detach_callback p_callback);
+
+	// Holds keep the pipeline running even if no clients are
+	// connected. This is useful for internal consumers of the
+	// stream output (like the snapshot cache). Each call to
+	// acquire_hold() must be paired with a release_hold() call.
+	// These functions must be called from the mainloop thread.
+	void acquire_hold();
+	void release_hold();
+
+	// Returns true if neither clients nor holds are keeping
+	// the pipeline running, and no stop linger is pending.
+	bool is_idle() const;
+
+	// Hysteresis between starting and stopping the pipeline, so that
+	// clients that connect and go away right again (probes of players
+	// and monitoring tools) do not start the encoder. The first client
+	// starts the pipeline only after the start grace period, and only if
+	// it is still connected then. The last client or hold stops it only
+	// after the stop linger period, and only if no client connected or
+	// hold was acquired in between. Holds always start the pipeline right
+	// away. Times are in milliseconds; 0 disables the respective delay.
+	// Must be called from the mainloop thread.
+	void set_start_stop_delays(guint const p_start_grace_ms, guint const p_stop_linger_ms);
+
+	// Returns how often the pipeline was started, and how often a start
+	// was avoided by the hysteresis (either because the client was gone
+	// before the start grace period ended, or because a client or hold
+	// came back during the stop linger period).
+	unsigned int get_num_starts() const
+	{
+		return m_num_starts;
+	}
+
+	unsigned int get_num_avoided_starts() const
+	{
+		return m_num_avoided_starts;
+	}
+
+	unsigned int get_num_clients() const;
+
+	// The idle callback is invoked in the mainloop thread whenever the
+	// pipeline was stopped because the last client or hold went away.
+	// It must not destroy the http_stream_pipeline instance directly.
+	typedef std::function < void() > idle_callback;
+	void set_idle_callback(idle_callback p_idle_callback);
+
+	// The client removed callback is invoked in the mainloop thread with
+	// the socket of every client that got disconnected (that is, that was
+	// not detached with detach_client()). The socket is closed already.
+	typedef std::function < void(GSocket *p_socket) > client_removed_callback;
+	void set_client_removed_callback(client_removed_callback p_client_removed_callback);
+
+	// Records the lifecycle of the clients (added, first byte sent,
+	// removed) on the connections track of the trace, and the state
+	// changes of the pipeline on the pipelines track. The first byte is
+	// noticed when the next buffer arrives at the client's sink, so it
+	// is recorded up to one buffer late. Clients that were added before
+	// the trace was set are only recorded once they are removed. Null
+	// turns this off.
+	void set_event_trace(event_trace *p_event_trace);
+
+	// The ID of this pipeline on the pipelines track
+	gint64 get_trace_id() const
+	{
+		return m_trace_id;
+	}
+
+
+private:
+	http_stream_pipeline(http_stream_pipeline const &) = delete;
+	http_stream_pipeline& operator = (http_stream_pipeline const &) = delete;
+
+	typedef std::map < GSocket* , GIOStream* > clients;
+
+	// A multisocketsink and the clients connected to it. Branches
+	// that are created on demand live in their own bin, which is
+	// connected to request pads of the output tees.
+	struct output_branch
+	{
+		http_stream_pipeline *m_pipeline;
+		std::string m_name;
+		GstElement *m_bin, *m_multisocketsink;
+		std::vector < GstPad* > m_tee_pads;
+		clients m_clients;
+		// Clients that have not been sent any data yet;
+		// only tracked while an event trace is set
+		std::set < GSocket* > m_first_byte_pending;
+		// The size of m_first_byte_pending, which the sink pad probe
+		// checks for each buffer without locking the client mutex
+		std::atomic < std::size_t > m_num_first_byte_pending;
+
+		output_branch(http_stream_pipeline *p_pipeline, std::string p_name);
+		~output_branch();
+	};
+
+	typedef std::map < std::string, std::unique_ptr < output_branch > > output_branches;
+	typedef std::map < std::string, GstElement* > tees;
+
+	// A source switch that is in progress. It is shared with the pad
+	// probes of the new source, which perform the switch itself in the
+	// new source's streaming thread.
+	struct source_switch
+	{
+		enum state
+		{
+			pending,
+			switched,
+			aborted
+		};
+
+		http_stream_pipeline *m_pipeline;
+		GstElement *m_new_bin, *m_old_bin;
+		bool m_wait_for_keyframe;
+		// True if the new bin shows the slate
+		bool m_slate;
+		gint64 m_request_time, m_switch_time;
+		guint m_timeout_source;
+
+		std::mutex m_mutex;
+		state m_state;
+	};
+
+	// Exactly one of p_argv and p_loop_clip is set
+	http_stream_pipeline(std::string p_content_type, char **p_argv, std::shared_ptr < slate_clip const > p_loop_clip, sink_settings p_sink_settings);
+
+	static GstElement* create_source_bin(char **p_argv, std::vector < std::string > &p_output_names);
+	// Takes over the new bin (see switch_source())
+	void switch_to_bin(GstElement *p_new_bin, std::vector < std::string > p_output_names, bool const p_preroll, bool const p_slate);
+	void detach_source_bin(GstElement *p_source_bin);
+	void remove_source_bin(GstElement *p_source_bin);
+	static GstPadProbeReturn new_source_probe(GstPad *p_pad, GstPadProbeInfo *p_info, gpointer p_user_data);
+	static GstPadProbeReturn track_running_time_probe(GstPad *p_pad, GstPadProbeInfo *p_info, gpointer p_user_data);
+	void perform_source_switch(source_switch &p_switch, GstBuffer *p_first_buffer);
+	void finish_source_switch();
+	void abort_source_switch(char const *p_reason);
+	static GstPadProbeReturn first_byte_probe(GstPad *, GstPadProbeInfo *, gpointer p_user_data);
+	static GstPadProbeReturn source_eos_probe(GstPad *, GstPadProbeInfo *p_info, gpointer p_user_data);
+	void schedule_source_restart(char const *p_reason);
+	void restart_source();
+
+	// Creates a bin that loops the clip, with one ghost pad per output
+	GstElement* create_clip_bin(std::shared_ptr < slate_clip const > const &p_clip, std::vector < std::string > const &p_output_names) const;
+	void show_slate();
+	// Runs the stall check while the pipeline is running
+	// and a slate with a stall timeout is set
+	void update_stall_check();
+	static gboolean stall_check_timeout(gpointer p_user_data);
+
+	std::string select_audio_output(std::string const &p_last_path_component, char const *p_accept_header) const;
+	GstCaps* get_stream_caps(std::string const &p_stream_name) const;
+	static bool tap_audio_stream(GstElement *p_cmdline_bin);
+
+	GstElement* create_multisocketsink(output_branch *p_branch);
+	output_branch* create_branch(std::string const &p_output);
+	// The branch must already be taken out of m_branches. Must be
+	// called with the client mutex unlocked, since the bin's state
+	// is set to NULL, which waits for the sink's streaming thread.
+	void remove_branch(std::unique_ptr < output_branch > p_branch);
+	void clear_all_branches();
+
+	// What request_start() and request_stop() decided to do
+	enum class state_change
+	{
+		none,
+		start,
+		stop,
+		// A pending start was called off, so the pipeline is idle
+		// without having to be stopped
+		idle
+	};
+
+	// Must be called with the client mutex locked. They only decide;
+	// the decision is carried out by change_state() after the mutex
+	// is unlocked, since setting the state waits for the streaming
+	// threads, and these lock the client mutex too.
+	state_change request_start(bool const p_immediately);
+	state_change request_stop();
+	// Also invokes the idle callback if the pipeline became idle
+	void change_state(state_change const p_change);
+	static gboolean start_grace_timeout(gpointer p_user_data);
+	static gboolean stop_linger_timeout(gpointer p_user_data);
+
+	static void on_client_socket_removed(GstElement *p_element, GSocket *p_socket, gpointer p_user_data);
+	static void on_client_removed(GstElement *, GObject *, gint p_status, gpointer p_user_data);
+	bool bus_watch(GstBus *, GstMessage *p_message);
+
+
+	GstElement *m_pipeline;
+	guint m_bus_watch_id;
+	GstElement *m_source_bin;
+	std::string m_primary_output;
+	GstPad *m_stream_pad;
+	std::shared_ptr < h264_parameter_set_cache > m_parameter_set_cache;
+	std::string m_content_type;
+	bool m_muxed;
+	std::string m_default_container;
+	sink_settings m_sink_settings, m_premium_sink_settings;
+	tees m_tees;
+	output_branches m_branches;
+	unsigned int m_num_clients, m_num_holds;
+	std::map < GSocket*, detach_callback > m_detached_clients;
+	mutable std::mutex m_client_mutex;
+	idle_callback m_idle_callback;
+	client_removed_callback m_client_removed_callback;
+	guint m_resume_window_ms;
+	// Read by the streaming threads
+	std::atomic < event_trace* > m_event_trace;
+	gint64 m_trace_id;
+
+	std::vector < std::string > m_source_argv;
+	std::shared_ptr < source_switch > m_source_switch;
+	std::atomic < GstClockTime > m_last_running_time_end;
+	unsigned int m_num_source_switches;
+	gint64 m_last_switch_latency;
+
+	std::atomic < bool > m_restart_source;
+	guint m_restart_source_timeout;
+	unsigned int m_num_source_restarts;
+
+	std::shared_ptr < slate_clip const > m_slate;
+	guint m_stall_timeout_ms;
+	guint m_stall_check_source;
+	// Monotonic time of the last buffer on the primary output
+	std::atomic < gint64 > m_last_buffer_time;
+	bool m_slate_active;
+	unsigned int m_num_slate_activations;
+
+	guint m_start_grace_ms, m_stop_linger_ms;
+	guint m_start_grace_source, m_stop_linger_source;
+	bool m_running;
+	unsigned int m_num_starts, m_num_avoided_starts;
+
+	// Indexed by priority_class
+	std::atomic < guint64 > m_num_evictions[2];
+};
+
+
+#endif
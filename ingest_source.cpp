@@ -0,0 +1,226 @@
+#include <iostream>
+#include <cstdlib>
+#include "http_stream_pipeline.hpp"
+#include "ingest_source.hpp"
+
+
+namespace
+{
+
+
+// The name of the appsrc in the launch line
+char const *ingest_element_name = "ingest";
+
+// Maximum amount of data queued in the appsrc before
+// reading from the sender is paused
+guint64 const max_queued_bytes = 4 * 1024 * 1024;
+
+// How often a paused request checks if it can continue
+guint const unpause_check_interval_ms = 20;
+
+
+} // unnamed namespace end
+
+
+
+
+ingest_source::ingest_source(SoupServer *p_server, http_stream_pipeline &p_pipeline)
+	: m_server(p_server)
+	, m_pipeline(p_pipeline)
+	, m_msg(nullptr)
+	, m_appsrc(nullptr)
+	, m_discont(false)
+	, m_last_chunk_time(0)
+	, m_last_chunk_interval(0)
+	, m_pause_start_time(0)
+	, m_unpause_source(0)
+{
+	m_stats.m_connected = false;
+	m_stats.m_num_connections = 0;
+	m_stats.m_bytes_received = 0;
+	m_stats.m_num_chunks = 0;
+	m_stats.m_jitter = 0;
+	m_stats.m_num_pauses = 0;
+	m_stats.m_paused_time = 0;
+	m_stats.m_queued_bytes = 0;
+}
+
+
+ingest_source::~ingest_source()
+{
+	end(false);
+}
+
+
+bool ingest_source::begin(SoupMessage *p_msg)
+{
+	if (m_msg != nullptr)
+		return false;
+
+	GstElement *appsrc = m_pipeline.find_source_element(ingest_element_name);
+	if (appsrc == nullptr)
+		return false;
+
+	m_appsrc = GST_APP_SRC(appsrc);
+	m_msg = p_msg;
+
+	// The data arrives as it is produced, so let the appsrc
+	// timestamp it with the running time of its arrival
+	g_object_set(
+		G_OBJECT(m_appsrc),
+		"is-live", TRUE,
+		"do-timestamp", TRUE,
+		"format", GST_FORMAT_TIME,
+		"max-bytes", max_queued_bytes,
+		nullptr
+	);
+
+	// Hand the chunks to the pipeline as they arrive
+	// instead of collecting the entire body first
+	soup_message_body_set_accumulate(p_msg->request_body, FALSE);
+	g_signal_connect(G_OBJECT(p_msg), "got-chunk", G_CALLBACK(on_got_chunk), this);
+	g_signal_connect(G_OBJECT(p_msg), "finished", G_CALLBACK(on_finished), this);
+
+	m_discont = (m_stats.m_num_connections > 0);
+	m_last_chunk_time = 0;
+	m_last_chunk_interval = 0;
+
+	m_stats.m_connected = true;
+	++m_stats.m_num_connections;
+
+	m_pipeline.acquire_hold();
+
+	std::cerr << "Ingest request started\n";
+
+	return true;
+}
+
+
+ingest_source::stats ingest_source::get_stats() const
+{
+	stats current_stats = m_stats;
+	current_stats.m_queued_bytes = (m_appsrc != nullptr) ? gst_app_src_get_current_level_bytes(m_appsrc) : 0;
+	if (m_pause_start_time != 0)
+		current_stats.m_paused_time += g_get_monotonic_time() - m_pause_start_time;
+	return current_stats;
+}
+
+
+void ingest_source::on_got_chunk(SoupMessage *, SoupBuffer *p_chunk, gpointer p_user_data)
+{
+	ingest_source *self = reinterpret_cast < ingest_source* > (p_user_data);
+	self->push_chunk(p_chunk);
+}
+
+
+void ingest_source::on_finished(SoupMessage *, gpointer p_user_data)
+{
+	ingest_source *self = reinterpret_cast < ingest_source* > (p_user_data);
+	std::cerr << "Ingest request finished\n";
+	self->end(true);
+}
+
+
+void ingest_source::push_chunk(SoupBuffer *p_chunk)
+{
+	if (p_chunk->length == 0)
+		return;
+
+	gint64 now = g_get_monotonic_time();
+	if (m_last_chunk_time != 0)
+	{
+		gint64 interval = now - m_last_chunk_time;
+		if (m_last_chunk_interval != 0)
+			m_stats.m_jitter += (std::llabs(interval - m_last_chunk_interval) - m_stats.m_jitter) / 16;
+		m_last_chunk_interval = interval;
+	}
+	m_last_chunk_time = now;
+
+	m_stats.m_bytes_received += p_chunk->length;
+	++m_stats.m_num_chunks;
+
+	// The chunk is only valid during the signal emission, so
+	// the buffer wraps a copy (which usually is just a ref)
+	SoupBuffer *chunk_copy = soup_buffer_copy(p_chunk);
+	GstBuffer *buffer = gst_buffer_new_wrapped_full(
+		GST_MEMORY_FLAG_READONLY,
+		gpointer(chunk_copy->data), chunk_copy->length,
+		0, chunk_copy->length,
+		chunk_copy, GDestroyNotify(soup_buffer_free)
+	);
+
+	if (m_discont)
+	{
+		GST_BUFFER_FLAG_SET(buffer, GST_BUFFER_FLAG_DISCONT);
+		m_discont = false;
+	}
+
+	GstFlowReturn flow_ret = gst_app_src_push_buffer(m_appsrc, buffer);
+	if (flow_ret != GST_FLOW_OK)
+		std::cerr << "Could not push ingested data: " << gst_flow_get_name(flow_ret) << "\n";
+
+	if (gst_app_src_get_current_level_bytes(m_appsrc) >= max_queued_bytes)
+		pause();
+}
+
+
+void ingest_source::pause()
+{
+	if (m_unpause_source != 0)
+		return;
+
+	soup_server_pause_message(m_server, m_msg);
+	m_pause_start_time = g_get_monotonic_time();
+	++m_stats.m_num_pauses;
+
+	m_unpause_source = g_timeout_add(unpause_check_interval_ms, [](gpointer p_user_data) -> gboolean
+	{
+		ingest_source *self = reinterpret_cast < ingest_source* > (p_user_data);
+		return self->try_unpause() ? G_SOURCE_REMOVE : G_SOURCE_CONTINUE;
+	}, this);
+}
+
+
+bool ingest_source::try_unpause()
+{
+	if (gst_app_src_get_current_level_bytes(m_appsrc) > (max_queued_bytes / 2))
+		return false;
+
+	m_unpause_source = 0;
+	m_stats.m_paused_time += g_get_monotonic_time() - m_pause_start_time;
+	m_pause_start_time = 0;
+
+	soup_server_unpause_message(m_server, m_msg);
+
+	return true;
+}
+
+
+void ingest_source::end(bool const p_request_finished)
+{
+	if (m_msg == nullptr)
+		return;
+
+	g_signal_handlers_disconnect_by_data(G_OBJECT(m_msg), this);
+
+	// If the request is still going on (because the ingest source is
+	// being destroyed), the rest of its body is just discarded
+	if (m_unpause_source != 0)
+	{
+		g_source_remove(m_unpause_source);
+		m_unpause_source = 0;
+		m_stats.m_paused_time += g_get_monotonic_time() - m_pause_start_time;
+		m_pause_start_time = 0;
+		if (!p_request_finished)
+			soup_server_unpause_message(m_server, m_msg);
+	}
+
+	m_msg = nullptr;
+
+	gst_object_unref(GST_OBJECT(m_appsrc));
+	m_appsrc = nullptr;
+
+	m_stats.m_connected = false;
+
+	m_pipeline.release_hold();
+}
@@ -0,0 +1,94 @@
+#ifndef GST_SOUP_SERVER_EXAMPLE_INGEST_SOURCE_HPP
+#define GST_SOUP_SERVER_EXAMPLE_INGEST_SOURCE_HPP
+
+#include <glib.h>
+#include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
+#include <libsoup/soup.h>
+
+
+class http_stream_pipeline;
+
+
+// Feeds the body of a PUT or POST request into the appsrc called
+// "ingest" in the launch line of a http_stream_pipeline, while the
+// request is still coming in. This way, remote encoders can push a
+// stream to the server over HTTP (typically with chunked transfer
+// encoding), and the pipeline fans it out to the clients as usual.
+//
+// Only one request is ingested at a time. While it is, a hold keeps the
+// pipeline running. When the request ends, the clients stay connected;
+// the next request continues the stream (its first buffer is marked as
+// a discontinuity). The appsrc is configured as a live source that
+// timestamps the incoming data.
+//
+// If the appsrc's queue is full, reading the request is paused until the
+// queue is half empty again, so the sender is slowed down by TCP flow
+// control instead of the server buffering an unbounded amount of data.
+//
+// All functions must be called from the mainloop thread.
+class ingest_source
+{
+public:
+	struct stats
+	{
+		bool m_connected;
+		guint64 m_num_connections;
+		guint64 m_bytes_received, m_num_chunks;
+
+		// Smoothed variation of the time between incoming chunks
+		// (computed like the RTP interarrival jitter), in microseconds
+		gint64 m_jitter;
+
+		// How often and how long reading had to be paused
+		// because the pipeline did not keep up
+		guint64 m_num_pauses;
+		gint64 m_paused_time;
+
+		guint64 m_queued_bytes;
+	};
+
+	explicit ingest_source(SoupServer *p_server, http_stream_pipeline &p_pipeline);
+	~ingest_source();
+
+	// Starts ingesting the request body of the given message. Must be
+	// called from the message's "got-headers" signal. Returns false if
+	// another request is being ingested already, or if the pipeline has
+	// no "ingest" appsrc.
+	bool begin(SoupMessage *p_msg);
+
+	bool is_ingesting(SoupMessage *p_msg) const
+	{
+		return (m_msg != nullptr) && (m_msg == p_msg);
+	}
+
+	stats get_stats() const;
+
+
+private:
+	ingest_source(ingest_source const &) = delete;
+	ingest_source& operator = (ingest_source const &) = delete;
+
+	static void on_got_chunk(SoupMessage *, SoupBuffer *p_chunk, gpointer p_user_data);
+	static void on_finished(SoupMessage *, gpointer p_user_data);
+	void push_chunk(SoupBuffer *p_chunk);
+	void pause();
+	bool try_unpause();
+	void end(bool const p_request_finished);
+
+
+	SoupServer *m_server;
+	http_stream_pipeline &m_pipeline;
+
+	SoupMessage *m_msg;
+	GstAppSrc *m_appsrc;
+	bool m_discont;
+	gint64 m_last_chunk_time, m_last_chunk_interval;
+	gint64 m_pause_start_time;
+	guint m_unpause_source;
+
+	stats m_stats;
+};
+
+
+#endif
@@ -0,0 +1,1231 @@
+#include <iostream>
+#include <stdexcept>
+#include <algorithm>
+#include "mount_table.hpp"
+#include "sibling_balancer.hpp"
+#include "scope_guard.hpp"
+
+
+namespace
+{
+
+
+// Keeps the pool and the pipeline instance referenced until
+// the request either added its client or was abandoned
+struct request_context
+{
+	SoupClientContext *m_client;
+	std::shared_ptr < pipeline_pool > m_pool;
+	http_stream_pipeline *m_pipeline;
+	std::string m_output;
+	bool m_from_latest_keyframe;
+	// Valid if the client resumes an earlier session
+	GstClockTime m_rewind;
+
+	// Used for registering the session once the socket is known
+	session_table *m_sessions;
+	std::string m_session_token, m_mount_name, m_path, m_accept_header;
+
+	// Null if tracing is off
+	event_trace *m_event_trace;
+
+	~request_context()
+	{
+		m_pool->release(*m_pipeline);
+	}
+};
+
+
+// Keeps a pipeline instance referenced while a zapped
+// client is on its way from its previous pipeline
+struct pipeline_reference
+{
+	std::shared_ptr < pipeline_pool > m_pool;
+	http_stream_pipeline *m_pipeline;
+
+	~pipeline_reference()
+	{
+		if (m_pipeline != nullptr)
+			m_pool->release(*m_pipeline);
+	}
+};
+
+
+std::string const zap_path = "/zap";
+
+
+// Request header with which relays ask for the latest queued keyframe
+// instead of the next one, to get data right away (see mount_table)
+char const *stream_start_header = "X-Stream-Start";
+char const *stream_start_latest_keyframe = "latest-keyframe";
+
+
+// shmsink's default, which leaves room for a few seconds of
+// high-bitrate video; the shared memory area is fixed in size
+guint64 const shm_default_size = 64 * 1024 * 1024;
+guint64 const shm_max_size_mb = 4095;
+
+
+// Used in place of the Accept header for WebSocket requests
+// (see mount_table::http_request_handler())
+char const *websocket_accept_header = "video/mp4";
+
+
+// User-Agent prefixes of health checkers that request the stream only
+// to look at the status code (Kubernetes, AWS and Google Cloud load
+// balancers, Consul, and the Prometheus blackbox exporter)
+char const *probe_user_agents[] = {
+	"kube-probe/",
+	"ELB-HealthChecker/",
+	"GoogleHC/",
+	"Consul Health Check",
+	"Blackbox Exporter/"
+};
+
+
+// Both delays are off unless configured, so pipelines start and stop
+// exactly when their clients come and go. A short start grace period
+// (like 250 ms) is enough for probes that only fetch the headers, and a
+// linger of a few seconds covers players that probe the stream and
+// reconnect for playback right after.
+guint const default_start_grace_ms = 0;
+guint const default_stop_linger_ms = 0;
+
+
+// Request header with which clients that lost their connection ask to
+// resume the session with the given token (see mount_table). Resuming
+// is off unless a window is configured, since the sinks then keep the
+// window's worth of data queued for each output. Most reconnects happen
+// within a few seconds, so a window like 5000 ms covers them.
+char const *resume_session_header = "X-Resume-Session";
+guint const default_resume_window_ms = 0;
+
+
+// Live sources normally deliver data at least once per second
+guint const default_slate_stall_ms = 3000;
+
+
+// Twice to three times the sink_settings defaults
+gint64 const premium_default_units_max_ms = 15000;
+gint64 const premium_default_units_soft_max_ms = 7000;
+guint64 const premium_default_timeout_ms = 30000;
+
+std::string const premium_sink_settings_prefix = "premium-";
+
+
+bool parameters_equal(pipeline_pool::parameter const &p_first, pipeline_pool::parameter const &p_second)
+{
+	return (p_first.m_name == p_second.m_name)
+	    && (p_first.m_min == p_second.m_min)
+	    && (p_first.m_max == p_second.m_max)
+	    && (p_first.m_default == p_second.m_default);
+}
+
+
+} // unnamed namespace end
+
+
+
+
+mount_config::mount_config()
+	: m_max_idle_instances(4)
+	, m_max_memory(0)
+	, m_priority(priority_class::standard)
+	, m_ingest(false)
+	, m_rtp_ttl(1)
+	, m_webrtc(false)
+	, m_shm_size(shm_default_size)
+	, m_start_grace_ms(default_start_grace_ms)
+	, m_stop_linger_ms(default_stop_linger_ms)
+	, m_resume_window_ms(default_resume_window_ms)
+	, m_slate_stall_ms(default_slate_stall_ms)
+{
+	// Premium clients may fall behind further before they are dropped
+	m_premium_sink_settings.m_units_max_ms = premium_default_units_max_ms;
+	m_premium_sink_settings.m_units_soft_max_ms = premium_default_units_soft_max_ms;
+	m_premium_sink_settings.m_timeout_ms = premium_default_timeout_ms;
+}
+
+
+void mount_config::set(std::string const &p_name, std::string const &p_value)
+{
+	if (p_name == "content-type")
+	{
+		m_content_type = p_value;
+	}
+	else if (p_name == "launch")
+	{
+		GError *gerror = nullptr;
+		gchar **argv = nullptr;
+		if (!g_shell_parse_argv(p_value.c_str(), nullptr, &argv, &gerror))
+		{
+			std::string s = std::string("invalid launch line: ") + gerror->message;
+			g_clear_error(&gerror);
+			throw std::runtime_error(s);
+		}
+
+		m_launch.assign(argv, argv + g_strv_length(argv));
+		g_strfreev(argv);
+	}
+	else if (p_name == "param")
+	{
+		m_parameters.clear();
+
+		gchar **declarations = g_strsplit(p_value.c_str(), ";", 0);
+		auto declarations_guard = make_scope_guard([declarations]() { g_strfreev(declarations); });
+
+		for (gchar **declaration = declarations; *declaration != nullptr; ++declaration)
+		{
+			std::string stripped = g_strstrip(*declaration);
+			if (!stripped.empty())
+				m_parameters.push_back(pipeline_pool::parse_parameter(stripped));
+		}
+	}
+	else if (p_name == "ingest")
+	{
+		if (p_value == "true")
+			m_ingest = true;
+		else if (p_value == "false")
+			m_ingest = false;
+		else
+			throw std::runtime_error("invalid ingest value \"" + p_value + "\" (expected true or false)");
+	}
+	else if (p_name == "relay")
+	{
+		m_relay_url = p_value;
+	}
+	else if (p_name == "loop")
+	{
+		m_loop_path = p_value;
+	}
+	else if (p_name == "rtp")
+	{
+		if (!p_value.empty())
+		{
+			std::string host;
+			guint port;
+			rtp_output::parse_destination(p_value, host, port);
+		}
+
+		m_rtp_destination = p_value;
+	}
+	else if (p_name == "rtp-ttl")
+	{
+		char *end = nullptr;
+		guint64 value = g_ascii_strtoull(p_value.c_str(), &end, 10);
+		if (p_value.empty() || (*end != '\0') || (value > 255))
+			throw std::runtime_error("invalid rtp-ttl \"" + p_value + "\"");
+
+		m_rtp_ttl = guint(value);
+	}
+	else if (p_name == "webrtc")
+	{
+		if (p_value == "true")
+			m_webrtc = true;
+		else if (p_value == "false")
+			m_webrtc = false;
+		else
+			throw std::runtime_error("invalid webrtc value \"" + p_value + "\" (expected true or false)");
+	}
+	else if (p_name == "unix")
+	{
+		m_unix_socket_path = p_value;
+	}
+	else if (p_name == "shm")
+	{
+		m_shm_socket_path = p_value;
+	}
+	else if (p_name == "shm-size")
+	{
+		char *end = nullptr;
+		guint64 value = g_ascii_strtoull(p_value.c_str(), &end, 10);
+		if (p_value.empty() || (*end != '\0') || (value == 0) || (value > shm_max_size_mb))
+			throw std::runtime_error("invalid shm-size \"" + p_value + "\"");
+
+		m_shm_size = value * 1024 * 1024;
+	}
+	else if (p_name == "slate")
+	{
+		m_slate_path = p_value;
+	}
+	else if ((p_name == "start-grace") || (p_name == "stop-linger") || (p_name == "resume-window") || (p_name == "slate-stall"))
+	{
+		char *end = nullptr;
+		guint64 value = g_ascii_strtoull(p_value.c_str(), &end, 10);
+		if (p_value.empty() || (*end != '\0') || (p_value[0] == '-') || (value > G_MAXUINT))
+			throw std::runtime_error("invalid " + p_name + " \"" + p_value + "\"");
+
+		if (p_name == "start-grace")
+			m_start_grace_ms = guint(value);
+		else if (p_name == "stop-linger")
+			m_stop_linger_ms = guint(value);
+		else if (p_name == "resume-window")
+			m_resume_window_ms = guint(value);
+		else
+			m_slate_stall_ms = guint(value);
+	}
+	else if (p_name == "priority")
+	{
+		if (p_value == "standard")
+			m_priority = priority_class::standard;
+		else if (p_value == "premium")
+			m_priority = priority_class::premium;
+		else
+			throw std::runtime_error("invalid priority \"" + p_value + "\" (expected standard or premium)");
+	}
+	else if (g_str_has_prefix(p_name.c_str(), premium_sink_settings_prefix.c_str()))
+	{
+		m_premium_sink_settings.set(p_name.substr(premium_sink_settings_prefix.size()), p_value);
+	}
+	else if (p_name == "adapt-param")
+	{
+		m_adapt_parameter = p_value;
+	}
+	else if (p_name == "adapt-ladder")
+	{
+		m_adapt_ladder.clear();
+
+		gchar **values = g_strsplit(p_value.c_str(), ";", 0);
+		auto values_guard = make_scope_guard([values]() { g_strfreev(values); });
+
+		for (gchar **value = values; *value != nullptr; ++value)
+		{
+			std::string stripped = g_strstrip(*value);
+			if (stripped.empty())
+				continue;
+
+			char *end = nullptr;
+			gint64 number = g_ascii_strtoll(stripped.c_str(), &end, 10);
+			if (*end != '\0')
+				throw std::runtime_error("invalid adapt-ladder value \"" + stripped + "\"");
+
+			m_adapt_ladder.push_back(number);
+		}
+	}
+	else if ((p_name == "pool-max-idle") || (p_name == "pool-max-memory"))
+	{
+		char *end = nullptr;
+		guint64 value = g_ascii_strtoull(p_value.c_str(), &end, 10);
+		if (p_value.empty() || (*end != '\0') || (p_value[0] == '-'))
+			throw std::runtime_error("invalid " + p_name + " \"" + p_value + "\"");
+
+		if (p_name == "pool-max-idle")
+			m_max_idle_instances = std::min < guint64 > (value, G_MAXUINT);
+		else
+			m_max_memory = value * 1024 * 1024;
+	}
+	else
+	{
+		m_sink_settings.set(p_name, p_value);
+	}
+}
+
+
+std::vector < std::string > mount_config::get_launch() const
+{
+	if (m_relay_url.empty())
+		return m_launch;
+
+	// The relayed stream is passed on as-is. souphttpsrc does not
+	// timestamp its data, so tsparse sets timestamps from the PCRs,
+	// which the sinks (and source restarts) depend on. It also
+	// aligns the buffers to whole packets. Parameter placeholders
+	// in the URL are substituted like in any other launch line.
+	return std::vector < std::string > {
+		"souphttpsrc", "name=relay",
+		"location=" + m_relay_url,
+		"is-live=true",
+		"extra-headers=headers," + std::string(stream_start_header) + "=(string)" + stream_start_latest_keyframe,
+		"!", "tsparse", "set-timestamps=true", "alignment=7",
+		"!", "queue", "name=stream"
+	};
+}
+
+
+void mount_config::validate() const
+{
+	if (m_content_type.empty())
+		throw std::runtime_error("no content-type set");
+	int num_sources = int(!m_launch.empty()) + int(!m_relay_url.empty()) + int(!m_loop_path.empty());
+	if (num_sources == 0)
+		throw std::runtime_error("no launch line, relay URL, or loop clip set");
+	if (num_sources > 1)
+		throw std::runtime_error("only one of launch line, relay URL, and loop clip can be used");
+	if (m_ingest && !m_relay_url.empty())
+		throw std::runtime_error("relay mounts cannot have ingest");
+	// The relayed stream is timestamped by tsparse (see get_launch())
+	if (!m_relay_url.empty() && !is_ts_content_type(m_content_type))
+		throw std::runtime_error("relay mounts need an MPEG-TS stream (content-type video/mp2t or video/mpegts)");
+	// A loop clip neither fails nor takes any parameters
+	if (!m_loop_path.empty() && (m_ingest || !m_slate_path.empty() || !m_parameters.empty()))
+		throw std::runtime_error("loop mounts cannot have ingest, a slate, or parameters");
+	// The pushed stream cannot be restarted by the server
+	if (m_ingest && !m_slate_path.empty())
+		throw std::runtime_error("mounts with ingest cannot have a slate");
+
+	// RTP is sent with rtpmp2tpay
+	if (!m_rtp_destination.empty() && !is_ts_content_type(m_content_type))
+		throw std::runtime_error("RTP output needs an MPEG-TS stream (content-type video/mp2t or video/mpegts)");
+
+	if (!m_unix_socket_path.empty() && (m_unix_socket_path == m_shm_socket_path))
+		throw std::runtime_error("unix and shm cannot use the same path");
+
+	// All requests share the one pipeline that the stream is pushed into
+	if (m_ingest && !m_parameters.empty())
+		throw std::runtime_error("mounts with ingest cannot have parameters");
+
+	if (!m_adapt_parameter.empty())
+	{
+		auto param_iter = std::find_if(m_parameters.begin(), m_parameters.end(), [this](pipeline_pool::parameter const &p_param) { return p_param.m_name == m_adapt_parameter; });
+		if (param_iter == m_parameters.end())
+			throw std::runtime_error("adapt-param \"" + m_adapt_parameter + "\" is not a declared parameter");
+		if (m_adapt_ladder.size() < 2)
+			throw std::runtime_error("adapt-ladder needs at least two values");
+
+		for (gint64 value : m_adapt_ladder)
+		{
+			if ((value < param_iter->m_min) || (value > param_iter->m_max))
+				throw std::runtime_error("adapt-ladder value " + std::to_string(value) + " is out of the range of parameter \"" + m_adapt_parameter + "\"");
+		}
+	}
+}
+
+
+bool mount_config::has_same_pipelines(mount_config const &p_other) const
+{
+	return (m_content_type == p_other.m_content_type)
+	    && (m_launch == p_other.m_launch)
+	    && (m_relay_url == p_other.m_relay_url)
+	    && (m_loop_path == p_other.m_loop_path)
+	    && (m_rtp_destination == p_other.m_rtp_destination)
+	    && (m_rtp_ttl == p_other.m_rtp_ttl)
+	    && (m_webrtc == p_other.m_webrtc)
+	    && (m_unix_socket_path == p_other.m_unix_socket_path)
+	    && (m_shm_socket_path == p_other.m_shm_socket_path)
+	    && (m_shm_size == p_other.m_shm_size)
+	    && (m_slate_path == p_other.m_slate_path)
+	    && (m_slate_stall_ms == p_other.m_slate_stall_ms)
+	    && (m_parameters.size() == p_other.m_parameters.size())
+	    && std::equal(m_parameters.begin(), m_parameters.end(), p_other.m_parameters.begin(), parameters_equal)
+	    && (m_ingest == p_other.m_ingest);
+}
+
+
+char const * get_mount_origin_name(mount_origin const p_origin)
+{
+	switch (p_origin)
+	{
+		case mount_origin::command_line: return "command-line";
+		case mount_origin::config_file: return "config-file";
+		case mount_origin::control_api: return "control-api";
+		default: return "<unknown>";
+	}
+}
+
+
+
+
+mount_table::mount_table(SoupServer *p_server, GstClockTime const p_snapshot_ttl)
+	: m_server(p_server)
+	, m_snapshot_ttl(p_snapshot_ttl)
+	, m_rtsp_server(nullptr)
+	, m_connection_limiter(nullptr)
+	, m_event_trace(nullptr)
+{
+	soup_server_add_handler(m_server, zap_path.c_str(), zap_request_handler, this, nullptr);
+
+	// Ingest requests have to be intercepted before their body is read
+	m_request_started_handler = g_signal_connect(G_OBJECT(m_server), "request-started", G_CALLBACK(on_request_started), this);
+}
+
+
+mount_table::~mount_table()
+{
+	g_signal_handler_disconnect(G_OBJECT(m_server), m_request_started_handler);
+	soup_server_remove_handler(m_server, zap_path.c_str());
+
+	for (auto &entry : m_mounts)
+		remove_handlers(entry.second.get());
+}
+
+
+void mount_table::validate_name(std::string const &p_name)
+{
+	bool valid = !p_name.empty() && std::all_of(p_name.begin(), p_name.end(), [](char const p_char)
+	{
+		return g_ascii_isalnum(p_char) || (p_char == '-') || (p_char == '_');
+	});
+
+	// "snapshot" and "webrtc" would be shadowed by the snapshot
+	// and WebRTC handlers of the mount that is served under "/",
+	// "zap" by the zap handler, and "load" by the sibling_balancer
+	if (!valid || (p_name == "snapshot") || (p_name == "webrtc") || (get_path(p_name) == zap_path) || (get_path(p_name) == sibling_balancer::load_path))
+		throw std::runtime_error("invalid mount name \"" + p_name + "\"");
+}
+
+
+std::string mount_table::get_path(std::string const &p_name)
+{
+	return "/" + p_name;
+}
+
+
+bool mount_table::set_mount(std::string const &p_name, mount_config p_config, mount_origin const p_origin)
+{
+	p_config.validate();
+
+	auto mount_iter = m_mounts.find(p_name);
+	if (mount_iter != m_mounts.end())
+	{
+		mount *existing_mount = mount_iter->second.get();
+
+		if (existing_mount->m_config.has_same_pipelines(p_config))
+		{
+			std::cerr << "Reconfiguring mount \"" << p_name << "\" without restarting it\n";
+
+			existing_mount->m_pool->set_limits(p_config.m_max_idle_instances, p_config.m_max_memory);
+			if (existing_mount->m_config.m_sink_settings != p_config.m_sink_settings)
+				existing_mount->m_pool->set_sink_settings(p_config.m_sink_settings);
+			if (existing_mount->m_config.m_premium_sink_settings != p_config.m_premium_sink_settings)
+				existing_mount->m_pool->set_premium_sink_settings(p_config.m_premium_sink_settings);
+			existing_mount->m_pool->set_start_stop_delays(p_config.m_start_grace_ms, p_config.m_stop_linger_ms);
+			existing_mount->m_pool->set_resume_window(p_config.m_resume_window_ms);
+
+			existing_mount->m_config = std::move(p_config);
+			existing_mount->m_origin = p_origin;
+
+			return false;
+		}
+
+		// Create the replacement first, so that the old mount
+		// stays intact if the new configuration does not work
+		// (except for its local outputs, which are set up again)
+		std::cerr << "Recreating mount \"" << p_name << "\"\n";
+		existing_mount->m_unix_socket.reset();
+		existing_mount->m_shm.reset();
+
+		std::unique_ptr < mount > new_mount;
+		try
+		{
+			new_mount = create_mount(p_name, std::move(p_config), p_origin);
+		}
+		catch (...)
+		{
+			try
+			{
+				create_local_outputs(*existing_mount, existing_mount->m_config);
+			}
+			catch (std::exception const &p_exc)
+			{
+				std::cerr << "Could not restore local outputs of mount \"" << p_name << "\": " << p_exc.what() << "\n";
+			}
+
+			throw;
+		}
+
+		remove_handlers(existing_mount);
+		mount_iter->second = std::move(new_mount);
+		add_handlers(mount_iter->second.get());
+
+		return false;
+	}
+	else
+	{
+		std::cerr << "Creating mount \"" << p_name << "\"\n";
+		std::unique_ptr < mount > new_mount = create_mount(p_name, std::move(p_config), p_origin);
+
+		mount *new_mount_ptr = new_mount.get();
+		m_mounts[p_name] = std::move(new_mount);
+		add_handlers(new_mount_ptr);
+
+		return true;
+	}
+}
+
+
+bool mount_table::set_sink_settings(std::string const &p_name, sink_settings const &p_sink_settings)
+{
+	auto mount_iter = m_mounts.find(p_name);
+	if (mount_iter == m_mounts.end())
+		return false;
+
+	mount *existing_mount = mount_iter->second.get();
+	existing_mount->m_config.m_sink_settings = p_sink_settings;
+	existing_mount->m_pool->set_sink_settings(p_sink_settings);
+
+	return true;
+}
+
+
+bool mount_table::switch_source(std::string const &p_name, std::vector < std::string > p_launch, bool const p_preroll)
+{
+	auto mount_iter = m_mounts.find(p_name);
+	if (mount_iter == m_mounts.end())
+		return false;
+
+	std::cerr << "Switching source of mount \"" << p_name << "\"\n";
+
+	mount *existing_mount = mount_iter->second.get();
+	if (!existing_mount->m_config.m_relay_url.empty())
+		throw std::runtime_error("the source of a relay mount cannot be switched");
+	if (!existing_mount->m_config.m_loop_path.empty())
+		throw std::runtime_error("the source of a loop mount cannot be switched");
+
+	existing_mount->m_pool->switch_source(p_launch, p_preroll);
+	existing_mount->m_config.m_launch = std::move(p_launch);
+
+	return true;
+}
+
+
+bool mount_table::remove_mount(std::string const &p_name)
+{
+	auto mount_iter = m_mounts.find(p_name);
+	if (mount_iter == m_mounts.end())
+		return false;
+
+	std::cerr << "Removing mount \"" << p_name << "\"\n";
+
+	remove_handlers(mount_iter->second.get());
+	m_mounts.erase(mount_iter);
+	m_sessions.clear_resume_history(p_name);
+
+	return true;
+}
+
+
+void mount_table::sync_config_file_mounts(std::map < std::string, mount_config > const &p_configs)
+{
+	// Remove mounts that are no longer in the configuration file
+	std::vector < std::string > removed_names;
+	for (auto const &entry : m_mounts)
+	{
+		if ((entry.second->m_origin == mount_origin::config_file) && (p_configs.find(entry.first) == p_configs.end()))
+			removed_names.push_back(entry.first);
+	}
+
+	for (std::string const &name : removed_names)
+		remove_mount(name);
+
+	// Add new mounts, and apply changes to existing ones
+	for (auto const &entry : p_configs)
+	{
+		auto mount_iter = m_mounts.find(entry.first);
+		if (mount_iter != m_mounts.end())
+		{
+			mount_config const &current_config = mount_iter->second->m_config;
+			bool unchanged = (mount_iter->second->m_origin == mount_origin::config_file)
+			              && current_config.has_same_pipelines(entry.second)
+			              && (current_config.m_sink_settings == entry.second.m_sink_settings)
+			              && (current_config.m_premium_sink_settings == entry.second.m_premium_sink_settings)
+			              && (current_config.m_priority == entry.second.m_priority)
+			              && (current_config.m_max_idle_instances == entry.second.m_max_idle_instances)
+			              && (current_config.m_max_memory == entry.second.m_max_memory)
+			              && (current_config.m_start_grace_ms == entry.second.m_start_grace_ms)
+			              && (current_config.m_stop_linger_ms == entry.second.m_stop_linger_ms)
+			              && (current_config.m_resume_window_ms == entry.second.m_resume_window_ms)
+			              && (current_config.m_adapt_parameter == entry.second.m_adapt_parameter)
+			              && (current_config.m_adapt_ladder == entry.second.m_adapt_ladder);
+			if (unchanged)
+				continue;
+		}
+
+		try
+		{
+			set_mount(entry.first, entry.second, mount_origin::config_file);
+		}
+		catch (std::exception const &p_exc)
+		{
+			std::cerr << "Could not set up mount \"" << entry.first << "\": " << p_exc.what() << "\n";
+		}
+	}
+}
+
+
+void mount_table::set_rtsp_server(rtsp_server *p_rtsp_server)
+{
+	for (auto const &entry : m_mounts)
+		remove_handlers(entry.second.get());
+
+	m_rtsp_server = p_rtsp_server;
+
+	for (auto const &entry : m_mounts)
+		add_handlers(entry.second.get());
+}
+
+
+unsigned int mount_table::get_num_clients() const
+{
+	unsigned int num_clients = 0;
+	for (auto const &entry : m_mounts)
+		num_clients += entry.second->m_pool->get_num_clients();
+	return num_clients;
+}
+
+
+void mount_table::set_redirect_callback(redirect_callback p_redirect_callback)
+{
+	m_redirect_callback = std::move(p_redirect_callback);
+}
+
+
+void mount_table::set_connection_limiter(connection_limiter *p_connection_limiter)
+{
+	m_connection_limiter = p_connection_limiter;
+}
+
+
+void mount_table::set_event_trace(event_trace *p_event_trace)
+{
+	m_event_trace = p_event_trace;
+	for (auto &entry : m_mounts)
+		entry.second->m_pool->set_event_trace(m_event_trace);
+}
+
+
+void mount_table::set_premium_tokens(std::set < std::string > p_tokens)
+{
+	m_premium_tokens = std::move(p_tokens);
+}
+
+
+priority_class mount_table::get_request_priority_class(mount const &p_mount, SoupMessage *p_msg) const
+{
+	static std::string const bearer_prefix = "Bearer ";
+
+	char const *authorization = soup_message_headers_get_one(p_msg->request_headers, "Authorization");
+	if ((authorization != nullptr) && g_str_has_prefix(authorization, bearer_prefix.c_str()) && (m_premium_tokens.find(authorization + bearer_prefix.size()) != m_premium_tokens.end()))
+		return priority_class::premium;
+
+	return p_mount.m_config.m_priority;
+}
+
+
+mount_table::mount const * mount_table::find_mount(std::string const &p_name) const
+{
+	auto mount_iter = m_mounts.find(p_name);
+	return (mount_iter != m_mounts.end()) ? mount_iter->second.get() : nullptr;
+}
+
+
+mount_table::mount * mount_table::find_mount(std::string const &p_name)
+{
+	auto mount_iter = m_mounts.find(p_name);
+	return (mount_iter != m_mounts.end()) ? mount_iter->second.get() : nullptr;
+}
+
+
+std::unique_ptr < mount_table::mount > mount_table::create_mount(std::string const &p_name, mount_config p_config, mount_origin const p_origin)
+{
+	std::unique_ptr < mount > new_mount(new mount);
+	new_mount->m_mount_table = this;
+	new_mount->m_name = p_name;
+	new_mount->m_num_downswitches = 0;
+	new_mount->m_num_upswitches = 0;
+	new_mount->m_num_probes = 0;
+	new_mount->m_num_resumes = 0;
+	new_mount->m_origin = p_origin;
+	new_mount->m_pool = std::make_shared < pipeline_pool > (
+		p_config.m_content_type,
+		p_config.get_launch(),
+		p_config.m_parameters,
+		p_config.m_max_idle_instances,
+		p_config.m_max_memory,
+		p_config.m_sink_settings,
+		p_config.m_loop_path.empty() ? nullptr : std::make_shared < slate_clip > (p_config.m_loop_path)
+	);
+	// The slate is shown while the source is restarted
+	new_mount->m_pool->set_restart_sources(!p_config.m_relay_url.empty() || !p_config.m_slate_path.empty());
+	if (!p_config.m_slate_path.empty())
+		new_mount->m_pool->set_slate(std::make_shared < slate_clip > (p_config.m_slate_path), p_config.m_slate_stall_ms);
+	new_mount->m_pool->set_start_stop_delays(p_config.m_start_grace_ms, p_config.m_stop_linger_ms);
+	new_mount->m_pool->set_premium_sink_settings(p_config.m_premium_sink_settings);
+	new_mount->m_pool->set_resume_window(p_config.m_resume_window_ms);
+	new_mount->m_pool->set_event_trace(m_event_trace);
+	// Ended sessions are remembered right away, so
+	// that they can be resumed without a delay
+	new_mount->m_pool->set_client_removed_callback([this](GSocket *p_socket)
+	{
+		m_sessions.end_session(p_socket);
+	});
+	new_mount->m_snapshot.reset(new snapshot_cache(new_mount->m_pool->get_default_pipeline(), m_snapshot_ttl));
+
+	if (p_config.m_ingest)
+	{
+		GstElement *appsrc = new_mount->m_pool->get_default_pipeline().find_source_element("ingest");
+		bool is_appsrc = (appsrc != nullptr) && GST_IS_APP_SRC(appsrc);
+		if (appsrc != nullptr)
+			gst_object_unref(GST_OBJECT(appsrc));
+		if (!is_appsrc)
+			throw std::runtime_error("no appsrc with name \"ingest\" found");
+
+		new_mount->m_ingest.reset(new ingest_source(m_server, new_mount->m_pool->get_default_pipeline()));
+	}
+
+	if (!p_config.m_rtp_destination.empty())
+		new_mount->m_rtp.reset(new rtp_output(new_mount->m_pool->get_default_pipeline(), p_config.m_rtp_destination, p_config.m_rtp_ttl));
+
+	if (p_config.m_webrtc)
+		new_mount->m_webrtc.reset(new webrtc_output(new_mount->m_pool->get_default_pipeline()));
+
+	create_local_outputs(*new_mount, p_config);
+
+	new_mount->m_config = std::move(p_config);
+
+	return new_mount;
+}
+
+
+void mount_table::create_local_outputs(mount &p_mount, mount_config const &p_config)
+{
+	if (!p_config.m_unix_socket_path.empty())
+		p_mount.m_unix_socket.reset(new unix_socket_output(p_mount.m_pool->get_default_pipeline(), p_config.m_unix_socket_path));
+
+	if (!p_config.m_shm_socket_path.empty())
+		p_mount.m_shm.reset(new shm_output(p_mount.m_pool->get_default_pipeline(), p_config.m_shm_socket_path, p_config.m_shm_size));
+}
+
+
+void mount_table::add_handlers(mount *p_mount)
+{
+	std::string path = get_path(p_mount->m_name);
+	std::string snapshot_path = (p_mount->m_name.empty() ? "" : path) + "/snapshot";
+	std::string webrtc_path = (p_mount->m_name.empty() ? "" : path) + "/webrtc";
+
+	soup_server_add_handler(m_server, path.c_str(), http_request_handler, p_mount, nullptr);
+	soup_server_add_handler(m_server, snapshot_path.c_str(), snapshot_request_handler, p_mount, nullptr);
+	if (p_mount->m_webrtc)
+		soup_server_add_websocket_handler(m_server, webrtc_path.c_str(), nullptr, nullptr, webrtc_output::websocket_handler, p_mount->m_webrtc.get(), nullptr);
+
+	if (m_rtsp_server != nullptr)
+		m_rtsp_server->add_mount(path, p_mount->m_pool->get_default_pipeline());
+}
+
+
+void mount_table::remove_handlers(mount *p_mount)
+{
+	std::string path = get_path(p_mount->m_name);
+	std::string snapshot_path = (p_mount->m_name.empty() ? "" : path) + "/snapshot";
+	std::string webrtc_path = (p_mount->m_name.empty() ? "" : path) + "/webrtc";
+
+	soup_server_remove_handler(m_server, path.c_str());
+	soup_server_remove_handler(m_server, snapshot_path.c_str());
+	if (p_mount->m_webrtc)
+		soup_server_remove_handler(m_server, webrtc_path.c_str());
+
+	if (m_rtsp_server != nullptr)
+		m_rtsp_server->remove_mount(path);
+}
+
+
+bool mount_table::answer_probe(mount &p_mount, SoupMessage *p_msg, char const *p_path)
+{
+	std::string method = p_msg->method;
+	char const *user_agent = soup_message_headers_get_one(p_msg->request_headers, "User-Agent");
+
+	bool health_check = false;
+	if ((user_agent != nullptr) && (method == SOUP_METHOD_GET))
+	{
+		for (char const *prefix : probe_user_agents)
+			health_check = health_check || g_str_has_prefix(user_agent, prefix);
+	}
+
+	if ((method != SOUP_METHOD_HEAD) && (method != SOUP_METHOD_OPTIONS) && !health_check)
+		return false;
+
+	++p_mount.m_num_probes;
+
+	if (method == SOUP_METHOD_OPTIONS)
+	{
+		soup_message_headers_replace(p_msg->response_headers, "Allow", p_mount.m_ingest ? "GET, HEAD, OPTIONS, PUT, POST" : "GET, HEAD, OPTIONS");
+		soup_message_set_status(p_msg, SOUP_STATUS_NO_CONTENT);
+		return true;
+	}
+
+	// All instances of a pool have the same outputs, so the
+	// default instance can answer for all of them without
+	// having to be running
+	http_stream_pipeline &pipeline = p_mount.m_pool->get_default_pipeline();
+	std::string output = pipeline.select_output(p_path, soup_message_headers_get_one(p_msg->request_headers, "Accept"));
+	if (output.empty())
+	{
+		soup_message_set_status(p_msg, SOUP_STATUS_NOT_ACCEPTABLE);
+		return true;
+	}
+
+	// The same headers as for a real request, but without a body. Health
+	// checkers get an empty body instead of an endless one.
+	soup_message_set_http_version(p_msg, SOUP_HTTP_1_0);
+	soup_message_headers_set_content_type(p_msg->response_headers, pipeline.get_content_type(output).c_str(), nullptr);
+	if (health_check)
+		soup_message_headers_set_content_length(p_msg->response_headers, 0);
+	else
+		soup_message_headers_set_encoding(p_msg->response_headers, SOUP_ENCODING_EOF);
+	soup_message_set_status(p_msg, SOUP_STATUS_OK);
+
+	return true;
+}
+
+
+void mount_table::http_request_handler(SoupServer *, SoupMessage *p_msg, char const *p_path, GHashTable *p_query, SoupClientContext *p_client, gpointer p_user_data)
+{
+	mount *requested_mount = reinterpret_cast < mount* > (p_user_data);
+	std::shared_ptr < pipeline_pool > pool = requested_mount->m_pool;
+	mount_table *self = requested_mount->m_mount_table;
+
+	// libsoup calls the handler once the request is read completely
+	if (self->m_event_trace != nullptr)
+		self->m_event_trace->record(event_trace::connections, event_trace::get_connection_id(soup_client_context_get_gsocket(p_client)), "connection", "request-parsed");
+
+	// Ingest requests end up here once their body is complete
+	// (see on_got_request_headers())
+	std::string method = p_msg->method;
+	if ((method == SOUP_METHOD_PUT) || (method == SOUP_METHOD_POST))
+	{
+		if (!requested_mount->m_ingest)
+			soup_message_set_status(p_msg, SOUP_STATUS_METHOD_NOT_ALLOWED);
+		else if (requested_mount->m_ingest->is_ingesting(p_msg))
+			soup_message_set_status(p_msg, SOUP_STATUS_NO_CONTENT);
+		else
+			soup_message_set_status(p_msg, SOUP_STATUS_CONFLICT);
+		return;
+	}
+
+	// Reject clients that open too many connections, or open them too
+	// quickly, before anything else is done for them. Unix socket clients
+	// have no host, and are not limited. Neither are premium clients.
+	priority_class priority = self->get_request_priority_class(*requested_mount, p_msg);
+	char const *client_host = soup_client_context_get_host(p_client);
+	std::string limited_address = ((self->m_connection_limiter != nullptr) && (client_host != nullptr) && (priority == priority_class::standard)) ? client_host : "";
+	if (!limited_address.empty())
+	{
+		connection_limiter::verdict verdict = self->m_connection_limiter->check(limited_address);
+		if (verdict != connection_limiter::accepted)
+		{
+			// libsoup has no constant for 429. Closing the connection
+			// keeps the client from queuing more requests on it.
+			if (verdict == connection_limiter::table_full)
+				soup_message_set_status(p_msg, SOUP_STATUS_SERVICE_UNAVAILABLE);
+			else
+				soup_message_set_status_full(p_msg, 429, "Too Many Requests");
+			soup_message_headers_replace(p_msg->response_headers, "Retry-After", std::to_string(self->m_connection_limiter->get_retry_after()).c_str());
+			soup_message_headers_replace(p_msg->response_headers, "Connection", "close");
+			return;
+		}
+	}
+
+	// These must not start the pipeline, and are not
+	// worth redirecting to a sibling either
+	if (answer_probe(*requested_mount, p_msg, p_path))
+		return;
+
+	// Send the client elsewhere if this server is full
+	if (self->m_redirect_callback && (priority == priority_class::standard))
+	{
+		std::string location = self->m_redirect_callback(requested_mount->m_name, p_msg);
+		if (!location.empty())
+		{
+			soup_message_set_redirect(p_msg, SOUP_STATUS_FOUND, location.c_str());
+			return;
+		}
+	}
+
+	// Get the pipeline instance for the parameters in the URL query
+	http_stream_pipeline *pipeline;
+	try
+	{
+		pipeline = &(pool->acquire(p_query));
+	}
+	catch (pipeline_pool::invalid_query const &p_exc)
+	{
+		std::cerr << "Invalid query: " << p_exc.what() << "\n";
+		soup_message_set_status(p_msg, SOUP_STATUS_BAD_REQUEST);
+		return;
+	}
+	catch (std::exception const &p_exc)
+	{
+		std::cerr << "Could not create pipeline instance: " << p_exc.what() << "\n";
+		soup_message_set_status(p_msg, SOUP_STATUS_INTERNAL_SERVER_ERROR);
+		return;
+	}
+
+	// WebSocket requests are meant for Media Source Extensions, which work
+	// best with fragmented MP4. Browsers do not send an Accept header for
+	// them, so MP4 is what they get unless the path says otherwise.
+	bool websocket = soup_websocket_server_check_handshake(p_msg, nullptr, nullptr, nullptr);
+	char const *accept_header = websocket ? websocket_accept_header : soup_message_headers_get_one(p_msg->request_headers, "Accept");
+
+	// Pick the output (and with it, the container format) for this request
+	std::string output = pipeline->select_output(p_path, accept_header);
+	if (output.empty())
+	{
+		pool->release(*pipeline);
+		soup_message_set_status(p_msg, SOUP_STATUS_NOT_ACCEPTABLE);
+		return;
+	}
+
+	if (websocket)
+	{
+		// This sets up the "101 Switching Protocols" response, or an
+		// error response if the handshake is not acceptable
+		if (!soup_websocket_server_process_handshake(p_msg, nullptr, nullptr))
+		{
+			pool->release(*pipeline);
+			return;
+		}
+
+		output = http_stream_pipeline::get_websocket_output(output);
+	}
+	else
+	{
+		// Set up the HTTP response headers. Use HTTP 1.0 (1.1 is not needed here).
+		// We intend to transmit an open-ended stream until we close the socket
+		// (because of an error or because EOS was reached), or the client disconnects.
+		// This means we need EOF encoding (= data ends when the socket is closed).
+		soup_message_set_http_version(p_msg, SOUP_HTTP_1_0);
+		soup_message_headers_set_encoding(p_msg->response_headers, SOUP_ENCODING_EOF);
+		soup_message_headers_set_content_type(p_msg->response_headers, pipeline->get_content_type(output).c_str(), nullptr);
+		soup_message_set_status(p_msg, SOUP_STATUS_OK);
+	}
+
+	output = http_stream_pipeline::get_priority_output(output, priority);
+
+	// From here on, the connection counts as a streaming connection
+	if (!limited_address.empty())
+		self->m_connection_limiter->add_connection(limited_address, soup_client_context_get_gsocket(p_client));
+
+	// A client that lost its connection continues where it left off, as
+	// far as the queued data allows, and keeps its token. Otherwise, the
+	// token allows the client to refer to this connection later on.
+	std::string session_token;
+	GstClockTime rewind = GST_CLOCK_TIME_NONE;
+	char const *resume_token = soup_message_headers_get_one(p_msg->request_headers, resume_session_header);
+	guint resume_window_ms = requested_mount->m_config.m_resume_window_ms;
+	gint64 end_time;
+	if ((resume_token != nullptr) && (resume_window_ms != 0) && self->m_sessions.resume_session(resume_token, requested_mount->m_name, end_time))
+	{
+		gint64 elapsed_us = g_get_monotonic_time() - end_time;
+		if (elapsed_us <= gint64(resume_window_ms) * 1000)
+		{
+			rewind = GstClockTime(elapsed_us) * GST_USECOND;
+			session_token = resume_token;
+			++requested_mount->m_num_resumes;
+		}
+	}
+	if (session_token.empty())
+		session_token = session_table::create_token();
+	soup_message_headers_replace(p_msg->response_headers, "X-Session-Token", session_token.c_str());
+
+	// Context for the wrote-headers callback below. It is deleted once the
+	// message is gone, which also covers clients that disconnect before
+	// the headers are written.
+	char const *stream_start = soup_message_headers_get_one(p_msg->request_headers, stream_start_header);
+	bool from_latest_keyframe = (stream_start != nullptr) && (g_strcmp0(stream_start, stream_start_latest_keyframe) == 0);
+	request_context *context = new request_context {
+		p_client, pool, pipeline, output, from_latest_keyframe, rewind,
+		&(requested_mount->m_mount_table->m_sessions), session_token, requested_mount->m_name, p_path, (accept_header != nullptr) ? accept_header : "",
+		self->m_event_trace
+	};
+
+	// Once the HTTP response headers have all been written, steal the connection
+	// and add the client. The idea is that once the headers are written, GStreamer
+	// (more specifically, the multisocketsink) should take over the connection,
+	// since we won't pass any data over the libsoup message body write functions
+	// anyway. So, let's just take over the connection and hand it over to the
+	// multisocketsink. (Keep a pointer to the GIOStream around to be able to
+	// close the stream if EOS is reached or an error occurs). The 101 response
+	// of a WebSocket handshake is an informational one, which libsoup signals
+	// separately; after it, the connection belongs to the WebSocket protocol.
+	void (*wrote_headers_cb)(SoupMessage *, gpointer) = [](SoupMessage *, gpointer p_user_data)
+	{
+		request_context *context_ = reinterpret_cast < request_context* > (p_user_data);
+
+		GSocket *socket = soup_client_context_get_gsocket(context_->m_client);
+		GIOStream *stream = soup_client_context_steal_connection(context_->m_client);
+
+		if (context_->m_event_trace != nullptr)
+			context_->m_event_trace->record(event_trace::connections, event_trace::get_connection_id(socket), "connection", "wrote-headers");
+
+		// Exceptions must not propagate into libsoup. If the client cannot
+		// be added (for example because the muxer for the requested container
+		// could not be set up), all that can be done at this point is to
+		// close the connection.
+		try
+		{
+			context_->m_pipeline->add_client(stream, socket, context_->m_output, context_->m_from_latest_keyframe, context_->m_rewind);
+			context_->m_sessions->add_session(context_->m_session_token, socket, context_->m_mount_name, context_->m_path, context_->m_accept_header);
+		}
+		catch (std::exception const &p_exc)
+		{
+			std::cerr << "Could not add client: " << p_exc.what() << "\n";
+			g_io_stream_close(stream, nullptr, nullptr);
+			g_object_unref(G_OBJECT(stream));
+		}
+	};
+	void (*destroy_context_cb)(gpointer, GClosure *) = [](gpointer p_user_data, GClosure *)
+	{
+		delete reinterpret_cast < request_context* > (p_user_data);
+	};
+	g_signal_connect_data(G_OBJECT(p_msg), websocket ? "wrote-informational" : "wrote-headers", G_CALLBACK(wrote_headers_cb), context, destroy_context_cb, GConnectFlags(0));
+}
+
+
+void mount_table::snapshot_request_handler(SoupServer *p_server, SoupMessage *p_msg, char const *, GHashTable *, SoupClientContext *, gpointer p_user_data)
+{
+	mount *requested_mount = reinterpret_cast < mount* > (p_user_data);
+	requested_mount->m_snapshot->handle_request(p_server, p_msg);
+}
+
+
+void mount_table::on_request_started(SoupServer *, SoupMessage *p_msg, SoupClientContext *p_client, gpointer p_user_data)
+{
+	// libsoup has no signal for accepted connections; the first
+	// request of a connection starts as soon as it sends data
+	mount_table *self = reinterpret_cast < mount_table* > (p_user_data);
+	if (self->m_event_trace != nullptr)
+		self->m_event_trace->record(event_trace::connections, event_trace::get_connection_id(soup_client_context_get_gsocket(p_client)), "connection", "request-started");
+
+	g_signal_connect(G_OBJECT(p_msg), "got-headers", G_CALLBACK(on_got_request_headers), p_user_data);
+}
+
+
+void mount_table::on_got_request_headers(SoupMessage *p_msg, gpointer p_user_data)
+{
+	mount_table *self = reinterpret_cast < mount_table* > (p_user_data);
+
+	std::string method = p_msg->method;
+	if ((method != SOUP_METHOD_PUT) && (method != SOUP_METHOD_POST))
+		return;
+
+	// Only the mount's path itself accepts ingest requests
+	std::string path = soup_uri_get_path(soup_message_get_uri(p_msg));
+	mount *requested_mount = g_str_has_prefix(path.c_str(), "/") ? self->find_mount(path.substr(1)) : nullptr;
+	if ((requested_mount == nullptr) || !requested_mount->m_ingest)
+		return;
+
+	if (!requested_mount->m_ingest->begin(p_msg))
+	{
+		// Do not collect the body of a request that is rejected anyway
+		std::cerr << "Rejecting ingest request for mount \"" << requested_mount->m_name << "\", since another one is in progress\n";
+		soup_message_body_set_accumulate(p_msg->request_body, FALSE);
+		soup_message_set_status(p_msg, SOUP_STATUS_CONFLICT);
+	}
+}
+
+
+guint mount_table::move_session(session_table::session &p_session, std::string const &p_target_name, GHashTable *p_target_query)
+{
+	gint64 move_start_time = g_get_monotonic_time();
+
+	auto source_mount_iter = m_mounts.find(p_session.m_mount_name);
+	auto target_mount_iter = m_mounts.find(p_target_name);
+	if (target_mount_iter == m_mounts.end())
+		return SOUP_STATUS_NOT_FOUND;
+
+	// Find the pipeline the client is currently in. If it is not in
+	// any, it is still on its way from a previous move.
+	http_stream_pipeline *source_pipeline = (source_mount_iter != m_mounts.end()) ? source_mount_iter->second->m_pool->find_client_pipeline(p_session.m_socket) : nullptr;
+	if (source_pipeline == nullptr)
+		return SOUP_STATUS_CONFLICT;
+
+	std::string source_output = source_pipeline->get_client_output(p_session.m_socket);
+
+	std::shared_ptr < pipeline_reference > target(new pipeline_reference { target_mount_iter->second->m_pool, nullptr });
+	try
+	{
+		target->m_pipeline = &(target->m_pool->acquire(p_target_query));
+	}
+	catch (pipeline_pool::invalid_query const &p_exc)
+	{
+		std::cerr << "Invalid query: " << p_exc.what() << "\n";
+		return SOUP_STATUS_BAD_REQUEST;
+	}
+	catch (std::exception const &p_exc)
+	{
+		std::cerr << "Could not create pipeline instance: " << p_exc.what() << "\n";
+		return SOUP_STATUS_INTERNAL_SERVER_ERROR;
+	}
+
+	// The client cannot renegotiate anything, so the target
+	// must deliver the same kind of stream
+	char const *accept_header = p_session.m_accept_header.empty() ? nullptr : p_session.m_accept_header.c_str();
+	std::string target_output = target->m_pipeline->select_output(p_session.m_path, accept_header);
+	if (!target_output.empty() && http_stream_pipeline::is_websocket_output(source_output))
+		target_output = http_stream_pipeline::get_websocket_output(target_output);
+	if (!target_output.empty())
+		target_output = http_stream_pipeline::get_priority_output(target_output, http_stream_pipeline::get_output_priority_class(source_output));
+	if (target_output.empty() || (target->m_pipeline->get_content_type(target_output) != source_pipeline->get_content_type(source_output)))
+		return SOUP_STATUS_CONFLICT;
+
+	if ((target->m_pipeline == source_pipeline) && (target_output == source_output))
+		return SOUP_STATUS_NO_CONTENT;
+
+	GSocket *socket = p_session.m_socket;
+	std::string token = p_session.m_token;
+
+	// The client continues with the latest keyframe the target has
+	// queued, so it does not have to wait for the next one
+	bool detached = source_pipeline->detach_client(socket, [target, socket, target_output, token, move_start_time](GIOStream *p_stream)
+	{
+		try
+		{
+			target->m_pipeline->add_client(p_stream, socket, target_output, true);
+			std::cerr << "Moved session " << token << " in " << ((g_get_monotonic_time() - move_start_time) / 1000) << " ms\n";
+		}
+		catch (std::exception const &p_exc)
+		{
+			std::cerr << "Could not add moved client: " << p_exc.what() << "\n";
+			g_io_stream_close(p_stream, nullptr, nullptr);
+			g_object_unref(G_OBJECT(p_stream));
+		}
+	});
+
+	if (!detached)
+		return SOUP_STATUS_CONFLICT;
+
+	p_session.m_mount_name = p_target_name;
+	return SOUP_STATUS_NO_CONTENT;
+}
+
+
+void mount_table::zap_request_handler(SoupServer *, SoupMessage *p_msg, char const *, GHashTable *p_query, SoupClientContext *, gpointer p_user_data)
+{
+	mount_table *self = reinterpret_cast < mount_table* > (p_user_data);
+
+	char const *token = (p_query != nullptr) ? reinterpret_cast < char const * > (g_hash_table_lookup(p_query, "session")) : nullptr;
+	char const *target_name = (p_query != nullptr) ? reinterpret_cast < char const * > (g_hash_table_lookup(p_query, "to")) : nullptr;
+	if ((token == nullptr) || (target_name == nullptr))
+	{
+		soup_message_set_status(p_msg, SOUP_STATUS_BAD_REQUEST);
+		return;
+	}
+
+	session_table::session *session = self->m_sessions.find_session(token);
+	if (session == nullptr)
+	{
+		soup_message_set_status(p_msg, SOUP_STATUS_NOT_FOUND);
+		return;
+	}
+
+	// The remaining query parameters select the target's pipeline instance
+	GHashTable *target_query = g_hash_table_new(g_str_hash, g_str_equal);
+	auto target_query_guard = make_scope_guard([target_query]() { g_hash_table_unref(target_query); });
+	{
+		GHashTableIter iter;
+		gpointer key, value;
+		g_hash_table_iter_init(&iter, p_query);
+		while (g_hash_table_iter_next(&iter, &key, &value))
+		{
+			std::string name = reinterpret_cast < char const * > (key);
+			if ((name != "session") && (name != "to"))
+				g_hash_table_insert(target_query, key, value);
+		}
+	}
+
+	// A zap starts over with the adaptation of the new mount
+	guint status = self->move_session(*session, target_name, target_query);
+	if (status == SOUP_STATUS_NO_CONTENT)
+		session->m_adaptation = session_table::adaptation_state();
+
+	soup_message_set_status(p_msg, status);
+}
@@ -0,0 +1,371 @@
+#ifndef GST_SOUP_SERVER_EXAMPLE_MOUNT_TABLE_HPP
+#define GST_SOUP_SERVER_EXAMPLE_MOUNT_TABLE_HPP
+
+#include <glib.h>
+#include <gst/gst.h>
+#include <libsoup/soup.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <memory>
+#include <functional>
+#include "http_stream_pipeline.hpp"
+#include "pipeline_pool.hpp"
+#include "snapshot_cache.hpp"
+#include "session_table.hpp"
+#include "ingest_source.hpp"
+#include "rtp_output.hpp"
+#include "webrtc_output.hpp"
+#include "unix_socket_output.hpp"
+#include "shm_output.hpp"
+#include "rtsp_server.hpp"
+#include "connection_limiter.hpp"
+#include "event_trace.hpp"
+
+
+// Everything that defines a mount.
+struct mount_config
+{
+	std::string m_content_type;
+	std::vector < std::string > m_launch;
+	pipeline_pool::parameters m_parameters;
+	unsigned int m_max_idle_instances;
+	guint64 m_max_memory;
+	sink_settings m_sink_settings;
+
+	// Settings of the sinks that serve premium clients, and the class
+	// of the clients that request the mount's path without a premium
+	// token (see mount_table)
+	sink_settings m_premium_sink_settings;
+	priority_class m_priority;
+
+	// Server-side quality adaptation (see quality_adapter). The ladder
+	// lists values of the parameter, from the highest quality to the
+	// lowest. Adaptation is off if the parameter name is empty.
+	std::string m_adapt_parameter;
+	std::vector < gint64 > m_adapt_ladder;
+
+	// If true, PUT/POST requests to the mount's path feed the
+	// appsrc called "ingest" in the launch line (see ingest_source)
+	bool m_ingest;
+
+	// URL of a stream served by another instance of this server. If set,
+	// the mount relays that stream instead of running a launch line.
+	std::string m_relay_url;
+
+	// Path of a pre-encoded clip. If set, the mount loops it in real time
+	// instead of running a launch line, without encoding anything (see
+	// http_stream_pipeline). Meant for load tests of the server itself.
+	std::string m_loop_path;
+
+	// If set (as HOST:PORT), the stream is also sent as RTP to that
+	// destination, typically a multicast group (see rtp_output)
+	std::string m_rtp_destination;
+	guint m_rtp_ttl;
+
+	// If true, the stream is also offered over WebRTC, with the
+	// signaling under "/NAME/webrtc" (see webrtc_output)
+	bool m_webrtc;
+
+	// If set, local consumers can read the raw stream from a Unix
+	// domain socket at this path (see unix_socket_output)
+	std::string m_unix_socket_path;
+
+	// If set, local consumers can read the stream from shared memory,
+	// through the shmsink control socket at this path (see shm_output).
+	// The size of the shared memory area is given in bytes.
+	std::string m_shm_socket_path;
+	guint64 m_shm_size;
+
+	// Hysteresis between starting and stopping the pipelines, in
+	// milliseconds (see http_stream_pipeline::set_start_stop_delays())
+	guint m_start_grace_ms, m_stop_linger_ms;
+
+	// How far back, in milliseconds, a client that lost its connection
+	// may resume the stream when it reconnects; 0 disables resuming
+	guint m_resume_window_ms;
+
+	// If set, this pre-encoded clip is looped to the clients while the
+	// source is down or has not delivered data for m_slate_stall_ms
+	// milliseconds (see http_stream_pipeline::set_slate())
+	std::string m_slate_path;
+	guint m_slate_stall_ms;
+
+	mount_config();
+
+	// Sets one of the values by name. The names are "content-type",
+	// "launch" (a launch line, split like a shell would split it),
+	// "param" (NAME:MIN:MAX:DEFAULT declarations separated by ';'),
+	// "pool-max-idle", "pool-max-memory" (in MiB), "adapt-param",
+	// "adapt-ladder" (values separated by ';'), "ingest" ("true" or
+	// "false"), "relay" (a URL), "loop" (a path), "rtp" (HOST:PORT),
+	// "rtp-ttl", "webrtc" ("true" or "false"), "unix" (a path), "shm" (a
+	// path), "shm-size" (in MiB), "start-grace", "stop-linger", "resume-window" (all in
+	// milliseconds), "slate" (a path), "slate-stall" (in milliseconds),
+	// "priority" ("standard" or "premium"), the names accepted by
+	// sink_settings::set(), and these names prefixed with "premium-" for
+	// the premium sink settings. Throws an exception if the name is
+	// unknown or the value is invalid.
+	void set(std::string const &p_name, std::string const &p_value);
+
+	// Returns the launch line the mount's pipelines are created from.
+	// For relay mounts, this is generated from the relay URL.
+	std::vector < std::string > get_launch() const;
+
+	// Throws an exception if mandatory values are missing, or
+	// if values do not fit together.
+	void validate() const;
+
+	// Returns true if both configurations produce the same pipelines,
+	// meaning that they only differ in values that can be changed
+	// without disconnecting clients.
+	bool has_same_pipelines(mount_config const &p_other) const;
+};
+
+
+enum class mount_origin
+{
+	command_line,
+	config_file,
+	control_api
+};
+
+char const * get_mount_origin_name(mount_origin const p_origin);
+
+
+// The set of streams the HTTP server offers. Each mount is served under
+// the path "/NAME" (the mount with the empty name is served under "/"),
+// and consists of a pipeline pool and a snapshot cache for the pool's
+// default pipeline ("/NAME/snapshot").
+//
+// Mounts can be added, reconfigured, and removed at runtime. Clients of
+// other mounts are never affected by this.
+//
+// Mounts with ingest enabled accept a stream that is pushed to their path
+// with PUT or POST, and serve it to the clients (see ingest_source).
+//
+// Mounts with an RTP destination also send the stream of their default
+// pipeline instance as RTP over UDP, all the time (see rtp_output).
+//
+// Mounts with WebRTC enabled send the "video" stream of their default
+// pipeline instance to WebRTC peers, which connect to the signaling
+// WebSocket under "/NAME/webrtc" (see webrtc_output).
+//
+// Mounts can also be read by local consumers, as a raw stream from a Unix
+// domain socket (see unix_socket_output), or from shared memory (see
+// shm_output). Both are fed by the default pipeline instance.
+//
+// HEAD and OPTIONS requests, and requests from well-known health checkers
+// (recognized by their User-Agent), are answered with the headers a real
+// request would get, but without acquiring a pipeline, so they never start
+// one. Players that connect and disconnect right again (to sniff the
+// content type, for example) cannot be told apart from real clients this
+// way; the start grace and stop linger periods keep them from starting
+// and stopping the encoder.
+//
+// Clients are put into a priority class when they make their request.
+// Requests with a premium token (in an "Authorization: Bearer TOKEN"
+// header) are premium, all others get the mount's priority class, so
+// whole mounts can be made premium as well. Premium clients are never
+// rejected by the connection limiter or redirected to a sibling, and are
+// served by separate sinks with the premium sink settings (typically
+// with larger queues and longer timeouts), so standard clients are
+// dropped first when the server cannot keep up.
+//
+// Relay mounts pull their stream from another instance of this server
+// (the origin), and pass it on to their clients as-is. The stream must be
+// MPEG-TS, since tsparse timestamps it on the way. Since pipelines only
+// run while they have clients, the upstream connection only exists while
+// somebody is watching, and all clients of a pipeline instance share it.
+// If the upstream connection fails or ends, it is reestablished without
+// disconnecting the clients. The relay asks the origin to start with the
+// latest keyframe it has queued (with the "X-Stream-Start: latest-keyframe"
+// request header, which every mount honors), so the gap is kept short.
+//
+// Every streaming response carries a session token (see session_table).
+// With it, a client can switch its connection to another mount without
+// reconnecting ("zapping"), by sending a request to
+// "/zap?session=TOKEN&to=NAME". The connection is moved from the current
+// mount's sink to the target mount's sink, and continues with the latest
+// keyframe the target has queued. Further query parameters select the
+// target's pipeline instance, just like with a regular request. The target
+// output is chosen as if the client's original request had been made to
+// the target mount; it must have the same content type as the current one.
+//
+// All functions must be called from the mainloop thread.
+class mount_table
+{
+public:
+	struct mount
+	{
+		mount_table *m_mount_table;
+		std::string m_name;
+		mount_config m_config;
+		mount_origin m_origin;
+
+		// Requests that are being set up keep a reference to the pool,
+		// so it may outlive the mount for a short while
+		std::shared_ptr < pipeline_pool > m_pool;
+		std::unique_ptr < snapshot_cache > m_snapshot;
+		std::unique_ptr < ingest_source > m_ingest;
+		std::unique_ptr < rtp_output > m_rtp;
+		std::unique_ptr < webrtc_output > m_webrtc;
+		std::unique_ptr < unix_socket_output > m_unix_socket;
+		std::unique_ptr < shm_output > m_shm;
+
+		// Clients moved to a lower/higher quality by quality adaptation
+		unsigned int m_num_downswitches, m_num_upswitches;
+
+		// Requests answered without acquiring a pipeline
+		unsigned int m_num_probes;
+
+		// Clients that resumed an earlier session
+		unsigned int m_num_resumes;
+	};
+
+	typedef std::map < std::string, std::unique_ptr < mount > > mounts;
+
+	explicit mount_table(SoupServer *p_server, GstClockTime const p_snapshot_ttl);
+	~mount_table();
+
+	// Throws an exception if the name cannot be used for a mount
+	// created from a configuration file or the control API.
+	static void validate_name(std::string const &p_name);
+
+	static std::string get_path(std::string const &p_name);
+
+	// Creates a mount, or reconfigures it if it exists already. If
+	// the pipelines are not affected by the new configuration, the
+	// changes are applied to the running pipelines. Otherwise, the
+	// mount is recreated, which disconnects its clients. If the new
+	// pipelines cannot be created, the mount is left untouched, and
+	// an exception is thrown. Returns true if a new mount was created.
+	bool set_mount(std::string const &p_name, mount_config p_config, mount_origin const p_origin);
+
+	// Changes the sink settings of a mount without disconnecting its
+	// clients. Returns false if there is no mount with that name.
+	bool set_sink_settings(std::string const &p_name, sink_settings const &p_sink_settings);
+
+	// Switches the sources of a mount's pipelines to a new launch line
+	// without disconnecting its clients. The new launch line must use the
+	// same parameters and have the same outputs. Throws an exception if
+	// the new launch line cannot be used. Returns false if there is no
+	// mount with that name.
+	bool switch_source(std::string const &p_name, std::vector < std::string > p_launch, bool const p_preroll);
+
+	// Moves the connection of a session to another mount (or another
+	// instance of the same mount) without closing it. The query selects
+	// the target's pipeline instance, and may be null. The client
+	// continues with the latest keyframe the target has queued. Returns
+	// an HTTP status code: 204 if the move was started, 404 if the target
+	// mount does not exist, 400 if the query is invalid, 409 if the target
+	// delivers a different content type or if the client is not connected
+	// to any pipeline (for example, because it is still being moved), and
+	// 500 if the target pipeline cannot be created.
+	guint move_session(session_table::session &p_session, std::string const &p_target_name, GHashTable *p_target_query);
+
+	session_table& get_sessions()
+	{
+		return m_sessions;
+	}
+
+	// Makes the default pipeline instances of all mounts available
+	// over RTSP, under the same paths as over HTTP. Mounts that are
+	// added later are made available as well. Null turns this off.
+	void set_rtsp_server(rtsp_server *p_rtsp_server);
+
+	// Streaming requests (including HEAD and OPTIONS) are checked by the
+	// limiter before anything else is done for them. Rejected requests get
+	// "429 Too Many Requests", or "503 Service Unavailable" if the limiter's
+	// address table is full. Requests over a Unix socket are not limited.
+	// Null turns this off.
+	void set_connection_limiter(connection_limiter *p_connection_limiter);
+
+	connection_limiter * get_connection_limiter()
+	{
+		return m_connection_limiter;
+	}
+
+	// Records the lifecycle of the streaming connections (request
+	// started, request parsed, response headers written) in the trace,
+	// and makes the pipelines of all mounts record theirs (see
+	// http_stream_pipeline::set_event_trace()). Null turns this off.
+	void set_event_trace(event_trace *p_event_trace);
+
+	event_trace * get_event_trace()
+	{
+		return m_event_trace;
+	}
+
+	// Tokens that make requests premium (see above)
+	void set_premium_tokens(std::set < std::string > p_tokens);
+
+	// Returns the number of clients of all mounts.
+	unsigned int get_num_clients() const;
+
+	// The redirect callback is asked about every new streaming request
+	// (not about snapshots, ingest, or zapping) before a pipeline is
+	// acquired for it. It gets the mount name and the message, and returns
+	// the URL the client shall be redirected to with "302 Found" instead,
+	// or an empty string if the request is to be served locally.
+	typedef std::function < std::string(std::string const &p_mount_name, SoupMessage *p_msg) > redirect_callback;
+	void set_redirect_callback(redirect_callback p_redirect_callback);
+
+	// Removes a mount and disconnects its clients. Returns false if
+	// there is no mount with that name.
+	bool remove_mount(std::string const &p_name);
+
+	// Makes the mounts that came from the configuration file match the
+	// given configurations. Mounts whose configuration did not change
+	// are left alone. Errors are logged; they do not stop the others
+	// from being applied.
+	void sync_config_file_mounts(std::map < std::string, mount_config > const &p_configs);
+
+	mount const * find_mount(std::string const &p_name) const;
+	mount * find_mount(std::string const &p_name);
+
+	mounts const & get_mounts() const
+	{
+		return m_mounts;
+	}
+
+
+private:
+	mount_table(mount_table const &) = delete;
+	mount_table& operator = (mount_table const &) = delete;
+
+	std::unique_ptr < mount > create_mount(std::string const &p_name, mount_config p_config, mount_origin const p_origin);
+	// Unix sockets and shmsink control sockets cannot exist twice at
+	// the same path, so unlike the rest of a mount, these are not set up
+	// until the mount they replace has released them
+	static void create_local_outputs(mount &p_mount, mount_config const &p_config);
+	void add_handlers(mount *p_mount);
+	void remove_handlers(mount *p_mount);
+
+	// Requests with one of the premium tokens as their bearer token
+	// are premium; all others get the priority class of the mount
+	priority_class get_request_priority_class(mount const &p_mount, SoupMessage *p_msg) const;
+	// Returns true if the request was answered as a probe
+	static bool answer_probe(mount &p_mount, SoupMessage *p_msg, char const *p_path);
+	static void http_request_handler(SoupServer *, SoupMessage *p_msg, char const *p_path, GHashTable *p_query, SoupClientContext *p_client, gpointer p_user_data);
+	static void snapshot_request_handler(SoupServer *p_server, SoupMessage *p_msg, char const *, GHashTable *, SoupClientContext *, gpointer p_user_data);
+	static void on_request_started(SoupServer *, SoupMessage *p_msg, SoupClientContext *p_client, gpointer p_user_data);
+	static void on_got_request_headers(SoupMessage *p_msg, gpointer p_user_data);
+	static void zap_request_handler(SoupServer *, SoupMessage *p_msg, char const *, GHashTable *p_query, SoupClientContext *, gpointer p_user_data);
+
+
+	SoupServer *m_server;
+	GstClockTime const m_snapshot_ttl;
+	mounts m_mounts;
+	session_table m_sessions;
+	gulong m_request_started_handler;
+	redirect_callback m_redirect_callback;
+	rtsp_server *m_rtsp_server;
+	connection_limiter *m_connection_limiter;
+	event_trace *m_event_trace;
+	std::set < std::string > m_premium_tokens;
+};
+
+
+#endif
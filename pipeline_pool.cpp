@@ -0,0 +1,521 @@
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <cerrno>
+#include <unistd.h>
+#include "pipeline_pool.hpp"
+
+
+namespace
+{
+
+
+bool parse_integer(std::string const &p_string, gint64 &p_value)
+{
+	if (p_string.empty())
+		return false;
+
+	char *end = nullptr;
+	errno = 0;
+	gint64 value = g_ascii_strtoll(p_string.c_str(), &end, 10);
+	if ((errno != 0) || (*end != '\0'))
+		return false;
+
+	p_value = value;
+	return true;
+}
+
+
+// Returns the resident memory size of this process in bytes,
+// or 0 if it cannot be determined
+guint64 get_resident_memory_size()
+{
+	std::ifstream statm("/proc/self/statm");
+	guint64 total_pages = 0, resident_pages = 0;
+	if (!(statm >> total_pages >> resident_pages))
+		return 0;
+
+	return resident_pages * guint64(sysconf(_SC_PAGESIZE));
+}
+
+
+// Replaces the @NAME@ placeholders in the launch line template, and
+// returns the argv-style array of the launch line. The strings in the
+// array are owned by p_launch_argv.
+std::vector < char* > substitute_placeholders(std::vector < std::string > &p_launch_argv, std::vector < std::pair < std::string, std::string > > const &p_substitutions)
+{
+	std::vector < char* > argv;
+
+	for (std::string &arg : p_launch_argv)
+	{
+		for (auto const &substitution : p_substitutions)
+		{
+			std::string::size_type pos = 0;
+			while ((pos = arg.find(substitution.first, pos)) != std::string::npos)
+			{
+				arg.replace(pos, substitution.first.size(), substitution.second);
+				pos += substitution.second.size();
+			}
+		}
+
+		argv.push_back(const_cast < char* > (arg.c_str()));
+	}
+
+	argv.push_back(nullptr);
+
+	return argv;
+}
+
+
+} // unnamed namespace end
+
+
+
+
+pipeline_pool::parameter pipeline_pool::parse_parameter(std::string const &p_declaration)
+{
+	gchar **tokens = g_strsplit(p_declaration.c_str(), ":", 0);
+	guint num_tokens = g_strv_length(tokens);
+
+	parameter param;
+	bool ok = (num_tokens == 4);
+	if (ok)
+	{
+		param.m_name = tokens[0];
+		ok = !param.m_name.empty()
+		  && parse_integer(tokens[1], param.m_min)
+		  && parse_integer(tokens[2], param.m_max)
+		  && parse_integer(tokens[3], param.m_default)
+		  && (param.m_min <= param.m_default)
+		  && (param.m_default <= param.m_max);
+	}
+
+	g_strfreev(tokens);
+
+	if (!ok)
+		throw std::runtime_error("invalid parameter declaration \"" + p_declaration + "\" (expected NAME:MIN:MAX:DEFAULT)");
+
+	return param;
+}
+
+
+pipeline_pool::pipeline_pool(std::string p_content_type, std::vector < std::string > p_launch_template, parameters p_parameters, unsigned int const p_max_idle_instances, guint64 const p_max_memory, sink_settings p_sink_settings, std::shared_ptr < slate_clip const > p_loop_clip)
+	: m_content_type(std::move(p_content_type))
+	, m_launch_template(std::move(p_launch_template))
+	, m_loop_clip(std::move(p_loop_clip))
+	, m_parameters(std::move(p_parameters))
+	, m_max_idle_instances(p_max_idle_instances)
+	, m_max_memory(p_max_memory)
+	, m_sink_settings(std::move(p_sink_settings))
+	, m_restart_sources(false)
+	, m_stall_timeout_ms(0)
+	, m_start_grace_ms(0)
+	, m_stop_linger_ms(0)
+	, m_resume_window_ms(0)
+	, m_event_trace(nullptr)
+	, m_num_evicted_starts(0)
+	, m_num_evicted_avoided_starts(0)
+	, m_default_pipeline(nullptr)
+	, m_eviction_source(0)
+{
+	for (guint64 &num_evictions : m_num_evicted_evictions)
+		num_evictions = 0;
+
+	// Create the default instance right away. This also
+	// verifies that the launch line template is usable.
+	instance &default_instance = find_or_create_instance(nullptr);
+	default_instance.m_pinned = true;
+	m_default_pipeline = default_instance.m_pipeline.get();
+}
+
+
+pipeline_pool::~pipeline_pool()
+{
+	if (m_eviction_source != 0)
+		g_source_remove(m_eviction_source);
+}
+
+
+void pipeline_pool::set_limits(unsigned int const p_max_idle_instances, guint64 const p_max_memory)
+{
+	m_max_idle_instances = p_max_idle_instances;
+	m_max_memory = p_max_memory;
+	schedule_eviction();
+}
+
+
+void pipeline_pool::set_sink_settings(sink_settings const &p_sink_settings)
+{
+	m_sink_settings = p_sink_settings;
+	for (auto &entry : m_instances)
+		entry.second.m_pipeline->set_sink_settings(m_sink_settings);
+}
+
+
+void pipeline_pool::set_premium_sink_settings(sink_settings const &p_sink_settings)
+{
+	m_premium_sink_settings = p_sink_settings;
+	for (auto &entry : m_instances)
+		entry.second.m_pipeline->set_premium_sink_settings(m_premium_sink_settings);
+}
+
+
+void pipeline_pool::set_restart_sources(bool const p_restart_sources)
+{
+	m_restart_sources = p_restart_sources;
+	for (auto &entry : m_instances)
+		entry.second.m_pipeline->set_restart_source(m_restart_sources);
+}
+
+
+void pipeline_pool::set_slate(std::shared_ptr < slate_clip const > p_slate, guint const p_stall_timeout_ms)
+{
+	m_slate = std::move(p_slate);
+	m_stall_timeout_ms = p_stall_timeout_ms;
+	for (auto &entry : m_instances)
+		entry.second.m_pipeline->set_slate(m_slate, m_stall_timeout_ms);
+}
+
+
+void pipeline_pool::set_start_stop_delays(guint const p_start_grace_ms, guint const p_stop_linger_ms)
+{
+	m_start_grace_ms = p_start_grace_ms;
+	m_stop_linger_ms = p_stop_linger_ms;
+	for (auto &entry : m_instances)
+		entry.second.m_pipeline->set_start_stop_delays(m_start_grace_ms, m_stop_linger_ms);
+}
+
+
+void pipeline_pool::set_resume_window(guint const p_resume_window_ms)
+{
+	m_resume_window_ms = p_resume_window_ms;
+	for (auto &entry : m_instances)
+		entry.second.m_pipeline->set_resume_window(m_resume_window_ms);
+}
+
+
+void pipeline_pool::set_client_removed_callback(http_stream_pipeline::client_removed_callback p_client_removed_callback)
+{
+	m_client_removed_callback = std::move(p_client_removed_callback);
+	for (auto &entry : m_instances)
+		entry.second.m_pipeline->set_client_removed_callback(m_client_removed_callback);
+}
+
+
+void pipeline_pool::set_event_trace(event_trace *p_event_trace)
+{
+	m_event_trace = p_event_trace;
+	for (auto &entry : m_instances)
+		entry.second.m_pipeline->set_event_trace(m_event_trace);
+}
+
+
+unsigned int pipeline_pool::get_num_clients() const
+{
+	unsigned int num_clients = 0;
+	for (auto const &entry : m_instances)
+		num_clients += entry.second.m_pipeline->get_num_clients();
+	return num_clients;
+}
+
+
+unsigned int pipeline_pool::get_num_pipeline_starts() const
+{
+	unsigned int num_starts = m_num_evicted_starts;
+	for (auto const &entry : m_instances)
+		num_starts += entry.second.m_pipeline->get_num_starts();
+	return num_starts;
+}
+
+
+unsigned int pipeline_pool::get_num_avoided_starts() const
+{
+	unsigned int num_avoided_starts = m_num_evicted_avoided_starts;
+	for (auto const &entry : m_instances)
+		num_avoided_starts += entry.second.m_pipeline->get_num_avoided_starts();
+	return num_avoided_starts;
+}
+
+
+http_stream_pipeline::priority_stats pipeline_pool::get_priority_stats(priority_class const p_class) const
+{
+	http_stream_pipeline::priority_stats stats;
+	stats.m_num_clients = 0;
+	stats.m_num_evictions = m_num_evicted_evictions[int(p_class)];
+	stats.m_dropped_buffers = 0;
+
+	for (auto const &entry : m_instances)
+	{
+		http_stream_pipeline::priority_stats instance_stats = entry.second.m_pipeline->get_priority_stats(p_class);
+		stats.m_num_clients += instance_stats.m_num_clients;
+		stats.m_num_evictions += instance_stats.m_num_evictions;
+		stats.m_dropped_buffers += instance_stats.m_dropped_buffers;
+	}
+
+	return stats;
+}
+
+
+http_stream_pipeline* pipeline_pool::find_client_pipeline(GSocket *p_socket)
+{
+	for (auto &entry : m_instances)
+	{
+		if (!entry.second.m_pipeline->get_client_output(p_socket).empty())
+			return entry.second.m_pipeline.get();
+	}
+
+	return nullptr;
+}
+
+
+pipeline_pool::parameter_values pipeline_pool::get_parameter_values(http_stream_pipeline const &p_pipeline) const
+{
+	for (auto const &entry : m_instances)
+	{
+		if (entry.second.m_pipeline.get() == &p_pipeline)
+			return entry.second.m_parameter_values;
+	}
+
+	return parameter_values();
+}
+
+
+http_stream_pipeline& pipeline_pool::acquire(GHashTable *p_query)
+{
+	instance &inst = find_or_create_instance(p_query);
+
+	++(inst.m_num_references);
+	inst.m_last_used = g_get_monotonic_time();
+
+	return *(inst.m_pipeline);
+}
+
+
+void pipeline_pool::release(http_stream_pipeline &p_pipeline)
+{
+	for (auto &entry : m_instances)
+	{
+		instance &inst = entry.second;
+		if (inst.m_pipeline.get() != &p_pipeline)
+			continue;
+
+		g_assert(inst.m_num_references > 0);
+		--(inst.m_num_references);
+		inst.m_last_used = g_get_monotonic_time();
+
+		// If the reference was not used for adding a client,
+		// the instance may be idle now
+		if (inst.m_num_references == 0)
+			schedule_eviction();
+
+		return;
+	}
+
+	g_assert_not_reached();
+}
+
+
+void pipeline_pool::switch_source(std::vector < std::string > p_launch_template, bool const p_preroll)
+{
+	auto switch_instance = [&](instance &p_instance)
+	{
+		std::vector < std::string > launch_argv = p_launch_template;
+		std::vector < char* > argv = substitute_placeholders(launch_argv, p_instance.m_substitutions);
+		p_instance.m_pipeline->switch_source(argv.data(), p_preroll);
+	};
+
+	// The default instance goes first, to find out
+	// if the new launch line can be used at all
+	instance *default_instance = nullptr;
+	for (auto &entry : m_instances)
+	{
+		if (entry.second.m_pipeline.get() == m_default_pipeline)
+			default_instance = &(entry.second);
+	}
+
+	g_assert(default_instance != nullptr);
+	switch_instance(*default_instance);
+
+	for (auto &entry : m_instances)
+	{
+		if (&(entry.second) == default_instance)
+			continue;
+
+		try
+		{
+			switch_instance(entry.second);
+		}
+		catch (std::exception const &p_exception)
+		{
+			std::cerr << "Could not switch source of pipeline instance for parameters \"" << entry.first << "\": " << p_exception.what() << "\n";
+		}
+	}
+
+	// New instances use the new launch line from now on
+	m_launch_template = std::move(p_launch_template);
+}
+
+
+http_stream_pipeline& pipeline_pool::get_default_pipeline()
+{
+	return *m_default_pipeline;
+}
+
+
+pipeline_pool::instance& pipeline_pool::find_or_create_instance(GHashTable *p_query)
+{
+	// Reject anything that is not a declared parameter. Silently
+	// ignoring typos would lead to confusing results, and to
+	// duplicate instances with default values.
+	if (p_query != nullptr)
+	{
+		GHashTableIter iter;
+		gpointer key, value;
+		g_hash_table_iter_init(&iter, p_query);
+		while (g_hash_table_iter_next(&iter, &key, &value))
+		{
+			char const *name = reinterpret_cast < char const * > (key);
+			auto param_iter = std::find_if(m_parameters.begin(), m_parameters.end(), [name](parameter const &p_param) { return p_param.m_name == name; });
+			if (param_iter == m_parameters.end())
+				throw invalid_query(std::string("unknown parameter \"") + name + "\"");
+		}
+	}
+
+	// Validate the values and build the canonical key, as well as
+	// the list of placeholder substitutions
+	std::string instance_key;
+	parameter_values instance_parameter_values;
+	substitutions instance_substitutions;
+	for (parameter const &param : m_parameters)
+	{
+		gint64 value = param.m_default;
+
+		char const *value_str = (p_query != nullptr) ? reinterpret_cast < char const * > (g_hash_table_lookup(p_query, param.m_name.c_str())) : nullptr;
+		if (value_str != nullptr)
+		{
+			if (!parse_integer(value_str, value))
+				throw invalid_query("value of parameter \"" + param.m_name + "\" is not an integer");
+			if ((value < param.m_min) || (value > param.m_max))
+				throw invalid_query("value of parameter \"" + param.m_name + "\" is out of range (valid range: " + std::to_string(param.m_min) + "-" + std::to_string(param.m_max) + ")");
+		}
+
+		std::string canonical_value = std::to_string(value);
+
+		if (!instance_key.empty())
+			instance_key += "&";
+		instance_key += param.m_name + "=" + canonical_value;
+
+		instance_parameter_values.emplace_back(param.m_name, value);
+		instance_substitutions.emplace_back("@" + param.m_name + "@", canonical_value);
+	}
+
+	// Look for an existing instance before doing the substitutions
+	auto instance_iter = m_instances.find(instance_key);
+	if (instance_iter != m_instances.end())
+		return instance_iter->second;
+
+	return create_instance(instance_key, std::move(instance_parameter_values), std::move(instance_substitutions));
+}
+
+
+pipeline_pool::instance& pipeline_pool::create_instance(std::string const &p_key, parameter_values p_parameter_values, substitutions p_substitutions)
+{
+	std::cerr << "Creating pipeline instance for parameters \"" << p_key << "\"\n";
+
+	std::vector < std::string > launch_argv = m_launch_template;
+	std::vector < char* > argv = substitute_placeholders(launch_argv, p_substitutions);
+
+	std::unique_ptr < http_stream_pipeline > pipeline;
+	if (m_loop_clip)
+		pipeline.reset(new http_stream_pipeline(m_content_type, m_loop_clip, m_sink_settings));
+	else
+		pipeline.reset(new http_stream_pipeline(m_content_type, argv.data(), m_sink_settings));
+	pipeline->set_restart_source(m_restart_sources);
+	pipeline->set_slate(m_slate, m_stall_timeout_ms);
+	pipeline->set_start_stop_delays(m_start_grace_ms, m_stop_linger_ms);
+	pipeline->set_premium_sink_settings(m_premium_sink_settings);
+	pipeline->set_resume_window(m_resume_window_ms);
+	pipeline->set_client_removed_callback(m_client_removed_callback);
+	pipeline->set_event_trace(m_event_trace);
+
+	// Whenever the instance stops, it may have to be evicted. Eviction is
+	// done later in an idle handler, since the idle callback is invoked
+	// from within the instance itself.
+	pipeline->set_idle_callback([this, p_key]()
+	{
+		auto instance_iter = m_instances.find(p_key);
+		if (instance_iter != m_instances.end())
+			instance_iter->second.m_last_used = g_get_monotonic_time();
+		schedule_eviction();
+	});
+
+	instance &inst = m_instances[p_key];
+	inst.m_pipeline = std::move(pipeline);
+	inst.m_parameter_values = std::move(p_parameter_values);
+	inst.m_substitutions = std::move(p_substitutions);
+	inst.m_num_references = 0;
+	inst.m_last_used = g_get_monotonic_time();
+	inst.m_pinned = false;
+
+	// A new instance makes it more likely that limits are exceeded
+	schedule_eviction();
+
+	return inst;
+}
+
+
+void pipeline_pool::schedule_eviction()
+{
+	if (m_eviction_source != 0)
+		return;
+
+	m_eviction_source = g_idle_add([](gpointer p_user_data) -> gboolean
+	{
+		pipeline_pool *self = reinterpret_cast < pipeline_pool* > (p_user_data);
+		self->m_eviction_source = 0;
+		self->evict_idle_instances();
+		return G_SOURCE_REMOVE;
+	}, this);
+}
+
+
+void pipeline_pool::evict_idle_instances()
+{
+	// Collect the instances that nobody uses, least recently used first
+	std::vector < instances::iterator > idle_instances;
+	for (auto iter = m_instances.begin(); iter != m_instances.end(); ++iter)
+	{
+		instance const &inst = iter->second;
+		if (!inst.m_pinned && (inst.m_num_references == 0) && inst.m_pipeline->is_idle())
+			idle_instances.push_back(iter);
+	}
+
+	std::sort(idle_instances.begin(), idle_instances.end(), [](instances::iterator const &p_first, instances::iterator const &p_second)
+	{
+		return p_first->second.m_last_used < p_second->second.m_last_used;
+	});
+
+	auto evict_next = [&]()
+	{
+		std::cerr << "Destroying idle pipeline instance for parameters \"" << idle_instances.front()->first << "\"\n";
+		http_stream_pipeline const &pipeline = *(idle_instances.front()->second.m_pipeline);
+		m_num_evicted_starts += pipeline.get_num_starts();
+		m_num_evicted_avoided_starts += pipeline.get_num_avoided_starts();
+		for (priority_class priority : { priority_class::standard, priority_class::premium })
+			m_num_evicted_evictions[int(priority)] += pipeline.get_priority_stats(priority).m_num_evictions;
+		m_instances.erase(idle_instances.front());
+		idle_instances.erase(idle_instances.begin());
+	};
+
+	while (idle_instances.size() > m_max_idle_instances)
+		evict_next();
+
+	// Note that the allocator does not necessarily return freed memory
+	// to the system right away, so this may evict more than necessary.
+	// It never touches instances that are in use though.
+	if (m_max_memory != 0)
+	{
+		while (!idle_instances.empty() && (get_resident_memory_size() > m_max_memory))
+			evict_next();
+	}
+}
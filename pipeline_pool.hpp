@@ -0,0 +1,176 @@
+#ifndef GST_SOUP_SERVER_EXAMPLE_PIPELINE_POOL_HPP
+#define GST_SOUP_SERVER_EXAMPLE_PIPELINE_POOL_HPP
+
+#include <glib.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include "http_stream_pipeline.hpp"
+
+
+// Creates http_stream_pipeline instances on demand from a templated
+// launch line.
+//
+// The launch line may contain placeholders of the form @NAME@. Each
+// placeholder refers to a declared integer parameter, whose value is
+// taken from the URL query of a request (like /cam?width=640), or from
+// the parameter's default if the query does not contain it. Parameters
+// are validated against their range, and only their canonical decimal
+// representation is ever inserted into the launch line.
+//
+// Requests with identical parameter sets share one instance. Instances
+// that are not used by anybody remain in the pool, so that they can be
+// reused quickly. If there are more of these idle instances than allowed,
+// or if the process uses more memory than allowed, the least recently
+// used idle instances are destroyed.
+//
+// All public functions must be called from the mainloop thread.
+class pipeline_pool
+{
+public:
+	struct parameter
+	{
+		std::string m_name;
+		gint64 m_min, m_max, m_default;
+	};
+
+	typedef std::vector < parameter > parameters;
+
+	// Thrown by acquire() if the query contains unknown parameters
+	// or invalid values
+	class invalid_query
+		: public std::runtime_error
+	{
+	public:
+		explicit invalid_query(std::string const &p_what)
+			: std::runtime_error(p_what)
+		{
+		}
+	};
+
+	// Parses a parameter declaration of the form NAME:MIN:MAX:DEFAULT.
+	static parameter parse_parameter(std::string const &p_declaration);
+
+	// p_max_memory is the limit of the process' resident memory size in
+	// bytes above which idle instances are destroyed; 0 means no limit.
+	// If p_loop_clip is set, the instances loop that clip instead of
+	// running the launch line template, which must be empty then.
+	explicit pipeline_pool(std::string p_content_type, std::vector < std::string > p_launch_template, parameters p_parameters, unsigned int const p_max_idle_instances, guint64 const p_max_memory, sink_settings p_sink_settings, std::shared_ptr < slate_clip const > p_loop_clip = nullptr);
+	~pipeline_pool();
+
+	// These apply to existing instances as well
+	void set_limits(unsigned int const p_max_idle_instances, guint64 const p_max_memory);
+	void set_sink_settings(sink_settings const &p_sink_settings);
+	void set_premium_sink_settings(sink_settings const &p_sink_settings);
+	// See http_stream_pipeline::set_restart_source()
+	void set_restart_sources(bool const p_restart_sources);
+	// See http_stream_pipeline::set_slate()
+	void set_slate(std::shared_ptr < slate_clip const > p_slate, guint const p_stall_timeout_ms);
+	// See http_stream_pipeline::set_start_stop_delays()
+	void set_start_stop_delays(guint const p_start_grace_ms, guint const p_stop_linger_ms);
+	// See http_stream_pipeline::set_resume_window()
+	void set_resume_window(guint const p_resume_window_ms);
+	// See http_stream_pipeline::set_client_removed_callback()
+	void set_client_removed_callback(http_stream_pipeline::client_removed_callback p_client_removed_callback);
+	// See http_stream_pipeline::set_event_trace()
+	void set_event_trace(event_trace *p_event_trace);
+
+	std::size_t get_num_instances() const
+	{
+		return m_instances.size();
+	}
+
+	unsigned int get_num_clients() const;
+
+	// Sums of http_stream_pipeline::get_num_starts() and
+	// get_num_avoided_starts() over all instances, including
+	// the ones that were destroyed already
+	unsigned int get_num_pipeline_starts() const;
+	unsigned int get_num_avoided_starts() const;
+
+	// Summed up over all instances; evictions include
+	// the ones of destroyed instances
+	http_stream_pipeline::priority_stats get_priority_stats(priority_class const p_class) const;
+
+	// Returns the instance the client with the given
+	// socket is connected to, or null if there is none.
+	http_stream_pipeline* find_client_pipeline(GSocket *p_socket);
+
+	// Returns the parameter values the given instance was created with,
+	// in declaration order.
+	typedef std::vector < std::pair < std::string, gint64 > > parameter_values;
+	parameter_values get_parameter_values(http_stream_pipeline const &p_pipeline) const;
+
+	// Returns the instance for the parameters in the given query (which
+	// may be null), creating it if necessary. The instance is not destroyed
+	// until the reference is given back with release(). In between, clients
+	// and holds can be added to it.
+	http_stream_pipeline& acquire(GHashTable *p_query);
+	void release(http_stream_pipeline &p_pipeline);
+
+	// Switches the sources of all instances to a new launch line template,
+	// without disconnecting clients (see http_stream_pipeline::switch_source()).
+	// The template must use the same parameters and outputs. Throws an
+	// exception if the default instance cannot switch to it; nothing is
+	// changed then. Failures of the other instances are only logged.
+	void switch_source(std::vector < std::string > p_launch_template, bool const p_preroll);
+
+	// Returns the instance that uses the default values of all parameters.
+	// It is created right away and never destroyed, since internal consumers
+	// (like the snapshot cache) attach to it.
+	http_stream_pipeline& get_default_pipeline();
+
+
+private:
+	pipeline_pool(pipeline_pool const &) = delete;
+	pipeline_pool& operator = (pipeline_pool const &) = delete;
+
+	typedef std::vector < std::pair < std::string, std::string > > substitutions;
+
+	struct instance
+	{
+		std::unique_ptr < http_stream_pipeline > m_pipeline;
+		parameter_values m_parameter_values;
+		substitutions m_substitutions;
+		unsigned int m_num_references;
+		gint64 m_last_used;
+		bool m_pinned;
+	};
+
+	// Instances are keyed by the canonical form of their parameter
+	// set ("NAME1=VALUE1&NAME2=VALUE2...", in declaration order)
+	typedef std::map < std::string, instance > instances;
+
+	instance& find_or_create_instance(GHashTable *p_query);
+	instance& create_instance(std::string const &p_key, parameter_values p_parameter_values, substitutions p_substitutions);
+	void schedule_eviction();
+	void evict_idle_instances();
+
+
+	std::string m_content_type;
+	std::vector < std::string > m_launch_template;
+	std::shared_ptr < slate_clip const > m_loop_clip;
+	parameters m_parameters;
+	unsigned int m_max_idle_instances;
+	guint64 m_max_memory;
+	sink_settings m_sink_settings, m_premium_sink_settings;
+	bool m_restart_sources;
+	std::shared_ptr < slate_clip const > m_slate;
+	guint m_stall_timeout_ms;
+	guint m_start_grace_ms, m_stop_linger_ms;
+	guint m_resume_window_ms;
+	http_stream_pipeline::client_removed_callback m_client_removed_callback;
+	event_trace *m_event_trace;
+
+	instances m_instances;
+	unsigned int m_num_evicted_starts, m_num_evicted_avoided_starts;
+	// Indexed by priority_class
+	guint64 m_num_evicted_evictions[2];
+	http_stream_pipeline *m_default_pipeline;
+	guint m_eviction_source;
+};
+
+
+#endif
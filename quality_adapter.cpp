@@ -0,0 +1,193 @@
+#include <iostream>
+#include <algorithm>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/sockios.h>
+#include "quality_adapter.hpp"
+#include "scope_guard.hpp"
+
+
+namespace
+{
+
+
+guint const check_interval_ms = 1000;
+
+// A send queue that is filled above 90% counts as congested,
+// one below 25% as healthy
+unsigned int const congested_queue_percentage = 90;
+unsigned int const healthy_queue_percentage = 25;
+
+// Number of checks in a row that must agree before a client is moved
+unsigned int const num_congested_checks = 3;
+unsigned int const num_healthy_checks = 30;
+
+// Time after a move during which a client is not moved again
+gint64 const settle_time = 10 * G_USEC_PER_SEC;
+
+
+// Returns the fill level of the socket's send queue in percent,
+// or -1 if it cannot be determined
+int get_send_queue_percentage(GSocket *p_socket)
+{
+	int fd = g_socket_get_fd(p_socket);
+
+	int queued_bytes = 0;
+	if (ioctl(fd, SIOCOUTQ, &queued_bytes) != 0)
+		return -1;
+
+	int buffer_size = 0;
+	socklen_t buffer_size_length = sizeof(buffer_size);
+	if ((getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buffer_size, &buffer_size_length) != 0) || (buffer_size <= 0))
+		return -1;
+
+	return int(gint64(queued_bytes) * 100 / buffer_size);
+}
+
+
+std::string describe_rendition(std::string const &p_parameter, gint64 const p_value)
+{
+	return p_parameter + "=" + std::to_string(p_value);
+}
+
+
+} // unnamed namespace end
+
+
+
+
+quality_adapter::quality_adapter(mount_table &p_mount_table)
+	: m_mount_table(p_mount_table)
+{
+	m_timeout_source = g_timeout_add(check_interval_ms, [](gpointer p_user_data) -> gboolean
+	{
+		quality_adapter *self = reinterpret_cast < quality_adapter* > (p_user_data);
+		self->check_sessions();
+		return G_SOURCE_CONTINUE;
+	}, this);
+}
+
+
+quality_adapter::~quality_adapter()
+{
+	g_source_remove(m_timeout_source);
+}
+
+
+void quality_adapter::check_sessions()
+{
+	gint64 now = g_get_monotonic_time();
+	m_mount_table.get_sessions().for_each_session([this, now](session_table::session &p_session)
+	{
+		check_session(p_session, now);
+	});
+}
+
+
+void quality_adapter::check_session(session_table::session &p_session, gint64 const p_now)
+{
+	mount_table::mount *current_mount = m_mount_table.find_mount(p_session.m_mount_name);
+	if ((current_mount == nullptr) || current_mount->m_config.m_adapt_parameter.empty())
+		return;
+
+	mount_config const &config = current_mount->m_config;
+	session_table::adaptation_state &state = p_session.m_adaptation;
+
+	// Clients that are being moved are not in any pipeline right now
+	http_stream_pipeline *pipeline = current_mount->m_pool->find_client_pipeline(p_session.m_socket);
+	http_stream_pipeline::client_stats stats;
+	if ((pipeline == nullptr) || !pipeline->get_client_stats(p_session.m_socket, stats))
+		return;
+
+	// Find out where on the ladder the client is. Clients that explicitly
+	// asked for a value that is not on the ladder are left alone.
+	pipeline_pool::parameter_values values = current_mount->m_pool->get_parameter_values(*pipeline);
+	auto value_iter = std::find_if(values.begin(), values.end(), [&config](std::pair < std::string, gint64 > const &p_value) { return p_value.first == config.m_adapt_parameter; });
+	if (value_iter == values.end())
+		return;
+
+	auto ladder_iter = std::find(config.m_adapt_ladder.begin(), config.m_adapt_ladder.end(), value_iter->second);
+	if (ladder_iter == config.m_adapt_ladder.end())
+		return;
+
+	bool dropped = (stats.m_dropped_buffers > state.m_num_dropped_buffers);
+	state.m_num_dropped_buffers = stats.m_dropped_buffers;
+
+	int queue_percentage = get_send_queue_percentage(p_session.m_socket);
+	if (queue_percentage < 0)
+		return;
+
+	if (dropped || (queue_percentage >= int(congested_queue_percentage)))
+	{
+		++state.m_num_congested_checks;
+		state.m_num_healthy_checks = 0;
+	}
+	else if (queue_percentage <= int(healthy_queue_percentage))
+	{
+		++state.m_num_healthy_checks;
+		state.m_num_congested_checks = 0;
+	}
+	else
+	{
+		state.m_num_congested_checks = 0;
+		state.m_num_healthy_checks = 0;
+	}
+
+	if ((state.m_last_change_time != 0) && ((p_now - state.m_last_change_time) < settle_time))
+		return;
+
+	// Dropped buffers are bad enough to act on right away
+	char const *reason;
+	auto new_ladder_iter = ladder_iter;
+	if ((dropped || (state.m_num_congested_checks >= num_congested_checks)) && ((ladder_iter + 1) != config.m_adapt_ladder.end()))
+	{
+		reason = dropped ? "dropped-buffers" : "send-queue-full";
+		++new_ladder_iter;
+	}
+	else if ((state.m_num_healthy_checks >= num_healthy_checks) && (ladder_iter != config.m_adapt_ladder.begin()))
+	{
+		reason = "recovered";
+		--new_ladder_iter;
+	}
+	else
+		return;
+
+	// Move the client to the instance with the new value, keeping the
+	// other parameters. The query only refers to the strings, so they
+	// have to stay around until the move was started.
+	std::vector < std::pair < std::string, std::string > > query_strings;
+	for (auto const &value : values)
+		query_strings.emplace_back(value.first, std::to_string((value.first == config.m_adapt_parameter) ? *new_ladder_iter : value.second));
+
+	GHashTable *query = g_hash_table_new(g_str_hash, g_str_equal);
+	auto query_guard = make_scope_guard([query]() { g_hash_table_unref(query); });
+	for (auto &query_string : query_strings)
+		g_hash_table_insert(query, const_cast < char* > (query_string.first.c_str()), const_cast < char* > (query_string.second.c_str()));
+
+	std::string from = describe_rendition(config.m_adapt_parameter, *ladder_iter);
+	std::string to = describe_rendition(config.m_adapt_parameter, *new_ladder_iter);
+	bool down = (new_ladder_iter > ladder_iter);
+
+	std::string mount_name = p_session.m_mount_name;
+	guint status = m_mount_table.move_session(p_session, mount_name, query);
+	if (status != SOUP_STATUS_NO_CONTENT)
+	{
+		std::cerr << "Could not move session " << p_session.m_token << " from " << from << " to " << to << ": HTTP status " << status << "\n";
+		return;
+	}
+
+	std::cerr << "Moving session " << p_session.m_token << " from " << from << " to " << to << " (" << reason << ")\n";
+
+	if (down)
+		++(current_mount->m_num_downswitches);
+	else
+		++(current_mount->m_num_upswitches);
+
+	p_session.m_rendition_history.push_back(session_table::rendition_change { g_get_real_time(), from, to, reason });
+	while (p_session.m_rendition_history.size() > session_table::max_rendition_history_size)
+		p_session.m_rendition_history.pop_front();
+
+	// The new sink has its own dropped buffers counter
+	state = session_table::adaptation_state();
+	state.m_last_change_time = p_now;
+}
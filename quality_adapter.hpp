@@ -0,0 +1,49 @@
+#ifndef GST_SOUP_SERVER_EXAMPLE_QUALITY_ADAPTER_HPP
+#define GST_SOUP_SERVER_EXAMPLE_QUALITY_ADAPTER_HPP
+
+#include <glib.h>
+#include "mount_table.hpp"
+
+
+// Moves clients that cannot keep up to a lower quality, and back up
+// once they recover, without them having to reconnect.
+//
+// This applies to mounts that have an adaptation parameter and ladder
+// configured. The quality levels are the pipeline instances of the mount
+// for the ladder's values of the parameter (all other parameters stay the
+// same). Once per second, each client of such a mount is checked:
+//
+// - It is congested if the sink dropped buffers for it, or if the kernel's
+//   send queue of its socket was nearly full for several checks in a row.
+//   Congested clients are moved one step down the ladder.
+// - It is healthy if its send queue stayed mostly empty, and nothing was
+//   dropped. Clients that were healthy for a longer while are moved one
+//   step up the ladder.
+//
+// After each move, the client is left alone for a few seconds, since
+// starting at the latest keyframe fills its send queue right away.
+// Moves are recorded in the session's rendition history, and counted
+// per mount.
+//
+// All functions must be called from the mainloop thread.
+class quality_adapter
+{
+public:
+	explicit quality_adapter(mount_table &p_mount_table);
+	~quality_adapter();
+
+
+private:
+	quality_adapter(quality_adapter const &) = delete;
+	quality_adapter& operator = (quality_adapter const &) = delete;
+
+	void check_sessions();
+	void check_session(session_table::session &p_session, gint64 const p_now);
+
+
+	mount_table &m_mount_table;
+	guint m_timeout_source;
+};
+
+
+#endif
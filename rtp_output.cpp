@@ -0,0 +1,253 @@
+#include <iostream>
+#include <stdexcept>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "http_stream_pipeline.hpp"
+#include "rtp_output.hpp"
+#include "scope_guard.hpp"
+
+
+namespace
+{
+
+
+// Upper limit for the number of packets sent in one call
+guint const max_batch_size = 64;
+
+// Length of the window over which the rates are measured
+gint64 const rate_window = G_USEC_PER_SEC;
+
+
+// Returns the CPU time the calling thread used so far, in microseconds
+gint64 get_thread_cpu_time()
+{
+	struct rusage usage;
+	if (getrusage(RUSAGE_THREAD, &usage) != 0)
+		return 0;
+
+	return (gint64(usage.ru_utime.tv_sec) + usage.ru_stime.tv_sec) * G_USEC_PER_SEC + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+
+} // unnamed namespace end
+
+
+
+
+void rtp_output::parse_destination(std::string const &p_destination, std::string &p_host, guint &p_port)
+{
+	std::string::size_type colon_pos = p_destination.rfind(':');
+	if ((colon_pos == std::string::npos) || (colon_pos == 0))
+		throw std::runtime_error("invalid RTP destination \"" + p_destination + "\" (expected HOST:PORT)");
+
+	// IPv6 addresses are given in brackets
+	std::string host = p_destination.substr(0, colon_pos);
+	if ((host.size() >= 2) && (host.front() == '[') && (host.back() == ']'))
+		host = host.substr(1, host.size() - 2);
+
+	std::string port_str = p_destination.substr(colon_pos + 1);
+	char *end = nullptr;
+	guint64 port = g_ascii_strtoull(port_str.c_str(), &end, 10);
+	if (port_str.empty() || (*end != '\0') || (port == 0) || (port > 65535))
+		throw std::runtime_error("invalid RTP port \"" + port_str + "\"");
+
+	p_host = host;
+	p_port = guint(port);
+}
+
+
+rtp_output::rtp_output(http_stream_pipeline &p_pipeline, std::string const &p_destination, guint const p_multicast_ttl)
+	: m_pipeline(p_pipeline)
+	, m_bin(nullptr)
+	, m_batch(nullptr)
+	, m_batch_pts(GST_CLOCK_TIME_NONE)
+	, m_window_start(0)
+	, m_window_start_cpu_time(0)
+	, m_window_start_packets(0)
+{
+	m_stats.m_num_packets = 0;
+	m_stats.m_num_batches = 0;
+	m_stats.m_packets_per_second = 0.0;
+	m_stats.m_cpu_usage = 0.0;
+
+	if (!m_pipeline.is_muxed())
+		throw std::runtime_error("RTP output needs a \"stream\" element");
+
+	std::string host;
+	guint port;
+	parse_destination(p_destination, host, port);
+
+	GstElement *queue = gst_element_factory_make("queue", nullptr);
+	GstElement *payloader = gst_element_factory_make("rtpmp2tpay", nullptr);
+	GstElement *udpsink = gst_element_factory_make("udpsink", nullptr);
+
+	if ((queue == nullptr) || (payloader == nullptr) || (udpsink == nullptr))
+	{
+		if (queue != nullptr) gst_object_unref(GST_OBJECT(queue));
+		if (payloader != nullptr) gst_object_unref(GST_OBJECT(payloader));
+		if (udpsink != nullptr) gst_object_unref(GST_OBJECT(udpsink));
+		throw std::runtime_error("could not create RTP output elements (queue, rtpmp2tpay, udpsink)");
+	}
+
+	// The packets go out as they come, so a slow network
+	// cannot hold up the rest of the pipeline
+	g_object_set(
+		G_OBJECT(udpsink),
+		"host", host.c_str(),
+		"port", gint(port),
+		"auto-multicast", TRUE,
+		"ttl-mc", gint(p_multicast_ttl),
+		"sync", FALSE,
+		"async", FALSE,
+		nullptr
+	);
+
+	m_bin = gst_bin_new(nullptr);
+	gst_object_ref_sink(GST_OBJECT(m_bin));
+	auto bin_guard = make_scope_guard([this]() { gst_object_unref(GST_OBJECT(m_bin)); });
+
+	gst_bin_add_many(GST_BIN(m_bin), queue, payloader, udpsink, nullptr);
+	gst_element_link_many(queue, payloader, udpsink, nullptr);
+
+	GstPad *queue_sinkpad = gst_element_get_static_pad(queue, "sink");
+	gst_element_add_pad(m_bin, gst_ghost_pad_new("sink", queue_sinkpad));
+	gst_object_unref(GST_OBJECT(queue_sinkpad));
+
+	GstPad *payloader_srcpad = gst_element_get_static_pad(payloader, "src");
+	gst_pad_add_probe(payloader_srcpad, GstPadProbeType(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM), batch_probe, this, nullptr);
+	gst_object_unref(GST_OBJECT(payloader_srcpad));
+
+	m_pipeline.attach_stream_consumer(m_bin);
+	bin_guard.dismiss();
+
+	// Multicast receivers cannot ask for the stream,
+	// so it has to be sent all the time
+	m_pipeline.acquire_hold();
+
+	std::cerr << "Sending RTP to " << host << ":" << port << "\n";
+}
+
+
+rtp_output::~rtp_output()
+{
+	m_pipeline.detach_stream_consumer(m_bin);
+	m_pipeline.release_hold();
+
+	// The streaming thread is gone now
+	if (m_batch != nullptr)
+		gst_buffer_list_unref(m_batch);
+	gst_object_unref(GST_OBJECT(m_bin));
+}
+
+
+rtp_output::stats rtp_output::get_stats() const
+{
+	std::lock_guard < std::mutex > lock(m_stats_mutex);
+	return m_stats;
+}
+
+
+GstPadProbeReturn rtp_output::batch_probe(GstPad *p_pad, GstPadProbeInfo *p_info, gpointer p_user_data)
+{
+	rtp_output *self = reinterpret_cast < rtp_output* > (p_user_data);
+
+	if (GST_PAD_PROBE_INFO_TYPE(p_info) & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM)
+	{
+		switch (GST_EVENT_TYPE(GST_PAD_PROBE_INFO_EVENT(p_info)))
+		{
+			// Packets from before a flush or a restart are stale. (Only
+			// serialized events are handled, since others can come from
+			// other threads.)
+			case GST_EVENT_FLUSH_STOP:
+			case GST_EVENT_STREAM_START:
+				if (self->m_batch != nullptr)
+				{
+					gst_buffer_list_unref(self->m_batch);
+					self->m_batch = nullptr;
+				}
+
+				// The streaming thread may be a different one now
+				self->m_window_start = 0;
+				break;
+
+			// Other events must not overtake the packets before them
+			default:
+				if (GST_EVENT_IS_SERIALIZED(GST_PAD_PROBE_INFO_EVENT(p_info)))
+					self->push_batch(p_pad);
+				break;
+		}
+
+		return GST_PAD_PROBE_OK;
+	}
+
+	// The payloader splits each input buffer into several packets,
+	// which all carry the input buffer's timestamp. A new timestamp
+	// means that the previous input buffer is done.
+	GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(p_info);
+	if ((self->m_batch != nullptr) && ((GST_BUFFER_PTS(buffer) != self->m_batch_pts) || (gst_buffer_list_length(self->m_batch) >= max_batch_size)))
+		self->push_batch(p_pad);
+
+	if (self->m_batch == nullptr)
+	{
+		self->m_batch = gst_buffer_list_new_sized(max_batch_size);
+		self->m_batch_pts = GST_BUFFER_PTS(buffer);
+	}
+
+	gst_buffer_list_add(self->m_batch, gst_buffer_ref(buffer));
+
+	{
+		std::lock_guard < std::mutex > lock(self->m_stats_mutex);
+		++(self->m_stats.m_num_packets);
+	}
+
+	self->update_rates();
+
+	return GST_PAD_PROBE_DROP;
+}
+
+
+void rtp_output::push_batch(GstPad *p_pad)
+{
+	if (m_batch == nullptr)
+		return;
+
+	GstBufferList *batch = m_batch;
+	m_batch = nullptr;
+
+	{
+		std::lock_guard < std::mutex > lock(m_stats_mutex);
+		++m_stats.m_num_batches;
+	}
+
+	// The probe does not see buffer lists, so this goes straight to
+	// udpsink. Errors are posted on the bus by udpsink itself.
+	gst_pad_push_list(p_pad, batch);
+}
+
+
+void rtp_output::update_rates()
+{
+	gint64 now = g_get_monotonic_time();
+
+	if (m_window_start == 0)
+	{
+		m_window_start = now;
+		m_window_start_cpu_time = get_thread_cpu_time();
+		m_window_start_packets = m_stats.m_num_packets;
+		return;
+	}
+
+	gint64 elapsed = now - m_window_start;
+	if (elapsed < rate_window)
+		return;
+
+	gint64 cpu_time = get_thread_cpu_time();
+
+	std::lock_guard < std::mutex > lock(m_stats_mutex);
+	m_stats.m_packets_per_second = double(m_stats.m_num_packets - m_window_start_packets) * G_USEC_PER_SEC / elapsed;
+	m_stats.m_cpu_usage = double(cpu_time - m_window_start_cpu_time) * 100.0 / elapsed;
+
+	m_window_start = now;
+	m_window_start_cpu_time = cpu_time;
+	m_window_start_packets = m_stats.m_num_packets;
+}
@@ -0,0 +1,75 @@
+#ifndef GST_SOUP_SERVER_EXAMPLE_RTP_OUTPUT_HPP
+#define GST_SOUP_SERVER_EXAMPLE_RTP_OUTPUT_HPP
+
+#include <glib.h>
+#include <gst/gst.h>
+#include <string>
+#include <mutex>
+
+
+class http_stream_pipeline;
+
+
+// Sends the MPEG-TS output of a http_stream_pipeline as RTP over UDP
+// (typically to a multicast group), in addition to the HTTP clients.
+// The encoding is not duplicated; the RTP branch gets its data from the
+// same "stream" element as the clients.
+//
+// The branch runs in its own streaming thread (queue ! rtpmp2tpay !
+// udpsink), so the HTTP fan-out is not affected by it. The packets that
+// the payloader produces for one input buffer are collected into a buffer
+// list, which udpsink sends with a single sendmmsg() call instead of one
+// sendmsg() per packet. This delays the packets by at most the time
+// between two buffers of the muxer.
+//
+// While the output exists, a hold keeps the pipeline running.
+//
+// All functions must be called from the mainloop thread.
+class rtp_output
+{
+public:
+	struct stats
+	{
+		guint64 m_num_packets;
+		// Buffer lists (that is, send calls) passed to udpsink
+		guint64 m_num_batches;
+		// Measured over the last second
+		double m_packets_per_second;
+		// CPU time the RTP branch's streaming thread used in the
+		// last second, in percent of one core
+		double m_cpu_usage;
+	};
+
+	// Parses a destination of the form HOST:PORT.
+	static void parse_destination(std::string const &p_destination, std::string &p_host, guint &p_port);
+
+	explicit rtp_output(http_stream_pipeline &p_pipeline, std::string const &p_destination, guint const p_multicast_ttl);
+	~rtp_output();
+
+	stats get_stats() const;
+
+
+private:
+	rtp_output(rtp_output const &) = delete;
+	rtp_output& operator = (rtp_output const &) = delete;
+
+	static GstPadProbeReturn batch_probe(GstPad *p_pad, GstPadProbeInfo *p_info, gpointer p_user_data);
+	void push_batch(GstPad *p_pad);
+	void update_rates();
+
+
+	http_stream_pipeline &m_pipeline;
+	GstElement *m_bin;
+
+	// These are only accessed from the branch's streaming thread
+	GstBufferList *m_batch;
+	GstClockTime m_batch_pts;
+	gint64 m_window_start, m_window_start_cpu_time;
+	guint64 m_window_start_packets;
+
+	mutable std::mutex m_stats_mutex;
+	stats m_stats;
+};
+
+
+#endif
@@ -0,0 +1,263 @@
+#include <iostream>
+#include <stdexcept>
+#include "http_stream_pipeline.hpp"
+#include "rtsp_server.hpp"
+#include "scope_guard.hpp"
+
+
+namespace
+{
+
+
+// The RTSP media only payload what the HTTP pipeline encoded
+char const *muxed_media_launch = "( appsrc name=src ! tsparse set-timestamps=true ! rtpmp2tpay name=pay0 pt=33 )";
+char const *video_media_launch = "( appsrc name=src ! h264parse config-interval=-1 ! rtph264pay name=pay0 pt=96 )";
+
+
+} // unnamed namespace end
+
+
+
+
+rtsp_server::rtsp_server(guint const p_port)
+{
+	m_server = gst_rtsp_server_new();
+	gst_rtsp_server_set_service(m_server, std::to_string(p_port).c_str());
+
+	// By default, clients are handled in threads of the server's pool,
+	// and so are the media signals. The mounts and the HTTP pipelines
+	// must only be touched from the mainloop thread, so the clients are
+	// handled in the main context instead.
+	GstRTSPThreadPool *thread_pool = gst_rtsp_server_get_thread_pool(m_server);
+	gst_rtsp_thread_pool_set_max_threads(thread_pool, 0);
+	g_object_unref(G_OBJECT(thread_pool));
+
+	m_server_source = gst_rtsp_server_attach(m_server, nullptr);
+	if (m_server_source == 0)
+	{
+		g_object_unref(G_OBJECT(m_server));
+		throw std::runtime_error("could not start listening for RTSP requests on port " + std::to_string(p_port));
+	}
+}
+
+
+rtsp_server::~rtsp_server()
+{
+	while (!m_mounts.empty())
+		remove_mount(m_mounts.begin()->first);
+
+	g_source_remove(m_server_source);
+	g_object_unref(G_OBJECT(m_server));
+}
+
+
+void rtsp_server::add_mount(std::string const &p_path, http_stream_pipeline &p_pipeline)
+{
+	remove_mount(p_path);
+
+	std::unique_ptr < rtsp_mount > new_mount(new rtsp_mount);
+	new_mount->m_pipeline = &p_pipeline;
+	new_mount->m_media = nullptr;
+	new_mount->m_branch = nullptr;
+	new_mount->m_appsrc = nullptr;
+	new_mount->m_got_keyframe = false;
+
+	// All clients of a path share one media, and
+	// with it, one branch of the HTTP pipeline
+	new_mount->m_factory = gst_rtsp_media_factory_new();
+	gst_rtsp_media_factory_set_launch(new_mount->m_factory, p_pipeline.is_muxed() ? muxed_media_launch : video_media_launch);
+	gst_rtsp_media_factory_set_shared(new_mount->m_factory, TRUE);
+	g_signal_connect(G_OBJECT(new_mount->m_factory), "media-configure", G_CALLBACK(on_media_configure), new_mount.get());
+
+	// The mount points take over one reference; the other one is ours
+	GstRTSPMountPoints *mount_points = gst_rtsp_server_get_mount_points(m_server);
+	gst_rtsp_mount_points_add_factory(mount_points, p_path.c_str(), GST_RTSP_MEDIA_FACTORY(g_object_ref(G_OBJECT(new_mount->m_factory))));
+	g_object_unref(G_OBJECT(mount_points));
+
+	m_mounts[p_path] = std::move(new_mount);
+}
+
+
+void rtsp_server::remove_mount(std::string const &p_path)
+{
+	auto mount_iter = m_mounts.find(p_path);
+	if (mount_iter == m_mounts.end())
+		return;
+
+	rtsp_mount &mount = *(mount_iter->second);
+
+	GstRTSPMountPoints *mount_points = gst_rtsp_server_get_mount_points(m_server);
+	gst_rtsp_mount_points_remove_factory(mount_points, p_path.c_str());
+	g_object_unref(G_OBJECT(mount_points));
+
+	g_signal_handlers_disconnect_by_data(G_OBJECT(mount.m_factory), &mount);
+	release_media(mount);
+	g_object_unref(G_OBJECT(mount.m_factory));
+
+	m_mounts.erase(mount_iter);
+}
+
+
+void rtsp_server::on_media_configure(GstRTSPMediaFactory *, GstRTSPMedia *p_media, gpointer p_user_data)
+{
+	rtsp_mount &mount = *reinterpret_cast < rtsp_mount* > (p_user_data);
+
+	// A previous media may not have been unprepared yet
+	release_media(mount);
+
+	GstElement *media_element = gst_rtsp_media_get_element(p_media);
+	GstElement *appsrc = gst_bin_get_by_name(GST_BIN(media_element), "src");
+	gst_object_unref(GST_OBJECT(media_element));
+	if (appsrc == nullptr)
+		return;
+
+	// The data arrives as the HTTP pipeline produces it. The caps
+	// are taken from the samples that are pushed into the appsrc.
+	g_object_set(
+		G_OBJECT(appsrc),
+		"is-live", TRUE,
+		"do-timestamp", TRUE,
+		"format", GST_FORMAT_TIME,
+		nullptr
+	);
+
+	// Feed the appsrc from a branch of the HTTP pipeline
+	GstElement *queue = gst_element_factory_make("queue", nullptr);
+	GstElement *appsink = gst_element_factory_make("appsink", nullptr);
+	if ((queue == nullptr) || (appsink == nullptr))
+	{
+		if (queue != nullptr) gst_object_unref(GST_OBJECT(queue));
+		if (appsink != nullptr) gst_object_unref(GST_OBJECT(appsink));
+		gst_object_unref(GST_OBJECT(appsrc));
+		std::cerr << "Could not create RTSP branch elements (queue, appsink)\n";
+		return;
+	}
+
+	g_object_set(G_OBJECT(appsink), "sync", FALSE, "enable-last-sample", FALSE, nullptr);
+
+	// The set of callbacks grew over time, so only fill in the one needed
+	GstAppSinkCallbacks callbacks = GstAppSinkCallbacks();
+	callbacks.new_sample = on_new_sample;
+	gst_app_sink_set_callbacks(GST_APP_SINK(appsink), &callbacks, &mount, nullptr);
+
+	GstElement *branch = gst_bin_new(nullptr);
+	gst_object_ref_sink(GST_OBJECT(branch));
+	gst_bin_add_many(GST_BIN(branch), queue, appsink, nullptr);
+	gst_element_link(queue, appsink);
+
+	GstPad *queue_sinkpad = gst_element_get_static_pad(queue, "sink");
+	gst_element_add_pad(branch, gst_ghost_pad_new("sink", queue_sinkpad));
+	gst_object_unref(GST_OBJECT(queue_sinkpad));
+
+	{
+		std::lock_guard < std::mutex > lock(mount.m_appsrc_mutex);
+		mount.m_appsrc = GST_APP_SRC(appsrc);
+		mount.m_got_keyframe = false;
+	}
+
+	try
+	{
+		mount.m_pipeline->attach_stream_consumer(branch);
+	}
+	catch (std::exception const &p_exc)
+	{
+		std::cerr << "Could not attach RTSP branch: " << p_exc.what() << "\n";
+
+		{
+			std::lock_guard < std::mutex > lock(mount.m_appsrc_mutex);
+			mount.m_appsrc = nullptr;
+		}
+
+		gst_object_unref(GST_OBJECT(branch));
+		gst_object_unref(GST_OBJECT(appsrc));
+		return;
+	}
+
+	mount.m_branch = branch;
+	mount.m_media = GST_RTSP_MEDIA(g_object_ref(G_OBJECT(p_media)));
+	g_signal_connect(G_OBJECT(p_media), "unprepared", G_CALLBACK(on_media_unprepared), &mount);
+
+	// The media counts like an HTTP client
+	mount.m_pipeline->acquire_hold();
+
+	std::cerr << "RTSP media created\n";
+}
+
+
+void rtsp_server::on_media_unprepared(GstRTSPMedia *, gpointer p_user_data)
+{
+	rtsp_mount &mount = *reinterpret_cast < rtsp_mount* > (p_user_data);
+	std::cerr << "RTSP media unprepared\n";
+	release_media(mount);
+}
+
+
+GstFlowReturn rtsp_server::on_new_sample(GstAppSink *p_appsink, gpointer p_user_data)
+{
+	rtsp_mount &mount = *reinterpret_cast < rtsp_mount* > (p_user_data);
+
+	GstSample *sample = gst_app_sink_pull_sample(p_appsink);
+	if (sample == nullptr)
+		return GST_FLOW_EOS;
+
+	auto sample_guard = make_scope_guard([sample]() { gst_sample_unref(sample); });
+
+	std::lock_guard < std::mutex > lock(mount.m_appsrc_mutex);
+
+	if (mount.m_appsrc == nullptr)
+		return GST_FLOW_OK;
+
+	// The branch is attached at an arbitrary point of the stream,
+	// so let the RTSP clients start with a keyframe
+	if (!mount.m_got_keyframe)
+	{
+		GstBuffer *buffer = gst_sample_get_buffer(sample);
+		if ((buffer == nullptr) || GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+			return GST_FLOW_OK;
+		mount.m_got_keyframe = true;
+
+		// The encoder may have sent the SPS and PPS long before
+		GstSample *parameter_sets = mount.m_pipeline->create_parameter_set_sample(sample);
+		if (parameter_sets != nullptr)
+		{
+			gst_app_src_push_sample(mount.m_appsrc, parameter_sets);
+			gst_sample_unref(parameter_sets);
+		}
+	}
+
+	// Errors show up in the RTSP media itself, and
+	// must not affect the HTTP pipeline
+	gst_app_src_push_sample(mount.m_appsrc, sample);
+
+	return GST_FLOW_OK;
+}
+
+
+void rtsp_server::release_media(rtsp_mount &p_mount)
+{
+	if (p_mount.m_media == nullptr)
+		return;
+
+	g_signal_handlers_disconnect_by_data(G_OBJECT(p_mount.m_media), &p_mount);
+
+	// This stops the branch's streaming thread, so
+	// on_new_sample() is not called anymore afterwards
+	p_mount.m_pipeline->detach_stream_consumer(p_mount.m_branch);
+	gst_object_unref(GST_OBJECT(p_mount.m_branch));
+	p_mount.m_branch = nullptr;
+
+	{
+		std::lock_guard < std::mutex > lock(p_mount.m_appsrc_mutex);
+
+		// If the media is still in use (because the path was
+		// removed), let its clients know that nothing comes anymore
+		gst_app_src_end_of_stream(p_mount.m_appsrc);
+		gst_object_unref(GST_OBJECT(p_mount.m_appsrc));
+		p_mount.m_appsrc = nullptr;
+	}
+
+	g_object_unref(G_OBJECT(p_mount.m_media));
+	p_mount.m_media = nullptr;
+
+	p_mount.m_pipeline->release_hold();
+}
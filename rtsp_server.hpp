@@ -0,0 +1,82 @@
+#ifndef GST_SOUP_SERVER_EXAMPLE_RTSP_SERVER_HPP
+#define GST_SOUP_SERVER_EXAMPLE_RTSP_SERVER_HPP
+
+#include <glib.h>
+#include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/app/gstappsink.h>
+#include <gst/rtsp-server/rtsp-server.h>
+#include <string>
+#include <map>
+#include <memory>
+#include <mutex>
+
+
+class http_stream_pipeline;
+
+
+// Serves the streams of http_stream_pipeline instances over RTSP, for
+// clients that do not speak HTTP. The RTSP side does not run its own
+// source or encoder. Instead, each RTSP media consists of an appsrc and
+// a payloader, and the appsrc is fed from a branch that is attached to
+// the encoded output of the HTTP pipeline (see
+// http_stream_pipeline::attach_stream_consumer()).
+//
+// The media of a mount is shared by all RTSP clients of that mount. While
+// it exists (from the first client's setup until the last client's
+// teardown or session timeout), it holds the HTTP pipeline, so the
+// pipeline is started and stopped just like it is for HTTP clients.
+//
+// In muxed mode, the stream must be MPEG-TS, which is sent with
+// rtpmp2tpay. In elementary stream mode, the "video" stream must be
+// H.264, which is sent with rtph264pay.
+//
+// All functions must be called from the mainloop thread. The RTSP clients
+// are handled in that thread too, since the server's thread pool is not
+// allowed to have any threads.
+class rtsp_server
+{
+public:
+	explicit rtsp_server(guint const p_port);
+	~rtsp_server();
+
+	// Makes the pipeline available under the given path (which must start
+	// with a '/'). If something is available under that path already, it
+	// is replaced. Existing RTSP sessions of a replaced or removed path
+	// stop getting data.
+	void add_mount(std::string const &p_path, http_stream_pipeline &p_pipeline);
+	void remove_mount(std::string const &p_path);
+
+
+private:
+	rtsp_server(rtsp_server const &) = delete;
+	rtsp_server& operator = (rtsp_server const &) = delete;
+
+	// The factory of one path, and the branch that feeds
+	// its media while the media exists
+	struct rtsp_mount
+	{
+		http_stream_pipeline *m_pipeline;
+		GstRTSPMediaFactory *m_factory;
+		GstRTSPMedia *m_media;
+		GstElement *m_branch;
+
+		// The appsrc is accessed from the branch's streaming thread
+		std::mutex m_appsrc_mutex;
+		GstAppSrc *m_appsrc;
+		bool m_got_keyframe;
+	};
+
+	static void on_media_configure(GstRTSPMediaFactory *, GstRTSPMedia *p_media, gpointer p_user_data);
+	static void on_media_unprepared(GstRTSPMedia *, gpointer p_user_data);
+	static GstFlowReturn on_new_sample(GstAppSink *p_appsink, gpointer p_user_data);
+	static void release_media(rtsp_mount &p_mount);
+
+
+	GstRTSPServer *m_server;
+	guint m_server_source;
+	std::map < std::string, std::unique_ptr < rtsp_mount > > m_mounts;
+};
+
+
+#endif
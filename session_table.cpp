@@ -0,0 +1,185 @@
+#include <fstream>
+#include "session_table.hpp"
+
+
+namespace
+{
+
+
+// 128 random bits, hex encoded
+std::size_t const token_num_bytes = 16;
+
+// How many sessions purge_some_closed_sessions() checks
+std::size_t const max_purge_checks = 8;
+
+
+} // unnamed namespace end
+
+
+
+
+session_table::adaptation_state::adaptation_state()
+	: m_num_dropped_buffers(0)
+	, m_num_congested_checks(0)
+	, m_num_healthy_checks(0)
+	, m_last_change_time(0)
+{
+}
+
+
+session_table::session_table()
+{
+}
+
+
+session_table::~session_table()
+{
+	for (auto &entry : m_sessions)
+		g_object_unref(G_OBJECT(entry.second.m_socket));
+}
+
+
+std::string session_table::create_token()
+{
+	// Tokens must not be guessable, since they allow for
+	// taking over someone else's connection. GLib's PRNG
+	// is only used if the system's is not available.
+	unsigned char bytes[token_num_bytes];
+	std::ifstream urandom("/dev/urandom", std::ios::binary);
+	if (!urandom.read(reinterpret_cast < char* > (bytes), sizeof(bytes)))
+	{
+		for (unsigned char &byte : bytes)
+			byte = g_random_int_range(0, 256);
+	}
+
+	static char const hex_digits[] = "0123456789abcdef";
+	std::string token;
+	for (unsigned char byte : bytes)
+	{
+		token += hex_digits[byte >> 4];
+		token += hex_digits[byte & 0xF];
+	}
+
+	return token;
+}
+
+
+void session_table::add_session(std::string const &p_token, GSocket *p_socket, std::string p_mount_name, std::string p_path, std::string p_accept_header)
+{
+	// Purging here keeps the table from growing with the number of
+	// connections ever made, even if end_session() is missed. Since
+	// more sessions are checked than added, it keeps up.
+	purge_some_closed_sessions();
+
+	session &new_session = m_sessions[p_token];
+	if (new_session.m_socket != nullptr)
+	{
+		m_tokens_by_socket.erase(new_session.m_socket);
+		g_object_unref(G_OBJECT(new_session.m_socket));
+	}
+	m_tokens_by_socket[p_socket] = p_token;
+	new_session.m_token = p_token;
+	new_session.m_socket = G_SOCKET(g_object_ref(G_OBJECT(p_socket)));
+	new_session.m_mount_name = std::move(p_mount_name);
+	new_session.m_path = std::move(p_path);
+	new_session.m_accept_header = std::move(p_accept_header);
+}
+
+
+session_table::session* session_table::find_session(std::string const &p_token)
+{
+	auto session_iter = m_sessions.find(p_token);
+	if (session_iter == m_sessions.end())
+		return nullptr;
+
+	if (g_socket_is_closed(session_iter->second.m_socket))
+	{
+		end_session(session_iter);
+		return nullptr;
+	}
+
+	return &(session_iter->second);
+}
+
+
+void session_table::end_session(GSocket *p_socket)
+{
+	auto token_iter = m_tokens_by_socket.find(p_socket);
+	if (token_iter == m_tokens_by_socket.end())
+		return;
+
+	auto session_iter = m_sessions.find(token_iter->second);
+	if (session_iter != m_sessions.end())
+		end_session(session_iter);
+}
+
+
+bool session_table::resume_session(std::string const &p_token, std::string const &p_mount_name, gint64 &p_end_time)
+{
+	// The connection may have been closed without end_session() having
+	// been called yet (the client removal is handled asynchronously);
+	// ending it now moves it to the ended ones
+	auto session_iter = m_sessions.find(p_token);
+	if ((session_iter != m_sessions.end()) && g_socket_is_closed(session_iter->second.m_socket))
+		end_session(session_iter);
+
+	auto mount_iter = m_ended_sessions.find(p_mount_name);
+	if (mount_iter == m_ended_sessions.end())
+		return false;
+
+	std::deque < ended_session > &ended = mount_iter->second;
+	for (auto ended_iter = ended.begin(); ended_iter != ended.end(); ++ended_iter)
+	{
+		if (ended_iter->m_token == p_token)
+		{
+			p_end_time = ended_iter->m_end_time;
+			ended.erase(ended_iter);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+void session_table::clear_resume_history(std::string const &p_mount_name)
+{
+	m_ended_sessions.erase(p_mount_name);
+}
+
+
+void session_table::purge_some_closed_sessions()
+{
+	auto session_iter = m_sessions.lower_bound(m_purge_position);
+	for (std::size_t i = 0; (i < max_purge_checks) && !m_sessions.empty(); ++i)
+	{
+		if (session_iter == m_sessions.end())
+			session_iter = m_sessions.begin();
+
+		if (g_socket_is_closed(session_iter->second.m_socket))
+			session_iter = end_session(session_iter);
+		else
+			++session_iter;
+	}
+
+	m_purge_position = (session_iter != m_sessions.end()) ? session_iter->first : std::string();
+}
+
+
+session_table::sessions::iterator session_table::end_session(sessions::iterator p_session_iter)
+{
+	session &old_session = p_session_iter->second;
+
+	std::deque < ended_session > &ended = m_ended_sessions[old_session.m_mount_name];
+	ended.push_back(ended_session { old_session.m_token, g_get_monotonic_time() });
+	if (ended.size() > max_ended_sessions)
+		ended.pop_front();
+
+	// The socket may have been given to a newer session since
+	auto token_iter = m_tokens_by_socket.find(old_session.m_socket);
+	if ((token_iter != m_tokens_by_socket.end()) && (token_iter->second == old_session.m_token))
+		m_tokens_by_socket.erase(token_iter);
+
+	g_object_unref(G_OBJECT(old_session.m_socket));
+	return m_sessions.erase(p_session_iter);
+}
@@ -0,0 +1,154 @@
+#ifndef GST_SOUP_SERVER_EXAMPLE_SESSION_TABLE_HPP
+#define GST_SOUP_SERVER_EXAMPLE_SESSION_TABLE_HPP
+
+#include <gio/gio.h>
+#include <string>
+#include <map>
+#include <deque>
+
+
+// Remembers the streaming connections by a random token, which is sent
+// to the client in the X-Session-Token response header. Requests that
+// refer to an existing connection (like switching it to another mount)
+// use this token to identify it.
+//
+// A session only refers to the connection's socket; which pipeline the
+// socket is in has to be looked up. Sessions end when their socket gets
+// closed. Normally, end_session() is called right away then; sessions
+// whose connection was closed some other way are purged lazily, a few
+// at a time.
+//
+// The tokens of the most recently ended sessions are remembered per
+// mount, together with the time the session ended, so that a client
+// which lost its connection can resume it (see resume_session()).
+//
+// All functions must be called from the mainloop thread.
+class session_table
+{
+public:
+	// Congestion tracking of quality_adapter
+	struct adaptation_state
+	{
+		guint64 m_num_dropped_buffers;
+		unsigned int m_num_congested_checks, m_num_healthy_checks;
+		gint64 m_last_change_time;
+
+		adaptation_state();
+	};
+
+	struct rendition_change
+	{
+		// Wall clock time, in microseconds since the epoch
+		gint64 m_time;
+		std::string m_from, m_to, m_reason;
+	};
+
+	typedef std::deque < rendition_change > rendition_history;
+
+	struct session
+	{
+		std::string m_token;
+		GSocket *m_socket;
+
+		// The mount the client is currently connected to, and what
+		// it originally requested (used for picking an output when the
+		// client is moved elsewhere)
+		std::string m_mount_name;
+		std::string m_path;
+		std::string m_accept_header;
+
+		adaptation_state m_adaptation;
+
+		// The most recent quality adaptation changes, oldest first.
+		// Only the last max_rendition_history_size ones are kept.
+		rendition_history m_rendition_history;
+	};
+
+	static std::size_t const max_rendition_history_size = 32;
+
+	// How many ended sessions are remembered per mount
+	static std::size_t const max_ended_sessions = 64;
+
+	session_table();
+	~session_table();
+
+	// Returns a new token. The session itself is added
+	// with add_session() once the socket is known.
+	static std::string create_token();
+
+	void add_session(std::string const &p_token, GSocket *p_socket, std::string p_mount_name, std::string p_path, std::string p_accept_header);
+
+	// Returns null if there is no session with that token,
+	// or if its connection has been closed in the meantime.
+	session* find_session(std::string const &p_token);
+
+	// Ends the session of the connection with the given socket,
+	// if there is one, and remembers it as ended.
+	void end_session(GSocket *p_socket);
+
+	// Looks up an ended session of the given mount. If there is one, it
+	// is forgotten (so it can only be resumed once), p_end_time is set to
+	// the monotonic time it ended at, and true is returned. Sessions whose
+	// connection is still open cannot be resumed.
+	bool resume_session(std::string const &p_token, std::string const &p_mount_name, gint64 &p_end_time);
+
+	// Forgets the ended sessions of the given mount
+	void clear_resume_history(std::string const &p_mount_name);
+
+	// Calls the function for every session whose connection is still
+	// open. The others are ended on the way.
+	template < typename Function >
+	void for_each_session(Function const &p_function)
+	{
+		for (auto session_iter = m_sessions.begin(); session_iter != m_sessions.end(); )
+		{
+			if (g_socket_is_closed(session_iter->second.m_socket))
+			{
+				session_iter = end_session(session_iter);
+			}
+			else
+			{
+				p_function(session_iter->second);
+				++session_iter;
+			}
+		}
+	}
+
+	std::size_t get_num_sessions() const
+	{
+		return m_sessions.size();
+	}
+
+
+private:
+	session_table(session_table const &) = delete;
+	session_table& operator = (session_table const &) = delete;
+
+	typedef std::map < std::string, session > sessions;
+	// For end_session(), which is called for every closed connection
+	typedef std::map < GSocket*, std::string > tokens_by_socket;
+
+	// Checks a few sessions for closed connections, starting
+	// where the previous call stopped
+	void purge_some_closed_sessions();
+	// Remembers the session as ended and removes it;
+	// returns the iterator to the next session
+	sessions::iterator end_session(sessions::iterator p_session_iter);
+
+	struct ended_session
+	{
+		std::string m_token;
+		gint64 m_end_time;
+	};
+
+	// Oldest first, per mount name
+	typedef std::map < std::string, std::deque < ended_session > > ended_sessions;
+
+	sessions m_sessions;
+	std::string m_purge_position;
+	tokens_by_socket m_tokens_by_socket;
+	ended_sessions m_ended_sessions;
+};
+
+
+#endif
@@ -0,0 +1,270 @@
+#include <iostream>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "http_stream_pipeline.hpp"
+#include "shm_output.hpp"
+#include "scope_guard.hpp"
+
+
+namespace
+{
+
+
+// Data is dropped once this much is waiting for room in the
+// shared memory area
+char const *pipeline_description = "appsrc name=src ! queue leaky=downstream max-size-buffers=0 max-size-bytes=0 max-size-time=1000000000 ! shmsink name=sink";
+
+
+// shmsink's signals come from its own thread; the consumers are
+// counted in the mainloop thread (see bus_watch())
+void post_consumer_message(GstElement *p_shmsink, char const *p_name)
+{
+	gst_element_post_message(p_shmsink, gst_message_new_element(GST_OBJECT(p_shmsink), gst_structure_new_empty(p_name)));
+}
+
+
+} // unnamed namespace end
+
+
+
+
+shm_output::shm_output(http_stream_pipeline &p_pipeline, std::string const &p_socket_path, guint64 const p_size)
+	: m_pipeline(p_pipeline)
+	, m_shm_pipeline(nullptr)
+	, m_appsrc(nullptr)
+	, m_watch_source(0)
+	, m_branch(nullptr)
+	, m_got_keyframe(false)
+{
+	m_stats.m_num_consumers = 0;
+	m_stats.m_num_connections = 0;
+
+	GError *gerror = nullptr;
+	m_shm_pipeline = gst_parse_launch(pipeline_description, &gerror);
+	if (m_shm_pipeline == nullptr)
+	{
+		std::string s = std::string("could not create shared memory pipeline: ") + gerror->message;
+		g_clear_error(&gerror);
+		throw std::runtime_error(s);
+	}
+	g_clear_error(&gerror);
+
+	auto pipeline_guard = make_scope_guard([this]() { gst_object_unref(GST_OBJECT(m_shm_pipeline)); });
+
+	m_appsrc = GST_APP_SRC(gst_bin_get_by_name(GST_BIN(m_shm_pipeline), "src"));
+	g_object_set(
+		G_OBJECT(m_appsrc),
+		"is-live", TRUE,
+		"do-timestamp", TRUE,
+		"format", GST_FORMAT_TIME,
+		nullptr
+	);
+
+	// The data is only written while consumers are connected, and
+	// is not synchronized to the clock (it already was upstream)
+	GstElement *shmsink = gst_bin_get_by_name(GST_BIN(m_shm_pipeline), "sink");
+	g_object_set(
+		G_OBJECT(shmsink),
+		"socket-path", p_socket_path.c_str(),
+		"shm-size", guint(p_size),
+		"wait-for-connection", FALSE,
+		"sync", FALSE,
+		"async", FALSE,
+		nullptr
+	);
+	void (*client_connected_cb)(GstElement *, gint, gpointer) = [](GstElement *p_shmsink, gint, gpointer)
+	{
+		post_consumer_message(p_shmsink, "ShmConsumerConnected");
+	};
+	void (*client_disconnected_cb)(GstElement *, gint, gpointer) = [](GstElement *p_shmsink, gint, gpointer)
+	{
+		post_consumer_message(p_shmsink, "ShmConsumerDisconnected");
+	};
+	g_signal_connect(G_OBJECT(shmsink), "client-connected", G_CALLBACK(client_connected_cb), nullptr);
+	g_signal_connect(G_OBJECT(shmsink), "client-disconnected", G_CALLBACK(client_disconnected_cb), nullptr);
+	gst_object_unref(GST_OBJECT(shmsink));
+
+	GstBus *bus = gst_pipeline_get_bus(GST_PIPELINE(m_shm_pipeline));
+	m_watch_source = gst_bus_add_watch(bus, bus_watch, this);
+	gst_object_unref(GST_OBJECT(bus));
+
+	// shmsink would pick a different path if the socket file exists,
+	// so remove a socket file that was left behind
+	struct stat file_stat;
+	if ((lstat(p_socket_path.c_str(), &file_stat) == 0) && S_ISSOCK(file_stat.st_mode))
+		unlink(p_socket_path.c_str());
+
+	// shmsink creates the control socket and the shared memory
+	// area when it starts, so it has to run all the time
+	if (gst_element_set_state(m_shm_pipeline, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE)
+	{
+		g_source_remove(m_watch_source);
+		gst_element_set_state(m_shm_pipeline, GST_STATE_NULL);
+		gst_object_unref(GST_OBJECT(m_appsrc));
+		throw std::runtime_error("could not start shared memory output at " + p_socket_path);
+	}
+
+	pipeline_guard.dismiss();
+
+	std::cerr << "Shared memory output at " << p_socket_path << "\n";
+}
+
+
+shm_output::~shm_output()
+{
+	stop();
+
+	g_source_remove(m_watch_source);
+
+	gst_element_set_state(m_shm_pipeline, GST_STATE_NULL);
+	gst_object_unref(GST_OBJECT(m_appsrc));
+	gst_object_unref(GST_OBJECT(m_shm_pipeline));
+}
+
+
+void shm_output::start()
+{
+	GstElement *queue = gst_element_factory_make("queue", nullptr);
+	GstElement *appsink = gst_element_factory_make("appsink", nullptr);
+	if ((queue == nullptr) || (appsink == nullptr))
+	{
+		if (queue != nullptr) gst_object_unref(GST_OBJECT(queue));
+		if (appsink != nullptr) gst_object_unref(GST_OBJECT(appsink));
+		throw std::runtime_error("could not create shared memory branch elements (queue, appsink)");
+	}
+
+	g_object_set(G_OBJECT(appsink), "sync", FALSE, "enable-last-sample", FALSE, nullptr);
+
+	GstAppSinkCallbacks callbacks = GstAppSinkCallbacks();
+	callbacks.new_sample = on_new_sample;
+	gst_app_sink_set_callbacks(GST_APP_SINK(appsink), &callbacks, this, nullptr);
+
+	GstElement *branch = gst_bin_new(nullptr);
+	gst_object_ref_sink(GST_OBJECT(branch));
+	auto branch_guard = make_scope_guard([branch]() { gst_object_unref(GST_OBJECT(branch)); });
+
+	gst_bin_add_many(GST_BIN(branch), queue, appsink, nullptr);
+	gst_element_link(queue, appsink);
+
+	GstPad *queue_sinkpad = gst_element_get_static_pad(queue, "sink");
+	gst_element_add_pad(branch, gst_ghost_pad_new("sink", queue_sinkpad));
+	gst_object_unref(GST_OBJECT(queue_sinkpad));
+
+	m_got_keyframe = false;
+	m_pipeline.attach_stream_consumer(branch);
+
+	branch_guard.dismiss();
+	m_branch = branch;
+
+	// The consumers count like HTTP clients
+	m_pipeline.acquire_hold();
+}
+
+
+void shm_output::stop()
+{
+	if (m_branch == nullptr)
+		return;
+
+	// This stops the branch's streaming thread, so
+	// on_new_sample() is not called anymore afterwards
+	m_pipeline.detach_stream_consumer(m_branch);
+	gst_object_unref(GST_OBJECT(m_branch));
+	m_branch = nullptr;
+
+	m_pipeline.release_hold();
+}
+
+
+GstFlowReturn shm_output::on_new_sample(GstAppSink *p_appsink, gpointer p_user_data)
+{
+	shm_output *self = reinterpret_cast < shm_output* > (p_user_data);
+
+	GstSample *sample = gst_app_sink_pull_sample(p_appsink);
+	if (sample == nullptr)
+		return GST_FLOW_EOS;
+
+	auto sample_guard = make_scope_guard([sample]() { gst_sample_unref(sample); });
+
+	if (!self->m_got_keyframe)
+	{
+		GstBuffer *buffer = gst_sample_get_buffer(sample);
+		if ((buffer == nullptr) || GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+			return GST_FLOW_OK;
+		self->m_got_keyframe = true;
+	}
+
+	// The buffer is only referenced here; the one copy
+	// is made by shmsink into the shared memory area
+	gst_app_src_push_sample(self->m_appsrc, sample);
+
+	return GST_FLOW_OK;
+}
+
+
+gboolean shm_output::bus_watch(GstBus *, GstMessage *p_msg, gpointer p_user_data)
+{
+	shm_output *self = reinterpret_cast < shm_output* > (p_user_data);
+
+	switch (GST_MESSAGE_TYPE(p_msg))
+	{
+		case GST_MESSAGE_ELEMENT:
+		{
+			GstStructure const *structure = gst_message_get_structure(p_msg);
+
+			if (gst_structure_has_name(structure, "ShmConsumerConnected"))
+			{
+				++self->m_stats.m_num_consumers;
+				++self->m_stats.m_num_connections;
+				std::cerr << "Shared memory consumer connected (" << self->m_stats.m_num_consumers << " consumer(s))\n";
+
+				if (self->m_stats.m_num_consumers == 1)
+				{
+					try
+					{
+						self->start();
+					}
+					catch (std::exception const &p_exc)
+					{
+						std::cerr << "Could not attach shared memory branch: " << p_exc.what() << "\n";
+					}
+				}
+			}
+			else if (gst_structure_has_name(structure, "ShmConsumerDisconnected") && (self->m_stats.m_num_consumers > 0))
+			{
+				--self->m_stats.m_num_consumers;
+				std::cerr << "Shared memory consumer disconnected (" << self->m_stats.m_num_consumers << " consumer(s))\n";
+
+				if (self->m_stats.m_num_consumers == 0)
+					self->stop();
+			}
+
+			break;
+		}
+
+		case GST_MESSAGE_WARNING:
+		case GST_MESSAGE_ERROR:
+		{
+			GError *gerror = nullptr;
+			gchar *debug_info = nullptr;
+
+			if (GST_MESSAGE_TYPE(p_msg) == GST_MESSAGE_ERROR)
+				gst_message_parse_error(p_msg, &gerror, &debug_info);
+			else
+				gst_message_parse_warning(p_msg, &gerror, &debug_info);
+
+			std::cerr << "Shared memory output " << ((GST_MESSAGE_TYPE(p_msg) == GST_MESSAGE_ERROR) ? "ERROR: " : "WARNING: ") << gerror->message << "; debug info: " << debug_info << "\n";
+
+			g_clear_error(&gerror);
+			g_free(debug_info);
+
+			break;
+		}
+
+		default:
+			break;
+	}
+
+	return TRUE;
+}
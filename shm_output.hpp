@@ -0,0 +1,77 @@
+#ifndef GST_SOUP_SERVER_EXAMPLE_SHM_OUTPUT_HPP
+#define GST_SOUP_SERVER_EXAMPLE_SHM_OUTPUT_HPP
+
+#include <glib.h>
+#include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/app/gstappsink.h>
+#include <string>
+
+
+class http_stream_pipeline;
+
+
+// Makes the stream of a http_stream_pipeline available to local consumers
+// through shared memory. A separate pipeline (appsrc ! queue ! shmsink) is
+// fed from a branch of the HTTP pipeline. shmsink writes each buffer into
+// its shared memory area once, and tells all consumers over its control
+// socket where it is; the consumers (typically shmsrc) map the area
+// read-only and read the data from there. The data is therefore neither
+// copied per consumer nor sent through any socket.
+//
+// While at least one consumer is connected, the branch is attached and
+// a hold keeps the HTTP pipeline running. The first consumer starts with
+// a keyframe; later ones start at whatever buffer comes next. If the
+// consumers do not release the buffers quickly enough, the oldest data
+// is dropped before it reaches shmsink, so slow consumers do not hold up
+// the HTTP pipeline.
+//
+// shmsink does not pass on caps, so consumers have to set them themselves.
+//
+// All functions must be called from the mainloop thread.
+class shm_output
+{
+public:
+	struct stats
+	{
+		guint m_num_consumers;
+		guint64 m_num_connections;
+	};
+
+	explicit shm_output(http_stream_pipeline &p_pipeline, std::string const &p_socket_path, guint64 const p_size);
+	~shm_output();
+
+	stats get_stats() const
+	{
+		return m_stats;
+	}
+
+
+private:
+	shm_output(shm_output const &) = delete;
+	shm_output& operator = (shm_output const &) = delete;
+
+	// Attach the branch to the HTTP pipeline, and detach it again
+	void start();
+	void stop();
+
+	static GstFlowReturn on_new_sample(GstAppSink *p_appsink, gpointer p_user_data);
+	static gboolean bus_watch(GstBus *, GstMessage *p_msg, gpointer p_user_data);
+
+
+	http_stream_pipeline &m_pipeline;
+
+	GstElement *m_shm_pipeline;
+	GstAppSrc *m_appsrc;
+	guint m_watch_source;
+
+	// The branch of the HTTP pipeline while consumers are connected;
+	// m_got_keyframe is only accessed from its streaming thread
+	GstElement *m_branch;
+	bool m_got_keyframe;
+
+	stats m_stats;
+};
+
+
+#endif
@@ -0,0 +1,243 @@
+#include <iostream>
+#include <json-glib/json-glib.h>
+#include "sibling_balancer.hpp"
+#include "scope_guard.hpp"
+
+
+namespace
+{
+
+
+guint const poll_interval_ms = 2000;
+
+// Load reports older than this are not trusted anymore
+gint64 const max_load_age = 3 * poll_interval_ms * G_TIME_SPAN_MILLISECOND;
+
+
+// Returns the value of an integer member of the object,
+// or 0 if there is no such member
+guint64 get_uint_member(JsonObject *p_object, char const *p_name)
+{
+	JsonNode *node = json_object_get_member(p_object, p_name);
+	if ((node == nullptr) || !JSON_NODE_HOLDS_VALUE(node) || (json_node_get_value_type(node) != G_TYPE_INT64))
+		return 0;
+
+	gint64 value = json_node_get_int(node);
+	return (value > 0) ? guint64(value) : 0;
+}
+
+
+} // unnamed namespace end
+
+
+
+
+std::string const sibling_balancer::load_path = "/load";
+
+
+sibling_balancer::sibling_balancer(SoupServer *p_server, mount_table &p_mount_table, std::vector < std::string > const &p_sibling_urls, unsigned int const p_capacity)
+	: m_server(p_server)
+	, m_mount_table(p_mount_table)
+	, m_capacity(p_capacity)
+	, m_session(nullptr)
+	, m_poll_source(0)
+	, m_num_redirects(0)
+{
+	for (std::string const &url : p_sibling_urls)
+	{
+		// Paths are appended to the base URL as they are
+		std::string base_url = url;
+		while (!base_url.empty() && (base_url.back() == '/'))
+			base_url.pop_back();
+
+		m_siblings.push_back(sibling { this, base_url, 0, 0, std::set < std::string > (), 0, false });
+	}
+
+	// Every server reports its load, even if it does not redirect
+	// clients itself, so others can redirect to it
+	soup_server_add_handler(m_server, load_path.c_str(), load_request_handler, this, nullptr);
+
+	if (!m_siblings.empty())
+	{
+		// Do not let an unresponsive sibling hold up its poll for too long
+		m_session = soup_session_new_with_options(SOUP_SESSION_TIMEOUT, guint(poll_interval_ms / 1000), nullptr);
+
+		m_poll_source = g_timeout_add(poll_interval_ms, [](gpointer p_user_data) -> gboolean
+		{
+			sibling_balancer *self = reinterpret_cast < sibling_balancer* > (p_user_data);
+			self->poll_siblings();
+			return G_SOURCE_CONTINUE;
+		}, this);
+		poll_siblings();
+	}
+
+	if (m_capacity > 0)
+	{
+		m_mount_table.set_redirect_callback([this](std::string const &p_mount_name, SoupMessage *p_msg)
+		{
+			return find_redirect(p_mount_name, p_msg);
+		});
+	}
+}
+
+
+sibling_balancer::~sibling_balancer()
+{
+	m_mount_table.set_redirect_callback(mount_table::redirect_callback());
+	soup_server_remove_handler(m_server, load_path.c_str());
+
+	if (m_poll_source != 0)
+		g_source_remove(m_poll_source);
+
+	if (m_session != nullptr)
+	{
+		// This invokes the callbacks of pending polls right away
+		soup_session_abort(m_session);
+		g_object_unref(G_OBJECT(m_session));
+	}
+}
+
+
+std::string sibling_balancer::find_redirect(std::string const &p_mount_name, SoupMessage *p_msg)
+{
+	if (m_mount_table.get_num_clients() < m_capacity)
+		return "";
+
+	gint64 now = g_get_monotonic_time();
+
+	// Compare the loads as fractions of the capacities, without division:
+	// a/b < c/d <=> a*d < c*b (with positive b and d)
+	sibling *least_loaded = nullptr;
+	for (sibling &candidate : m_siblings)
+	{
+		bool eligible = (candidate.m_last_update != 0)
+		             && ((now - candidate.m_last_update) <= max_load_age)
+		             && (candidate.m_capacity > 0)
+		             && (candidate.m_num_clients < candidate.m_capacity)
+		             && (candidate.m_mount_names.count(p_mount_name) != 0);
+		if (!eligible)
+			continue;
+
+		if ((least_loaded == nullptr) || (guint64(candidate.m_num_clients) * least_loaded->m_capacity < guint64(least_loaded->m_num_clients) * candidate.m_capacity))
+			least_loaded = &candidate;
+	}
+
+	if (least_loaded == nullptr)
+		return "";
+
+	// The client will show up there before the next poll
+	++(least_loaded->m_num_clients);
+	++m_num_redirects;
+
+	SoupURI *uri = soup_message_get_uri(p_msg);
+	std::string location = least_loaded->m_base_url + soup_uri_get_path(uri);
+	char const *query = soup_uri_get_query(uri);
+	if (query != nullptr)
+		location += std::string("?") + query;
+
+	return location;
+}
+
+
+void sibling_balancer::poll_siblings()
+{
+	for (sibling &sib : m_siblings)
+	{
+		// Do not pile up polls of a sibling that does not answer
+		if (sib.m_poll_pending)
+			continue;
+
+		std::string url = sib.m_base_url + load_path;
+		SoupMessage *msg = soup_message_new(SOUP_METHOD_GET, url.c_str());
+		if (msg == nullptr)
+		{
+			std::cerr << "Invalid sibling URL \"" << sib.m_base_url << "\"\n";
+			continue;
+		}
+
+		sib.m_poll_pending = true;
+		soup_session_queue_message(m_session, msg, on_poll_response, &sib);
+	}
+}
+
+
+void sibling_balancer::on_poll_response(SoupSession *, SoupMessage *p_msg, gpointer p_user_data)
+{
+	sibling &sib = *reinterpret_cast < sibling* > (p_user_data);
+	sib.m_poll_pending = false;
+
+	if (!SOUP_STATUS_IS_SUCCESSFUL(p_msg->status_code))
+		return;
+
+	JsonParser *parser = json_parser_new();
+	auto parser_guard = make_scope_guard([parser]() { g_object_unref(G_OBJECT(parser)); });
+
+	if (!json_parser_load_from_data(parser, p_msg->response_body->data, p_msg->response_body->length, nullptr))
+		return;
+
+	JsonNode *root = json_parser_get_root(parser);
+	if ((root == nullptr) || !JSON_NODE_HOLDS_OBJECT(root))
+		return;
+
+	JsonObject *object = json_node_get_object(root);
+	sib.m_num_clients = get_uint_member(object, "clients");
+	sib.m_capacity = get_uint_member(object, "capacity");
+
+	sib.m_mount_names.clear();
+	JsonNode *mounts_node = json_object_get_member(object, "mounts");
+	if ((mounts_node != nullptr) && JSON_NODE_HOLDS_ARRAY(mounts_node))
+	{
+		JsonArray *mounts = json_node_get_array(mounts_node);
+		for (guint i = 0; i < json_array_get_length(mounts); ++i)
+		{
+			JsonNode *name_node = json_array_get_element(mounts, i);
+			if (JSON_NODE_HOLDS_VALUE(name_node) && (json_node_get_value_type(name_node) == G_TYPE_STRING))
+				sib.m_mount_names.insert(json_node_get_string(name_node));
+		}
+	}
+
+	sib.m_last_update = g_get_monotonic_time();
+}
+
+
+void sibling_balancer::load_request_handler(SoupServer *, SoupMessage *p_msg, char const *, GHashTable *, SoupClientContext *, gpointer p_user_data)
+{
+	sibling_balancer *self = reinterpret_cast < sibling_balancer* > (p_user_data);
+
+	if (std::string(p_msg->method) != SOUP_METHOD_GET)
+	{
+		soup_message_set_status(p_msg, SOUP_STATUS_METHOD_NOT_ALLOWED);
+		return;
+	}
+
+	JsonBuilder *builder = json_builder_new();
+	json_builder_begin_object(builder);
+	json_builder_set_member_name(builder, "clients");
+	json_builder_add_int_value(builder, self->m_mount_table.get_num_clients());
+	json_builder_set_member_name(builder, "capacity");
+	json_builder_add_int_value(builder, self->m_capacity);
+	json_builder_set_member_name(builder, "redirects");
+	json_builder_add_int_value(builder, self->m_num_redirects);
+	json_builder_set_member_name(builder, "mounts");
+	json_builder_begin_array(builder);
+	for (auto const &entry : self->m_mount_table.get_mounts())
+		json_builder_add_string_value(builder, entry.first.c_str());
+	json_builder_end_array(builder);
+	json_builder_end_object(builder);
+
+	JsonGenerator *generator = json_generator_new();
+	JsonNode *root = json_builder_get_root(builder);
+	json_generator_set_root(generator, root);
+
+	gsize length = 0;
+	gchar *data = json_generator_to_data(generator, &length);
+
+	json_node_free(root);
+	g_object_unref(G_OBJECT(generator));
+	g_object_unref(G_OBJECT(builder));
+
+	// Load reports are only useful while they are fresh
+	soup_message_headers_replace(p_msg->response_headers, "Cache-Control", "no-store");
+	soup_message_set_status(p_msg, SOUP_STATUS_OK);
+	soup_message_set_response(p_msg, "application/json", SOUP_MEMORY_TAKE, data, length);
+}
@@ -0,0 +1,75 @@
+#ifndef GST_SOUP_SERVER_EXAMPLE_SIBLING_BALANCER_HPP
+#define GST_SOUP_SERVER_EXAMPLE_SIBLING_BALANCER_HPP
+
+#include <glib.h>
+#include <libsoup/soup.h>
+#include <string>
+#include <vector>
+#include <set>
+#include "mount_table.hpp"
+
+
+// Spreads new clients over a group of servers that offer the same mounts.
+//
+// Every server reports its load as JSON under "/load" on its streaming
+// port: the number of connected clients, the capacity (the number of
+// clients above which it sends new clients elsewhere; 0 if there is no
+// such limit), the names of its mounts, and how many clients it redirected
+// so far. Each server polls the "/load" resources of its configured
+// siblings every two seconds.
+//
+// Once the local number of clients reaches the capacity, new streaming
+// requests are answered with "302 Found" pointing to the same path and
+// query on the sibling that has the lowest load relative to its capacity,
+// is below its capacity, and has the requested mount. Siblings that did
+// not answer recently, and siblings without capacity, are not considered.
+// If there is no such sibling, the request is served locally anyway.
+// Redirected clients are added to the sibling's known load right away, so
+// that a burst of requests between two polls is spread out as well.
+//
+// All functions must be called from the mainloop thread.
+class sibling_balancer
+{
+public:
+	// Path of the load resource on the streaming port
+	static std::string const load_path;
+
+	// p_sibling_urls are the base URLs of the siblings' streaming ports
+	// (like "http://10.0.0.2:8080"). p_capacity is the local number of
+	// clients from which on clients are redirected; 0 disables redirects.
+	explicit sibling_balancer(SoupServer *p_server, mount_table &p_mount_table, std::vector < std::string > const &p_sibling_urls, unsigned int const p_capacity);
+	~sibling_balancer();
+
+
+private:
+	sibling_balancer(sibling_balancer const &) = delete;
+	sibling_balancer& operator = (sibling_balancer const &) = delete;
+
+	struct sibling
+	{
+		sibling_balancer *m_balancer;
+		std::string m_base_url;
+		unsigned int m_num_clients, m_capacity;
+		std::set < std::string > m_mount_names;
+		// Monotonic time of the last successful poll, or 0
+		gint64 m_last_update;
+		bool m_poll_pending;
+	};
+
+	std::string find_redirect(std::string const &p_mount_name, SoupMessage *p_msg);
+	void poll_siblings();
+	static void on_poll_response(SoupSession *, SoupMessage *p_msg, gpointer p_user_data);
+	static void load_request_handler(SoupServer *, SoupMessage *p_msg, char const *, GHashTable *, SoupClientContext *, gpointer p_user_data);
+
+
+	SoupServer *m_server;
+	mount_table &m_mount_table;
+	unsigned int m_capacity;
+	std::vector < sibling > m_siblings;
+	SoupSession *m_session;
+	guint m_poll_source;
+	unsigned int m_num_redirects;
+};
+
+
+#endif
@@ -0,0 +1,253 @@
+#include <iostream>
+#include <stdexcept>
+#include <algorithm>
+#include <mutex>
+#include <gst/app/gstappsink.h>
+#include "slate_clip.hpp"
+#include "scope_guard.hpp"
+
+
+namespace
+{
+
+
+// Reading and demuxing a short clip from a local file takes far less
+// than this; it only guards against files that never end (like FIFOs)
+GstClockTime const load_timeout = 10 * GST_SECOND;
+
+
+// Collects the streams that parsebin finds. Its pads are added from
+// its streaming thread.
+struct load_context
+{
+	GstElement *m_pipeline;
+	std::mutex m_mutex;
+	std::vector < std::pair < std::string, GstElement* > > m_appsinks;
+};
+
+
+void on_pad_added(GstElement *, GstPad *p_pad, gpointer p_user_data)
+{
+	load_context *context = reinterpret_cast < load_context* > (p_user_data);
+
+	GstCaps *caps = gst_pad_query_caps(p_pad, nullptr);
+	std::string media_type = gst_structure_get_name(gst_caps_get_structure(caps, 0));
+	gst_caps_unref(caps);
+
+	std::string name;
+	if (g_str_has_prefix(media_type.c_str(), "video/"))
+		name = "video";
+	else if (g_str_has_prefix(media_type.c_str(), "audio/"))
+		name = "audio";
+
+	std::lock_guard < std::mutex > lock(context->m_mutex);
+
+	bool taken = std::any_of(context->m_appsinks.begin(), context->m_appsinks.end(), [&name](std::pair < std::string, GstElement* > const &p_entry)
+	{
+		return p_entry.first == name;
+	});
+
+	// Everything else is discarded, but it has to go somewhere,
+	// since unlinked pads would make parsebin fail
+	GstElement *sink;
+	if (name.empty() || taken)
+	{
+		sink = gst_element_factory_make("fakesink", nullptr);
+		g_object_set(G_OBJECT(sink), "sync", FALSE, "async", FALSE, nullptr);
+	}
+	else
+	{
+		sink = gst_element_factory_make("appsink", nullptr);
+		g_object_set(G_OBJECT(sink), "sync", FALSE, "max-buffers", guint(0), nullptr);
+		context->m_appsinks.push_back(std::make_pair(name, GST_ELEMENT(gst_object_ref(GST_OBJECT(sink)))));
+	}
+
+	gst_bin_add(GST_BIN(context->m_pipeline), sink);
+	gst_element_sync_state_with_parent(sink);
+
+	GstPad *sinkpad = gst_element_get_static_pad(sink, "sink");
+	gst_pad_link(p_pad, sinkpad);
+	gst_object_unref(GST_OBJECT(sinkpad));
+}
+
+
+} // unnamed namespace end
+
+
+
+
+slate_clip::slate_clip(std::string p_path)
+	: m_path(std::move(p_path))
+	, m_duration(0)
+{
+	auto streams_guard = make_scope_guard([this]()
+	{
+		for (stream &clip_stream : m_streams)
+		{
+			gst_caps_unref(clip_stream.m_caps);
+			for (GstBuffer *buffer : clip_stream.m_buffers)
+				gst_buffer_unref(buffer);
+		}
+	});
+
+	// The clip is only parsed, not decoded; it is
+	// sent to the clients in its encoded form
+	GstElement *filesrc = gst_element_factory_make("filesrc", nullptr);
+	GstElement *parsebin = gst_element_factory_make("parsebin", nullptr);
+	if ((filesrc == nullptr) || (parsebin == nullptr))
+	{
+		if (filesrc != nullptr) gst_object_unref(GST_OBJECT(filesrc));
+		if (parsebin != nullptr) gst_object_unref(GST_OBJECT(parsebin));
+		throw std::runtime_error("could not create slate elements (filesrc, parsebin)");
+	}
+
+	load_context context;
+	context.m_pipeline = gst_pipeline_new(nullptr);
+	auto pipeline_guard = make_scope_guard([&context]()
+	{
+		gst_element_set_state(context.m_pipeline, GST_STATE_NULL);
+		for (auto const &appsink : context.m_appsinks)
+			gst_object_unref(GST_OBJECT(appsink.second));
+		gst_object_unref(GST_OBJECT(context.m_pipeline));
+	});
+
+	g_object_set(G_OBJECT(filesrc), "location", m_path.c_str(), nullptr);
+	gst_bin_add_many(GST_BIN(context.m_pipeline), filesrc, parsebin, nullptr);
+	gst_element_link(filesrc, parsebin);
+	g_signal_connect(G_OBJECT(parsebin), "pad-added", G_CALLBACK(on_pad_added), &context);
+
+	if (gst_element_set_state(context.m_pipeline, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE)
+		throw std::runtime_error("could not read slate clip " + m_path);
+
+	// The appsinks keep everything until the end is reached
+	GstBus *bus = gst_pipeline_get_bus(GST_PIPELINE(context.m_pipeline));
+	GstMessage *message = gst_bus_timed_pop_filtered(bus, load_timeout, GstMessageType(GST_MESSAGE_EOS | GST_MESSAGE_ERROR));
+	gst_object_unref(GST_OBJECT(bus));
+
+	if (message == nullptr)
+		throw std::runtime_error("timeout while reading slate clip " + m_path);
+
+	if (GST_MESSAGE_TYPE(message) == GST_MESSAGE_ERROR)
+	{
+		GError *gerror = nullptr;
+		gst_message_parse_error(message, &gerror, nullptr);
+		std::string s = "could not read slate clip " + m_path + ": " + gerror->message;
+		g_clear_error(&gerror);
+		gst_message_unref(message);
+		throw std::runtime_error(s);
+	}
+
+	gst_message_unref(message);
+
+	std::lock_guard < std::mutex > lock(context.m_mutex);
+	for (auto const &appsink : context.m_appsinks)
+	{
+		stream clip_stream;
+		clip_stream.m_name = appsink.first;
+		clip_stream.m_caps = nullptr;
+
+		for (GstSample *sample; (sample = gst_app_sink_pull_sample(GST_APP_SINK(appsink.second))) != nullptr; )
+		{
+			if (clip_stream.m_caps == nullptr)
+				clip_stream.m_caps = gst_caps_ref(gst_sample_get_caps(sample));
+			clip_stream.m_buffers.push_back(gst_buffer_ref(gst_sample_get_buffer(sample)));
+			gst_sample_unref(sample);
+		}
+
+		if (clip_stream.m_caps != nullptr)
+			m_streams.push_back(std::move(clip_stream));
+	}
+
+	if (m_streams.empty())
+		throw std::runtime_error("slate clip " + m_path + " contains neither video nor audio");
+
+	normalize_timestamps();
+
+	streams_guard.dismiss();
+
+	std::cerr << "Loaded slate clip " << m_path << " (" << m_streams.size() << " stream(s), " << GST_TIME_AS_MSECONDS(m_duration) << " ms)\n";
+}
+
+
+slate_clip::~slate_clip()
+{
+	for (stream &clip_stream : m_streams)
+	{
+		gst_caps_unref(clip_stream.m_caps);
+		for (GstBuffer *buffer : clip_stream.m_buffers)
+			gst_buffer_unref(buffer);
+	}
+}
+
+
+slate_clip::stream const * slate_clip::find_stream(std::string const &p_name) const
+{
+	for (stream const &clip_stream : m_streams)
+	{
+		if (clip_stream.m_name == p_name)
+			return &clip_stream;
+	}
+
+	return nullptr;
+}
+
+
+void slate_clip::normalize_timestamps()
+{
+	// A loop has to start with a keyframe
+	stream *video = nullptr;
+	for (stream &clip_stream : m_streams)
+	{
+		if (clip_stream.m_name == "video")
+			video = &clip_stream;
+	}
+
+	if (video != nullptr)
+	{
+		auto keyframe_iter = std::find_if(video->m_buffers.begin(), video->m_buffers.end(), [](GstBuffer *p_buffer)
+		{
+			return !GST_BUFFER_FLAG_IS_SET(p_buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+		});
+
+		if (keyframe_iter == video->m_buffers.end())
+			throw std::runtime_error("slate clip " + m_path + " contains no video keyframe");
+
+		for (auto buffer_iter = video->m_buffers.begin(); buffer_iter != keyframe_iter; ++buffer_iter)
+			gst_buffer_unref(*buffer_iter);
+		video->m_buffers.erase(video->m_buffers.begin(), keyframe_iter);
+	}
+
+	// DTS may lie before PTS (with B-frames), so both count for the start
+	GstClockTime start = GST_CLOCK_TIME_NONE, end = 0;
+	for (stream const &clip_stream : m_streams)
+	{
+		for (GstBuffer *buffer : clip_stream.m_buffers)
+		{
+			for (GstClockTime timestamp : { GST_BUFFER_PTS(buffer), GST_BUFFER_DTS(buffer) })
+			{
+				if (GST_CLOCK_TIME_IS_VALID(timestamp) && (!GST_CLOCK_TIME_IS_VALID(start) || (timestamp < start)))
+					start = timestamp;
+			}
+
+			if (GST_BUFFER_PTS_IS_VALID(buffer))
+				end = std::max(end, GST_BUFFER_PTS(buffer) + (GST_BUFFER_DURATION_IS_VALID(buffer) ? GST_BUFFER_DURATION(buffer) : 0));
+		}
+	}
+
+	if (!GST_CLOCK_TIME_IS_VALID(start) || (end <= start))
+		throw std::runtime_error("slate clip " + m_path + " has no usable timestamps");
+
+	m_duration = end - start;
+
+	for (stream &clip_stream : m_streams)
+	{
+		for (GstBuffer *&buffer : clip_stream.m_buffers)
+		{
+			buffer = gst_buffer_make_writable(buffer);
+			if (GST_BUFFER_PTS_IS_VALID(buffer))
+				GST_BUFFER_PTS(buffer) -= start;
+			if (GST_BUFFER_DTS_IS_VALID(buffer))
+				GST_BUFFER_DTS(buffer) -= start;
+		}
+	}
+}
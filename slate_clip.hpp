@@ -0,0 +1,73 @@
+#ifndef GST_SOUP_SERVER_EXAMPLE_SLATE_CLIP_HPP
+#define GST_SOUP_SERVER_EXAMPLE_SLATE_CLIP_HPP
+
+#include <gst/gst.h>
+#include <string>
+#include <vector>
+
+
+// A short pre-encoded clip (like a "stream temporarily unavailable"
+// card) that is shown to the clients while the source of a pipeline is
+// down (see http_stream_pipeline::set_slate()). Loop mounts, which are
+// used for load tests, run on such a clip instead of a launch line.
+//
+// The clip is read from a file once, and demuxed into its encoded video
+// and audio streams, which are kept in memory. The streams are named
+// like the outputs of a launch line ("video" and "audio"), and only the
+// first stream of each kind is used. The buffers' timestamps are
+// normalized, so that the clip starts at zero. Leading video buffers
+// that are not keyframes are dropped, so that the clip can be looped.
+//
+// Once loaded, the clip is never modified, so it can be shared by all
+// pipelines of a mount, and read from any thread.
+class slate_clip
+{
+public:
+	struct stream
+	{
+		std::string m_name;
+		GstCaps *m_caps;
+		std::vector < GstBuffer* > m_buffers;
+	};
+
+	typedef std::vector < stream > streams;
+
+	// Throws an exception if the file cannot be read or demuxed,
+	// or if it contains neither video nor audio.
+	explicit slate_clip(std::string p_path);
+	~slate_clip();
+
+	std::string const & get_path() const
+	{
+		return m_path;
+	}
+
+	streams const & get_streams() const
+	{
+		return m_streams;
+	}
+
+	// Returns null if the clip has no stream with that name
+	stream const * find_stream(std::string const &p_name) const;
+
+	// The time after which the clip starts over
+	GstClockTime get_duration() const
+	{
+		return m_duration;
+	}
+
+
+private:
+	slate_clip(slate_clip const &) = delete;
+	slate_clip& operator = (slate_clip const &) = delete;
+
+	void normalize_timestamps();
+
+
+	std::string m_path;
+	streams m_streams;
+	GstClockTime m_duration;
+};
+
+
+#endif
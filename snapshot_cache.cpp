@@ -0,0 +1,555 @@
+#include <iostream>
+#include <algorithm>
+#include <string>
+#include <gst/app/gstappsrc.h>
+#include <gst/app/gstappsink.h>
+#include "http_stream_pipeline.hpp"
+#include "snapshot_cache.hpp"
+#include "scope_guard.hpp"
+
+
+namespace
+{
+
+
+// Upper limit for the amount of data that is stored for one keyframe.
+// If the keyframe interval is very long, storing everything until the
+// next keyframe would be wasteful. The first few buffers after the
+// keyframe are enough for decoding one frame.
+gsize const max_keyframe_run_size = 8 * 1024 * 1024;
+
+// If no buffer passed by for this long (in microseconds), the pipeline
+// is considered to be idle, and the stored keyframe to be stale.
+gint64 const stream_idle_threshold = G_USEC_PER_SEC;
+
+guint const keyframe_wait_timeout_ms = 3000;
+guint const decode_timeout_ms = 5000;
+
+char const *decode_pipeline_description =
+	"appsrc name=src ! decodebin ! videoconvert ! videoscale ! jpegenc snapshot=true ! appsink name=sink sync=false";
+
+
+} // unnamed namespace end
+
+
+
+
+snapshot_cache::keyframe_run::keyframe_run()
+	: m_size(0)
+	, m_timestamp(0)
+{
+}
+
+snapshot_cache::keyframe_run::~keyframe_run()
+{
+	clear();
+}
+
+void snapshot_cache::keyframe_run::clear()
+{
+	for (GstBuffer *buffer : m_buffers)
+		gst_buffer_unref(buffer);
+	m_buffers.clear();
+	m_size = 0;
+	m_timestamp = 0;
+}
+
+void snapshot_cache::keyframe_run::swap(keyframe_run &p_other)
+{
+	m_buffers.swap(p_other.m_buffers);
+	std::swap(m_size, p_other.m_size);
+	std::swap(m_timestamp, p_other.m_timestamp);
+}
+
+
+
+
+snapshot_cache::snapshot_cache(http_stream_pipeline &p_pipeline, GstClockTime const p_ttl)
+	: m_pipeline(p_pipeline)
+	, m_ttl(GST_TIME_AS_USECONDS(p_ttl))
+	, m_probe_id(0)
+	, m_last_buffer_timestamp(0)
+	, m_waiting_for_keyframe(false)
+	, m_keyframe_notify_source(0)
+	, m_holding_pipeline(false)
+	, m_keyframe_timeout_source(0)
+	, m_decode_pipeline(nullptr)
+	, m_decode_bus_watch(0)
+	, m_decode_timeout_source(0)
+	, m_jpeg(nullptr)
+	, m_jpeg_timestamp(0)
+	, m_server(nullptr)
+{
+	m_probe_id = gst_pad_add_probe(
+		m_pipeline.get_stream_pad(),
+		GstPadProbeType(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+		on_stream_data,
+		gpointer(this),
+		nullptr
+	);
+}
+
+snapshot_cache::~snapshot_cache()
+{
+	gst_pad_remove_probe(m_pipeline.get_stream_pad(), m_probe_id);
+
+	stop_waiting_for_keyframe();
+
+	// Passing a null pointer answers all pending messages with the
+	// last JPEG (if there is one) and tears down the decode pipeline
+	finish_decode(nullptr);
+
+	if (m_jpeg != nullptr)
+		g_bytes_unref(m_jpeg);
+}
+
+
+void snapshot_cache::handle_request(SoupServer *p_server, SoupMessage *p_msg)
+{
+	gint64 now = g_get_monotonic_time();
+
+	// Serve the cached JPEG if it is still fresh
+	if ((m_jpeg != nullptr) && ((now - m_jpeg_timestamp) < m_ttl))
+	{
+		respond(p_msg);
+		return;
+	}
+
+	// A new JPEG has to be produced. Pause the message until
+	// then; finish_decode() answers and unpauses it.
+	m_server = p_server;
+	soup_server_pause_message(p_server, p_msg);
+	g_object_ref(G_OBJECT(p_msg));
+	m_pending_messages.push_back(p_msg);
+
+	// If the client goes away in the meantime, forget the message
+	void (*finished_cb)(SoupMessage *, gpointer) = [](SoupMessage *p_msg_, gpointer p_user_data)
+	{
+		snapshot_cache *self = reinterpret_cast < snapshot_cache* > (p_user_data);
+		self->remove_pending_message(p_msg_);
+	};
+	g_signal_connect(G_OBJECT(p_msg), "finished", G_CALLBACK(finished_cb), this);
+
+	// If a decode is already underway (or a keyframe for it is being
+	// waited for), the message is answered once that is done. This is
+	// what keeps the number of decodes at one per TTL window.
+	if ((m_decode_pipeline != nullptr) || m_holding_pipeline)
+		return;
+
+	// If data is currently flowing, the stored keyframe is the latest
+	// one, and can be decoded right away. Otherwise, the pipeline has
+	// to be started first to get a current keyframe.
+	bool keyframe_is_current;
+	{
+		std::lock_guard < std::mutex > lock(m_keyframe_mutex);
+		keyframe_is_current = !m_complete_run.m_buffers.empty() && ((now - m_last_buffer_timestamp) < stream_idle_threshold);
+	}
+
+	if (keyframe_is_current)
+		start_decode();
+	else
+		wait_for_keyframe();
+}
+
+
+GstPadProbeReturn snapshot_cache::on_stream_data(GstPad *, GstPadProbeInfo *p_info, gpointer p_user_data)
+{
+	snapshot_cache *self = reinterpret_cast < snapshot_cache* > (p_user_data);
+
+	if (p_info->type & GST_PAD_PROBE_TYPE_BUFFER)
+	{
+		self->store_buffer(GST_PAD_PROBE_INFO_BUFFER(p_info));
+	}
+	else if (p_info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+	{
+		GstBufferList *buffer_list = GST_PAD_PROBE_INFO_BUFFER_LIST(p_info);
+		guint num_buffers = gst_buffer_list_length(buffer_list);
+		for (guint i = 0; i < num_buffers; ++i)
+			self->store_buffer(gst_buffer_list_get(buffer_list, i));
+	}
+
+	return GST_PAD_PROBE_OK;
+}
+
+
+void snapshot_cache::store_buffer(GstBuffer *p_buffer)
+{
+	// Header buffers are also present in the "streamheader"
+	// caps field, which is where start_decode() gets them from
+	if (GST_BUFFER_FLAG_IS_SET(p_buffer, GST_BUFFER_FLAG_HEADER))
+		return;
+
+	// Guard against race conditions, since this is
+	// executed in the streaming thread
+	std::lock_guard < std::mutex > lock(m_keyframe_mutex);
+
+	gint64 now = g_get_monotonic_time();
+	m_last_buffer_timestamp = now;
+
+	if (!GST_BUFFER_FLAG_IS_SET(p_buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+	{
+		// A new keyframe begins, so the current run is complete
+		if (!m_current_run.m_buffers.empty())
+		{
+			m_complete_run.swap(m_current_run);
+
+			// If the mainloop is waiting for this, notify it. Changing
+			// states etc. is not possible in the streaming thread.
+			if (m_waiting_for_keyframe && (m_keyframe_notify_source == 0))
+			{
+				m_keyframe_notify_source = g_idle_add([](gpointer p_user_data) -> gboolean
+				{
+					snapshot_cache *self = reinterpret_cast < snapshot_cache* > (p_user_data);
+
+					{
+						std::lock_guard < std::mutex > lock_(self->m_keyframe_mutex);
+						self->m_keyframe_notify_source = 0;
+					}
+
+					self->stop_waiting_for_keyframe();
+					self->start_decode();
+
+					return G_SOURCE_REMOVE;
+				}, gpointer(this));
+			}
+		}
+
+		m_current_run.clear();
+		m_current_run.m_timestamp = now;
+	}
+	else if (m_current_run.m_buffers.empty())
+	{
+		// Delta units without a preceding keyframe cannot be decoded
+		return;
+	}
+
+	gsize size = gst_buffer_get_size(p_buffer);
+	if ((m_current_run.m_size + size) > max_keyframe_run_size)
+		return;
+
+	m_current_run.m_buffers.push_back(gst_buffer_ref(p_buffer));
+	m_current_run.m_size += size;
+}
+
+
+void snapshot_cache::wait_for_keyframe()
+{
+	std::cerr << "Snapshot requested while the pipeline is idle - waiting for a new keyframe\n";
+
+	{
+		std::lock_guard < std::mutex > lock(m_keyframe_mutex);
+
+		// Whatever is stored is from an earlier run of the pipeline.
+		// Discard it to make sure it is not mistaken for new data.
+		m_current_run.clear();
+		m_complete_run.clear();
+		m_waiting_for_keyframe = true;
+	}
+
+	m_holding_pipeline = true;
+	m_pipeline.acquire_hold();
+
+	// If the keyframe interval is long, do not wait for the
+	// next keyframe; decode whatever came in until then
+	m_keyframe_timeout_source = g_timeout_add(keyframe_wait_timeout_ms, [](gpointer p_user_data) -> gboolean
+	{
+		snapshot_cache *self = reinterpret_cast < snapshot_cache* > (p_user_data);
+		self->m_keyframe_timeout_source = 0;
+
+		std::cerr << "No complete keyframe received in time - using partial keyframe data for the snapshot\n";
+
+		self->stop_waiting_for_keyframe();
+		self->start_decode();
+
+		return G_SOURCE_REMOVE;
+	}, gpointer(this));
+}
+
+
+void snapshot_cache::stop_waiting_for_keyframe()
+{
+	{
+		std::lock_guard < std::mutex > lock(m_keyframe_mutex);
+
+		m_waiting_for_keyframe = false;
+		if (m_keyframe_notify_source != 0)
+		{
+			g_source_remove(m_keyframe_notify_source);
+			m_keyframe_notify_source = 0;
+		}
+	}
+
+	if (m_keyframe_timeout_source != 0)
+	{
+		g_source_remove(m_keyframe_timeout_source);
+		m_keyframe_timeout_source = 0;
+	}
+
+	if (m_holding_pipeline)
+	{
+		m_holding_pipeline = false;
+		m_pipeline.release_hold();
+	}
+}
+
+
+void snapshot_cache::start_decode()
+{
+	if (m_decode_pipeline != nullptr)
+		return;
+
+	// Get our own references to the keyframe buffers, so the
+	// streaming thread can go on replacing the stored runs.
+	// Prefer the complete run; if there is none yet, the
+	// current one still may be enough to decode one frame.
+	std::vector < GstBuffer* > buffers;
+	auto buffers_guard = make_scope_guard([&buffers]()
+	{
+		for (GstBuffer *buffer : buffers)
+			gst_buffer_unref(buffer);
+	});
+
+	{
+		std::lock_guard < std::mutex > lock(m_keyframe_mutex);
+
+		keyframe_run const &run = m_complete_run.m_buffers.empty() ? m_current_run : m_complete_run;
+		for (GstBuffer *buffer : run.m_buffers)
+			buffers.push_back(gst_buffer_ref(buffer));
+	}
+
+	if (buffers.empty())
+	{
+		std::cerr << "No keyframe available for snapshot\n";
+		finish_decode(nullptr);
+		return;
+	}
+
+	GstCaps *caps = gst_pad_get_current_caps(m_pipeline.get_stream_pad());
+	if (caps == nullptr)
+	{
+		std::cerr << "Stream caps unknown - cannot decode snapshot\n";
+		finish_decode(nullptr);
+		return;
+	}
+	auto caps_guard = make_scope_guard([caps]() { gst_caps_unref(caps); });
+
+
+	// Setup the decode pipeline & its bus watch
+
+	GError *gerror = nullptr;
+	m_decode_pipeline = gst_parse_launch(decode_pipeline_description, &gerror);
+	if (m_decode_pipeline == nullptr)
+	{
+		std::cerr << "Could not create snapshot pipeline: " << gerror->message << "\n";
+		g_clear_error(&gerror);
+		finish_decode(nullptr);
+		return;
+	}
+	else if (gerror != nullptr)
+	{
+		std::cerr << "WARNING: snapshot pipeline: " << gerror->message << "\n";
+		g_clear_error(&gerror);
+	}
+
+	GstBus *bus = gst_pipeline_get_bus(GST_PIPELINE(m_decode_pipeline));
+	m_decode_bus_watch = gst_bus_add_watch(
+		bus,
+		[](GstBus *p_bus, GstMessage *p_msg, gpointer p_user_data) -> gboolean
+		{
+			snapshot_cache *self = reinterpret_cast < snapshot_cache* > (p_user_data);
+			return self->decode_bus_watch(p_bus, p_msg);
+		},
+		gpointer(this)
+	);
+	gst_object_unref(GST_OBJECT(bus));
+
+	m_decode_timeout_source = g_timeout_add(decode_timeout_ms, [](gpointer p_user_data) -> gboolean
+	{
+		snapshot_cache *self = reinterpret_cast < snapshot_cache* > (p_user_data);
+		self->m_decode_timeout_source = 0;
+
+		std::cerr << "Snapshot decoding timed out\n";
+		self->finish_decode(nullptr);
+
+		return G_SOURCE_REMOVE;
+	}, gpointer(this));
+
+	// appsrc only accepts data once it is started, which
+	// happens during the READY->PAUSED state change
+	if (gst_element_set_state(m_decode_pipeline, GST_STATE_PAUSED) == GST_STATE_CHANGE_FAILURE)
+	{
+		std::cerr << "Could not start snapshot pipeline\n";
+		finish_decode(nullptr);
+		return;
+	}
+
+
+	// Feed the keyframe to the decode pipeline. Just like how the
+	// multisocketsink does it with new clients, the stream headers
+	// (if any) are sent first.
+
+	GstElement *appsrc = gst_bin_get_by_name(GST_BIN(m_decode_pipeline), "src");
+	g_assert(appsrc != nullptr);
+
+	gst_app_src_set_caps(GST_APP_SRC(appsrc), caps);
+
+	GValue const *streamheader = gst_structure_get_value(gst_caps_get_structure(caps, 0), "streamheader");
+	if ((streamheader != nullptr) && GST_VALUE_HOLDS_ARRAY(streamheader))
+	{
+		guint num_headers = gst_value_array_get_size(streamheader);
+		for (guint i = 0; i < num_headers; ++i)
+		{
+			GValue const *header = gst_value_array_get_value(streamheader, i);
+			if (GST_VALUE_HOLDS_BUFFER(header))
+				gst_app_src_push_buffer(GST_APP_SRC(appsrc), gst_buffer_ref(gst_value_get_buffer(header)));
+		}
+	}
+
+	for (GstBuffer *buffer : buffers)
+		gst_app_src_push_buffer(GST_APP_SRC(appsrc), gst_buffer_ref(buffer));
+
+	gst_app_src_end_of_stream(GST_APP_SRC(appsrc));
+	gst_object_unref(GST_OBJECT(appsrc));
+
+	gst_element_set_state(m_decode_pipeline, GST_STATE_PLAYING);
+}
+
+
+bool snapshot_cache::decode_bus_watch(GstBus *, GstMessage *p_message)
+{
+	switch (GST_MESSAGE_TYPE(p_message))
+	{
+		case GST_MESSAGE_EOS:
+		{
+			// jpegenc's snapshot mode posts EOS after the first
+			// frame, so the JPEG is in the appsink by now (unless
+			// the stream did not contain any decodable video)
+
+			GstElement *appsink = gst_bin_get_by_name(GST_BIN(m_decode_pipeline), "sink");
+			GstSample *sample = gst_app_sink_pull_sample(GST_APP_SINK(appsink));
+			gst_object_unref(GST_OBJECT(appsink));
+
+			GBytes *jpeg = nullptr;
+			if (sample != nullptr)
+			{
+				GstBuffer *buffer = gst_sample_get_buffer(sample);
+				gpointer data;
+				gsize size;
+				gst_buffer_extract_dup(buffer, 0, gst_buffer_get_size(buffer), &data, &size);
+				jpeg = g_bytes_new_take(data, size);
+				gst_sample_unref(sample);
+			}
+			else
+				std::cerr << "Snapshot pipeline produced no frame\n";
+
+			// Returning false removes the watch
+			m_decode_bus_watch = 0;
+			finish_decode(jpeg);
+			return false;
+		}
+
+		case GST_MESSAGE_ERROR:
+		{
+			GError *gerror = nullptr;
+			gchar *debug_info = nullptr;
+			gst_message_parse_error(p_message, &gerror, &debug_info);
+
+			std::cerr << "ERROR while decoding snapshot: " << gerror->message << "; debug info: " << debug_info << "\n";
+
+			g_clear_error(&gerror);
+			g_free(debug_info);
+
+			m_decode_bus_watch = 0;
+			finish_decode(nullptr);
+			return false;
+		}
+
+		default:
+			break;
+	}
+
+	return true;
+}
+
+
+void snapshot_cache::finish_decode(GBytes *p_jpeg)
+{
+	if (m_decode_timeout_source != 0)
+	{
+		g_source_remove(m_decode_timeout_source);
+		m_decode_timeout_source = 0;
+	}
+
+	if (m_decode_bus_watch != 0)
+	{
+		g_source_remove(m_decode_bus_watch);
+		m_decode_bus_watch = 0;
+	}
+
+	if (m_decode_pipeline != nullptr)
+	{
+		gst_element_set_state(m_decode_pipeline, GST_STATE_NULL);
+		gst_object_unref(GST_OBJECT(m_decode_pipeline));
+		m_decode_pipeline = nullptr;
+	}
+
+	// If decoding failed, the previous JPEG is kept. A stale
+	// snapshot is more useful to a dashboard than an error.
+	if (p_jpeg != nullptr)
+	{
+		if (m_jpeg != nullptr)
+			g_bytes_unref(m_jpeg);
+		m_jpeg = p_jpeg;
+		m_jpeg_timestamp = g_get_monotonic_time();
+	}
+
+	std::vector < SoupMessage* > pending_messages;
+	pending_messages.swap(m_pending_messages);
+
+	for (SoupMessage *msg : pending_messages)
+	{
+		g_signal_handlers_disconnect_by_data(G_OBJECT(msg), this);
+		respond(msg);
+		soup_server_unpause_message(m_server, msg);
+		g_object_unref(G_OBJECT(msg));
+	}
+}
+
+
+void snapshot_cache::respond(SoupMessage *p_msg)
+{
+	if (m_jpeg == nullptr)
+	{
+		soup_message_set_status(p_msg, SOUP_STATUS_SERVICE_UNAVAILABLE);
+		return;
+	}
+
+	// Let HTTP caches in between keep the JPEG for as long as we do
+	gint64 age = g_get_monotonic_time() - m_jpeg_timestamp;
+	gint64 max_age = std::max(m_ttl - age, gint64(0)) / G_USEC_PER_SEC;
+	std::string cache_control = "max-age=" + std::to_string(max_age);
+
+	soup_message_headers_replace(p_msg->response_headers, "Cache-Control", cache_control.c_str());
+	soup_message_headers_set_content_type(p_msg->response_headers, "image/jpeg", nullptr);
+
+	// The SoupBuffer shares the JPEG bytes instead of copying them
+	gsize size;
+	gconstpointer data = g_bytes_get_data(m_jpeg, &size);
+	SoupBuffer *buffer = soup_buffer_new_with_owner(data, size, g_bytes_ref(m_jpeg), GDestroyNotify(g_bytes_unref));
+	soup_message_body_append_buffer(p_msg->response_body, buffer);
+	soup_buffer_free(buffer);
+
+	soup_message_set_status(p_msg, SOUP_STATUS_OK);
+}
+
+
+void snapshot_cache::remove_pending_message(SoupMessage *p_msg)
+{
+	auto iter = std::find(m_pending_messages.begin(), m_pending_messages.end(), p_msg);
+	if (iter == m_pending_messages.end())
+		return;
+
+	m_pending_messages.erase(iter);
+	g_signal_handlers_disconnect_by_data(G_OBJECT(p_msg), this);
+	g_object_unref(G_OBJECT(p_msg));
+}
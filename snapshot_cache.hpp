@@ -0,0 +1,90 @@
+#ifndef GST_SOUP_SERVER_EXAMPLE_SNAPSHOT_CACHE_HPP
+#define GST_SOUP_SERVER_EXAMPLE_SNAPSHOT_CACHE_HPP
+
+#include <glib.h>
+#include <gst/gst.h>
+#include <libsoup/soup.h>
+#include <vector>
+#include <mutex>
+
+
+class http_stream_pipeline;
+
+
+// Produces JPEG snapshots of the output of a http_stream_pipeline.
+//
+// A pad probe keeps the buffers of the most recent keyframe (that is,
+// everything from the last non-delta buffer until the next one). These
+// are only decoded and encoded to JPEG once a snapshot is requested.
+// The resulting JPEG is then cached for the given TTL, so regardless of
+// how many requests come in, there is at most one decode per TTL window.
+//
+// If the pipeline is not running when a snapshot is requested, a hold
+// is acquired on it until a new keyframe is available.
+//
+// All public functions must be called from the mainloop thread.
+class snapshot_cache
+{
+public:
+	explicit snapshot_cache(http_stream_pipeline &p_pipeline, GstClockTime const p_ttl);
+	~snapshot_cache();
+
+	void handle_request(SoupServer *p_server, SoupMessage *p_msg);
+
+
+private:
+	snapshot_cache(snapshot_cache const &) = delete;
+	snapshot_cache& operator = (snapshot_cache const &) = delete;
+
+	struct keyframe_run
+	{
+		std::vector < GstBuffer* > m_buffers;
+		gsize m_size;
+		gint64 m_timestamp;
+
+		keyframe_run();
+		~keyframe_run();
+		void clear();
+		void swap(keyframe_run &p_other);
+	};
+
+	static GstPadProbeReturn on_stream_data(GstPad *, GstPadProbeInfo *p_info, gpointer p_user_data);
+	void store_buffer(GstBuffer *p_buffer);
+
+	void wait_for_keyframe();
+	void stop_waiting_for_keyframe();
+	void start_decode();
+	bool decode_bus_watch(GstBus *, GstMessage *p_message);
+	void finish_decode(GBytes *p_jpeg);
+
+	void respond(SoupMessage *p_msg);
+	void remove_pending_message(SoupMessage *p_msg);
+
+
+	http_stream_pipeline &m_pipeline;
+	gint64 const m_ttl;
+	gulong m_probe_id;
+
+	// These are accessed by the streaming thread and
+	// therefore protected by m_keyframe_mutex
+	std::mutex m_keyframe_mutex;
+	keyframe_run m_current_run, m_complete_run;
+	gint64 m_last_buffer_timestamp;
+	bool m_waiting_for_keyframe;
+	guint m_keyframe_notify_source;
+
+	bool m_holding_pipeline;
+	guint m_keyframe_timeout_source;
+
+	GstElement *m_decode_pipeline;
+	guint m_decode_bus_watch, m_decode_timeout_source;
+
+	GBytes *m_jpeg;
+	gint64 m_jpeg_timestamp;
+
+	SoupServer *m_server;
+	std::vector < SoupMessage* > m_pending_messages;
+};
+
+
+#endif
@@ -0,0 +1,400 @@
+#include <algorithm>
+#include "ts_header_cache.hpp"
+
+
+namespace
+{
+
+
+gsize const packet_size = 188;
+guint8 const sync_byte = 0x47;
+
+guint16 const pat_pid = 0x0000;
+guint8 const pat_table_id = 0x00;
+guint8 const pmt_table_id = 0x02;
+
+// PATs and PMTs are rarely larger than one packet; anything
+// larger than this is most likely garbage
+std::size_t const max_section_packets = 8;
+
+// A single 0x47 may just as well be part of a payload, so the data
+// is only trusted again after a loss of sync once this many sync
+// bytes are found one packet apart
+std::size_t const num_resync_packets = 3;
+gsize const resync_window_size = (num_resync_packets - 1) * packet_size + 1;
+
+
+// The CRC32 of MPEG-2 PSI sections (polynomial 0x04C11DB7, initial
+// value 0xFFFFFFFF, no reflection, no final XOR). Over a whole section
+// including its CRC field, the result is 0.
+guint32 compute_crc32(guint8 const *p_data, gsize const p_size)
+{
+	guint32 crc = 0xFFFFFFFF;
+
+	for (gsize i = 0; i < p_size; ++i)
+	{
+		crc ^= guint32(p_data[i]) << 24;
+		for (int bit = 0; bit < 8; ++bit)
+			crc = (crc & 0x80000000) ? ((crc << 1) ^ 0x04C11DB7) : (crc << 1);
+	}
+
+	return crc;
+}
+
+
+} // unnamed namespace end
+
+
+
+
+ts_header_cache::ts_header_cache()
+	: m_in_sync(false)
+	, m_changed(false)
+	, m_upstream_headers(false)
+	, m_sending_caps(false)
+{
+}
+
+
+void ts_header_cache::attach(GstPad *p_sinkpad)
+{
+	gst_pad_add_probe(
+		p_sinkpad,
+		GstPadProbeType(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM),
+		probe,
+		new ts_header_cache(),
+		[](gpointer p_data) { delete reinterpret_cast < ts_header_cache* > (p_data); }
+	);
+}
+
+
+GstPadProbeReturn ts_header_cache::probe(GstPad *p_pad, GstPadProbeInfo *p_info, gpointer p_user_data)
+{
+	ts_header_cache *self = reinterpret_cast < ts_header_cache* > (p_user_data);
+
+	bool changed = false;
+
+	if (!(GST_PAD_PROBE_INFO_TYPE(p_info) & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) && self->m_upstream_headers)
+	{
+		// Nothing to do while upstream provides the headers
+		return GST_PAD_PROBE_OK;
+	}
+	else if (GST_PAD_PROBE_INFO_TYPE(p_info) & GST_PAD_PROBE_TYPE_BUFFER)
+	{
+		changed = self->parse_buffer(GST_PAD_PROBE_INFO_BUFFER(p_info));
+	}
+	else if (GST_PAD_PROBE_INFO_TYPE(p_info) & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+	{
+		GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST(p_info);
+		for (guint i = 0; i < gst_buffer_list_length(list); ++i)
+			changed = self->parse_buffer(gst_buffer_list_get(list, i)) || changed;
+	}
+	else
+	{
+		// Caps that come from upstream (or the ones sent below)
+		// get the latest stream headers, unless upstream put stream
+		// headers into them already (mpegtsmux does). These are
+		// left alone, and the cache stays out of the way then.
+		GstEvent *event = GST_PAD_PROBE_INFO_EVENT(p_info);
+		if (GST_EVENT_TYPE(event) != GST_EVENT_CAPS)
+			return GST_PAD_PROBE_OK;
+
+		GstCaps *caps = nullptr;
+		gst_event_parse_caps(event, &caps);
+
+		if (!self->m_sending_caps)
+		{
+			self->m_upstream_headers = (gst_caps_get_size(caps) > 0) && gst_structure_has_field(gst_caps_get_structure(caps, 0), "streamheader");
+			if (self->m_upstream_headers)
+				return GST_PAD_PROBE_OK;
+		}
+
+		GstCaps *caps_with_headers = self->add_stream_headers(caps);
+		if (caps_with_headers != nullptr)
+		{
+			GST_PAD_PROBE_INFO_DATA(p_info) = gst_event_new_caps(caps_with_headers);
+			gst_caps_unref(caps_with_headers);
+			gst_event_unref(event);
+		}
+
+		return GST_PAD_PROBE_OK;
+	}
+
+	if (changed)
+	{
+		// New caps carry the new headers to the sinks. They are sent
+		// before the buffer that completed the tables; the probe
+		// above adds the headers to them. Sources like souphttpsrc
+		// do not set any caps, so some have to be made up then.
+		// The sinks send changed stream headers to the clients that
+		// are connected already as well, which happens rarely, since
+		// the tables seldom change.
+		GstCaps *caps = gst_pad_get_current_caps(p_pad);
+		if (caps == nullptr)
+			caps = gst_caps_new_simple("video/mpegts", "systemstream", G_TYPE_BOOLEAN, TRUE, "packetsize", G_TYPE_INT, gint(packet_size), nullptr);
+
+		// The probe is called from within gst_pad_send_event()
+		self->m_sending_caps = true;
+		gst_pad_send_event(p_pad, gst_event_new_caps(caps));
+		self->m_sending_caps = false;
+		gst_caps_unref(caps);
+	}
+
+	return GST_PAD_PROBE_OK;
+}
+
+
+bool ts_header_cache::parse_buffer(GstBuffer *p_buffer)
+{
+	GstMapInfo map_info;
+	if (!gst_buffer_map(p_buffer, &map_info, GST_MAP_READ))
+		return false;
+
+	parse_data(map_info.data, map_info.size);
+	gst_buffer_unmap(p_buffer, &map_info);
+
+	bool changed = m_changed;
+	m_changed = false;
+	return changed;
+}
+
+
+void ts_header_cache::parse_data(guint8 const *p_data, gsize p_size)
+{
+	while (p_size > 0)
+	{
+		// Out of sync (as at the start), the data is collected in a
+		// window until it starts with enough sync bytes one packet apart
+		if (!m_in_sync)
+		{
+			gsize num_new = std::min(resync_window_size - m_resync_window.size(), p_size);
+			m_resync_window.insert(m_resync_window.end(), p_data, p_data + num_new);
+			p_data += num_new;
+			p_size -= num_new;
+
+			if (m_resync_window.size() < resync_window_size)
+				continue;
+
+			bool in_sync = true;
+			for (std::size_t i = 0; i < num_resync_packets; ++i)
+				in_sync = in_sync && (m_resync_window[i * packet_size] == sync_byte);
+
+			if (in_sync)
+			{
+				// The window holds complete packets, plus the
+				// first byte of the next one
+				for (std::size_t i = 0; (i + 1) < num_resync_packets; ++i)
+					parse_packet(m_resync_window.data() + i * packet_size);
+				m_partial_packet.assign(m_resync_window.end() - 1, m_resync_window.end());
+				m_resync_window.clear();
+				m_in_sync = true;
+			}
+			else
+			{
+				// Move the window ahead to the next candidate
+				auto next_sync = std::find(m_resync_window.begin() + 1, m_resync_window.end(), sync_byte);
+				m_resync_window.erase(m_resync_window.begin(), next_sync);
+			}
+
+			continue;
+		}
+
+		// Finish the packet that the previous buffer ended in
+		if (!m_partial_packet.empty())
+		{
+			gsize num_missing = std::min(packet_size - m_partial_packet.size(), p_size);
+			m_partial_packet.insert(m_partial_packet.end(), p_data, p_data + num_missing);
+			p_data += num_missing;
+			p_size -= num_missing;
+
+			if (m_partial_packet.size() == packet_size)
+			{
+				parse_packet(m_partial_packet.data());
+				m_partial_packet.clear();
+			}
+
+			continue;
+		}
+
+		if (p_data[0] != sync_byte)
+		{
+			m_in_sync = false;
+			continue;
+		}
+
+		if (p_size < packet_size)
+		{
+			m_partial_packet.assign(p_data, p_data + p_size);
+			break;
+		}
+
+		parse_packet(p_data);
+		p_data += packet_size;
+		p_size -= packet_size;
+	}
+}
+
+
+void ts_header_cache::parse_packet(guint8 const *p_packet)
+{
+	guint16 pid = guint16(((p_packet[1] & 0x1F) << 8) | p_packet[2]);
+	if ((pid != pat_pid) && (m_pmt_pids.find(pid) == m_pmt_pids.end()))
+		return;
+
+	bool unit_start = (p_packet[1] & 0x40) != 0;
+	guint8 adaptation_field_control = (p_packet[3] >> 4) & 0x03;
+	if ((adaptation_field_control & 0x01) == 0)
+		return;
+
+	gsize payload_offset = 4;
+	if (adaptation_field_control & 0x02)
+		payload_offset += 1 + p_packet[4];
+	if (payload_offset >= packet_size)
+		return;
+
+	table &pending = m_pending_tables[pid];
+
+	if (unit_start)
+	{
+		// The pointer field gives the start of the section
+		gsize section_offset = payload_offset + 1 + p_packet[payload_offset];
+		if (section_offset >= packet_size)
+		{
+			m_pending_tables.erase(pid);
+			return;
+		}
+
+		pending.m_packets.assign(p_packet, p_packet + packet_size);
+		pending.m_section.assign(p_packet + section_offset, p_packet + packet_size);
+	}
+	else
+	{
+		// A continuation without a start is of no use
+		if (pending.m_packets.empty() || (pending.m_packets.size() >= max_section_packets * packet_size))
+		{
+			m_pending_tables.erase(pid);
+			return;
+		}
+
+		pending.m_packets.insert(pending.m_packets.end(), p_packet, p_packet + packet_size);
+		pending.m_section.insert(pending.m_section.end(), p_packet + payload_offset, p_packet + packet_size);
+	}
+
+	complete_section(pid);
+}
+
+
+void ts_header_cache::complete_section(guint16 const p_pid)
+{
+	table &pending = m_pending_tables[p_pid];
+	std::vector < guint8 > &section = pending.m_section;
+
+	if (section.size() < 3)
+		return;
+
+	gsize section_size = 3 + (((section[1] & 0x0F) << 8) | section[2]);
+	if (section.size() < section_size)
+		return;
+
+	section.resize(section_size);
+
+	// Corrupted sections must not end up in the stream headers
+	if (compute_crc32(section.data(), section.size()) != 0)
+	{
+		m_pending_tables.erase(p_pid);
+		return;
+	}
+
+	// Tables that only apply later (current_next_indicator
+	// is 0) are ignored until they are sent as current ones
+	guint8 expected_table_id = (p_pid == pat_pid) ? pat_table_id : pmt_table_id;
+	if ((section[0] != expected_table_id) || (section_size < 12) || ((section[5] & 0x01) == 0))
+	{
+		m_pending_tables.erase(p_pid);
+		return;
+	}
+
+	if (p_pid == pat_pid)
+	{
+		// The program loop lies between the 8 byte header and the
+		// CRC. Program number 0 refers to the network PID.
+		std::set < guint16 > pmt_pids;
+		for (gsize i = 8; (i + 8) <= section_size; i += 4)
+		{
+			guint16 program_number = guint16((section[i] << 8) | section[i + 1]);
+			if (program_number != 0)
+				pmt_pids.insert(guint16(((section[i + 2] & 0x1F) << 8) | section[i + 3]));
+		}
+
+		if (pmt_pids != m_pmt_pids)
+		{
+			for (auto table_iter = m_tables.begin(); table_iter != m_tables.end(); )
+			{
+				if ((table_iter->first != pat_pid) && (pmt_pids.find(table_iter->first) == pmt_pids.end()))
+					table_iter = m_tables.erase(table_iter);
+				else
+					++table_iter;
+			}
+
+			m_pmt_pids = std::move(pmt_pids);
+			m_changed = true;
+		}
+	}
+
+	table &current = m_tables[p_pid];
+	if (current.m_section != section)
+	{
+		current = std::move(pending);
+		m_changed = true;
+	}
+
+	m_pending_tables.erase(p_pid);
+}
+
+
+GstCaps* ts_header_cache::add_stream_headers(GstCaps *p_caps) const
+{
+	if ((gst_caps_get_size(p_caps) == 0) || m_pmt_pids.empty())
+		return nullptr;
+
+	// The PAT goes first, since it tells where the PMTs are
+	auto pat_iter = m_tables.find(pat_pid);
+	if (pat_iter == m_tables.end())
+		return nullptr;
+
+	std::vector < table const * > header_tables;
+	header_tables.push_back(&(pat_iter->second));
+	for (guint16 pid : m_pmt_pids)
+	{
+		auto table_iter = m_tables.find(pid);
+		if (table_iter == m_tables.end())
+			return nullptr;
+		header_tables.push_back(&(table_iter->second));
+	}
+
+	gsize headers_size = 0;
+	for (table const *header_table : header_tables)
+		headers_size += header_table->m_packets.size();
+
+	GstBuffer *headers = gst_buffer_new_allocate(nullptr, headers_size, nullptr);
+	gsize offset = 0;
+	for (table const *header_table : header_tables)
+	{
+		gst_buffer_fill(headers, offset, header_table->m_packets.data(), header_table->m_packets.size());
+		offset += header_table->m_packets.size();
+	}
+	GST_BUFFER_FLAG_SET(headers, GST_BUFFER_FLAG_HEADER);
+
+	GValue header_value = G_VALUE_INIT;
+	g_value_init(&header_value, GST_TYPE_BUFFER);
+	g_value_take_boxed(&header_value, headers);
+
+	GValue streamheader = G_VALUE_INIT;
+	g_value_init(&streamheader, GST_TYPE_ARRAY);
+	gst_value_array_append_and_take_value(&streamheader, &header_value);
+
+	GstCaps *caps = gst_caps_copy(p_caps);
+	gst_structure_take_value(gst_caps_get_structure(caps, 0), "streamheader", &streamheader);
+
+	return caps;
+}
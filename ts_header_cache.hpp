@@ -0,0 +1,83 @@
+#ifndef GST_SOUP_SERVER_EXAMPLE_TS_HEADER_CACHE_HPP
+#define GST_SOUP_SERVER_EXAMPLE_TS_HEADER_CACHE_HPP
+
+#include <gst/gst.h>
+#include <map>
+#include <set>
+#include <vector>
+
+
+// Keeps the most recent PAT and PMT of an MPEG-TS stream, and puts them
+// into the stream's caps as stream headers. The multisocketsinks send
+// these to each new client before anything else, so a client that starts
+// at a keyframe can decode right away, instead of waiting until the muxer
+// repeats the tables. Containers like Matroska and MP4 carry their
+// headers (including the codecs' configuration) in the caps already.
+// If the caps from upstream have stream headers already (mpegtsmux sets
+// them), these are kept, and the cache does nothing.
+//
+// When the tables change, the sinks send the new headers to the clients
+// that are connected already too, so these see the tables once more.
+//
+// The cache sits in a pad probe and parses only the packet headers and
+// the PSI sections. The buffers do not have to be packet-aligned (data
+// from souphttpsrc is not). After a loss of sync, packets are only parsed
+// again once several sync bytes are found one packet apart, and sections
+// with a wrong CRC are dropped. The caps are only updated if the content
+// of the tables changes, not each time the muxer repeats them.
+class ts_header_cache
+{
+public:
+	// Attaches a cache to the sink pad. Everything that passes the pad
+	// from then on is parsed, and the caps that pass it get the stream
+	// headers. Probes that are attached to the pad later on (like the
+	// WebSocket framing) see the caps with the stream headers.
+	static void attach(GstPad *p_sinkpad);
+
+
+private:
+	ts_header_cache();
+
+	ts_header_cache(ts_header_cache const &) = delete;
+	ts_header_cache& operator = (ts_header_cache const &) = delete;
+
+	static GstPadProbeReturn probe(GstPad *p_pad, GstPadProbeInfo *p_info, gpointer p_user_data);
+
+	// Returns true if the tables changed
+	bool parse_buffer(GstBuffer *p_buffer);
+	void parse_data(guint8 const *p_data, gsize p_size);
+	void parse_packet(guint8 const *p_packet);
+	void complete_section(guint16 const p_pid);
+
+	// Returns null if the PAT or one of the PMTs is still missing.
+	// The returned caps are new, and p_caps is not unref'd.
+	GstCaps* add_stream_headers(GstCaps *p_caps) const;
+
+	struct table
+	{
+		// The TS packets the section came in
+		std::vector < guint8 > m_packets;
+		// The section without the part of the packets around it;
+		// compared to find out if the table changed, since the
+		// packets differ in their continuity counters anyway
+		std::vector < guint8 > m_section;
+	};
+
+	// Keyed by PID
+	typedef std::map < guint16, table > tables;
+
+	tables m_tables, m_pending_tables;
+	std::set < guint16 > m_pmt_pids;
+	std::vector < guint8 > m_partial_packet;
+	// Used while out of sync; see parse_data()
+	std::vector < guint8 > m_resync_window;
+	bool m_in_sync;
+	bool m_changed;
+	// True if the last caps from upstream had stream headers of their own
+	bool m_upstream_headers;
+	// True while the probe sends caps itself
+	bool m_sending_caps;
+};
+
+
+#endif
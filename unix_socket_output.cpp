@@ -0,0 +1,82 @@
+#include <iostream>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <gio/gunixsocketaddress.h>
+#include "http_stream_pipeline.hpp"
+#include "unix_socket_output.hpp"
+
+
+unix_socket_output::unix_socket_output(http_stream_pipeline &p_pipeline, std::string p_path)
+	: m_pipeline(p_pipeline)
+	, m_path(std::move(p_path))
+	, m_service(nullptr)
+	, m_num_connections(0)
+{
+	m_output = m_pipeline.select_output("/", nullptr);
+	if (m_output.empty())
+		throw std::runtime_error("no output for Unix socket consumers");
+
+	// bind() fails if the file exists, so remove a socket file that
+	// was left behind. Other kinds of files are not touched.
+	struct stat file_stat;
+	if ((lstat(m_path.c_str(), &file_stat) == 0) && S_ISSOCK(file_stat.st_mode))
+		unlink(m_path.c_str());
+
+	m_service = g_socket_service_new();
+
+	GError *gerror = nullptr;
+	GSocketAddress *address = g_unix_socket_address_new(m_path.c_str());
+	bool ok = g_socket_listener_add_address(G_SOCKET_LISTENER(m_service), address, G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_DEFAULT, nullptr, nullptr, &gerror);
+	g_object_unref(G_OBJECT(address));
+
+	if (!ok)
+	{
+		std::string s = "could not listen on Unix socket " + m_path + ": " + gerror->message;
+		g_clear_error(&gerror);
+		g_object_unref(G_OBJECT(m_service));
+		throw std::runtime_error(s);
+	}
+
+	g_signal_connect(G_OBJECT(m_service), "incoming", G_CALLBACK(on_incoming), this);
+	g_socket_service_start(m_service);
+
+	std::cerr << "Listening for local consumers on Unix socket " << m_path << "\n";
+}
+
+
+unix_socket_output::~unix_socket_output()
+{
+	// Connected consumers stay; they belong to the pipeline now
+	g_signal_handlers_disconnect_by_data(G_OBJECT(m_service), this);
+	g_socket_service_stop(m_service);
+	g_socket_listener_close(G_SOCKET_LISTENER(m_service));
+	g_object_unref(G_OBJECT(m_service));
+
+	unlink(m_path.c_str());
+}
+
+
+gboolean unix_socket_output::on_incoming(GSocketService *, GSocketConnection *p_connection, GObject *, gpointer p_user_data)
+{
+	unix_socket_output *self = reinterpret_cast < unix_socket_output* > (p_user_data);
+
+	// The pipeline takes over the connection like it takes over a
+	// HTTP connection that was stolen from libsoup
+	GSocket *socket = g_socket_connection_get_socket(p_connection);
+	GIOStream *stream = G_IO_STREAM(g_object_ref(G_OBJECT(p_connection)));
+
+	try
+	{
+		self->m_pipeline.add_client(stream, socket, self->m_output);
+		++self->m_num_connections;
+	}
+	catch (std::exception const &p_exc)
+	{
+		std::cerr << "Could not add Unix socket consumer: " << p_exc.what() << "\n";
+		g_io_stream_close(stream, nullptr, nullptr);
+		g_object_unref(G_OBJECT(stream));
+	}
+
+	return TRUE;
+}
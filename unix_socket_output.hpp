@@ -0,0 +1,50 @@
+#ifndef GST_SOUP_SERVER_EXAMPLE_UNIX_SOCKET_OUTPUT_HPP
+#define GST_SOUP_SERVER_EXAMPLE_UNIX_SOCKET_OUTPUT_HPP
+
+#include <glib.h>
+#include <gio/gio.h>
+#include <string>
+
+
+class http_stream_pipeline;
+
+
+// Serves the stream of a http_stream_pipeline to local consumers over a
+// Unix domain socket, without HTTP. Every connection is handed to the
+// pipeline as a client of its default output (the one a HTTP request
+// without Accept header and URL suffix would get), just like a HTTP
+// connection is after the response headers were written. Consumers just
+// read the raw stream until they close the connection. This avoids the
+// overhead of the TCP/IP stack and of the HTTP request handling.
+//
+// The socket file is created when the output is created (a stale socket
+// file from an earlier run is replaced), and removed when it is destroyed.
+//
+// All functions must be called from the mainloop thread.
+class unix_socket_output
+{
+public:
+	explicit unix_socket_output(http_stream_pipeline &p_pipeline, std::string p_path);
+	~unix_socket_output();
+
+	guint64 get_num_connections() const
+	{
+		return m_num_connections;
+	}
+
+
+private:
+	unix_socket_output(unix_socket_output const &) = delete;
+	unix_socket_output& operator = (unix_socket_output const &) = delete;
+
+	static gboolean on_incoming(GSocketService *, GSocketConnection *p_connection, GObject *, gpointer p_user_data);
+
+
+	http_stream_pipeline &m_pipeline;
+	std::string m_path, m_output;
+	GSocketService *m_service;
+	guint64 m_num_connections;
+};
+
+
+#endif
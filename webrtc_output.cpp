@@ -0,0 +1,648 @@
+#include <iostream>
+#include <stdexcept>
+#include <cstring>
+#include <gst/sdp/sdp.h>
+#include <gst/video/video.h>
+#define GST_USE_UNSTABLE_API
+#include <gst/webrtc/webrtc.h>
+#include <json-glib/json-glib.h>
+#include "http_stream_pipeline.hpp"
+#include "webrtc_output.hpp"
+#include "scope_guard.hpp"
+
+
+namespace
+{
+
+
+// The payloaded stream. The caps are also given to webrtcbin as codec
+// preferences, so it can create an offer before any data has arrived.
+std::string const rtp_caps = "application/x-rtp,media=video,encoding-name=H264,payload=96,clock-rate=90000";
+std::string const pipeline_description = "appsrc name=src ! h264parse config-interval=-1 ! rtph264pay name=pay config-interval=-1 ! " + rtp_caps + " ! tee name=rtp allow-not-linked=true";
+
+// The encoder is asked for a keyframe at most this often
+gint64 const keyframe_request_interval = G_USEC_PER_SEC;
+
+// How much data a peer's queue holds before it drops the oldest
+// packets. This is kept short, since old packets are of no use to a
+// peer that needs low latency.
+guint64 const peer_queue_max_time = 200 * GST_MSECOND;
+
+
+// Signaling messages come from webrtcbin's threads, and are passed
+// to the mainloop thread (which owns the WebSocket) via the bus
+void post_signal(GstElement *p_webrtcbin, GstStructure *p_signal)
+{
+	gst_element_post_message(p_webrtcbin, gst_message_new_element(GST_OBJECT(p_webrtcbin), p_signal));
+}
+
+
+// Returns an empty string if the member is missing or not a string
+char const * get_string_member(JsonObject *p_object, char const *p_name)
+{
+	JsonNode *node = json_object_get_member(p_object, p_name);
+	if ((node == nullptr) || (json_node_get_value_type(node) != G_TYPE_STRING))
+		return "";
+
+	return json_node_get_string(node);
+}
+
+
+} // unnamed namespace end
+
+
+
+
+webrtc_output::webrtc_output(http_stream_pipeline &p_pipeline)
+	: m_pipeline(p_pipeline)
+	, m_webrtc_pipeline(nullptr)
+	, m_appsrc(nullptr)
+	, m_tee(nullptr)
+	, m_watch_source(0)
+	, m_branch(nullptr)
+	, m_got_keyframe(false)
+	, m_last_keyframe_request(0)
+{
+	m_stats.m_num_peers = 0;
+	m_stats.m_num_connections = 0;
+	m_stats.m_num_keyframe_requests = 0;
+	m_stats.m_num_forwarded_keyframe_requests = 0;
+
+	if (m_pipeline.is_muxed())
+		throw std::runtime_error("WebRTC output needs an elementary stream \"video\" element");
+
+	GError *gerror = nullptr;
+	m_webrtc_pipeline = gst_parse_launch(pipeline_description.c_str(), &gerror);
+	if (m_webrtc_pipeline == nullptr)
+	{
+		std::string s = std::string("could not create WebRTC pipeline: ") + gerror->message;
+		g_clear_error(&gerror);
+		throw std::runtime_error(s);
+	}
+	g_clear_error(&gerror);
+
+	auto pipeline_guard = make_scope_guard([this]() { gst_object_unref(GST_OBJECT(m_webrtc_pipeline)); });
+
+	m_appsrc = GST_APP_SRC(gst_bin_get_by_name(GST_BIN(m_webrtc_pipeline), "src"));
+	m_tee = gst_bin_get_by_name(GST_BIN(m_webrtc_pipeline), "rtp");
+
+	// Like with RTSP, the data arrives as the HTTP pipeline produces it,
+	// and the caps are taken from the samples pushed into the appsrc
+	g_object_set(
+		G_OBJECT(m_appsrc),
+		"is-live", TRUE,
+		"do-timestamp", TRUE,
+		"format", GST_FORMAT_TIME,
+		nullptr
+	);
+
+	// The force-key-unit events that webrtcbin sends for PLI/FIR
+	// feedback pass through the payloader on their way upstream
+	GstElement *payloader = gst_bin_get_by_name(GST_BIN(m_webrtc_pipeline), "pay");
+	GstPad *payloader_sinkpad = gst_element_get_static_pad(payloader, "sink");
+	gst_pad_add_probe(payloader_sinkpad, GST_PAD_PROBE_TYPE_EVENT_UPSTREAM, keyframe_request_probe, this, nullptr);
+	gst_object_unref(GST_OBJECT(payloader_sinkpad));
+	gst_object_unref(GST_OBJECT(payloader));
+
+	GstBus *bus = gst_pipeline_get_bus(GST_PIPELINE(m_webrtc_pipeline));
+	m_watch_source = gst_bus_add_watch(bus, bus_watch, this);
+	gst_object_unref(GST_OBJECT(bus));
+
+	pipeline_guard.dismiss();
+}
+
+
+webrtc_output::~webrtc_output()
+{
+	while (!m_peers.empty())
+		remove_peer(m_peers.begin()->first);
+
+	g_source_remove(m_watch_source);
+
+	gst_element_set_state(m_webrtc_pipeline, GST_STATE_NULL);
+	gst_object_unref(GST_OBJECT(m_tee));
+	gst_object_unref(GST_OBJECT(m_appsrc));
+	gst_object_unref(GST_OBJECT(m_webrtc_pipeline));
+}
+
+
+void webrtc_output::websocket_handler(SoupServer *, SoupWebsocketConnection *p_connection, char const *, SoupClientContext *, gpointer p_user_data)
+{
+	webrtc_output *self = reinterpret_cast < webrtc_output* > (p_user_data);
+
+	try
+	{
+		self->add_peer(p_connection);
+	}
+	catch (std::exception const &p_exc)
+	{
+		std::cerr << "Could not add WebRTC peer: " << p_exc.what() << "\n";
+		soup_websocket_connection_close(p_connection, SOUP_WEBSOCKET_CLOSE_SERVER_ERROR, nullptr);
+	}
+}
+
+
+webrtc_output::stats webrtc_output::get_stats() const
+{
+	std::lock_guard < std::mutex > lock(m_stats_mutex);
+	return m_stats;
+}
+
+
+void webrtc_output::add_peer(SoupWebsocketConnection *p_connection)
+{
+	GstElement *queue = gst_element_factory_make("queue", nullptr);
+	GstElement *webrtcbin = gst_element_factory_make("webrtcbin", nullptr);
+	if ((queue == nullptr) || (webrtcbin == nullptr))
+	{
+		if (queue != nullptr) gst_object_unref(GST_OBJECT(queue));
+		if (webrtcbin != nullptr) gst_object_unref(GST_OBJECT(webrtcbin));
+		throw std::runtime_error("could not create WebRTC peer elements (queue, webrtcbin)");
+	}
+
+	g_object_set(
+		G_OBJECT(queue),
+		"leaky", 2, // downstream (= drop the oldest data)
+		"max-size-buffers", guint(0),
+		"max-size-bytes", guint(0),
+		"max-size-time", peer_queue_max_time,
+		nullptr
+	);
+
+	// Without a STUN server, only host candidates are gathered
+	gst_util_set_object_arg(G_OBJECT(webrtcbin), "bundle-policy", "max-bundle");
+
+	if (m_peers.empty())
+		start();
+
+	gst_bin_add_many(GST_BIN(m_webrtc_pipeline), queue, webrtcbin, nullptr);
+
+	// Requesting the pad with caps sets up a transceiver for them,
+	// which in turn triggers the negotiation
+	g_signal_connect(G_OBJECT(webrtcbin), "on-negotiation-needed", G_CALLBACK(on_negotiation_needed), nullptr);
+	g_signal_connect(G_OBJECT(webrtcbin), "on-ice-candidate", G_CALLBACK(on_ice_candidate), nullptr);
+
+	GstCaps *caps = gst_caps_from_string(rtp_caps.c_str());
+	GstPad *webrtc_sinkpad = gst_element_request_pad(webrtcbin, gst_element_class_get_pad_template(GST_ELEMENT_GET_CLASS(webrtcbin), "sink_%u"), nullptr, caps);
+	gst_caps_unref(caps);
+
+	GstPad *queue_srcpad = gst_element_get_static_pad(queue, "src");
+	gst_pad_link(queue_srcpad, webrtc_sinkpad);
+	gst_object_unref(GST_OBJECT(queue_srcpad));
+	gst_object_unref(GST_OBJECT(webrtc_sinkpad));
+
+	GstPad *tee_srcpad = gst_element_get_request_pad(m_tee, "src_%u");
+	GstPad *queue_sinkpad = gst_element_get_static_pad(queue, "sink");
+	gst_pad_link(tee_srcpad, queue_sinkpad);
+	gst_object_unref(GST_OBJECT(queue_sinkpad));
+
+	gst_element_sync_state_with_parent(webrtcbin);
+	gst_element_sync_state_with_parent(queue);
+
+	std::unique_ptr < peer > new_peer(new peer);
+	new_peer->m_connection = SOUP_WEBSOCKET_CONNECTION(g_object_ref(G_OBJECT(p_connection)));
+	new_peer->m_queue = queue;
+	new_peer->m_webrtcbin = webrtcbin;
+	new_peer->m_tee_srcpad = tee_srcpad;
+	m_peers[p_connection] = std::move(new_peer);
+
+	g_signal_connect(G_OBJECT(p_connection), "message", G_CALLBACK(on_message), this);
+	g_signal_connect(G_OBJECT(p_connection), "closed", G_CALLBACK(on_closed), this);
+
+	{
+		std::lock_guard < std::mutex > lock(m_stats_mutex);
+		m_stats.m_num_peers = m_peers.size();
+		++m_stats.m_num_connections;
+	}
+
+	// Let the new peer start right away instead of
+	// waiting for the next regular keyframe
+	request_keyframe();
+
+	std::cerr << "WebRTC peer added (" << m_peers.size() << " peer(s))\n";
+}
+
+
+void webrtc_output::remove_peer(SoupWebsocketConnection *p_connection)
+{
+	auto peer_iter = m_peers.find(p_connection);
+	if (peer_iter == m_peers.end())
+		return;
+
+	peer &removed_peer = *(peer_iter->second);
+
+	g_signal_handlers_disconnect_by_data(G_OBJECT(removed_peer.m_connection), this);
+	if (soup_websocket_connection_get_state(removed_peer.m_connection) == SOUP_WEBSOCKET_STATE_OPEN)
+		soup_websocket_connection_close(removed_peer.m_connection, SOUP_WEBSOCKET_CLOSE_GOING_AWAY, nullptr);
+	g_object_unref(G_OBJECT(removed_peer.m_connection));
+
+	// Releasing tee request pads is safe even while data is flowing
+	GstPad *queue_sinkpad = gst_element_get_static_pad(removed_peer.m_queue, "sink");
+	gst_pad_unlink(removed_peer.m_tee_srcpad, queue_sinkpad);
+	gst_object_unref(GST_OBJECT(queue_sinkpad));
+	gst_element_release_request_pad(m_tee, removed_peer.m_tee_srcpad);
+	gst_object_unref(GST_OBJECT(removed_peer.m_tee_srcpad));
+
+	gst_element_set_state(removed_peer.m_webrtcbin, GST_STATE_NULL);
+	gst_element_set_state(removed_peer.m_queue, GST_STATE_NULL);
+	gst_bin_remove_many(GST_BIN(m_webrtc_pipeline), removed_peer.m_queue, removed_peer.m_webrtcbin, nullptr);
+
+	m_peers.erase(peer_iter);
+
+	{
+		std::lock_guard < std::mutex > lock(m_stats_mutex);
+		m_stats.m_num_peers = m_peers.size();
+	}
+
+	if (m_peers.empty())
+		stop();
+
+	std::cerr << "WebRTC peer removed (" << m_peers.size() << " peer(s))\n";
+}
+
+
+webrtc_output::peer * webrtc_output::find_peer(GstObject *p_object)
+{
+	for (auto &entry : m_peers)
+	{
+		if (GST_OBJECT(entry.second->m_webrtcbin) == p_object)
+			return entry.second.get();
+	}
+
+	return nullptr;
+}
+
+
+void webrtc_output::start()
+{
+	GstElement *queue = gst_element_factory_make("queue", nullptr);
+	GstElement *appsink = gst_element_factory_make("appsink", nullptr);
+	if ((queue == nullptr) || (appsink == nullptr))
+	{
+		if (queue != nullptr) gst_object_unref(GST_OBJECT(queue));
+		if (appsink != nullptr) gst_object_unref(GST_OBJECT(appsink));
+		throw std::runtime_error("could not create WebRTC branch elements (queue, appsink)");
+	}
+
+	g_object_set(G_OBJECT(appsink), "sync", FALSE, "enable-last-sample", FALSE, nullptr);
+
+	GstAppSinkCallbacks callbacks = GstAppSinkCallbacks();
+	callbacks.new_sample = on_new_sample;
+	gst_app_sink_set_callbacks(GST_APP_SINK(appsink), &callbacks, this, nullptr);
+
+	GstElement *branch = gst_bin_new(nullptr);
+	gst_object_ref_sink(GST_OBJECT(branch));
+	auto branch_guard = make_scope_guard([branch]() { gst_object_unref(GST_OBJECT(branch)); });
+
+	gst_bin_add_many(GST_BIN(branch), queue, appsink, nullptr);
+	gst_element_link(queue, appsink);
+
+	GstPad *queue_sinkpad = gst_element_get_static_pad(queue, "sink");
+	gst_element_add_pad(branch, gst_ghost_pad_new("sink", queue_sinkpad));
+	gst_object_unref(GST_OBJECT(queue_sinkpad));
+
+	gst_element_set_state(m_webrtc_pipeline, GST_STATE_PLAYING);
+
+	m_got_keyframe = false;
+	try
+	{
+		m_pipeline.attach_stream_consumer(branch);
+	}
+	catch (...)
+	{
+		gst_element_set_state(m_webrtc_pipeline, GST_STATE_NULL);
+		throw;
+	}
+
+	branch_guard.dismiss();
+	m_branch = branch;
+
+	// The peers count like HTTP clients
+	m_pipeline.acquire_hold();
+}
+
+
+void webrtc_output::stop()
+{
+	if (m_branch == nullptr)
+		return;
+
+	// This stops the branch's streaming thread, so
+	// on_new_sample() is not called anymore afterwards
+	m_pipeline.detach_stream_consumer(m_branch);
+	gst_object_unref(GST_OBJECT(m_branch));
+	m_branch = nullptr;
+
+	gst_element_set_state(m_webrtc_pipeline, GST_STATE_NULL);
+
+	m_pipeline.release_hold();
+}
+
+
+void webrtc_output::request_keyframe()
+{
+	if (m_branch == nullptr)
+		return;
+
+	gint64 now = g_get_monotonic_time();
+
+	{
+		std::lock_guard < std::mutex > lock(m_stats_mutex);
+
+		// Several peers usually lose the same packets, so their
+		// requests are answered with one keyframe
+		if ((m_last_keyframe_request != 0) && ((now - m_last_keyframe_request) < keyframe_request_interval))
+			return;
+
+		m_last_keyframe_request = now;
+		++m_stats.m_num_forwarded_keyframe_requests;
+	}
+
+	// The event travels upstream through the HTTP pipeline's tee to
+	// the encoder. It affects the HTTP clients as well, which is why
+	// the requests are rate limited.
+	gst_element_send_event(m_branch, gst_video_event_new_upstream_force_key_unit(GST_CLOCK_TIME_NONE, TRUE, 0));
+}
+
+
+void webrtc_output::send_to_peer(peer &p_peer, GstStructure const *p_signal)
+{
+	JsonBuilder *builder = json_builder_new();
+	json_builder_begin_object(builder);
+
+	json_builder_set_member_name(builder, "type");
+	json_builder_add_string_value(builder, gst_structure_get_string(p_signal, "type"));
+
+	if (gst_structure_has_field(p_signal, "sdp"))
+	{
+		json_builder_set_member_name(builder, "sdp");
+		json_builder_add_string_value(builder, gst_structure_get_string(p_signal, "sdp"));
+	}
+
+	if (gst_structure_has_field(p_signal, "candidate"))
+	{
+		guint mline_index = 0;
+		gst_structure_get_uint(p_signal, "sdpMLineIndex", &mline_index);
+
+		json_builder_set_member_name(builder, "candidate");
+		json_builder_add_string_value(builder, gst_structure_get_string(p_signal, "candidate"));
+		json_builder_set_member_name(builder, "sdpMLineIndex");
+		json_builder_add_int_value(builder, mline_index);
+	}
+
+	json_builder_end_object(builder);
+
+	JsonNode *node = json_builder_get_root(builder);
+	g_object_unref(G_OBJECT(builder));
+
+	JsonGenerator *generator = json_generator_new();
+	json_generator_set_root(generator, node);
+	gchar *text = json_generator_to_data(generator, nullptr);
+	g_object_unref(G_OBJECT(generator));
+	json_node_free(node);
+
+	soup_websocket_connection_send_text(p_peer.m_connection, text);
+	g_free(text);
+}
+
+
+void webrtc_output::on_negotiation_needed(GstElement *p_webrtcbin, gpointer)
+{
+	// The promise keeps webrtcbin alive until the offer is there,
+	// even if the peer is removed in the meantime
+	GstPromise *promise = gst_promise_new_with_change_func(
+		on_offer_created,
+		gst_object_ref(GST_OBJECT(p_webrtcbin)),
+		[](gpointer p_data) { gst_object_unref(GST_OBJECT(p_data)); }
+	);
+	g_signal_emit_by_name(p_webrtcbin, "create-offer", nullptr, promise);
+}
+
+
+void webrtc_output::on_offer_created(GstPromise *p_promise, gpointer p_user_data)
+{
+	GstElement *webrtcbin = GST_ELEMENT(p_user_data);
+
+	GstWebRTCSessionDescription *offer = nullptr;
+	if (gst_promise_wait(p_promise) == GST_PROMISE_RESULT_REPLIED)
+		gst_structure_get(gst_promise_get_reply(p_promise), "offer", GST_TYPE_WEBRTC_SESSION_DESCRIPTION, &offer, nullptr);
+	gst_promise_unref(p_promise);
+
+	if (offer == nullptr)
+	{
+		GST_ELEMENT_ERROR(webrtcbin, STREAM, FAILED, ("could not create WebRTC offer"), (nullptr));
+		return;
+	}
+
+	g_signal_emit_by_name(webrtcbin, "set-local-description", offer, nullptr);
+
+	gchar *sdp = gst_sdp_message_as_text(offer->sdp);
+	post_signal(webrtcbin, gst_structure_new("WebRTCSignal", "type", G_TYPE_STRING, "offer", "sdp", G_TYPE_STRING, sdp, nullptr));
+	g_free(sdp);
+
+	gst_webrtc_session_description_free(offer);
+}
+
+
+void webrtc_output::on_ice_candidate(GstElement *p_webrtcbin, guint p_mline_index, gchar *p_candidate, gpointer)
+{
+	post_signal(p_webrtcbin, gst_structure_new("WebRTCSignal", "type", G_TYPE_STRING, "ice", "candidate", G_TYPE_STRING, p_candidate, "sdpMLineIndex", G_TYPE_UINT, p_mline_index, nullptr));
+}
+
+
+void webrtc_output::on_message(SoupWebsocketConnection *p_connection, gint p_type, GBytes *p_message, gpointer p_user_data)
+{
+	webrtc_output *self = reinterpret_cast < webrtc_output* > (p_user_data);
+
+	auto peer_iter = self->m_peers.find(p_connection);
+	if ((peer_iter == self->m_peers.end()) || (p_type != SOUP_WEBSOCKET_DATA_TEXT))
+		return;
+
+	GstElement *webrtcbin = peer_iter->second->m_webrtcbin;
+
+	gsize length = 0;
+	gchar const *data = reinterpret_cast < gchar const * > (g_bytes_get_data(p_message, &length));
+
+	JsonParser *parser = json_parser_new();
+	auto parser_guard = make_scope_guard([parser]() { g_object_unref(G_OBJECT(parser)); });
+
+	GError *gerror = nullptr;
+	if (!json_parser_load_from_data(parser, data, length, &gerror))
+	{
+		std::cerr << "Invalid WebRTC signaling message: " << gerror->message << "\n";
+		g_clear_error(&gerror);
+		return;
+	}
+
+	JsonNode *root = json_parser_get_root(parser);
+	if ((root == nullptr) || !JSON_NODE_HOLDS_OBJECT(root))
+	{
+		std::cerr << "Invalid WebRTC signaling message: not a JSON object\n";
+		return;
+	}
+
+	JsonObject *object = json_node_get_object(root);
+	std::string type = get_string_member(object, "type");
+
+	if (type == "answer")
+	{
+		char const *sdp_text = get_string_member(object, "sdp");
+
+		GstSDPMessage *sdp = nullptr;
+		gst_sdp_message_new(&sdp);
+		if (gst_sdp_message_parse_buffer(reinterpret_cast < guint8 const * > (sdp_text), strlen(sdp_text), sdp) != GST_SDP_OK)
+		{
+			std::cerr << "Invalid SDP answer from WebRTC peer\n";
+			gst_sdp_message_free(sdp);
+			return;
+		}
+
+		// The description takes over the SDP message
+		GstWebRTCSessionDescription *answer = gst_webrtc_session_description_new(GST_WEBRTC_SDP_TYPE_ANSWER, sdp);
+		g_signal_emit_by_name(webrtcbin, "set-remote-description", answer, nullptr);
+		gst_webrtc_session_description_free(answer);
+	}
+	else if (type == "ice")
+	{
+		// The end of the candidates is signaled with an empty one
+		char const *candidate = get_string_member(object, "candidate");
+		guint mline_index = json_object_has_member(object, "sdpMLineIndex") ? guint(json_object_get_int_member(object, "sdpMLineIndex")) : 0;
+		if (candidate[0] != '\0')
+			g_signal_emit_by_name(webrtcbin, "add-ice-candidate", mline_index, candidate);
+	}
+	else
+		std::cerr << "Unknown WebRTC signaling message type \"" << type << "\"\n";
+}
+
+
+void webrtc_output::on_closed(SoupWebsocketConnection *p_connection, gpointer p_user_data)
+{
+	webrtc_output *self = reinterpret_cast < webrtc_output* > (p_user_data);
+	self->remove_peer(p_connection);
+}
+
+
+GstFlowReturn webrtc_output::on_new_sample(GstAppSink *p_appsink, gpointer p_user_data)
+{
+	webrtc_output *self = reinterpret_cast < webrtc_output* > (p_user_data);
+
+	GstSample *sample = gst_app_sink_pull_sample(p_appsink);
+	if (sample == nullptr)
+		return GST_FLOW_EOS;
+
+	auto sample_guard = make_scope_guard([sample]() { gst_sample_unref(sample); });
+
+	// The branch is attached at an arbitrary point of the stream,
+	// and the decoders of the peers need a keyframe to start
+	if (!self->m_got_keyframe)
+	{
+		GstBuffer *buffer = gst_sample_get_buffer(sample);
+		if ((buffer == nullptr) || GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+			return GST_FLOW_OK;
+		self->m_got_keyframe = true;
+
+		// The encoder may have sent the SPS and PPS long before
+		GstSample *parameter_sets = self->m_pipeline.create_parameter_set_sample(sample);
+		if (parameter_sets != nullptr)
+		{
+			gst_app_src_push_sample(self->m_appsrc, parameter_sets);
+			gst_sample_unref(parameter_sets);
+		}
+	}
+
+	// Errors show up in the WebRTC pipeline, and
+	// must not affect the HTTP pipeline
+	gst_app_src_push_sample(self->m_appsrc, sample);
+
+	return GST_FLOW_OK;
+}
+
+
+GstPadProbeReturn webrtc_output::keyframe_request_probe(GstPad *, GstPadProbeInfo *p_info, gpointer p_user_data)
+{
+	webrtc_output *self = reinterpret_cast < webrtc_output* > (p_user_data);
+
+	GstEvent *event = GST_PAD_PROBE_INFO_EVENT(p_info);
+	if (!gst_video_event_is_force_key_unit(event))
+		return GST_PAD_PROBE_OK;
+
+	{
+		std::lock_guard < std::mutex > lock(self->m_stats_mutex);
+		++self->m_stats.m_num_keyframe_requests;
+	}
+
+	// The appsrc cannot do anything with the event; the
+	// request is passed on from the mainloop thread instead
+	gst_element_post_message(
+		self->m_webrtc_pipeline,
+		gst_message_new_element(GST_OBJECT(self->m_webrtc_pipeline), gst_structure_new_empty("KeyframeRequest"))
+	);
+
+	return GST_PAD_PROBE_DROP;
+}
+
+
+gboolean webrtc_output::bus_watch(GstBus *, GstMessage *p_msg, gpointer p_user_data)
+{
+	webrtc_output *self = reinterpret_cast < webrtc_output* > (p_user_data);
+
+	switch (GST_MESSAGE_TYPE(p_msg))
+	{
+		case GST_MESSAGE_ELEMENT:
+		{
+			GstStructure const *structure = gst_message_get_structure(p_msg);
+
+			if (gst_structure_has_name(structure, "KeyframeRequest"))
+			{
+				self->request_keyframe();
+			}
+			else if (gst_structure_has_name(structure, "WebRTCSignal"))
+			{
+				// The peer may be gone by now
+				peer *target = self->find_peer(GST_MESSAGE_SRC(p_msg));
+				if (target != nullptr)
+					self->send_to_peer(*target, structure);
+			}
+
+			break;
+		}
+
+		case GST_MESSAGE_WARNING:
+		case GST_MESSAGE_ERROR:
+		{
+			GError *gerror = nullptr;
+			gchar *debug_info = nullptr;
+
+			if (GST_MESSAGE_TYPE(p_msg) == GST_MESSAGE_ERROR)
+				gst_message_parse_error(p_msg, &gerror, &debug_info);
+			else
+				gst_message_parse_warning(p_msg, &gerror, &debug_info);
+
+			std::cerr << "WebRTC " << ((GST_MESSAGE_TYPE(p_msg) == GST_MESSAGE_ERROR) ? "ERROR: " : "WARNING: ") << gerror->message << "; debug info: " << debug_info << "\n";
+
+			g_clear_error(&gerror);
+			g_free(debug_info);
+
+			if (GST_MESSAGE_TYPE(p_msg) != GST_MESSAGE_ERROR)
+				break;
+
+			// Errors of a peer only end that peer's connection.
+			// The shared part of the pipeline is left as it is.
+			for (auto &entry : self->m_peers)
+			{
+				if (gst_object_has_as_ancestor(GST_MESSAGE_SRC(p_msg), GST_OBJECT(entry.second->m_webrtcbin)) || (GST_MESSAGE_SRC(p_msg) == GST_OBJECT(entry.second->m_webrtcbin)))
+				{
+					self->remove_peer(entry.first);
+					break;
+				}
+			}
+
+			break;
+		}
+
+		default:
+			break;
+	}
+
+	return TRUE;
+}
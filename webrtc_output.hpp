@@ -0,0 +1,123 @@
+#ifndef GST_SOUP_SERVER_EXAMPLE_WEBRTC_OUTPUT_HPP
+#define GST_SOUP_SERVER_EXAMPLE_WEBRTC_OUTPUT_HPP
+
+#include <glib.h>
+#include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/app/gstappsink.h>
+#include <libsoup/soup.h>
+#include <map>
+#include <memory>
+#include <mutex>
+
+
+class http_stream_pipeline;
+
+
+// Sends the H.264 "video" stream of a http_stream_pipeline (in elementary
+// stream mode) to browsers over WebRTC, for viewers that need a lower
+// latency than HTTP streaming can offer.
+//
+// The stream is not encoded again. A branch of the HTTP pipeline feeds an
+// appsrc in a separate pipeline, where the stream is payloaded once
+// (appsrc ! h264parse ! rtph264pay ! tee). Each peer gets its own queue and
+// webrtcbin behind the tee, so the RTP packets are shared by all peers, and
+// only the per-peer work (SRTP, ICE, RTCP) is done for each of them. The
+// per-peer queues are leaky, so a peer that cannot keep up loses packets
+// instead of holding up the others.
+//
+// Peers report losses with RTCP PLI/FIR, which webrtcbin turns into
+// upstream force-key-unit events. These are passed on to the encoder of
+// the HTTP pipeline, at most once per keyframe_request_interval, however
+// many peers ask for one. A new peer also asks for a keyframe, so it
+// does not have to wait for the next regular one.
+//
+// The signaling goes over a WebSocket (see websocket_handler()). It uses
+// JSON text messages with a "type" member. The server sends an "offer"
+// (with "sdp") once the peer connects, and the peer replies with an
+// "answer" (with "sdp"). ICE candidates are exchanged in both directions
+// as "ice" messages (with "candidate" and "sdpMLineIndex"). No STUN or
+// TURN server is used, so only host candidates are gathered; this is
+// enough for peers on the same host or network.
+//
+// While at least one peer is connected, a hold keeps the HTTP pipeline
+// running. The WebRTC pipeline is only running during that time as well.
+//
+// All functions must be called from the mainloop thread.
+class webrtc_output
+{
+public:
+	struct stats
+	{
+		guint m_num_peers;
+		guint64 m_num_connections;
+		// Keyframe requests from the peers, and how
+		// many of them were passed on to the encoder
+		guint64 m_num_keyframe_requests;
+		guint64 m_num_forwarded_keyframe_requests;
+	};
+
+	explicit webrtc_output(http_stream_pipeline &p_pipeline);
+	~webrtc_output();
+
+	// Callback for soup_server_add_websocket_handler(). The user data
+	// must point to the webrtc_output. Each connection becomes a peer.
+	static void websocket_handler(SoupServer *, SoupWebsocketConnection *p_connection, char const *, SoupClientContext *, gpointer p_user_data);
+
+	stats get_stats() const;
+
+
+private:
+	webrtc_output(webrtc_output const &) = delete;
+	webrtc_output& operator = (webrtc_output const &) = delete;
+
+	struct peer
+	{
+		SoupWebsocketConnection *m_connection;
+		GstElement *m_queue, *m_webrtcbin;
+		GstPad *m_tee_srcpad;
+	};
+
+	void add_peer(SoupWebsocketConnection *p_connection);
+	void remove_peer(SoupWebsocketConnection *p_connection);
+	peer * find_peer(GstObject *p_object);
+
+	// Attach the branch to the HTTP pipeline, and detach it again
+	void start();
+	void stop();
+
+	void request_keyframe();
+	void send_to_peer(peer &p_peer, GstStructure const *p_signal);
+
+	static void on_negotiation_needed(GstElement *p_webrtcbin, gpointer);
+	static void on_offer_created(GstPromise *p_promise, gpointer p_user_data);
+	static void on_ice_candidate(GstElement *p_webrtcbin, guint p_mline_index, gchar *p_candidate, gpointer);
+	static void on_message(SoupWebsocketConnection *p_connection, gint p_type, GBytes *p_message, gpointer p_user_data);
+	static void on_closed(SoupWebsocketConnection *p_connection, gpointer p_user_data);
+	static GstFlowReturn on_new_sample(GstAppSink *p_appsink, gpointer p_user_data);
+	static GstPadProbeReturn keyframe_request_probe(GstPad *, GstPadProbeInfo *p_info, gpointer p_user_data);
+	static gboolean bus_watch(GstBus *, GstMessage *p_msg, gpointer p_user_data);
+
+
+	http_stream_pipeline &m_pipeline;
+
+	GstElement *m_webrtc_pipeline;
+	GstAppSrc *m_appsrc;
+	GstElement *m_tee;
+	guint m_watch_source;
+
+	// The branch of the HTTP pipeline while peers are connected;
+	// m_got_keyframe is only accessed from its streaming thread
+	GstElement *m_branch;
+	bool m_got_keyframe;
+
+	std::map < SoupWebsocketConnection*, std::unique_ptr < peer > > m_peers;
+
+	// Accessed from the streaming threads of the WebRTC pipeline
+	mutable std::mutex m_stats_mutex;
+	stats m_stats;
+	gint64 m_last_keyframe_request;
+};
+
+
+#endif